@@ -0,0 +1,62 @@
+#include "AllocCounter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#ifdef VARIANT_COUNT_ALLOCS
+
+static std::atomic<uint64_t> s_allocs(0);
+
+bool AllocCounter::enabled()
+{
+  return true;
+}
+
+uint64_t AllocCounter::count()
+{
+  return s_allocs.load(std::memory_order_relaxed);
+}
+
+static void* countedAlloc(std::size_t n)
+{
+  s_allocs.fetch_add(1, std::memory_order_relaxed);
+  if (n == 0)
+    n = 1;
+  void* p = std::malloc(n);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void* operator new(std::size_t n) { return countedAlloc(n); }
+void* operator new[](std::size_t n) { return countedAlloc(n); }
+
+void* operator new(std::size_t n, const std::nothrow_t&) noexcept
+{
+  try { return countedAlloc(n); } catch (...) { return nullptr; }
+}
+
+void* operator new[](std::size_t n, const std::nothrow_t&) noexcept
+{
+  try { return countedAlloc(n); } catch (...) { return nullptr; }
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+
+#else
+
+bool AllocCounter::enabled()
+{
+  return false;
+}
+
+uint64_t AllocCounter::count()
+{
+  return 0;
+}
+
+#endif
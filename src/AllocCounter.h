@@ -0,0 +1,21 @@
+#ifndef VARIANT_ALLOC_COUNTER_H__
+#define VARIANT_ALLOC_COUNTER_H__
+
+#include <cstdint>
+
+/** Counts calls to the global operator new, for checking that the
+ * per-read path doesn't allocate. The counting operator new is only
+ * built with VARIANT_COUNT_ALLOCS (configure --enable-alloc-counter),
+ * as it puts an atomic increment on every allocation of every thread.
+ * htslib's own malloc calls are not seen here.
+ */
+namespace AllocCounter {
+
+  /** True if allocations are counted */
+  bool enabled();
+
+  /** Number of operator new / new[] calls so far, on all threads. 0 if not enabled */
+  uint64_t count();
+
+}
+#endif
@@ -0,0 +1,195 @@
+#include "BaiBuilder.h"
+
+#include <cstdio>
+#include <cstring>
+
+// smallest bin and linear index window, as in the SAM spec
+static const int MIN_SHIFT = 14;
+
+// first bin of level l, counting the top level as 0
+static inline uint32_t firstBin(int l) { return ((1u << (3 * l)) - 1) / 7; }
+
+uint32_t BaiBuilder::reg2bin(int32_t beg, int32_t end, int depth)
+{
+  --end;
+  int s = MIN_SHIFT;
+  for (int l = depth; l > 0; --l, s += 3)
+    if (beg >> s == end >> s)
+      return firstBin(l) + (beg >> s);
+  return 0;
+}
+
+int BaiBuilder::depthFor(uint64_t len)
+{
+  int depth = 5;
+  while ((1ull << (MIN_SHIFT + 3 * depth)) < len)
+    ++depth;
+  return depth;
+}
+
+int32_t BaiBuilder::recordEnd(const uint8_t* rec, size_t len)
+{
+  int32_t pos;
+  uint32_t bin_mq_nl, flag_nc;
+  memcpy(&pos, rec + 4, 4);
+  memcpy(&bin_mq_nl, rec + 8, 4);
+  memcpy(&flag_nc, rec + 12, 4);
+
+  // as bam_endpos: an unmapped read, or one with no reference bases, covers one
+  const uint16_t BAM_FUNMAP = 4;
+  if ((flag_nc >> 16) & BAM_FUNMAP)
+    return pos + 1;
+
+  size_t cigar = 32 + (bin_mq_nl & 0xff);
+  size_t n_cigar = flag_nc & 0xffff;
+  int32_t rlen = 0;
+  for (size_t i = 0; i < n_cigar && cigar + 4 * i + 4 <= len; ++i) {
+    uint32_t op;
+    memcpy(&op, rec + cigar + 4 * i, 4);
+    // M, D, N, = and X take up the reference
+    if ((0x18d >> (op & 0xf)) & 1)
+      rlen += op >> 4;
+  }
+  return pos + (rlen > 0 ? rlen : 1);
+}
+
+void BaiBuilder::closeChunk()
+{
+  if (!m_open)
+    return;
+  m_open = false;
+
+  // chunks of a bin that meet in the same block are read with one seek anyway
+  std::vector<Chunk>& chunks = m_refs[m_tid].bins[m_bin];
+  if (chunks.size() && chunks.back().end >> 16 == m_chunk.beg >> 16)
+    chunks.back().end = m_chunk.end;
+  else
+    chunks.push_back(m_chunk);
+}
+
+bool BaiBuilder::push(int32_t tid, int32_t beg, int32_t end, bool mapped, uint64_t off_beg, uint64_t off_end)
+{
+  ++m_records;
+
+  if (tid < 0 || tid >= (int32_t)m_refs.size()) {
+    closeChunk();
+    m_unplaced = true;
+    ++m_no_coor;
+    return tid < 0;
+  }
+
+  if (m_unplaced || tid < m_tid || (tid == m_tid && beg < m_last_pos))
+    return false;
+
+  if (tid != m_tid) {
+    closeChunk();
+    m_tid = tid;
+  }
+  m_last_pos = beg;
+  if (end <= beg)
+    end = beg + 1;
+
+  uint32_t bin = reg2bin(beg, end, m_depth);
+  if (!m_open || bin != m_bin) {
+    closeChunk();
+    m_open = true;
+    m_bin = bin;
+    m_chunk.beg = off_beg;
+  }
+  m_chunk.end = off_end;
+
+  // the first record to touch each 16 kb window
+  Ref& r = m_refs[tid];
+  size_t w_end = (size_t)(end - 1) >> MIN_SHIFT;
+  if (r.linear.size() <= w_end)
+    r.linear.resize(w_end + 1, UINT64_MAX);
+  for (size_t w = beg >> MIN_SHIFT; w <= w_end; ++w)
+    if (r.linear[w] == UINT64_MAX)
+      r.linear[w] = off_beg;
+
+  if (r.off_beg == UINT64_MAX)
+    r.off_beg = off_beg;
+  r.off_end = off_end;
+  if (mapped)
+    ++r.n_mapped;
+  else
+    ++r.n_unmapped;
+
+  return true;
+}
+
+template <typename T>
+static void put(std::string& out, T v)
+{
+  // BAI is little-endian, as are the hosts we build on
+  out.append((const char*)&v, sizeof(T));
+}
+
+bool BaiBuilder::write(const std::string& file)
+{
+  closeChunk();
+
+  // the pseudo-bin comes after the last real one
+  const uint32_t meta_bin = firstBin(m_depth + 1) + 1;
+
+  std::string out(csi() ? "CSI\1" : "BAI\1", 4);
+  if (csi()) {
+    put<int32_t>(out, MIN_SHIFT);
+    put<int32_t>(out, m_depth);
+    put<int32_t>(out, 0);
+  }
+  put<int32_t>(out, m_refs.size());
+  for (auto& r : m_refs) {
+    bool any = r.off_beg != UINT64_MAX;
+
+    // as htslib: windows before the first record get its offset, and a window
+    // no record touches gets the one before it, which is never too late
+    uint64_t last = any ? r.off_beg : 0;
+    for (auto& off : r.linear) {
+      if (off == UINT64_MAX)
+	off = last;
+      last = off;
+    }
+
+    put<int32_t>(out, r.bins.size() + any);
+    for (auto& b : r.bins) {
+      put<uint32_t>(out, b.first);
+      // CSI has no linear index. each bin has the offset of its first window instead
+      if (csi()) {
+	int l = 0;
+	for (uint32_t p = b.first; p; p = (p - 1) >> 3)
+	  ++l;
+	size_t bot = (size_t)(b.first - firstBin(l)) << 3 * (m_depth - l);
+	put<uint64_t>(out, bot < r.linear.size() ? r.linear[bot] : 0);
+      }
+      put<int32_t>(out, b.second.size());
+      for (auto& c : b.second) {
+	put<uint64_t>(out, c.beg);
+	put<uint64_t>(out, c.end);
+      }
+    }
+    if (any) {
+      put<uint32_t>(out, meta_bin);
+      if (csi())
+	put<uint64_t>(out, 0);
+      put<int32_t>(out, 2);
+      put<uint64_t>(out, r.off_beg);
+      put<uint64_t>(out, r.off_end);
+      put<uint64_t>(out, r.n_mapped);
+      put<uint64_t>(out, r.n_unmapped);
+    }
+
+    if (!csi()) {
+      put<int32_t>(out, r.linear.size());
+      for (auto off : r.linear)
+	put<uint64_t>(out, off);
+    }
+  }
+  put<uint64_t>(out, m_no_coor);
+
+  FILE* fp = fopen(file.c_str(), "wb");
+  if (!fp)
+    return false;
+  bool ok = fwrite(out.data(), 1, out.size(), fp) == out.size();
+  return fclose(fp) == 0 && ok;
+}
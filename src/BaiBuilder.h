@@ -0,0 +1,89 @@
+#ifndef VARIANT_BAI_BUILDER_H__
+#define VARIANT_BAI_BUILDER_H__
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+/** Build a BAM index (.bai) from records as they are written, so the
+ * output doesn't need a second pass with samtools index.
+ *
+ * Each record is given with its span on the reference and the BGZF
+ * virtual offsets where it starts and ends in the file. The index is
+ * laid out as htslib's: chunks per bin (neighbors in the same block
+ * merged), a 16 kb linear index, and the pseudo-bin with the offsets
+ * and mapped/unmapped counts of each reference.
+ *
+ * References longer than BAI's 2^29 bases need more bin levels, which
+ * only a CSI index has. With depth > 5 the index is written as CSI.
+ */
+class BaiBuilder
+{
+ public:
+
+  explicit BaiBuilder(int32_t n_ref = 0, int depth = 5) : m_refs(n_ref > 0 ? n_ref : 0), m_depth(depth) {}
+
+  /** Add a record on [beg, end) of tid (-1 for no coordinate), stored at
+   * virtual offsets [off_beg, off_end). Returns false if it comes before
+   * the record before it, as the index needs coordinate order */
+  bool push(int32_t tid, int32_t beg, int32_t end, bool mapped, uint64_t off_beg, uint64_t off_end);
+
+  /** Write the index. Returns false if the file can't be written */
+  bool write(const std::string& file);
+
+  /** Records pushed */
+  uint64_t records() const { return m_records; }
+
+  /** True if the index is written as CSI */
+  bool csi() const { return m_depth != 5; }
+
+  /** File extension of the index, .bai or .csi */
+  std::string extension() const { return csi() ? ".csi" : ".bai"; }
+
+  /** The bin of [beg, end), as in the SAM spec, with depth levels below the top one */
+  static uint32_t reg2bin(int32_t beg, int32_t end, int depth = 5);
+
+  /** The fewest levels (at least BAI's 5) that cover a reference of len bases */
+  static int depthFor(uint64_t len);
+
+  /** End of the alignment of a record in BAM encoding (from refID on,
+   * without block_size): pos plus the reference length of its CIGAR,
+   * or pos + 1 if that is 0 */
+  static int32_t recordEnd(const uint8_t* rec, size_t len);
+
+ private:
+
+  struct Chunk {
+    uint64_t beg;
+    uint64_t end;
+  };
+
+  struct Ref {
+    std::map<uint32_t, std::vector<Chunk> > bins;
+    std::vector<uint64_t> linear;
+    uint64_t off_beg = UINT64_MAX;
+    uint64_t off_end = 0;
+    uint64_t n_mapped = 0;
+    uint64_t n_unmapped = 0;
+  };
+
+  // add the open chunk to its bin
+  void closeChunk();
+
+  std::vector<Ref> m_refs;
+  int m_depth;
+
+  int32_t m_tid = -1;
+  int32_t m_last_pos = -1;
+  bool m_unplaced = false;  // past the reads with a coordinate
+
+  bool m_open = false;
+  uint32_t m_bin = 0;
+  Chunk m_chunk = {0, 0};
+
+  uint64_t m_no_coor = 0;
+  uint64_t m_records = 0;
+
+};
+#endif
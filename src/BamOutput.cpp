@@ -0,0 +1,144 @@
+#include "BamOutput.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+static inline void append_le32(std::string& s, uint32_t v)
+{
+  char b[4];
+  for (int i = 0; i < 4; ++i)
+    b[i] = (v >> (8*i)) & 0xff;
+  s.append(b, 4);
+}
+
+void BamOutput::packHeader(const bam_hdr_t* h, std::string& out)
+{
+  out.assign("BAM\1", 4);
+  append_le32(out, h->l_text);
+  out.append(h->text, h->l_text);
+  append_le32(out, h->n_targets);
+  for (int32_t i = 0; i < h->n_targets; ++i) {
+    size_t l_name = strlen(h->target_name[i]) + 1;
+    append_le32(out, l_name);
+    out.append(h->target_name[i], l_name);
+    append_le32(out, h->target_len[i]);
+  }
+}
+
+bool BamOutput::open(const std::string& file, const bam_hdr_t* h, int level, int threads, bool index)
+{
+  if (!m_bgzf.open(file, level, threads))
+    return false;
+
+  m_file = file;
+  if (index) {
+    uint64_t max_len = 0;
+    for (int32_t i = 0; i < h->n_targets; ++i)
+      max_len = std::max<uint64_t>(max_len, h->target_len[i]);
+    m_index.reset(new BaiBuilder(h->n_targets, BaiBuilder::depthFor(max_len)));
+    m_bgzf.trackBlocks();
+  }
+
+  std::string hdr;
+  packHeader(h, hdr);
+  m_bgzf.write(hdr.data(), hdr.size());
+
+  // reads start on a fresh block, as htslib does
+  m_bgzf.flush();
+  return true;
+}
+
+void BamOutput::write(const bam1_t* b)
+{
+  const bam1_core_t* c = &b->core;
+
+  // block_size, then the fixed fields, then the variable-length data.
+  // BAM is little-endian, as are the hosts we build on
+  uint32_t x[9];
+  x[0] = b->l_data + 32;
+  x[1] = c->tid;
+  x[2] = c->pos;
+  x[3] = (uint32_t)c->bin<<16 | c->qual<<8 | c->l_qname;
+  x[4] = (uint32_t)c->flag<<16 | c->n_cigar;
+  x[5] = c->l_qseq;
+  x[6] = c->mtid;
+  x[7] = c->mpos;
+  x[8] = c->isize;
+
+  if (!m_index) {
+    m_bgzf.writeRecord(x, sizeof(x), b->data, b->l_data);
+    return;
+  }
+
+  Pending p;
+  p.tid = c->tid;
+  p.beg = c->pos;
+  p.end = bam_endpos(b);
+  p.mapped = !(c->flag & BAM_FUNMAP);
+  uint64_t block = m_bgzf.blockNumber();
+  m_bgzf.fitRecord(sizeof(x) + b->l_data);
+  blockEnded(block);
+  p.beg_block = m_bgzf.blockNumber();
+  p.beg_off = m_bgzf.blockOffset();
+  m_bgzf.writeRecord(x, sizeof(x), b->data, b->l_data);
+  p.end_block = m_bgzf.blockNumber();
+  p.end_off = m_bgzf.blockOffset();
+  m_pending.push_back(p);
+
+  indexWritten();
+}
+
+void BamOutput::blockEnded(uint64_t block)
+{
+  // as htslib reads it, a record that ends its block ends at the start of the next
+  if (m_bgzf.blockNumber() != block && m_pending.size() && m_pending.back().end_block == block) {
+    m_pending.back().end_block = m_bgzf.blockNumber();
+    m_pending.back().end_off = 0;
+  }
+}
+
+void BamOutput::indexWritten()
+{
+  while (m_pending.size()) {
+    const Pending& p = m_pending.front();
+    // the end of a record inside the open block can still move to the next
+    if (p.end_block == m_bgzf.blockNumber() && p.end_off)
+      return;
+    uint64_t end = m_bgzf.blockAddress(p.end_block);
+    if (end == UINT64_MAX)
+      return;
+    uint64_t beg = m_bgzf.blockAddress(p.beg_block);
+    if (!m_index->push(p.tid, p.beg, p.end, p.mapped, beg << 16 | p.beg_off, end << 16 | p.end_off)) {
+      m_index_failed = true;
+      m_index.reset();
+      m_pending.clear();
+      return;
+    }
+    m_bgzf.forgetBlocks(p.beg_block);
+    m_pending.pop_front();
+  }
+}
+
+void BamOutput::close()
+{
+  if (m_index) {
+    uint64_t block = m_bgzf.blockNumber();
+    m_bgzf.flush();
+    blockEnded(block);
+  }
+  m_bgzf.close();
+
+  if (!m_index)
+    return;
+  indexWritten();
+  if (m_index) {
+    std::string file = m_file + m_index->extension();
+    if (!m_index->write(file)) {
+      std::cerr << "ERROR: Could not write index " << file << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    m_index_file = file;
+    m_index.reset();
+  }
+}
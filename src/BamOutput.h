@@ -0,0 +1,79 @@
+#ifndef VARIANT_BAM_OUTPUT_H__
+#define VARIANT_BAM_OUTPUT_H__
+
+#include <deque>
+#include <memory>
+#include <string>
+
+#include "htslib/sam.h"
+#include "BgzfWriter.h"
+#include "BaiBuilder.h"
+
+/** Write BAM records through a BgzfWriter.
+ *
+ * With index set, the index is built as the records are written and
+ * saved next to the file at close (.bai, or .csi for references over
+ * 2^29 bases). A record's virtual offsets are only known once its block
+ * is compressed and on disk, so records wait in a short queue until then.
+ */
+class BamOutput
+{
+ public:
+
+  BamOutput() {}
+
+  /** Open the file and write the header. Returns false on failure */
+  bool open(const std::string& file, const bam_hdr_t* h, int level = -1, int threads = 0, bool index = false);
+
+  /** Carry on writing a file cut off at a checkpoint (see BgzfWriter::resume).
+   * The header is already there */
+  bool resume(const std::string& file, uint64_t size, uint64_t in_bytes, int level = -1, int threads = 0) {
+    return m_bgzf.resume(file, size, in_bytes, level, threads);
+  }
+
+  /** Append one record */
+  void write(const bam1_t* b);
+
+  /** Close the file, and write the index if there is one */
+  void close();
+
+  /** The index written at close, or "" if none was (not asked for, or
+   * the records weren't in coordinate order) */
+  const std::string& indexFile() const { return m_index_file; }
+
+  /** True if an index was asked for but the records were out of order */
+  bool indexFailed() const { return m_index_failed; }
+
+  bool isOpen() const { return m_bgzf.isOpen(); }
+
+  BgzfWriter& bgzf() { return m_bgzf; }
+
+  /** Serialize the header into the BAM binary layout */
+  static void packHeader(const bam_hdr_t* h, std::string& out);
+
+ private:
+
+  // a record waiting for its blocks to be written
+  struct Pending {
+    int32_t tid, beg, end;
+    bool mapped;
+    uint64_t beg_block, end_block;
+    uint32_t beg_off, end_off;
+  };
+
+  // index the records whose blocks are on disk
+  void indexWritten();
+
+  // called after the open block may have been submitted, block being the one open before
+  void blockEnded(uint64_t block);
+
+  BgzfWriter m_bgzf;
+
+  std::string m_file;
+  std::unique_ptr<BaiBuilder> m_index;
+  std::deque<Pending> m_pending;
+  std::string m_index_file;
+  bool m_index_failed = false;
+
+};
+#endif
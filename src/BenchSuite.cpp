@@ -0,0 +1,195 @@
+#include "BenchSuite.h"
+
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const char* TABLE_HEADER = "date\tlabel\tcase\tseconds\treads_per_sec\tmb_per_sec\tpeak_rss_kb\tallocs";
+
+static std::string replaceAll(std::string s, const std::string& from, const std::string& to)
+{
+  for (size_t i = s.find(from); i != std::string::npos; i = s.find(from, i + to.size()))
+    s.replace(i, from.size(), to);
+  return s;
+}
+
+BenchSuite::BenchSuite(const std::string& variant, const std::string& bam, uint64_t reads, const std::string& dir)
+  : m_variant(variant), m_bam(bam), m_reads(reads), m_dir(dir)
+{
+  struct stat st;
+  if (stat(bam.c_str(), &st) == 0)
+    m_bytes = st.st_size;
+}
+
+void BenchSuite::add(const std::string& name, const std::vector<std::string>& args)
+{
+  Case c;
+  c.name = name;
+  for (auto& a : args)
+    c.args.push_back(replaceAll(replaceAll(a, "{bam}", m_bam), "{dir}", m_dir));
+  m_cases.push_back(c);
+}
+
+bool BenchSuite::runOnce(const Case& c, Result& r)
+{
+  std::string log = m_dir + "/" + c.name + ".log";
+
+  std::vector<char*> argv;
+  argv.push_back((char*)m_variant.c_str());
+  for (auto& a : c.args)
+    argv.push_back((char*)a.c_str());
+  argv.push_back((char*)"-v");
+  argv.push_back(nullptr);
+
+  auto start = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid < 0)
+    return false;
+  if (pid == 0) {
+    // reads that go to stdout are thrown away, the -v report goes to the log
+    int out = open("/dev/null", O_WRONLY);
+    int err = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0 || err < 0)
+      _exit(127);
+    dup2(out, STDOUT_FILENO);
+    dup2(err, STDERR_FILENO);
+    execv(m_variant.c_str(), argv.data());
+    _exit(127);
+  }
+
+  int status = 0;
+  struct rusage ru;
+  if (wait4(pid, &status, 0, &ru) != pid)
+    return false;
+  r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    return false;
+
+  // ru_maxrss is in kilobytes on Linux
+  r.name = c.name;
+  r.peak_rss_kb = ru.ru_maxrss;
+  r.reads_per_sec = m_reads / r.seconds;
+  r.mb_per_sec = m_bytes / 1e6 / r.seconds;
+
+  std::ifstream ifs(log);
+  std::stringstream ss;
+  ss << ifs.rdbuf();
+  r.allocs = parseAllocs(ss.str());
+  return true;
+}
+
+bool BenchSuite::run(int repeat)
+{
+  m_results.clear();
+  std::printf("%-14s %10s %12s %10s %12s %14s\n", "case", "seconds", "reads/s", "MB/s", "peak RSS MB", "allocations");
+  for (auto& c : m_cases) {
+    Result best;
+    for (int i = 0; i < repeat; ++i) {
+      Result r;
+      if (!runOnce(c, r)) {
+	std::cerr << "ERROR: Case " << c.name << " failed. See " << m_dir << "/" << c.name << ".log" << std::endl;
+	return false;
+      }
+      if (i == 0 || r.seconds < best.seconds)
+	best = r;
+    }
+    std::printf("%-14s %10.2f %12.0f %10.1f %12.1f %14llu\n", best.name.c_str(), best.seconds, best.reads_per_sec,
+		best.mb_per_sec, best.peak_rss_kb / 1024.0, (unsigned long long)best.allocs);
+    m_results.push_back(best);
+  }
+  return true;
+}
+
+bool BenchSuite::appendTable(const std::string& file, const std::string& label) const
+{
+  bool is_new = access(file.c_str(), F_OK) != 0;
+  std::ofstream ofs(file, std::ios::app);
+  if (!ofs)
+    return false;
+
+  char date[32];
+  time_t now = time(nullptr);
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+  if (is_new)
+    ofs << TABLE_HEADER << std::endl;
+  for (auto& r : m_results)
+    ofs << date << "\t" << (label.length() ? label : "-") << "\t" << r.name << "\t" << r.seconds << "\t"
+	<< (uint64_t)r.reads_per_sec << "\t" << r.mb_per_sec << "\t" << r.peak_rss_kb << "\t" << r.allocs << std::endl;
+  return (bool)ofs;
+}
+
+bool BenchSuite::readTable(const std::string& file, std::vector<Result>& results)
+{
+  std::ifstream ifs(file);
+  std::string line;
+  if (!ifs || !std::getline(ifs, line) || line != TABLE_HEADER)
+    return false;
+
+  // later rows of a case replace earlier ones, in the order cases first came
+  std::map<std::string, size_t> index;
+  results.clear();
+  while (std::getline(ifs, line)) {
+    std::istringstream iss(line);
+    std::string date, label;
+    Result r;
+    if (!(iss >> date >> label >> r.name >> r.seconds >> r.reads_per_sec >> r.mb_per_sec >> r.peak_rss_kb >> r.allocs))
+      continue;
+    auto it = index.find(r.name);
+    if (it == index.end()) {
+      index[r.name] = results.size();
+      results.push_back(r);
+    } else {
+      results[it->second] = r;
+    }
+  }
+  return true;
+}
+
+std::vector<std::string> BenchSuite::compare(const std::vector<Result>& base, const std::vector<Result>& results,
+					     double tolerance)
+{
+  std::vector<std::string> worse;
+  for (auto& r : results) {
+    for (auto& b : base) {
+      if (b.name != r.name)
+	continue;
+      std::ostringstream msg;
+      if (r.reads_per_sec < b.reads_per_sec * (1 - tolerance))
+	msg << " reads/s " << (uint64_t)b.reads_per_sec << " -> " << (uint64_t)r.reads_per_sec;
+      if (r.peak_rss_kb > b.peak_rss_kb * (1 + tolerance))
+	msg << " peak RSS " << b.peak_rss_kb << " -> " << r.peak_rss_kb << " kB";
+      // a few allocations either way are noise (htslib, the C++ runtime)
+      if (r.allocs > b.allocs * (1 + tolerance) + 1000)
+	msg << " allocations " << b.allocs << " -> " << r.allocs;
+      if (msg.str().length())
+	worse.push_back(r.name + ":" + msg.str());
+    }
+  }
+  return worse;
+}
+
+uint64_t BenchSuite::parseAllocs(const std::string& log)
+{
+  const std::string key = "heap allocations during the walk: ";
+  size_t i = log.find(key);
+  if (i == std::string::npos)
+    return 0;
+
+  uint64_t n = 0;
+  for (i += key.size(); i < log.size() && (isdigit(log[i]) || log[i] == ','); ++i)
+    if (log[i] != ',')
+      n = n * 10 + (log[i] - '0');
+  return n;
+}
@@ -0,0 +1,77 @@
+#ifndef VARIANT_BENCH_SUITE_H__
+#define VARIANT_BENCH_SUITE_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/** End-to-end runs of the variant binary on one BAM, for make bench
+ * (variant_bench suite).
+ *
+ * Each case runs variant -v as a child process and is measured from the
+ * outside: wall time, peak RSS (from wait4) and the heap allocations the
+ * run reports. Throughput is over the reads and the compressed bytes of
+ * the input. Results are appended to a table, one row per case, which a
+ * later run can be checked against.
+ */
+class BenchSuite
+{
+ public:
+
+  struct Result {
+    std::string name;
+    double seconds = 0;
+    double reads_per_sec = 0;
+    double mb_per_sec = 0;
+    long peak_rss_kb = 0;
+    uint64_t allocs = 0;
+  };
+
+  /** Run variant on bam with reads records, keeping logs and outputs in dir */
+  BenchSuite(const std::string& variant, const std::string& bam, uint64_t reads, const std::string& dir);
+
+  /** Add a case. In args, {bam} is the input and {dir} the work directory */
+  void add(const std::string& name, const std::vector<std::string>& args);
+
+  /** Run every case repeat times, keeping the fastest run of each.
+   * Returns false if a run fails, with its log left in dir */
+  bool run(int repeat);
+
+  const std::vector<Result>& results() const { return m_results; }
+
+  /** Append the results to file, with the date and label (a commit, say)
+   * on each row. The header goes in first if the file is new */
+  bool appendTable(const std::string& file, const std::string& label) const;
+
+  /** Read the last row of each case from a table written by appendTable */
+  static bool readTable(const std::string& file, std::vector<Result>& results);
+
+  /** Cases of results that are worse than in base by more than tolerance
+   * (0.1 for 10%): slower, or using more memory or allocations. One line each */
+  static std::vector<std::string> compare(const std::vector<Result>& base, const std::vector<Result>& results,
+					  double tolerance);
+
+  /** The allocation count from the -v output of variant. 0 if there isn't one */
+  static uint64_t parseAllocs(const std::string& log);
+
+ private:
+
+  struct Case {
+    std::string name;
+    std::vector<std::string> args;
+  };
+
+  // run one case once. false if it didn't exit cleanly
+  bool runOnce(const Case& c, Result& r);
+
+  std::string m_variant;
+  std::string m_bam;
+  uint64_t m_reads;
+  std::string m_dir;
+  uint64_t m_bytes = 0;
+
+  std::vector<Case> m_cases;
+  std::vector<Result> m_results;
+
+};
+#endif
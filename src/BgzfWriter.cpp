@@ -0,0 +1,287 @@
+#include "BgzfWriter.h"
+
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+#include <zlib.h>
+
+const size_t BgzfWriter::BLOCK_SIZE;
+const size_t BgzfWriter::MAX_BLOCK_SIZE;
+
+// empty block that marks the end of a BGZF file
+static const uint8_t BGZF_EOF[28] = { 0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+static const size_t BGZF_HEADER_SIZE = 18;
+static const size_t BGZF_FOOTER_SIZE = 8;
+
+static inline void put_le16(uint8_t* p, uint16_t v) { p[0] = v & 0xff; p[1] = v >> 8; }
+static inline void put_le32(uint8_t* p, uint32_t v) { for (int i = 0; i < 4; ++i) p[i] = (v >> (8*i)) & 0xff; }
+
+BgzfWriter::~BgzfWriter()
+{
+  if (m_fp)
+    close();
+}
+
+bool BgzfWriter::open(const std::string& file, int level, int threads)
+{
+  m_file = file;
+  m_fp = fopen(file.c_str(), "wb");
+  if (!m_fp)
+    return false;
+
+  start(level, threads);
+  return true;
+}
+
+bool BgzfWriter::resume(const std::string& file, uint64_t size, uint64_t in_bytes, int level, int threads)
+{
+  m_file = file;
+  m_fp = fopen(file.c_str(), "r+b");
+  if (!m_fp)
+    return false;
+
+  // a file shorter than the checkpoint isn't the one it was taken on
+  if (fseeko(m_fp, 0, SEEK_END) != 0 || (uint64_t)ftello(m_fp) < size
+      || ftruncate(fileno(m_fp), size) != 0 || fseeko(m_fp, size, SEEK_SET) != 0) {
+    fclose(m_fp);
+    m_fp = nullptr;
+    return false;
+  }
+
+  m_out_bytes = size;
+  m_in_bytes = in_bytes;
+  start(level, threads);
+  return true;
+}
+
+void BgzfWriter::start(int level, int threads)
+{
+  m_level = level;
+  m_current.reset(new Block);
+  m_current->in.reserve(BLOCK_SIZE);
+
+  for (int i = 0; i < threads; ++i)
+    m_threads.push_back(std::thread(&BgzfWriter::worker, this));
+}
+
+size_t BgzfWriter::compressBlock(const uint8_t* in, size_t len, uint8_t* out, int level)
+{
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, level < 0 ? Z_DEFAULT_COMPRESSION : level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    std::cerr << "ERROR: Failed to initialize zlib" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  zs.next_in = const_cast<uint8_t*>(in);
+  zs.avail_in = len;
+  zs.next_out = out + BGZF_HEADER_SIZE;
+  zs.avail_out = MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+  if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+    std::cerr << "ERROR: BGZF block did not fit after compression" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  size_t clen = zs.total_out;
+  deflateEnd(&zs);
+
+  size_t block_len = clen + BGZF_HEADER_SIZE + BGZF_FOOTER_SIZE;
+
+  // gzip header with the BC extra field holding the block size
+  static const uint8_t header[16] = { 0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 0x06, 0, 'B', 'C', 0x02, 0 };
+  memcpy(out, header, 16);
+  put_le16(out + 16, block_len - 1);
+
+  put_le32(out + BGZF_HEADER_SIZE + clen, crc32(crc32(0L, NULL, 0L), in, len));
+  put_le32(out + BGZF_HEADER_SIZE + clen + 4, len);
+
+  return block_len;
+}
+
+void BgzfWriter::write(const void* data, size_t len)
+{
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  m_in_bytes += len;
+  while (len) {
+    size_t n = std::min(len, BLOCK_SIZE - m_current->in.size());
+    m_current->in.insert(m_current->in.end(), p, p + n);
+    p += n;
+    len -= n;
+    if (m_current->in.size() == BLOCK_SIZE)
+      submit();
+  }
+}
+
+void BgzfWriter::writeRecord(const void* head, size_t head_len, const void* data, size_t len)
+{
+  fitRecord(head_len + len);
+  write(head, head_len);
+  write(data, len);
+}
+
+void BgzfWriter::fitRecord(size_t len)
+{
+  if (m_current->in.size() && m_current->in.size() + len > BLOCK_SIZE)
+    submit();
+}
+
+void BgzfWriter::trackBlocks()
+{
+  m_track = true;
+  m_addr_base = m_blocks;
+  m_addrs.assign(1, m_out_bytes);
+}
+
+void BgzfWriter::forgetBlocks(uint64_t n)
+{
+  while (m_addrs.size() > 1 && m_addr_base < n) {
+    m_addrs.pop_front();
+    ++m_addr_base;
+  }
+}
+
+void BgzfWriter::writeRawBlock(const uint8_t* block, size_t len, size_t in_len)
+{
+  flush();
+  drainAll();
+  if (fwrite(block, 1, len, m_fp) != len) {
+    std::cerr << "ERROR: Failed to write to " << m_file << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  m_out_bytes += len;
+  m_in_bytes += in_len;
+}
+
+void BgzfWriter::flush()
+{
+  if (m_current->in.size())
+    submit();
+}
+
+void BgzfWriter::submit()
+{
+  ++m_blocks;
+  std::shared_ptr<Block> b(m_current.release());
+  m_current.reset(new Block);
+  m_current->in.reserve(BLOCK_SIZE);
+
+  if (m_threads.empty()) {
+    b->out.resize(MAX_BLOCK_SIZE);
+    b->out_len = compressBlock(b->in.data(), b->in.size(), b->out.data(), m_level);
+    writeBlock(*b);
+    return;
+  }
+
+  size_t in_flight;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pending.push_back(b);
+    m_jobs.push_back(b);
+    in_flight = m_pending.size();
+  }
+  m_job_cv.notify_one();
+
+  // keep a bounded number of blocks in memory
+  drain(in_flight > 4 * m_threads.size());
+}
+
+void BgzfWriter::drain(bool block_until_done)
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  if (block_until_done)
+    m_done_cv.wait(lock, [&]{ return m_pending.empty() || m_pending.front()->done; });
+
+  while (m_pending.size() && m_pending.front()->done) {
+    std::shared_ptr<Block> b = m_pending.front();
+    m_pending.pop_front();
+    lock.unlock();
+    writeBlock(*b);
+    lock.lock();
+  }
+}
+
+void BgzfWriter::writeBlock(const Block& b)
+{
+  if (fwrite(b.out.data(), 1, b.out_len, m_fp) != b.out_len) {
+    std::cerr << "ERROR: Failed to write to " << m_file << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  m_out_bytes += b.out_len;
+  if (m_track)
+    m_addrs.push_back(m_out_bytes);
+}
+
+void BgzfWriter::worker()
+{
+  for (;;) {
+    std::shared_ptr<Block> b;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_job_cv.wait(lock, [&]{ return m_stop || m_jobs.size(); });
+      if (m_jobs.empty())
+	return;
+      b = m_jobs.front();
+      m_jobs.pop_front();
+    }
+
+    b->out.resize(MAX_BLOCK_SIZE);
+    b->out_len = compressBlock(b->in.data(), b->in.size(), b->out.data(), m_level);
+    std::vector<uint8_t>().swap(b->in);
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      b->done = true;
+    }
+    m_done_cv.notify_all();
+  }
+}
+
+void BgzfWriter::drainAll()
+{
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_pending.empty())
+	break;
+    }
+    drain(true);
+  }
+}
+
+uint64_t BgzfWriter::sync()
+{
+  flush();
+  drainAll();
+  if (fflush(m_fp) != 0 || fsync(fileno(m_fp)) != 0) {
+    std::cerr << "ERROR: Failed to write to " << m_file << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return m_out_bytes;
+}
+
+void BgzfWriter::close()
+{
+  if (!m_fp)
+    return;
+
+  flush();
+  drainAll();
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_job_cv.notify_all();
+  for (auto& t : m_threads)
+    t.join();
+  m_threads.clear();
+
+  if (fwrite(BGZF_EOF, 1, sizeof(BGZF_EOF), m_fp) != sizeof(BGZF_EOF)) {
+    std::cerr << "ERROR: Failed to write to " << m_file << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  m_out_bytes += sizeof(BGZF_EOF);
+
+  fclose(m_fp);
+  m_fp = nullptr;
+}
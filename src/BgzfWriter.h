@@ -0,0 +1,155 @@
+#ifndef VARIANT_BGZF_WRITER_H__
+#define VARIANT_BGZF_WRITER_H__
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/** Write a BGZF file, compressing blocks on a pool of threads.
+ *
+ * Data is cut into blocks of up to BLOCK_SIZE bytes in the order it is
+ * written. Full blocks are handed to the compression threads and written
+ * out strictly in order as they finish, so the file is the same for
+ * any number of threads. With 0 threads blocks are compressed inline.
+ */
+class BgzfWriter
+{
+ public:
+
+  BgzfWriter() {}
+
+  ~BgzfWriter();
+
+  BgzfWriter(const BgzfWriter&) = delete;
+  BgzfWriter& operator=(const BgzfWriter&) = delete;
+
+  /** Open a file for writing. level is the zlib level (0-9, -1 for default) */
+  bool open(const std::string& file, int level = -1, int threads = 0);
+
+  /** Open a file this class wrote before and carry on after its first
+   * size bytes, as returned by sync. The rest of the file is cut off.
+   * in_bytes is the uncompressed byte count at that point */
+  bool resume(const std::string& file, uint64_t size, uint64_t in_bytes, int level = -1, int threads = 0);
+
+  /** Append bytes. Blocks are cut wherever they fill up */
+  void write(const void* data, size_t len);
+
+  /** Append a record given in two parts, starting a new block first if
+   * it doesn't fit in the current one (so a BAM record doesn't span blocks) */
+  void writeRecord(const void* head, size_t head_len, const void* data, size_t len);
+
+  /** Start a new block if len bytes don't fit in the rest of this one
+   * (and it isn't empty), as writeRecord does */
+  void fitRecord(size_t len);
+
+  /** Where the next byte goes: the number of its block, counting from
+   * 0 when the file was opened, and its offset in the block */
+  uint64_t blockNumber() const { return m_blocks; }
+  size_t blockOffset() const { return m_current->in.size(); }
+
+  /** Keep the file address of each block once it is written, for
+   * blockAddress. Call right after open */
+  void trackBlocks();
+
+  /** File address of block n, or UINT64_MAX until every block before
+   * it is written. Blocks before one that was forgotten are unknown */
+  uint64_t blockAddress(uint64_t n) const {
+    return n >= m_addr_base && n - m_addr_base < m_addrs.size() ? m_addrs[n - m_addr_base] : UINT64_MAX;
+  }
+
+  /** Stop keeping the addresses of blocks before n */
+  void forgetBlocks(uint64_t n);
+
+  /** Append a complete BGZF block as it is, after ending the current one.
+   * in_len is the number of bytes it holds uncompressed */
+  void writeRawBlock(const uint8_t* block, size_t len, size_t in_len);
+
+  /** End the current block, even if it isn't full */
+  void flush();
+
+  /** Flush and wait until every block so far is on disk. Returns the
+   * size of the file, which ends on a block boundary */
+  uint64_t sync();
+
+  /** Flush, wait for all blocks to be written, add the EOF marker and close */
+  void close();
+
+  bool isOpen() const { return m_fp != nullptr; }
+
+  /** Uncompressed bytes written so far */
+  uint64_t uncompressedBytes() const { return m_in_bytes; }
+
+  /** Compressed bytes on disk so far (only blocks already written) */
+  uint64_t compressedBytes() const { return m_out_bytes; }
+
+  static const size_t BLOCK_SIZE = 0xff00;
+
+  static const size_t MAX_BLOCK_SIZE = 0x10000;
+
+  /** Compress one block into a complete BGZF block. Returns its size */
+  static size_t compressBlock(const uint8_t* in, size_t len, uint8_t* out, int level);
+
+ private:
+
+  struct Block {
+    std::vector<uint8_t> in;
+    std::vector<uint8_t> out;
+    size_t out_len = 0;
+    bool done = false;
+  };
+
+  // set up the block and the compression threads for an open file
+  void start(int level, int threads);
+
+  // wait until every pending block is written
+  void drainAll();
+
+  // hand the current block to the pool (or compress it here)
+  void submit();
+
+  // write out finished blocks from the front of the queue. wait for
+  // the front one if block_until_done
+  void drain(bool block_until_done);
+
+  void writeBlock(const Block& b);
+
+  void worker();
+
+  FILE* m_fp = nullptr;
+  std::string m_file;
+
+  int m_level = -1;
+
+  std::unique_ptr<Block> m_current;
+
+  uint64_t m_in_bytes = 0;
+  uint64_t m_out_bytes = 0;
+
+  // blocks handed on so far
+  uint64_t m_blocks = 0;
+
+  // with trackBlocks, the addresses of blocks m_addr_base on, up to the next one to be written
+  bool m_track = false;
+  uint64_t m_addr_base = 0;
+  std::deque<uint64_t> m_addrs;
+
+  // blocks in file order, waiting to be compressed and written
+  std::deque<std::shared_ptr<Block> > m_pending;
+
+  // blocks waiting for a compression thread
+  std::deque<std::shared_ptr<Block> > m_jobs;
+
+  std::vector<std::thread> m_threads;
+  std::mutex m_mutex;
+  std::condition_variable m_job_cv;
+  std::condition_variable m_done_cv;
+  bool m_stop = false;
+
+};
+#endif
@@ -0,0 +1,136 @@
+#include "BlockPrefetcher.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fcntl.h>
+#include <memory>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const uint64_t BlockPrefetcher::MAX_AHEAD;
+const size_t BlockPrefetcher::CHUNK;
+const size_t BlockPrefetcher::ALIGN;
+
+BlockPrefetcher::~BlockPrefetcher()
+{
+  stop();
+}
+
+bool BlockPrefetcher::start(const std::string& file, const std::vector<Range>& ranges)
+{
+  stop();
+
+  m_fd = ::open(file.c_str(), O_RDONLY);
+  if (m_fd < 0)
+    return false;
+
+  struct stat st;
+  uint64_t size = fstat(m_fd, &st) == 0 ? st.st_size : UINT64_MAX;
+
+  m_ranges = ranges;
+  m_before.assign(1, 0);
+  for (auto& r : m_ranges) {
+    r.end = std::min(r.end, size);
+    r.begin = std::min(r.begin, r.end);
+    m_before.push_back(m_before.back() + (r.end - r.begin));
+  }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  // a bigger kernel read-ahead for the reads of this descriptor
+  posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  m_current = 0;
+  m_reader = 0;
+  m_stop = false;
+  m_bytes = 0;
+  m_read_ns = 0;
+  m_thread = std::thread(&BlockPrefetcher::run, this);
+  return true;
+}
+
+void BlockPrefetcher::advance(size_t i)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (i <= m_current)
+      return;
+    m_current = i;
+    m_reader = std::max(m_reader, m_before[std::min(i, m_ranges.size())]);
+  }
+  m_cv.notify_all();
+}
+
+void BlockPrefetcher::advanceTo(uint64_t offset)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_current >= m_ranges.size())
+      return;
+    const Range& r = m_ranges[m_current];
+    if (offset <= r.begin)
+      return;
+    uint64_t at = m_before[m_current] + (std::min(offset, r.end) - r.begin);
+    if (at <= m_reader)
+      return;
+    m_reader = at;
+  }
+  m_cv.notify_all();
+}
+
+void BlockPrefetcher::stop()
+{
+  if (m_thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+  }
+  if (m_fd >= 0)
+    ::close(m_fd);
+  m_fd = -1;
+}
+
+void BlockPrefetcher::run()
+{
+  void* p = nullptr;
+  if (posix_memalign(&p, ALIGN, CHUNK) != 0)
+    return;
+  std::unique_ptr<char, void(*)(void*)> buf((char*)p, std::free);
+
+  uint64_t done = 0; // bytes of the ranges read so far
+
+  for (size_t i = 0; i < m_ranges.size(); ++i) {
+    for (uint64_t off = m_ranges[i].begin; off < m_ranges[i].end; ) {
+
+      {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_cv.wait(lock, [&]{ return m_stop || done < m_reader + m_window; });
+	if (m_stop)
+	  return;
+	// the reader is already past this range
+	if (m_current > i)
+	  break;
+      }
+
+      size_t n = std::min<uint64_t>(CHUNK, m_ranges[i].end - off);
+#ifdef POSIX_FADV_WILLNEED
+      // start on the next chunk while this one is read
+      if (off + n < m_ranges[i].end)
+	posix_fadvise(m_fd, off + n, std::min<uint64_t>(CHUNK, m_ranges[i].end - off - n), POSIX_FADV_WILLNEED);
+#endif
+      auto t = std::chrono::steady_clock::now();
+      ssize_t got = ::pread(m_fd, buf.get(), n, off);
+      m_read_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t).count();
+      if (got <= 0)
+	return; // past the end of the file, or an error the reader will report
+      off += got;
+      done += got;
+      m_bytes += got;
+    }
+    done = std::max(done, m_before[i + 1]);
+  }
+}
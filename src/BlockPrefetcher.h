@@ -0,0 +1,96 @@
+#ifndef VARIANT_BLOCK_PREFETCHER_H__
+#define VARIANT_BLOCK_PREFETCHER_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/** Reads byte ranges of a file on a background thread, in large
+ * sequential reads, so they are in the page cache by the time the
+ * BGZF reader asks for them.
+ *
+ * Ranges are read in order, CHUNK bytes at a time into an aligned
+ * buffer. The file is marked for sequential access, and the kernel is
+ * asked for each chunk before the thread waits on the one before it,
+ * so two reads are in flight. The thread stays at most a window of
+ * bytes ahead of where the reader says it is, so a long region list
+ * (or a whole file) doesn't push its own earlier blocks out of the
+ * cache.
+ */
+class BlockPrefetcher
+{
+ public:
+
+  struct Range {
+    uint64_t begin;
+    uint64_t end;
+  };
+
+  BlockPrefetcher() {}
+
+  ~BlockPrefetcher();
+
+  BlockPrefetcher(const BlockPrefetcher&) = delete;
+  BlockPrefetcher& operator=(const BlockPrefetcher&) = delete;
+
+  /** Start reading these ranges of file. Ranges past the end of the file
+   * stop at it. Returns false if it can't be opened */
+  bool start(const std::string& file, const std::vector<Range>& ranges);
+
+  /** Bytes to read ahead of the reader, at least CHUNK. Call before start */
+  void setWindow(uint64_t bytes) { m_window = bytes < CHUNK ? CHUNK : bytes; }
+
+  uint64_t window() const { return m_window; }
+
+  /** The reader has moved on to range i */
+  void advance(size_t i);
+
+  /** The reader is at this file offset, in the range it is on */
+  void advanceTo(uint64_t offset);
+
+  /** Stop the thread and close the file */
+  void stop();
+
+  /** Bytes read ahead so far */
+  uint64_t bytes() const { return m_bytes; }
+
+  /** Time the thread has spent reading, in ns */
+  uint64_t readNs() const { return m_read_ns; }
+
+  static const uint64_t MAX_AHEAD = 64 << 20;
+
+  static const size_t CHUNK = 4 << 20;
+
+  // of the read buffer
+  static const size_t ALIGN = 4096;
+
+ private:
+
+  void run();
+
+  int m_fd = -1;
+
+  uint64_t m_window = MAX_AHEAD;
+
+  std::vector<Range> m_ranges;
+
+  // bytes in the ranges before range i
+  std::vector<uint64_t> m_before;
+
+  std::thread m_thread;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+
+  size_t m_current = 0;
+  uint64_t m_reader = 0; // bytes of the ranges before the reader
+  bool m_stop = false;
+
+  std::atomic<uint64_t> m_bytes{0};
+  std::atomic<uint64_t> m_read_ns{0};
+
+};
+#endif
@@ -0,0 +1,194 @@
+#include "Checkpoint.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <unistd.h>
+#include <zlib.h>
+
+static const char MAGIC[8] = {'V', 'B', 'C', 'K', 'P', 'T', 2, 0};
+
+// fixed-width fields in host order. a checkpoint is only read back on the machine type that wrote it
+template <typename T>
+static void put(std::string& out, T v)
+{
+  out.append((const char*)&v, sizeof(T));
+}
+
+static void putString(std::string& out, const std::string& s)
+{
+  put<uint64_t>(out, s.size());
+  out += s;
+}
+
+namespace {
+
+  struct Reader {
+    const std::string& in;
+    size_t pos;
+    bool ok;
+
+    template <typename T>
+    T get() {
+      T v = T();
+      if (pos + sizeof(T) > in.size()) {
+	ok = false;
+	return v;
+      }
+      memcpy(&v, in.data() + pos, sizeof(T));
+      pos += sizeof(T);
+      return v;
+    }
+
+    std::string getString() {
+      uint64_t n = get<uint64_t>();
+      if (!ok || n > in.size() - pos) {
+	ok = false;
+	return std::string();
+      }
+      pos += n;
+      return in.substr(pos - n, n);
+    }
+  };
+
+}
+
+void Checkpoint::save(const std::string& file) const
+{
+  std::string out(MAGIC, sizeof(MAGIC));
+  putString(out, args);
+  put(out, in_offset);
+  put(out, out_size);
+  put(out, out_bytes);
+  put(out, total);
+  put(out, keep);
+  put(out, core_skipped);
+
+  put<uint64_t>(out, rule_counts.size());
+  for (auto c : rule_counts)
+    put(out, c);
+
+  put(out, cov.chr);
+  put(out, cov.base);
+  put<uint8_t>(out, cov.started);
+  put<uint64_t>(out, cov.depth.size());
+  out.append((const char*)cov.depth.data(), cov.depth.size() * sizeof(uint32_t));
+  put(out, cov_last);
+
+  put<uint64_t>(out, held.size());
+  for (auto& h : held)
+    putString(out, h);
+
+  put<uint32_t>(out, crc32(crc32(0L, NULL, 0L), (const Bytef*)out.data(), out.size()));
+
+  std::string tmp = file + ".tmp";
+  FILE* fp = fopen(tmp.c_str(), "wb");
+  bool ok = fp && fwrite(out.data(), 1, out.size(), fp) == out.size() && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+  if (fp)
+    ok = fclose(fp) == 0 && ok;
+  if (!ok || rename(tmp.c_str(), file.c_str()) != 0) {
+    std::cerr << "ERROR: Could not write checkpoint " << file << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+bool Checkpoint::load(const std::string& file)
+{
+  std::ifstream ifs(file, std::ios::binary);
+  if (!ifs)
+    return false;
+  std::string in((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+  Reader r = {in, sizeof(MAGIC), true};
+  bool ok = in.size() > sizeof(MAGIC) + 4 && memcmp(in.data(), MAGIC, sizeof(MAGIC)) == 0;
+  if (ok) {
+    uint32_t crc;
+    memcpy(&crc, in.data() + in.size() - 4, 4);
+    ok = crc == crc32(crc32(0L, NULL, 0L), (const Bytef*)in.data(), in.size() - 4);
+  }
+
+  if (ok) {
+    args = r.getString();
+    in_offset = r.get<int64_t>();
+    out_size = r.get<uint64_t>();
+    out_bytes = r.get<uint64_t>();
+    total = r.get<uint64_t>();
+    keep = r.get<uint64_t>();
+    core_skipped = r.get<uint64_t>();
+
+    rule_counts.resize(std::min<uint64_t>(r.get<uint64_t>(), in.size()));
+    for (auto& c : rule_counts)
+      c = r.get<uint64_t>();
+
+    cov.chr = r.get<int32_t>();
+    cov.base = r.get<int32_t>();
+    cov.started = r.get<uint8_t>();
+    cov.depth.resize(std::min<uint64_t>(r.get<uint64_t>(), in.size()));
+    for (auto& d : cov.depth)
+      d = r.get<uint32_t>();
+    cov_last = r.get<int32_t>();
+
+    held.resize(std::min<uint64_t>(r.get<uint64_t>(), in.size()));
+    for (auto& h : held) {
+      h = r.getString();
+      if (h.size() < 32)
+	r.ok = false;
+    }
+
+    ok = r.ok && r.pos + 4 == in.size();
+  }
+
+  if (!ok) {
+    std::cerr << "ERROR: Checkpoint " << file << " is damaged. Remove it to start over" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return true;
+}
+
+std::string Checkpoint::pack(const bam1_t* b)
+{
+  // the same fields, in the same order, as BamOutput::write
+  const bam1_core_t* c = &b->core;
+  uint32_t x[8];
+  x[0] = c->tid;
+  x[1] = c->pos;
+  x[2] = (uint32_t)c->bin<<16 | c->qual<<8 | c->l_qname;
+  x[3] = (uint32_t)c->flag<<16 | c->n_cigar;
+  x[4] = c->l_qseq;
+  x[5] = c->mtid;
+  x[6] = c->mpos;
+  x[7] = c->isize;
+
+  std::string s((const char*)x, sizeof(x));
+  s.append((const char*)b->data, b->l_data);
+  return s;
+}
+
+void Checkpoint::unpack(const std::string& s, bam1_t* b)
+{
+  uint32_t x[8];
+  memcpy(x, s.data(), sizeof(x));
+  bam1_core_t* c = &b->core;
+  c->tid = x[0];
+  c->pos = x[1];
+  c->bin = x[2] >> 16;
+  c->qual = x[2] >> 8 & 0xff;
+  c->l_qname = x[2] & 0xff;
+  c->flag = x[3] >> 16;
+  c->n_cigar = x[3] & 0xffff;
+  c->l_qseq = x[4];
+  c->mtid = x[5];
+  c->mpos = x[6];
+  c->isize = x[7];
+
+  b->l_data = s.size() - sizeof(x);
+  if (b->m_data < b->l_data) {
+    b->m_data = b->l_data;
+    b->data = (uint8_t*)realloc(b->data, b->m_data);
+  }
+  memcpy(b->data, s.data() + sizeof(x), b->l_data);
+}
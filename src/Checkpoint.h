@@ -0,0 +1,49 @@
+#ifndef VARIANT_CHECKPOINT_H__
+#define VARIANT_CHECKPOINT_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "htslib/sam.h"
+
+#include "StreamingCoverage.h"
+
+/** How far a run had got, so that a run that is killed can carry on
+ * from there instead of starting over (--checkpoint).
+ *
+ * A checkpoint is taken between two reads, once everything written so
+ * far is on disk, so the output up to out_size is final. It is written
+ * to a temporary file and renamed into place, so a run killed while
+ * saving leaves the one before it whole.
+ */
+struct Checkpoint
+{
+  std::string args;          // command line, which the resumed run must repeat
+  int64_t in_offset = 0;     // BGZF virtual offset of the next input record
+  uint64_t out_size = 0;     // compressed bytes of output on disk
+  uint64_t out_bytes = 0;    // and the uncompressed bytes they hold
+
+  uint64_t total = 0;        // rc_main, with the reads the core filter skipped
+  uint64_t keep = 0;
+  uint64_t core_skipped = 0;
+
+  std::vector<uint64_t> rule_counts;  // per region and rule, in script order
+
+  StreamingCoverage::State cov;  // -m state
+  int32_t cov_last = -1;
+  std::vector<std::string> held;  // reads waiting on their coverage, packed
+
+  /** Write to file, replacing the checkpoint before. Exits on failure */
+  void save(const std::string& file) const;
+
+  /** Read a checkpoint. False if there is none. Exits if it is damaged */
+  bool load(const std::string& file);
+
+  /** A record as the fixed fields and data of its BAM encoding (no block_size) */
+  static std::string pack(const bam1_t* b);
+
+  /** The reverse, into b */
+  static void unpack(const std::string& s, bam1_t* b);
+};
+#endif
@@ -0,0 +1,41 @@
+#ifndef VARIANT_CORE_FILTER_H__
+#define VARIANT_CORE_FILTER_H__
+
+#include <cstdint>
+#include <cstdlib>
+
+/** Conditions on the fixed 36-byte core of a BAM record (flag, mapq,
+ * tid, isize) that every rule shares. A record that fails them can't
+ * be kept by any rule, so it can be skipped before it is decoded.
+ *
+ * The ranges are the hull of the rules' own ranges, so this only
+ * answers "might pass". See RuleProgram::coreFilter
+ */
+struct CoreFilter
+{
+  bool active = false;
+
+  uint16_t mask = 0;  // flag bits every rule tests the same way
+  uint16_t want = 0;
+
+  bool has_mapq = false;
+  int mapq_min = 0;
+  int mapq_max = 0;
+
+  bool has_isize = false;  // on |isize|
+  int isize_min = 0;
+  int isize_max = 0;
+
+  bool placed = false;  // every rule is tied to regions, so the read or its mate needs a chromosome
+
+  bool pass(int32_t tid, uint16_t flag, int mapq, int32_t mtid, int32_t isize) const {
+    if ((flag & mask) != want)
+      return false;
+    if (has_mapq && (mapq < mapq_min || mapq > mapq_max))
+      return false;
+    if (has_isize && (std::abs(isize) < isize_min || std::abs(isize) > isize_max))
+      return false;
+    return !placed || tid >= 0 || mtid >= 0;
+  }
+};
+#endif
@@ -0,0 +1,153 @@
+#include "CoverageSampler.h"
+#include "htslib/khash.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+
+const int32_t CoverageSampler::MAX_PAIR_GAP;
+
+CoverageSampler::CoverageSampler()
+{
+  m_groups.push_back(std::unique_ptr<Group>(new Group));
+}
+
+void CoverageSampler::setTarget(int target, uint32_t seed)
+{
+  m_target = target;
+  m_seed = seed;
+  m_groups.resize(1);
+  m_groups[0]->target = target;
+  m_last = nullptr;
+}
+
+bool CoverageSampler::setPerReadGroup(const std::string& spec)
+{
+  m_per_rg = true;
+  m_rg_targets.clear();
+  m_groups.resize(1);
+  m_last = nullptr;
+
+  std::istringstream iss(spec);
+  std::string item;
+  while (std::getline(iss, item, ',')) {
+    size_t eq = item.rfind('=');
+    if (eq == 0 || eq == std::string::npos || eq + 1 == item.length())
+      return false;
+    char* end;
+    long n = std::strtol(item.c_str() + eq + 1, &end, 10);
+    if (*end)
+      return false;
+    m_rg_targets[item.substr(0, eq)] = n;
+  }
+  return true;
+}
+
+void CoverageSampler::configure(const CoverageSampler& o)
+{
+  setTarget(o.m_target, o.m_seed);
+  m_per_rg = o.m_per_rg;
+  m_rg_targets = o.m_rg_targets;
+}
+
+void CoverageSampler::reset(int32_t chr)
+{
+  m_chr = chr;
+  for (auto& g : m_groups)
+    g->cov.reset(chr);
+}
+
+void CoverageSampler::restore(const StreamingCoverage::State& s)
+{
+  m_groups[0]->cov.restore(s);
+  m_chr = s.chr;
+}
+
+CoverageSampler::Group& CoverageSampler::group(const bam1_t* b)
+{
+  if (!m_per_rg)
+    return *m_groups[0];
+
+  const uint8_t* rg = bam_aux_get(b, "RG");
+  if (!rg || *rg != 'Z')
+    return *m_groups[0];
+  const char* name = (const char*)rg + 1;
+
+  if (m_last && m_last->name == name)
+    return *m_last;
+  for (auto& g : m_groups)
+    if (g->name == name)
+      return *(m_last = g.get());
+
+  m_groups.push_back(std::unique_ptr<Group>(new Group));
+  Group& g = *m_groups.back();
+  g.name = name;
+  auto it = m_rg_targets.find(g.name);
+  g.target = it == m_rg_targets.end() ? m_target : it->second;
+  g.cov.reset(m_chr);
+  return *(m_last = &g);
+}
+
+int32_t CoverageSampler::coverageEnd(const bam1_t* b)
+{
+  return std::max(bam_endpos(b), b->core.pos + 1);
+}
+
+bool CoverageSampler::pairPlaced(const bam1_t* b)
+{
+  // secondary and supplementary alignments don't have the mate pointing back at them
+  const bam1_core_t& c = b->core;
+  return (c.flag & BAM_FPAIRED) && !(c.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) &&
+    c.tid >= 0 && c.tid == c.mtid && std::abs(c.pos - c.mpos) <= MAX_PAIR_GAP;
+}
+
+int32_t CoverageSampler::needUntil(const bam1_t* b)
+{
+  return pairPlaced(b) ? std::max(b->core.pos, b->core.mpos) : coverageEnd(b) - 1;
+}
+
+int32_t CoverageSampler::needFrom(const bam1_t* b)
+{
+  return pairPlaced(b) ? std::min(b->core.pos, b->core.mpos) : b->core.pos;
+}
+
+void CoverageSampler::add(const bam1_t* b)
+{
+  if (!(b->core.flag & BAM_FUNMAP))
+    group(b).cov.add(b->core.pos, coverageEnd(b));
+}
+
+void CoverageSampler::advance(int32_t pos)
+{
+  for (auto& g : m_groups)
+    g->cov.advance(pos);
+}
+
+int CoverageSampler::depth(const bam1_t* b, int32_t pos)
+{
+  return group(b).cov.depth(pos);
+}
+
+int CoverageSampler::sampleDepth(const bam1_t* b)
+{
+  const StreamingCoverage& cov = group(b).cov;
+  if (pairPlaced(b))
+    return std::max(cov.depth(b->core.pos), cov.depth(b->core.mpos));
+  return std::max(cov.depth(b->core.pos), cov.depth(coverageEnd(b) - 1));
+}
+
+bool CoverageSampler::keep(const bam1_t* b)
+{
+  const int target = group(b).target;
+  double this_cov = sampleDepth(b);
+
+  // if cov->inf, sample_rate -> 0. if cov -> target, sample_rate -> 1
+  if (this_cov > target && target > 0) {
+    double sample_rate = 1 - (this_cov - target) / this_cov;
+    uint32_t k = __ac_Wang_hash(__ac_X31_hash_string(bam_get_qname(b)) ^ m_seed);
+    return (double)(k&0xffffff) / 0x1000000 <= sample_rate;
+  }
+
+  // only take if reaches minimum coverage (target = -10)
+  return this_cov >= -target;
+}
@@ -0,0 +1,122 @@
+#ifndef VARIANT_COVERAGE_SAMPLER_H__
+#define VARIANT_COVERAGE_SAMPLER_H__
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "htslib/sam.h"
+
+#include "StreamingCoverage.h"
+
+/** The -m decision: keep a read or not from the depth around it.
+ *
+ * A read is kept with probability target / depth, drawn from a hash of
+ * its name and the seed, so the draw is the same for both mates and on
+ * every run. The depth is the true depth of the reads the walk sees,
+ * taken at fixed points:
+ *
+ *  - for a pair with both mates on one chromosome, no more than
+ *    MAX_PAIR_GAP apart, the larger depth at the two mates' starts. Both
+ *    mates know both starts, so they see the same depth and the pair is
+ *    kept or dropped whole
+ *  - for any other read, the larger depth at its first and last base
+ *
+ * So a decision depends on the name, the seed and the depth, and not on
+ * the order reads were buffered in or where a walk was cut. A read is
+ * final once the walk has passed needUntil(), and needs the depth from
+ * needFrom() on.
+ *
+ * With setPerReadGroup, each read group has its own depth and target.
+ * A negative target is a minimum: reads are kept only where the depth
+ * reaches it.
+ */
+class CoverageSampler
+{
+ public:
+
+  // mate starts further apart than this are decided one read at a time
+  static const int32_t MAX_PAIR_GAP = 5000;
+
+  CoverageSampler();
+
+  /** Depth to bring the reads down to, and the seed of the draw */
+  void setTarget(int target, uint32_t seed);
+
+  int target() const { return m_target; }
+
+  /** Count the depth of each read group on its own, with targets from
+   * spec ("RG1=30,RG2=10"). Groups that aren't named use the -m target.
+   * Returns false if spec can't be parsed */
+  bool setPerReadGroup(const std::string& spec);
+
+  bool perReadGroup() const { return m_per_rg; }
+
+  /** Take the settings of another sampler, but none of its depth */
+  void configure(const CoverageSampler& o);
+
+  /** Forget the depths and start on a new chromosome */
+  void reset(int32_t chr);
+
+  int32_t chr() const { return m_chr; }
+
+  /** Count a mapped read in the depth. In order of start position */
+  void add(const bam1_t* b);
+
+  /** Forget the depth before pos */
+  void advance(int32_t pos);
+
+  /** Depth of the read's group at pos */
+  int depth(const bam1_t* b, int32_t pos);
+
+  /** The depth the decision on b is made from */
+  int sampleDepth(const bam1_t* b);
+
+  /** Keep b? Only once the walk has passed needUntil(b) */
+  bool keep(const bam1_t* b);
+
+  /** Last position whose depth the decision on b needs */
+  static int32_t needUntil(const bam1_t* b);
+
+  /** First position whose depth the decision on b needs */
+  static int32_t needFrom(const bam1_t* b);
+
+  /** True if b is decided together with its mate */
+  static bool pairPlaced(const bam1_t* b);
+
+  /** Coverage is counted over [pos, end). A read has at least one base */
+  static int32_t coverageEnd(const bam1_t* b);
+
+  /** The depth so far, when read groups aren't counted apart (for checkpoints) */
+  StreamingCoverage::State state() const { return m_groups[0]->cov.state(); }
+
+  void restore(const StreamingCoverage::State& s);
+
+ private:
+
+  struct Group {
+    std::string name;
+    int target = 0;
+    StreamingCoverage cov;
+  };
+
+  // the group of b. there is only one unless per read group
+  Group& group(const bam1_t* b);
+
+  int m_target = 0;
+  uint32_t m_seed = 0;
+  int32_t m_chr = -1;
+
+  bool m_per_rg = false;
+  std::map<std::string, int> m_rg_targets;
+
+  // the first is the group of reads with no RG tag
+  std::vector<std::unique_ptr<Group> > m_groups;
+
+  // reads come in runs of the same read group
+  Group* m_last = nullptr;
+
+};
+#endif
@@ -0,0 +1,385 @@
+#include "HtsReader.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+
+#include "htslib/bgzf.h"
+
+#include "StageProfiler.h"
+
+const uint64_t HtsReader::TIME_EVERY;
+
+// CPU time of the calling thread, in ns
+static uint64_t threadCpuNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void HtsReader::InputStats::merge(const InputStats& o)
+{
+  ns += o.ns;
+  cpu_ns += o.cpu_ns;
+  ahead_bytes += o.ahead_bytes;
+  ahead_ns += o.ahead_ns;
+}
+
+HtsReader::~HtsReader()
+{
+  resetIterator();
+  if (m_idx)
+    hts_idx_destroy(m_idx);
+  if (m_hdr)
+    bam_hdr_destroy(m_hdr);
+  if (m_fp)
+    sam_close(m_fp);
+}
+
+bool HtsReader::open(const std::string& in)
+{
+  m_in = in;
+  m_fp = sam_open(in.c_str(), "r");
+  if (!m_fp)
+    return false;
+
+  m_hdr = sam_hdr_read(m_fp);
+  return m_hdr != nullptr;
+}
+
+void HtsReader::setReference(const std::string& ref)
+{
+  m_ref = ref;
+  if (m_fp && m_fp->format.format == cram && ref.length())
+    hts_set_fai_filename(m_fp, ref.c_str());
+}
+
+bool HtsReader::loadIndex()
+{
+  if (!m_idx && m_fp)
+    m_idx = sam_index_load(m_fp, m_in.c_str());
+  return m_idx != nullptr;
+}
+
+void HtsReader::sortAndMerge(SnowTools::GenomicRegionVector& grv)
+{
+  if (grv.size() < 2)
+    return;
+
+  std::sort(grv.begin(), grv.end(), [](const SnowTools::GenomicRegion& a, const SnowTools::GenomicRegion& b) {
+      return a.chr < b.chr || (a.chr == b.chr && a.pos1 < b.pos1);
+    });
+
+  size_t last = 0;
+  for (size_t i = 1; i < grv.size(); ++i) {
+    if (grv[i].chr == grv[last].chr && grv[i].pos1 <= grv[last].pos2)
+      grv[last].pos2 = std::max(grv[last].pos2, grv[i].pos2);
+    else
+      grv[++last] = grv[i];
+  }
+  grv.resize(last + 1);
+}
+
+void HtsReader::setRegions(const SnowTools::GenomicRegionVector& grv)
+{
+  m_regions = grv;
+  sortAndMerge(m_regions);
+
+  resetIterator();
+  m_unplaced = false;
+  m_has_prev = false;
+  m_done = false;
+
+  if (m_regions.size() && !loadIndex()) {
+    std::cerr << "ERROR: Regions were requested, but no index was found for " << m_in << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  planSeeks();
+}
+
+void HtsReader::planSeeks()
+{
+  stopPrefetch();
+  m_seeks.clear();
+  m_seek_idx = 0;
+  m_region_bytes = m_seek_bytes = 0;
+
+  // CRAM offsets aren't BGZF virtual offsets, so there each region is a query
+  bool bam_input = m_fp->format.format == bam;
+
+  for (size_t i = 0; i < m_regions.size(); ++i) {
+    const SnowTools::GenomicRegion& gr = m_regions[i];
+
+    uint64_t begin = UINT64_MAX, end = 0;
+    if (bam_input) {
+      hts_itr_t* itr = sam_itr_queryi(m_idx, gr.chr, gr.pos1, gr.pos2);
+      for (int k = 0; itr && k < itr->n_off; ++k) {
+	// a chunk ends somewhere in the block its end offset points to
+	begin = std::min(begin, itr->off[k].u >> 16);
+	end = std::max(end, (itr->off[k].v >> 16) + BGZF_MAX_BLOCK_SIZE);
+      }
+      if (itr)
+	hts_itr_destroy(itr);
+      if (begin > end)
+	continue; // nothing there
+      m_region_bytes += end - begin;
+    }
+
+    Seek* last = m_seeks.size() ? &m_seeks.back() : nullptr;
+    if (bam_input && m_seek_gap >= 0 && last && last->region.chr == gr.chr
+	&& begin <= last->end + (uint64_t)m_seek_gap) {
+      last->region.pos2 = gr.pos2;
+      last->last = i;
+      last->begin = std::min(last->begin, begin);
+      last->end = std::max(last->end, end);
+    } else {
+      m_seeks.push_back({gr, i, i, begin, end});
+    }
+  }
+
+  if (!bam_input)
+    return;
+
+  // one range per seek, without the bytes the seek before already covers
+  std::vector<BlockPrefetcher::Range> ranges;
+  uint64_t covered = 0;
+  for (auto& sk : m_seeks) {
+    uint64_t b = std::max(sk.begin, std::min(covered, sk.end));
+    ranges.push_back({b, sk.end});
+    m_seek_bytes += sk.end - b;
+    covered = std::max(covered, sk.end);
+  }
+
+  if (m_prefetch && ranges.size())
+    startPrefetch(ranges);
+}
+
+void HtsReader::startPrefetch(const std::vector<BlockPrefetcher::Range>& ranges)
+{
+  stopPrefetch();
+  m_prefetcher.reset(new BlockPrefetcher);
+  m_prefetcher->setWindow(m_prefetch_window);
+  m_ahead_at = 0;
+  if (!m_prefetcher->start(m_in, ranges))
+    m_prefetcher.reset();
+}
+
+void HtsReader::stopPrefetch()
+{
+  if (!m_prefetcher)
+    return;
+  m_prefetcher->stop();
+  m_input.ahead_bytes += m_prefetcher->bytes();
+  m_input.ahead_ns += m_prefetcher->readNs();
+  m_prefetcher.reset();
+  m_stream_ahead = false;
+}
+
+void HtsReader::trackPrefetch()
+{
+  // the mutex of the prefetcher is taken once a megabyte or so, not per read
+  uint64_t at = m_fp->fp.bgzf->block_address;
+  if (at >= m_ahead_at + (BlockPrefetcher::CHUNK >> 2)) {
+    m_ahead_at = at;
+    m_prefetcher->advanceTo(at);
+  }
+}
+
+HtsReader::InputStats HtsReader::inputStats() const
+{
+  InputStats s = m_input;
+  if (m_prefetcher) {
+    s.ahead_bytes += m_prefetcher->bytes();
+    s.ahead_ns += m_prefetcher->readNs();
+  }
+  return s;
+}
+
+void HtsReader::setPreviousRegion(const SnowTools::GenomicRegion& gr)
+{
+  m_prev = gr;
+  m_has_prev = true;
+}
+
+void HtsReader::setUnplaced()
+{
+  m_regions.clear();
+  m_seeks.clear();
+  stopPrefetch();
+  resetIterator();
+  m_unplaced = true;
+  m_has_prev = false;
+  m_done = false;
+
+  if (!loadIndex()) {
+    std::cerr << "ERROR: No index found for " << m_in << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+void HtsReader::resetIterator()
+{
+  if (m_itr)
+    hts_itr_destroy(m_itr);
+  m_itr = nullptr;
+}
+
+bool HtsReader::nextRegion()
+{
+  resetIterator();
+
+  if (m_unplaced) {
+    if (m_done)
+      return false;
+    m_done = true;
+    m_itr = sam_itr_queryi(m_idx, HTS_IDX_NOCOOR, 0, 0);
+    return m_itr != nullptr;
+  }
+
+  while (m_seek_idx < m_seeks.size()) {
+    const Seek& sk = m_seeks[m_seek_idx++];
+    if (m_prefetcher) {
+      m_prefetcher->advance(m_seek_idx - 1);
+      m_ahead_at = 0;
+    }
+    m_gap_idx = sk.first;
+    m_itr = sam_itr_queryi(m_idx, sk.region.chr, sk.region.pos1, sk.region.pos2);
+    if (m_itr)
+      return true;
+  }
+  return false;
+}
+
+int64_t HtsReader::tell() const
+{
+  if (!m_fp || m_fp->format.format != bam || m_unplaced || m_regions.size())
+    return -1;
+  return bgzf_tell(m_fp->fp.bgzf);
+}
+
+bool HtsReader::seek(int64_t offset)
+{
+  if (!m_fp || m_fp->format.format != bam || m_unplaced || m_regions.size())
+    return false;
+  stopPrefetch(); // started again from the new offset
+  return bgzf_seek(m_fp->fp.bgzf, offset, SEEK_SET) >= 0;
+}
+
+void HtsReader::skipCoreRejected()
+{
+  // the core is read in place, so only little-endian BAM
+  static const uint16_t one = 1;
+  if (m_fp->format.format != bam || *(const uint8_t*)&one != 1)
+    return;
+
+  BGZF* fp = m_fp->fp.bgzf;
+  for (;;) {
+    // load the next block if this one is used up. at the end of the
+    // file (or on an error) sam_read1 is left to say so
+    if (fp->block_offset >= fp->block_length && (bgzf_read_block(fp) != 0 || fp->block_length == 0))
+      return;
+
+    // block_size, then the 32 bytes of refID, pos, bin_mq_nl, flag_nc,
+    // l_seq, next_refID, next_pos and tlen
+    int avail = fp->block_length - fp->block_offset;
+    if (avail < 36)
+      return;
+    const uint8_t* p = (const uint8_t*)fp->uncompressed_block + fp->block_offset;
+    int32_t block_len;
+    uint32_t x[8];
+    std::memcpy(&block_len, p, 4);
+    std::memcpy(x, p + 4, 32);
+
+    // a record that runs into the next block is read whole by htslib
+    if (block_len < 32 || block_len > avail - 4)
+      return;
+
+    if (m_core.pass((int32_t)x[0], x[3] >> 16, x[2] >> 8 & 0xff, (int32_t)x[5], (int32_t)x[7]))
+      return;
+
+    fp->block_offset += 4 + block_len;
+    ++m_core_skipped;
+  }
+}
+
+bool HtsReader::next(bam1_t* b)
+{
+  if (!m_timed || (++m_calls & (TIME_EVERY - 1)))
+    return readNext(b);
+
+  // the wall clock time the thread wasn't on the CPU is time it waited on the file
+  uint64_t t = StageProfiler::now();
+  uint64_t c = threadCpuNs();
+  bool valid = readNext(b);
+  m_input.cpu_ns += (threadCpuNs() - c) * TIME_EVERY;
+  m_input.ns += (StageProfiler::now() - t) * TIME_EVERY;
+  return valid;
+}
+
+bool HtsReader::readNext(bam1_t* b)
+{
+  // stream the whole file
+  if (!m_unplaced && m_regions.empty()) {
+    if (m_prefetch && !m_stream_ahead && m_fp->format.format == bam) {
+      startPrefetch({{(uint64_t)m_fp->fp.bgzf->block_address, UINT64_MAX}});
+      m_stream_ahead = true; // once, even if the file couldn't be opened again
+    }
+    if (m_core.active)
+      skipCoreRejected();
+    int valid = sam_read1(m_fp, m_hdr, b);
+    if (valid < -1) {
+      std::cerr << "ERROR: Failed to read record from " << m_in << " (truncated file?)" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (m_prefetcher)
+      trackPrefetch();
+    return valid >= 0;
+  }
+
+  for (;;) {
+
+    if (!m_itr && !nextRegion())
+      return false;
+
+    int valid = sam_itr_next(m_fp, m_itr, b);
+    if (valid < -1) {
+      std::cerr << "ERROR: Failed to read record from " << m_in << " (truncated file?)" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (valid < 0) {
+      resetIterator();
+      continue;
+    }
+    if (m_prefetcher)
+      trackPrefetch();
+
+    if (m_unplaced)
+      return true;
+
+    // already returned by the region before this one?
+    const Seek& sk = m_seeks[m_seek_idx - 1];
+    const SnowTools::GenomicRegion* prev = nullptr;
+    if (sk.first > 0)
+      prev = &m_regions[sk.first - 1];
+    else if (m_has_prev)
+      prev = &m_prev;
+
+    if (prev && prev->chr == b->core.tid && b->core.pos < prev->pos2)
+      continue;
+
+    // a merged seek also walks the gaps between its regions. reads come
+    // in order of position, so the region to test against only moves on
+    if (sk.last > sk.first) {
+      while (m_gap_idx < sk.last && m_regions[m_gap_idx].pos2 <= b->core.pos)
+	++m_gap_idx;
+      if (bam_endpos(b) <= m_regions[m_gap_idx].pos1)
+	continue;
+    }
+
+    return true;
+  }
+}
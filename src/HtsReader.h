@@ -0,0 +1,224 @@
+#ifndef VARIANT_HTS_READER_H__
+#define VARIANT_HTS_READER_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "htslib/sam.h"
+#include "SnowTools/GenomicRegion.h"
+
+#include "BlockPrefetcher.h"
+#include "CoreFilter.h"
+
+/** Read records from a BAM/CRAM, either streaming the whole file
+ * or jumping through the index to a list of regions.
+ *
+ * Regions are sorted and merged when set, and a read that overlaps
+ * two regions is only returned for the first one. This makes it safe
+ * to cut a region list into pieces that are walked independently,
+ * as long as each piece is told the region that came before it.
+ *
+ * For BAM input, neighboring regions whose index chunks are within
+ * a gap of each other in the compressed file are walked with one
+ * index query, skipping the reads that fall between them. This gives
+ * the same reads as a query per region, with fewer seeks and without
+ * decompressing a shared block twice. The compressed ranges can also
+ * be read ahead on a background thread (see BlockPrefetcher), and so
+ * can the rest of the file when streaming a BAM. CRAM input is never
+ * read ahead.
+ *
+ * When streaming a BAM, a CoreFilter can be set. The core of each
+ * record is then looked at where it sits in the decompressed block,
+ * and a record that fails is stepped over without being copied out
+ * or decoded. Records that cross a block boundary are read as usual.
+ */
+class HtsReader
+{
+ public:
+
+  HtsReader() {}
+
+  ~HtsReader();
+
+  HtsReader(const HtsReader&) = delete;
+  HtsReader& operator=(const HtsReader&) = delete;
+
+  /** Open a BAM/CRAM for reading. Returns false if it can't be opened */
+  bool open(const std::string& in);
+
+  /** Set the reference used to decode CRAM input */
+  void setReference(const std::string& ref);
+
+  /** Load the index. Returns false if there is none */
+  bool loadIndex();
+
+  /** Walk only these regions, in sorted order. Empty means whole file */
+  void setRegions(const SnowTools::GenomicRegionVector& grv);
+
+  /** Skip reads that were already returned by this region, which
+   * is the last one walked before the regions of this reader */
+  void setPreviousRegion(const SnowTools::GenomicRegion& gr);
+
+  /** Walk only the reads with no coordinate (at the end of a sorted file) */
+  void setUnplaced();
+
+  /** Walk regions whose compressed ranges are at most gap bytes apart
+   * with one query. -1 gives each region its own query. Call before setRegions */
+  void setSeekGap(int64_t gap) { m_seek_gap = gap; }
+
+  int64_t seekGap() const { return m_seek_gap; }
+
+  /** Read a BAM input ahead on another thread: the ranges of the
+   * regions, or the rest of the file when streaming. Nothing for CRAM */
+  void setPrefetch(bool prefetch) { m_prefetch = prefetch; }
+
+  bool prefetch() const { return m_prefetch; }
+
+  /** Compressed bytes to read ahead of the reader. Call before setRegions */
+  void setPrefetchWindow(uint64_t bytes) { m_prefetch_window = bytes; }
+
+  uint64_t prefetchWindow() const { return m_prefetch_window; }
+
+  /** Index queries made for the regions */
+  size_t seeks() const { return m_seeks.size(); }
+
+  /** Compressed bytes covered by a query per region, and by the merged queries */
+  uint64_t regionBytes() const { return m_region_bytes; }
+  uint64_t seekBytes() const { return m_seek_bytes; }
+
+  /** Bytes read ahead by the prefetcher */
+  uint64_t prefetchedBytes() const { return inputStats().ahead_bytes; }
+
+  /** Where the time of the input went */
+  struct InputStats {
+    uint64_t ns = 0;           // in next()
+    uint64_t cpu_ns = 0;       // of that, on the CPU: inflating and decoding
+    uint64_t ahead_bytes = 0;  // read ahead by the prefetcher
+    uint64_t ahead_ns = 0;     // spent reading by the prefetcher
+
+    // in next(), waiting on the file
+    uint64_t waitNs() const { return ns > cpu_ns ? ns - cpu_ns : 0; }
+
+    void merge(const InputStats& o);
+  };
+
+  /** Time next(), on the wall clock and on the CPU of the calling thread.
+   * One call in TIME_EVERY is timed, and the times scaled up */
+  void setTimed(bool timed) { m_timed = timed; }
+
+  bool timed() const { return m_timed; }
+
+  InputStats inputStats() const;
+
+  /** Add the stats of another reader to these (for shards) */
+  void addInputStats(const InputStats& s) { m_input.merge(s); }
+
+  // a power of 2
+  static const uint64_t TIME_EVERY = 64;
+
+  /** Skip records that fail f while streaming a BAM. The reads returned
+   * must go through the rules f came from, which reject the rest anyway */
+  void setCoreFilter(const CoreFilter& f) { m_core = f; }
+
+  /** Records skipped by the core filter */
+  uint64_t coreSkipped() const { return m_core_skipped; }
+
+  /** Carry the count on from an earlier run (for checkpoints) */
+  void setCoreSkipped(uint64_t n) { m_core_skipped = n; }
+
+  /** Virtual offset of the next record when streaming a BAM, or -1 */
+  int64_t tell() const;
+
+  /** Go back to an offset from tell. Returns false if it can't */
+  bool seek(int64_t offset);
+
+  /** Read the next record into b. Returns false when done */
+  bool next(bam1_t* b);
+
+  bam_hdr_t* header() const { return m_hdr; }
+
+  const std::string& filename() const { return m_in; }
+
+  const std::string& reference() const { return m_ref; }
+
+  bool hasIndex() const { return m_idx != nullptr; }
+
+  bool isCram() const { return m_fp && m_fp->format.format == cram; }
+
+  const SnowTools::GenomicRegionVector& regions() const { return m_regions; }
+
+  /** Sort a region list and merge the regions that overlap */
+  static void sortAndMerge(SnowTools::GenomicRegionVector& grv);
+
+ private:
+
+  // one index query, covering m_regions[first..last]
+  struct Seek {
+    SnowTools::GenomicRegion region;
+    size_t first;
+    size_t last;
+    uint64_t begin; // compressed byte range of its chunks
+    uint64_t end;
+  };
+
+  // group the regions into seeks
+  void planSeeks();
+
+  // point the iterator at the next seek. false if no more
+  bool nextRegion();
+
+  void resetIterator();
+
+  // step over the records at the read position that fail m_core
+  void skipCoreRejected();
+
+  bool readNext(bam1_t* b);
+
+  void startPrefetch(const std::vector<BlockPrefetcher::Range>& ranges);
+
+  // add the prefetcher's counts to m_input and stop it
+  void stopPrefetch();
+
+  // tell the prefetcher where the BGZF reader is
+  void trackPrefetch();
+
+  std::string m_in;
+  std::string m_ref;
+
+  htsFile* m_fp = nullptr;
+  bam_hdr_t* m_hdr = nullptr;
+  hts_idx_t* m_idx = nullptr;
+  hts_itr_t* m_itr = nullptr;
+
+  SnowTools::GenomicRegionVector m_regions;
+
+  std::vector<Seek> m_seeks;
+  size_t m_seek_idx = 0;
+  size_t m_gap_idx = 0; // region the reads of a merged seek have reached
+
+  int64_t m_seek_gap = 0x10000;
+  bool m_prefetch = false;
+  uint64_t m_prefetch_window = BlockPrefetcher::MAX_AHEAD;
+  std::unique_ptr<BlockPrefetcher> m_prefetcher;
+  bool m_stream_ahead = false; // the prefetcher was started on the stream
+  uint64_t m_ahead_at = 0;     // offset last given to the prefetcher
+
+  bool m_timed = false;
+  uint64_t m_calls = 0;
+  InputStats m_input;
+
+  uint64_t m_region_bytes = 0;
+  uint64_t m_seek_bytes = 0;
+
+  CoreFilter m_core;
+  uint64_t m_core_skipped = 0;
+
+  SnowTools::GenomicRegion m_prev;
+  bool m_has_prev = false;
+
+  bool m_unplaced = false;
+  bool m_done = false;
+
+};
+#endif
@@ -0,0 +1,132 @@
+#include "IntervalIndex.h"
+
+#include <algorithm>
+#include <cstring>
+
+void IntervalIndex::add(int32_t chr, int32_t start, int32_t end)
+{
+  if (chr < 0 || end < start)
+    return;
+  m_pending.push_back({chr, {start, end}});
+}
+
+void IntervalIndex::build()
+{
+  forEach([this](int32_t c, int32_t start, int32_t end) { m_pending.push_back({c, {start, end}}); });
+  m_view = false;
+  m_view_owner.reset();
+
+  std::sort(m_pending.begin(), m_pending.end(), [](const std::pair<int32_t, Interval>& a,
+						   const std::pair<int32_t, Interval>& b) {
+	      return a.first != b.first ? a.first < b.first : a.second.start < b.second.start;
+	    });
+
+  m_iv.clear();
+  m_chr.assign(m_pending.size() ? m_pending.back().first + 2 : 1, 0);
+
+  int32_t chr = -1;
+  for (auto& p : m_pending) {
+    // touching intervals merge too. for whole-number queries it's the same set
+    if (p.first == chr && (int64_t)p.second.start <= (int64_t)m_iv.back().end + 1) {
+      m_iv.back().end = std::max(m_iv.back().end, p.second.end);
+      continue;
+    }
+    for (; chr < p.first; ++chr)
+      m_chr[chr + 1] = m_iv.size();
+    m_iv.push_back(p.second);
+  }
+  for (; chr + 1 < (int32_t)m_chr.size(); ++chr)
+    m_chr[chr + 1] = m_iv.size();
+
+  std::vector<std::pair<int32_t, Interval> >().swap(m_pending);
+  m_iv.shrink_to_fit();
+}
+
+size_t IntervalIndex::chrBegin(int32_t chr) const
+{
+  return chr + 1 < (int32_t)chrCount() ? chrs()[chr] : size();
+}
+
+size_t IntervalIndex::chrEnd(int32_t chr) const
+{
+  return chr + 1 < (int32_t)chrCount() ? chrs()[chr + 1] : size();
+}
+
+size_t IntervalIndex::seek(size_t lo, size_t hi, int32_t start) const
+{
+  return std::lower_bound(ivs() + lo, ivs() + hi, start,
+			  [](const Interval& iv, int32_t s) { return iv.end < s; }) - ivs();
+}
+
+bool IntervalIndex::overlaps(int32_t chr, int32_t start, int32_t end) const
+{
+  if (chr < 0)
+    return false;
+  size_t hi = chrEnd(chr);
+  size_t i = seek(chrBegin(chr), hi, start);
+  return i < hi && ivs()[i].start <= end;
+}
+
+bool IntervalIndex::overlaps(Cursor& c, int32_t chr, int32_t start, int32_t end) const
+{
+  if (chr < 0)
+    return false;
+
+  size_t hi = chrEnd(chr);
+  if (chr != c.chr || start < c.last) {
+    c.chr = chr;
+    c.i = seek(chrBegin(chr), hi, start);
+    ++c.seeks;
+  } else {
+    // the intervals stepped over end before this start, so before any later one
+    const Interval* iv = ivs();
+    while (c.i < hi && iv[c.i].end < start)
+      ++c.i;
+  }
+  c.last = start;
+  return c.i < hi && ivs()[c.i].start <= end;
+}
+
+size_t IntervalIndex::bytes() const
+{
+  return m_iv.capacity() * sizeof(Interval) + m_chr.capacity() * sizeof(uint64_t);
+}
+
+void IntervalIndex::serialize(std::string& out) const
+{
+  uint64_t n[2] = {chrCount(), size()};
+  out.append((const char*)n, sizeof(n));
+  out.append((const char*)chrs(), n[0] * sizeof(uint64_t));
+  out.append((const char*)ivs(), n[1] * sizeof(Interval));
+}
+
+bool IntervalIndex::view(const uint8_t* data, size_t n, std::shared_ptr<const void> owner)
+{
+  uint64_t head[2];
+  if (n < sizeof(head) || (uintptr_t)data % 8)
+    return false;
+  memcpy(head, data, sizeof(head));
+  if (head[0] > n / 8 || head[1] > n / 8 || sizeof(head) + head[0] * 8 + head[1] * sizeof(Interval) != n)
+    return false;
+
+  const uint64_t* chr = (const uint64_t*)(data + sizeof(head));
+  const Interval* iv = (const Interval*)(chr + head[0]);
+
+  // offsets that run backwards or past the end would send a query out of bounds
+  if (head[0] == 0 || chr[0] != 0 || chr[head[0] - 1] != head[1])
+    return false;
+  for (uint64_t c = 1; c < head[0]; ++c)
+    if (chr[c] < chr[c - 1])
+      return false;
+
+  m_iv.clear();
+  m_chr.clear();
+  m_pending.clear();
+  m_view = true;
+  m_view_owner = owner;
+  m_view_iv = iv;
+  m_view_chr = chr;
+  m_view_n = head[1];
+  m_view_nchr = head[0];
+  return true;
+}
@@ -0,0 +1,113 @@
+#ifndef VARIANT_INTERVAL_INDEX_H__
+#define VARIANT_INTERVAL_INDEX_H__
+
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/** Answers "does [start, end] overlap any interval?" for a fixed set
+ * of intervals (VCF sites, BED lines, ...).
+ *
+ * Intervals are sorted and merged when the index is built, so each
+ * chromosome is a run of disjoint intervals in a flat array, 8 bytes
+ * apiece. A Cursor remembers where the last query landed. As long as
+ * query starts don't go down (coordinate-sorted reads) it only steps
+ * forward, so a sorted walk costs O(reads + intervals) in all. A query
+ * on another chromosome, or one that goes backwards, finds its place
+ * again by binary search.
+ *
+ * A built index can be written out as one flat block and later used in
+ * place, straight from a mapped file (see RegionCache), with nothing
+ * parsed, sorted or copied.
+ */
+class IntervalIndex
+{
+ public:
+
+  struct Cursor {
+    int32_t chr = -1;
+    int32_t last = INT32_MIN;
+    size_t i = 0;
+    uint64_t seeks = 0;   // binary searches, for new chromosomes and unsorted input
+  };
+
+  IntervalIndex() {}
+
+  /** Add [start, end], both inclusive. Call build() when done */
+  void add(int32_t chr, int32_t start, int32_t end);
+
+  /** Sort and merge what was added */
+  void build();
+
+  /** True if [start, end] overlaps an interval. No cursor, so always a binary search */
+  bool overlaps(int32_t chr, int32_t start, int32_t end) const;
+
+  /** Same, starting from where the cursor was left */
+  bool overlaps(Cursor& c, int32_t chr, int32_t start, int32_t end) const;
+
+  /** Number of intervals after merging */
+  size_t size() const { return m_view ? m_view_n : m_iv.size(); }
+
+  /** Heap memory held by the index. A view holds none */
+  size_t bytes() const;
+
+  /** Call f(chr, start, end) for each interval, in order */
+  template <typename F>
+  void forEach(F f) const {
+    for (size_t c = 0; c + 1 < chrCount(); ++c)
+      for (size_t i = chrs()[c]; i < chrs()[c + 1]; ++i)
+	f((int32_t)c, ivs()[i].start, ivs()[i].end);
+  }
+
+  /** Append the built index to out as one block: the number of
+   * chromosome offsets and of intervals, then both arrays as they are
+   * in memory. The block is a multiple of 8 bytes */
+  void serialize(std::string& out) const;
+
+  /** Use a block written by serialize in place of the intervals, without
+   * copying it. data must be 8-byte aligned, and owner keeps it alive
+   * (a mapped file, say). Returns false if the block doesn't hold up */
+  bool view(const uint8_t* data, size_t n, std::shared_ptr<const void> owner);
+
+  /** True if the intervals are a view */
+  bool viewed() const { return m_view; }
+
+ private:
+
+  struct Interval {
+    int32_t start;
+    int32_t end;
+  };
+
+  // first interval of chr, or the end for a chromosome past the last one
+  size_t chrBegin(int32_t chr) const;
+  size_t chrEnd(int32_t chr) const;
+
+  // first interval on [lo, hi) that ends at or after start
+  size_t seek(size_t lo, size_t hi, int32_t start) const;
+
+  // the intervals and chromosome offsets, from the vectors or a view
+  const Interval* ivs() const { return m_view ? m_view_iv : m_iv.data(); }
+  const uint64_t* chrs() const { return m_view ? m_view_chr : m_chr.data(); }
+  size_t chrCount() const { return m_view ? m_view_nchr : m_chr.size(); }
+
+  std::vector<Interval> m_iv;
+
+  // intervals of chromosome c are m_iv[m_chr[c], m_chr[c+1])
+  std::vector<uint64_t> m_chr;
+
+  bool m_view = false;
+  std::shared_ptr<const void> m_view_owner;
+  const Interval* m_view_iv = nullptr;
+  const uint64_t* m_view_chr = nullptr;
+  size_t m_view_n = 0;
+  size_t m_view_nchr = 0;
+
+  // added but not yet built
+  std::vector<std::pair<int32_t, Interval> > m_pending;
+
+};
+#endif
@@ -0,0 +1,133 @@
+#include "MateLinkPlanner.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "HtsReader.h"
+#include "IntervalIndex.h"
+
+const int32_t MateLinkPlanner::MATE_MARGIN;
+const int32_t MateLinkPlanner::MERGE_GAP;
+
+// length a read covers on the reference, or its own length if that is more
+static int32_t readSpan(const bam1_t* b)
+{
+  return std::max((int32_t)bam_endpos(b) - b->core.pos, b->core.l_qseq);
+}
+
+void MateLinkPlanner::mergeNearby(SnowTools::GenomicRegionVector& grv, int32_t gap)
+{
+  if (grv.size() < 2)
+    return;
+
+  std::sort(grv.begin(), grv.end(), [](const SnowTools::GenomicRegion& a, const SnowTools::GenomicRegion& b) {
+      return a.chr < b.chr || (a.chr == b.chr && a.pos1 < b.pos1);
+    });
+
+  size_t last = 0;
+  for (size_t i = 1; i < grv.size(); ++i) {
+    if (grv[i].chr == grv[last].chr && grv[i].pos1 <= grv[last].pos2 + gap)
+      grv[last].pos2 = std::max(grv[last].pos2, grv[i].pos2);
+    else
+      grv[++last] = grv[i];
+  }
+  grv.resize(last + 1);
+}
+
+void MateLinkPlanner::addSupplementary(const bam1_t* b, bam_hdr_t* h, SnowTools::GenomicRegionVector& loci)
+{
+  uint8_t* sa = bam_aux_get(b, "SA");
+  if (!sa || *sa != 'Z')
+    return;
+
+  // rname,pos,strand,CIGAR,mapQ,NM; ...
+  const char* p = (const char*)sa + 1;
+  while (*p) {
+    const char* comma = std::strchr(p, ',');
+    const char* semi = std::strchr(p, ';');
+    if (!comma || (semi && semi < comma))
+      break;
+    std::string chr(p, comma - p);
+    int32_t tid = bam_name2id(h, chr.c_str());
+    int32_t pos = std::atoi(comma + 1) - 1; // SA positions are 1-based
+    if (tid >= 0 && pos >= 0) {
+      loci.push_back(SnowTools::GenomicRegion(tid, pos, pos + 1));
+      ++m_supplementary;
+    }
+    if (!semi)
+      break;
+    p = semi + 1;
+  }
+}
+
+bool MateLinkPlanner::plan(const SnowTools::MiniRulesCollection& mr)
+{
+  m_regions.clear();
+
+  // regions whose own reads may be kept, and the mate-linked ones
+  SnowTools::GenomicRegionVector linked;
+  IntervalIndex linked_idx;
+  for (auto& reg : mr.m_regions) {
+    if (reg.excluder)
+      continue; // only ever removes reads
+    if (reg.m_whole_genome)
+      return false;
+    // widened as in RuleProgram, so nothing the rules could match is left out
+    int32_t pad = reg.pad + 1;
+    for (auto& gr : reg.m_grv) {
+      SnowTools::GenomicRegion w(gr.chr, std::max(0, gr.pos1 - pad), gr.pos2 + pad);
+      m_regions.push_back(w);
+      if (reg.m_applies_to_mate) {
+	linked_idx.add(w.chr, w.pos1, w.pos2);
+	w.pos1 = std::max(0, w.pos1 - MATE_MARGIN);
+	linked.push_back(w);
+      }
+    }
+  }
+  linked_idx.build();
+
+  HtsReader reader;
+  if (!reader.open(m_bam) || !reader.loadIndex())
+    return false;
+  reader.setReference(m_ref);
+
+  bam1_t* b = bam_init1();
+  int32_t longest = 0;
+
+  // phase one: where are the mates of the reads in the linked regions?
+  SnowTools::GenomicRegionVector loci;
+  reader.setRegions(linked);
+  while (reader.next(b)) {
+    ++m_scanned;
+    longest = std::max(longest, readSpan(b));
+    if (b->core.mtid >= 0) {
+      loci.push_back(SnowTools::GenomicRegion(b->core.mtid, b->core.mpos, b->core.mpos + 1));
+      ++m_mates;
+    }
+  }
+  mergeNearby(loci, MERGE_GAP);
+
+  // the mates' supplementary alignments point back to the region too
+  SnowTools::GenomicRegionVector supp;
+  reader.setRegions(loci);
+  while (reader.next(b)) {
+    ++m_scanned;
+    longest = std::max(longest, readSpan(b));
+    if (b->core.mtid >= 0 && linked_idx.overlaps(b->core.mtid, b->core.mpos - 1, b->core.mpos + readSpan(b)))
+      addSupplementary(b, reader.header(), supp);
+  }
+  bam_destroy1(b);
+
+  // a read longer than the margin could have a mate we didn't look for
+  if (longest > MATE_MARGIN) {
+    m_long = true;
+    m_regions.clear();
+    return false;
+  }
+
+  m_regions.insert(m_regions.end(), loci.begin(), loci.end());
+  m_regions.insert(m_regions.end(), supp.begin(), supp.end());
+  mergeNearby(m_regions, MERGE_GAP);
+  return true;
+}
@@ -0,0 +1,73 @@
+#ifndef VARIANT_MATE_LINK_PLANNER_H__
+#define VARIANT_MATE_LINK_PLANNER_H__
+
+#include <string>
+
+#include "SnowTools/MiniRules.h"
+#include "SnowTools/GenomicRegion.h"
+
+/** Works out which parts of an indexed BAM can hold a read that a set
+ * of rules with mate-linked regions (mlregion, -l, -L) would keep, so
+ * those rules don't need a walk of the whole file.
+ *
+ * Phase one jumps to each mate-linked region and collects the mate
+ * position (RNEXT/PNEXT) of every read there. A quick look at those
+ * mates picks up the supplementary alignments named in their SA tags,
+ * which carry the same mate fields. The regions to walk are then the
+ * rule regions plus all of these loci, with loci that are close
+ * together merged so they cost one seek. Walking them with the same
+ * rules keeps the same reads, in the same order, as the full scan.
+ *
+ * Secondary alignments of a mate are not named anywhere in its pair,
+ * so they are only found if they fall in a walked region.
+ */
+class MateLinkPlanner
+{
+ public:
+
+  MateLinkPlanner(const std::string& bam, const std::string& ref) : m_bam(bam), m_ref(ref) {}
+
+  /** Plan the walk for these rules. Returns false if the whole BAM has
+   * to be walked (a WG region, no index, or reads too long for MATE_MARGIN) */
+  bool plan(const SnowTools::MiniRulesCollection& mr);
+
+  /** Regions to walk, sorted and merged */
+  const SnowTools::GenomicRegionVector& regions() const { return m_regions; }
+
+  /** Reads looked at to find the mates, and mate loci found */
+  uint64_t scanned() const { return m_scanned; }
+  uint64_t mates() const { return m_mates; }
+
+  /** Supplementary alignment loci added from SA tags */
+  uint64_t supplementary() const { return m_supplementary; }
+
+  /** True if plan() gave up because of a long read */
+  bool longReads() const { return m_long; }
+
+  // a mate-linked region is also searched this far to its left, for
+  // reads whose mate starts before it and reaches into it
+  static const int32_t MATE_MARGIN = 1000;
+
+  // loci closer than this are read in one pass instead of two seeks
+  static const int32_t MERGE_GAP = 1000;
+
+ private:
+
+  // add the SA tag alignments of b as loci
+  void addSupplementary(const bam1_t* b, bam_hdr_t* h, SnowTools::GenomicRegionVector& loci);
+
+  // sort, and merge regions less than gap apart
+  static void mergeNearby(SnowTools::GenomicRegionVector& grv, int32_t gap);
+
+  std::string m_bam;
+  std::string m_ref;
+
+  SnowTools::GenomicRegionVector m_regions;
+
+  uint64_t m_scanned = 0;
+  uint64_t m_mates = 0;
+  uint64_t m_supplementary = 0;
+  bool m_long = false;
+
+};
+#endif
@@ -0,0 +1,177 @@
+#include "MotifMatcher.h"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <utility>
+
+// 4-bit BAM code to A/C/G/T = 0..3, or 4 for anything else
+static const uint8_t BAM_CODE[16] = {4, 0, 1, 4, 2, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4};
+
+static int baseCode(char c)
+{
+  switch (c) {
+  case 'A': return 0;
+  case 'C': return 1;
+  case 'G': return 2;
+  case 'T': return 3;
+  default: return 4;
+  }
+}
+
+void MotifMatcher::build(const std::vector<std::string>& motifs, int strands)
+{
+  m_motifs = 0;
+  m_exact = true;
+
+  // plain trie first. -1 is no child
+  std::vector<int32_t> go(4, -1);
+  std::vector<uint8_t> out(1, 0);
+
+  auto insert = [&](const std::vector<int>& codes, uint8_t strand) {
+    int32_t s = 0;
+    for (int c : codes) {
+      if (go[s * 4 + c] < 0) {
+	go[s * 4 + c] = out.size();
+	go.insert(go.end(), 4, -1);
+	out.push_back(0);
+      }
+      s = go[s * 4 + c];
+    }
+    out[s] |= strand;
+  };
+
+  std::vector<int> codes, rc;
+  for (auto& m : motifs) {
+    codes.clear();
+    for (char ch : m) {
+      int c = baseCode(std::toupper((unsigned char)ch));
+      if (c > 3)
+	break;
+      codes.push_back(c);
+    }
+    if (codes.size() != m.size() || codes.empty()) {
+      m_exact = false;
+      continue;
+    }
+    if (strands & FORWARD)
+      insert(codes, FORWARD);
+    if (strands & REVERSE) {
+      rc.assign(codes.rbegin(), codes.rend());
+      for (auto& c : rc)
+	c = 3 - c;
+      insert(rc, REVERSE);
+    }
+    ++m_motifs;
+  }
+
+  // breadth-first: failure links, then fill in the missing edges so it's a DFA
+  size_t n = out.size();
+  std::vector<int32_t> fail(n, 0), order;
+  order.reserve(n);
+  order.push_back(0);
+  for (size_t q = 0; q < order.size(); ++q) {
+    int32_t u = order[q];
+    for (int c = 0; c < 4; ++c) {
+      int32_t v = go[u * 4 + c];
+      if (v >= 0) {
+	fail[v] = u ? go[fail[u] * 4 + c] : 0;
+	out[v] |= out[fail[v]];
+	order.push_back(v);
+      } else {
+	go[u * 4 + c] = u ? go[fail[u] * 4 + c] : 0;
+      }
+    }
+  }
+
+  // renumber in breadth-first order and pack the outputs into the edges
+  std::vector<uint32_t> id(n);
+  for (size_t i = 0; i < n; ++i)
+    id[order[i]] = i;
+  m_delta.assign(n * 4, 0);
+  for (size_t u = 0; u < n; ++u)
+    for (int c = 0; c < 4; ++c) {
+      int32_t v = go[u * 4 + c];
+      m_delta[id[u] * 4 + c] = id[v] | (uint32_t)out[v] << OUT_SHIFT;
+    }
+}
+
+bool MotifMatcher::load(const std::string& file, int strands)
+{
+  std::ifstream in(file);
+  if (!in)
+    return false;
+
+  std::vector<std::string> motifs;
+  std::string line;
+  while (std::getline(in, line)) {
+    line.erase(std::remove_if(line.begin(), line.end(), [](unsigned char c) { return std::isspace(c); }), line.end());
+    if (line.length())
+      motifs.push_back(line);
+  }
+  build(motifs, strands);
+  return true;
+}
+
+std::shared_ptr<const MotifMatcher> MotifMatcher::shared(const std::string& file, int strands)
+{
+  static std::mutex mtx;
+  static std::map<std::pair<std::string, int>, std::weak_ptr<const MotifMatcher> > cache;
+
+  std::lock_guard<std::mutex> lock(mtx);
+  std::weak_ptr<const MotifMatcher>& slot = cache[std::make_pair(file, strands)];
+  std::shared_ptr<const MotifMatcher> m = slot.lock();
+  if (m)
+    return m;
+
+  std::shared_ptr<MotifMatcher> built(new MotifMatcher);
+  if (!built->load(file, strands))
+    return nullptr;
+  slot = built;
+  return built;
+}
+
+int MotifMatcher::scan(const uint8_t* seq, int n, int want) const
+{
+  if (m_delta.empty())
+    return 0;
+
+  const uint32_t* d = m_delta.data();
+  uint32_t s = 0, found = 0;
+  for (int i = 0; i < n; ++i) {
+    int c = BAM_CODE[(seq[i >> 1] >> ((~i & 1) << 2)) & 0xf];
+    if (c > 3) {
+      s = 0;
+      continue;
+    }
+    uint32_t t = d[s * 4 + c];
+    s = t & STATE_MASK;
+    if (t >> OUT_SHIFT) {
+      found |= t >> OUT_SHIFT;
+      if ((found & want) == (uint32_t)want)
+	break;
+    }
+  }
+  return found & want;
+}
+
+int MotifMatcher::scan(const std::string& seq, int want) const
+{
+  if (m_delta.empty())
+    return 0;
+
+  uint32_t s = 0, found = 0;
+  for (char ch : seq) {
+    int c = baseCode(ch);
+    if (c > 3) {
+      s = 0;
+      continue;
+    }
+    uint32_t t = m_delta[s * 4 + c];
+    s = t & STATE_MASK;
+    found |= t >> OUT_SHIFT;
+  }
+  return found & want;
+}
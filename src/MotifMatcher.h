@@ -0,0 +1,81 @@
+#ifndef VARIANT_MOTIF_MATCHER_H__
+#define VARIANT_MOTIF_MATCHER_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/** Aho-Corasick automaton over a motif dictionary that scans the 4-bit
+ * packed sequence of a BAM record directly.
+ *
+ * The trie is built over A/C/G/T and turned into a full DFA, so each
+ * base costs one table lookup. The reverse complement of every motif
+ * can be added with its own output bit, so a single pass finds hits on
+ * both strands; a matcher built for one strand leaves those states out.
+ * States are numbered in breadth-first order, which
+ * keeps the shallow levels, where a scan spends most of its time, in
+ * the first few cache lines of the table. An N or other ambiguity code
+ * sends the scan back to the root, since no motif contains one.
+ *
+ * A built matcher is never changed, so one copy can be shared by all
+ * threads. shared() hands out one per dictionary file.
+ */
+class MotifMatcher
+{
+ public:
+
+  enum Strand {
+    FORWARD = 1,
+    REVERSE = 2,  // reverse complement
+    BOTH = 3
+  };
+
+  MotifMatcher() {}
+
+  /** Build from a list of motifs, for the given strands. Motifs with
+   * anything but A/C/G/T (after upper-casing) are left out, and exact()
+   * becomes false */
+  void build(const std::vector<std::string>& motifs, int strands = BOTH);
+
+  /** Read a dictionary file, one motif per line. false if it can't be read */
+  bool load(const std::string& file, int strands = BOTH);
+
+  /** The matcher for this file and strands, built on first use and
+   * shared. nullptr if it can't be read */
+  static std::shared_ptr<const MotifMatcher> shared(const std::string& file, int strands = BOTH);
+
+  /** Which of the wanted strands have a hit in the n bases of seq.
+   * Stops as soon as all of them do */
+  int scan(const uint8_t* seq, int n, int want = BOTH) const;
+
+  /** Same, on a plain A/C/G/T string (for tests and benchmarks) */
+  int scan(const std::string& seq, int want = BOTH) const;
+
+  /** True if every motif made it into the automaton */
+  bool exact() const { return m_exact; }
+
+  /** Motifs in the dictionary */
+  size_t size() const { return m_motifs; }
+
+  /** States of the automaton */
+  size_t states() const { return m_delta.size() / 4; }
+
+  /** Memory held by the automaton */
+  size_t bytes() const { return m_delta.capacity() * sizeof(uint32_t); }
+
+ private:
+
+  // a transition holds the next state, and in its top two bits the
+  // strands that have a motif ending there
+  static const uint32_t STATE_MASK = 0x3fffffff;
+  static const int OUT_SHIFT = 30;
+
+  std::vector<uint32_t> m_delta;
+
+  size_t m_motifs = 0;
+  bool m_exact = true;
+
+};
+#endif
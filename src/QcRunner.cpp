@@ -0,0 +1,69 @@
+#include "QcRunner.h"
+
+#include <algorithm>
+#include <thread>
+
+void QcRunner::worker(HtsReader* main_reader)
+{
+  HtsReader rd;
+  if (!rd.open(m_bam)) {
+    std::cerr << "ERROR: Could not open " << m_bam << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  rd.setReference(main_reader->reference());
+  rd.setSeekGap(main_reader->seekGap());
+  rd.setPrefetch(main_reader->prefetch());
+  rd.setPrefetchWindow(main_reader->prefetchWindow());
+  rd.setTimed(main_reader->timed());
+
+  QcStats stats;
+  bam1_t* b = bam_init1();
+
+  const std::vector<ReadShard>& shards = m_shards->shards();
+  size_t i;
+  while ((i = m_next_shard++) < shards.size()) {
+    const ReadShard& s = shards[i];
+    if (s.unplaced) {
+      rd.setUnplaced();
+    } else {
+      rd.setRegions(s.regions);
+      if (s.has_prev)
+	rd.setPreviousRegion(s.prev);
+    }
+    while (rd.next(b))
+      stats.add(b);
+  }
+  bam_destroy1(b);
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_stats.merge(stats);
+  main_reader->addInputStats(rd.inputStats());
+}
+
+void QcRunner::run(VariantBamWalker& walk, bool verbose)
+{
+  if (m_threads > 1) {
+    m_shards.reset(new ShardRunner(m_bam, m_threads));
+    m_shards->setShardWidth(m_width);
+    if (!m_shards->setup(walk))
+      m_shards.reset();
+  }
+
+  if (!m_shards) {
+    bam1_t* b = bam_init1();
+    while (walk.m_reader.next(b))
+      m_stats.add(b);
+    bam_destroy1(b);
+    return;
+  }
+
+  if (verbose)
+    std::cerr << "...reading " << m_shards->size() << " shards on " << m_threads << " threads" << std::endl;
+
+  size_t nthreads = std::min((size_t)m_threads, m_shards->size());
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < nthreads; ++i)
+    workers.push_back(std::thread(&QcRunner::worker, this, &walk.m_reader));
+  for (auto& t : workers)
+    t.join();
+}
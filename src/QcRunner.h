@@ -0,0 +1,54 @@
+#ifndef VARIANT_QC_RUNNER_H__
+#define VARIANT_QC_RUNNER_H__
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "QcStats.h"
+#include "ShardRunner.h"
+
+/** The qc file of a -Q run. Every read of the walk's regions (the -k
+ * regions, or the whole file) goes from the reader straight into a
+ * QcStats: no rules, no BamRead and no output.
+ *
+ * With more than one thread and a sorted, indexed input, the regions
+ * are cut into the shards of ShardRunner. Each thread reads its shards
+ * with a reader and a QcStats of its own, and the stats are merged as
+ * the threads finish. Reads are owned by one shard, as in a filtering
+ * walk, so the counts are the same on any number of threads.
+ */
+class QcRunner
+{
+ public:
+
+  QcRunner(const std::string& bam, int threads) : m_bam(bam), m_threads(threads) {}
+
+  /** Read the regions of walk's reader, on threads if it can be sharded */
+  void run(VariantBamWalker& walk, bool verbose);
+
+  /** Cut shards this wide instead of ShardRunner::SHARD_WIDTH. Call before run */
+  void setShardWidth(int32_t width) { m_width = width; }
+
+  const QcStats& stats() const { return m_stats; }
+
+  /** Shards the reads were split into. 0 if they were read in one stream */
+  size_t shards() const { return m_shards ? m_shards->size() : 0; }
+
+ private:
+
+  void worker(HtsReader* main_reader);
+
+  std::string m_bam;
+  int m_threads;
+  int32_t m_width = ShardRunner::SHARD_WIDTH;
+
+  std::unique_ptr<ShardRunner> m_shards;
+  std::atomic<size_t> m_next_shard{0};
+
+  QcStats m_stats;
+  std::mutex m_mutex;
+
+};
+#endif
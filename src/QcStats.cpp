@@ -0,0 +1,117 @@
+#include "QcStats.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+const char* QcStats::HEADER = "ReadGroup\tReadCount\tSupplementary\tUnmapped\tMateUnmapped\tQCFailed\tDuplicate\t"
+  "MappingQuality\tNM\tInsertSize\tClippedBases\tMeanPhredScore\tReadLength";
+
+void QcStats::ReadGroup::merge(const ReadGroup& o)
+{
+  reads += o.reads;
+  supplementary += o.supplementary;
+  unmapped += o.unmapped;
+  mate_unmapped += o.mate_unmapped;
+  qcfail += o.qcfail;
+  duplicate += o.duplicate;
+  mapq.merge(o.mapq);
+  nm.merge(o.nm);
+  isize.merge(o.isize);
+  clip.merge(o.clip);
+  phred.merge(o.phred);
+  length.merge(o.length);
+}
+
+std::ostream& operator<<(std::ostream& out, const QcStats::ReadGroup& g)
+{
+  return out << g.name << "\t" << g.reads << "\t" << g.supplementary << "\t" << g.unmapped << "\t"
+	     << g.mate_unmapped << "\t" << g.qcfail << "\t" << g.duplicate << "\t" << g.mapq << "\t"
+	     << g.nm << "\t" << g.isize << "\t" << g.clip << "\t" << g.phred << "\t" << g.length;
+}
+
+QcStats::ReadGroup* QcStats::group(const char* name)
+{
+  if (m_last && m_last->name == name)
+    return m_last;
+  for (auto& g : m_groups)
+    if (g->name == name)
+      return m_last = g.get();
+  m_groups.push_back(std::unique_ptr<ReadGroup>(new ReadGroup));
+  m_groups.back()->name = name;
+  return m_last = m_groups.back().get();
+}
+
+void QcStats::add(const bam1_t* b)
+{
+  const bam1_core_t& c = b->core;
+
+  const uint8_t* rg = bam_aux_get(b, "RG");
+  ReadGroup& g = *group(rg && *rg == 'Z' ? (const char*)rg + 1 : "NA");
+
+  ++g.reads;
+  if (c.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY))
+    ++g.supplementary;
+  if (c.flag & BAM_FUNMAP)
+    ++g.unmapped;
+  if (c.flag & BAM_FMUNMAP)
+    ++g.mate_unmapped;
+  if (c.flag & BAM_FQCFAIL)
+    ++g.qcfail;
+  if (c.flag & BAM_FDUP)
+    ++g.duplicate;
+
+  g.mapq.add(c.qual);
+
+  const uint8_t* nm = bam_aux_get(b, "NM");
+  if (nm)
+    g.nm.add(bam_aux2i(nm));
+
+  if ((c.flag & (BAM_FUNMAP | BAM_FMUNMAP)) || !(c.flag & BAM_FPAIRED))
+    g.isize.add(-2);
+  else if (c.tid != c.mtid)
+    g.isize.add(-1);
+  else
+    g.isize.add(std::abs(c.isize));
+
+  m_features.reset(b);
+  g.clip.add(m_features.clipBases());
+
+  // missing qualities are 0xff
+  const uint8_t* q = bam_get_qual(b);
+  if (c.l_qseq && q[0] != 0xff) {
+    uint32_t sum = 0;
+    for (int32_t i = 0; i < c.l_qseq; ++i)
+      sum += q[i];
+    g.phred.add(sum / c.l_qseq);
+  }
+
+  g.length.add(c.l_qseq);
+}
+
+void QcStats::merge(const QcStats& o)
+{
+  for (auto& g : o.m_groups)
+    group(g->name.c_str())->merge(*g);
+}
+
+uint64_t QcStats::reads() const
+{
+  uint64_t n = 0;
+  for (auto& g : m_groups)
+    n += g->reads;
+  return n;
+}
+
+std::ostream& operator<<(std::ostream& out, const QcStats& qc)
+{
+  std::vector<const QcStats::ReadGroup*> groups;
+  for (auto& g : qc.m_groups)
+    groups.push_back(g.get());
+  std::sort(groups.begin(), groups.end(), [](const QcStats::ReadGroup* a, const QcStats::ReadGroup* b) { return a->name < b->name; });
+
+  out << QcStats::HEADER << std::endl;
+  for (auto g : groups)
+    out << *g << std::endl;
+  return out;
+}
@@ -0,0 +1,111 @@
+#ifndef VARIANT_QC_STATS_H__
+#define VARIANT_QC_STATS_H__
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "htslib/sam.h"
+
+#include "ReadFeatures.h"
+
+/** Per read group statistics of a BAM, for the -q and -Q qc files.
+ *
+ * The file has the layout of SnowTools::BamStats, which R/BamQCPlot.R
+ * plots and variant merge -q adds up: a header line, then one row per
+ * read group of flag counts followed by the mapq, NM, insert size,
+ * clipped bases, mean phred and read length histograms. Each histogram
+ * is written as min_max_count bins separated by commas.
+ *
+ * Reads are added from the raw record. The histograms are flat arrays
+ * of a fixed size, so once its read group has been seen a read costs a
+ * few increments and no allocation. Each thread keeps a QcStats of its
+ * own, and merge() adds them up at the end.
+ */
+class QcStats
+{
+ public:
+
+  /** Counts of the values MIN to MIN + BINS - 2, one per bin. The
+   * last bin holds everything above, and the first everything below */
+  template <int32_t MIN, size_t BINS>
+  struct Histogram {
+    uint64_t counts[BINS] = {};
+
+    void add(int32_t v) {
+      int64_t i = (int64_t)v - MIN;
+      ++counts[i < 0 ? 0 : i < (int64_t)BINS ? i : BINS - 1];
+    }
+
+    void merge(const Histogram& o) {
+      for (size_t i = 0; i < BINS; ++i)
+	counts[i] += o.counts[i];
+    }
+
+    friend std::ostream& operator<<(std::ostream& out, const Histogram& h) {
+      for (size_t i = 0; i + 1 < BINS; ++i)
+	out << (MIN + (int32_t)i) << "_" << (MIN + (int32_t)i) << "_" << h.counts[i] << ",";
+      return out << (MIN + (int32_t)BINS - 1) << "_" << INT32_MAX << "_" << h.counts[BINS - 1];
+    }
+  };
+
+  struct ReadGroup {
+    std::string name;
+
+    uint64_t reads = 0;
+    uint64_t supplementary = 0;  // secondary or supplementary alignments
+    uint64_t unmapped = 0;
+    uint64_t mate_unmapped = 0;
+    uint64_t qcfail = 0;
+    uint64_t duplicate = 0;
+
+    Histogram<0, 102> mapq;
+    Histogram<0, 102> nm;       // reads with an NM tag
+    Histogram<-2, 2003> isize;  // -2 if the read or its mate is unmapped, -1 if on another chromosome
+    Histogram<0, 102> clip;     // soft and hard clipped bases
+    Histogram<0, 102> phred;    // reads with qualities
+    Histogram<0, 252> length;
+
+    void merge(const ReadGroup& o);
+
+    friend std::ostream& operator<<(std::ostream& out, const ReadGroup& g);
+  };
+
+  QcStats() {}
+
+  QcStats(const QcStats&) = delete;
+  QcStats& operator=(const QcStats&) = delete;
+
+  /** Count a read, under its RG tag (NA if it has none) */
+  void add(const bam1_t* b);
+
+  /** Add the counts of another QcStats to these */
+  void merge(const QcStats& o);
+
+  /** Reads added, over all read groups */
+  uint64_t reads() const;
+
+  /** The read groups seen, in the order they were first seen */
+  const std::vector<std::unique_ptr<ReadGroup> >& groups() const { return m_groups; }
+
+  /** Write the qc file. Read groups are in name order */
+  friend std::ostream& operator<<(std::ostream& out, const QcStats& qc);
+
+  static const char* HEADER;
+
+ private:
+
+  // the group called name, made if it is new
+  ReadGroup* group(const char* name);
+
+  std::vector<std::unique_ptr<ReadGroup> > m_groups;
+
+  // reads come in runs of the same read group
+  ReadGroup* m_last = nullptr;
+
+  ReadFeatures m_features;
+
+};
+#endif
@@ -0,0 +1,78 @@
+#include "ReadFeatures.h"
+#include "ReadKernels.h"
+
+#include <algorithm>
+
+void ReadFeatures::cigar()
+{
+  if (have(HAVE_CIGAR))
+    return;
+
+  m_ins = m_del = m_ins_max = m_del_max = m_sclip_left = m_sclip_right = m_hclip = 0;
+  const uint32_t* c = bam_get_cigar(m_b);
+  bool aligned = false;
+  for (uint32_t i = 0; i < m_b->core.n_cigar; ++i) {
+    int len = bam_cigar_oplen(c[i]);
+    switch (bam_cigar_op(c[i])) {
+    case BAM_CINS: m_ins += len; m_ins_max = std::max(m_ins_max, len); aligned = true; break;
+    case BAM_CDEL: m_del += len; m_del_max = std::max(m_del_max, len); aligned = true; break;
+    case BAM_CSOFT_CLIP: (aligned ? m_sclip_right : m_sclip_left) += len; break;
+    case BAM_CHARD_CLIP: m_hclip += len; break;
+    default: aligned = true; break;
+    }
+  }
+}
+
+int ReadFeatures::nBases()
+{
+  if (have(HAVE_NBASES))
+    return m_nbases;
+
+  m_nbases = ReadKernels::countN(bam_get_seq(m_b), m_b->core.l_qseq);
+  return m_nbases;
+}
+
+int ReadFeatures::trimmedEnd(int phred)
+{
+  // the cache holds one threshold, which is all a typical script uses
+  if ((m_have & HAVE_TRIM) && m_trim_phred == phred) {
+    ++m_hits;
+    return m_trim_end;
+  }
+  m_have |= HAVE_TRIM;
+  ++m_misses;
+
+  // the kernels compare bytes, so settle out-of-range thresholds here
+  int n = m_b->core.l_qseq;
+  m_trim_phred = phred;
+  if (phred <= 0)
+    m_trim_end = n;
+  else if (phred > 255)
+    m_trim_end = 0;
+  else
+    m_trim_end = ReadKernels::lastQualAtLeast(bam_get_qual(m_b), n, phred);
+  return m_trim_end;
+}
+
+bool ReadFeatures::hasAltTags()
+{
+  if (have(HAVE_ALT))
+    return m_alt;
+
+  m_alt = bam_aux_get(m_b, "XA") || bam_aux_get(m_b, "XP");
+  return m_alt;
+}
+
+bool ReadFeatures::hasMotif(const MotifMatcher& m)
+{
+  if ((m_have & HAVE_MOTIF) && m_motif_of == &m) {
+    ++m_hits;
+    return m_motif;
+  }
+  m_have |= HAVE_MOTIF;
+  ++m_misses;
+
+  m_motif_of = &m;
+  m_motif = m.scan(bam_get_seq(m_b), m_b->core.l_qseq, MotifMatcher::FORWARD) != 0;
+  return m_motif;
+}
@@ -0,0 +1,108 @@
+#ifndef VARIANT_READ_FEATURES_H__
+#define VARIANT_READ_FEATURES_H__
+
+#include <cstdint>
+
+#include "htslib/sam.h"
+
+#include "MotifMatcher.h"
+
+/** Values the rules look at, computed from a read the first time
+ * one of them is asked for and reused until the next read.
+ *
+ * Features that come out of the same pass are filled together: one
+ * CIGAR walk gives inserted, deleted and clipped bases, and one scan
+ * of the qualities gives the quality-trimmed end for a threshold.
+ * Hits and misses are counted across all reads.
+ */
+class ReadFeatures
+{
+ public:
+
+  ReadFeatures() {}
+
+  /** Start on a new read. Nothing is computed yet */
+  void reset(const bam1_t* b) { m_b = b; m_have = 0; }
+
+  /** Total inserted bases (I operations) */
+  int insBases() { cigar(); return m_ins; }
+
+  /** Total deleted bases (D operations) */
+  int delBases() { cigar(); return m_del; }
+
+  /** Length of the longest I and D operation. 0 if there is none */
+  int maxInsOp() { cigar(); return m_ins_max; }
+  int maxDelOp() { cigar(); return m_del_max; }
+
+  /** Total clipped bases (S and H operations) */
+  int clipBases() { cigar(); return m_sclip_left + m_sclip_right + m_hclip; }
+
+  /** Soft-clipped bases at the start and end of the read */
+  int softClipLeft() { cigar(); return m_sclip_left; }
+  int softClipRight() { cigar(); return m_sclip_right; }
+
+  /** Hard-clipped bases */
+  int hardClipBases() { cigar(); return m_hclip; }
+
+  /** Number of N bases in the sequence */
+  int nBases();
+
+  /** One past the last base with quality >= phred. 0 if there is none.
+   * A quality-trimmed read can't extend past this */
+  int trimmedEnd(int phred);
+
+  /** True if the read has an XA or XP tag */
+  bool hasAltTags();
+
+  /** True if the forward sequence has a motif of m. The last dictionary asked about is cached */
+  bool hasMotif(const MotifMatcher& m);
+
+  uint64_t hits() const { return m_hits; }
+
+  uint64_t misses() const { return m_misses; }
+
+ private:
+
+  enum {
+    HAVE_CIGAR = 1,
+    HAVE_NBASES = 2,
+    HAVE_TRIM = 4,
+    HAVE_ALT = 8,
+    HAVE_MOTIF = 16
+  };
+
+  // true if the feature was already there. otherwise marks it and counts a miss
+  bool have(int f) {
+    if (m_have & f) {
+      ++m_hits;
+      return true;
+    }
+    m_have |= f;
+    ++m_misses;
+    return false;
+  }
+
+  void cigar();
+
+  const bam1_t* m_b = nullptr;
+  int m_have = 0;
+
+  int m_ins = 0;
+  int m_del = 0;
+  int m_ins_max = 0;
+  int m_del_max = 0;
+  int m_sclip_left = 0;
+  int m_sclip_right = 0;
+  int m_hclip = 0;
+  int m_nbases = 0;
+  int m_trim_phred = -1;
+  int m_trim_end = 0;
+  bool m_alt = false;
+  const MotifMatcher* m_motif_of = nullptr;
+  bool m_motif = false;
+
+  uint64_t m_hits = 0;
+  uint64_t m_misses = 0;
+
+};
+#endif
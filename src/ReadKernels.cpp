@@ -0,0 +1,193 @@
+#include "ReadKernels.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define VARIANT_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+namespace ReadKernels {
+
+namespace scalar {
+
+  int countQualAtLeast(const uint8_t* qual, int n, uint8_t thresh)
+  {
+    int c = 0;
+    for (int i = 0; i < n; ++i)
+      c += qual[i] >= thresh;
+    return c;
+  }
+
+  int lastQualAtLeast(const uint8_t* qual, int n, uint8_t thresh)
+  {
+    while (n > 0 && qual[n - 1] < thresh)
+      --n;
+    return n;
+  }
+
+  int countN(const uint8_t* seq, int n)
+  {
+    int c = 0;
+    for (int i = 0; i < n; ++i)
+      c += ((seq[i >> 1] >> ((~i & 1) << 2)) & 0xf) == 15;
+    return c;
+  }
+
+}
+
+#ifdef VARIANT_X86_KERNELS
+
+namespace sse42 {
+
+  __attribute__((target("sse4.2,popcnt")))
+  int countQualAtLeast(const uint8_t* qual, int n, uint8_t thresh)
+  {
+    const __m128i t = _mm_set1_epi8((char)thresh);
+    int c = 0, i = 0;
+    for (; i + 16 <= n; i += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(qual + i));
+      // max(x, t) == x  <=>  x >= t, unsigned
+      c += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(x, t), x)));
+    }
+    return c + scalar::countQualAtLeast(qual + i, n - i, thresh);
+  }
+
+  __attribute__((target("sse4.2,popcnt")))
+  int lastQualAtLeast(const uint8_t* qual, int n, uint8_t thresh)
+  {
+    const __m128i t = _mm_set1_epi8((char)thresh);
+    int i = n;
+    for (; i >= 16; i -= 16) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(qual + i - 16));
+      unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(x, t), x));
+      if (m)
+	return i - 16 + (32 - __builtin_clz(m));
+    }
+    return scalar::lastQualAtLeast(qual, i, thresh);
+  }
+
+  __attribute__((target("sse4.2,popcnt")))
+  int countN(const uint8_t* seq, int n)
+  {
+    const __m128i hi = _mm_set1_epi8((char)0xf0);
+    const __m128i lo = _mm_set1_epi8(0x0f);
+    int c = 0, b = 0;
+    // whole bytes only, so both nibbles are bases
+    for (; b + 16 <= n / 2; b += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(seq + b));
+      c += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(x, hi), hi)));
+      c += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(x, lo), lo)));
+    }
+    return c + scalar::countN(seq + b, n - 2 * b);
+  }
+
+}
+
+namespace avx2 {
+
+  __attribute__((target("avx2,popcnt")))
+  int countQualAtLeast(const uint8_t* qual, int n, uint8_t thresh)
+  {
+    const __m256i t = _mm256_set1_epi8((char)thresh);
+    int c = 0, i = 0;
+    for (; i + 32 <= n; i += 32) {
+      __m256i x = _mm256_loadu_si256((const __m256i*)(qual + i));
+      c += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(x, t), x)));
+    }
+    return c + sse42::countQualAtLeast(qual + i, n - i, thresh);
+  }
+
+  __attribute__((target("avx2,popcnt")))
+  int lastQualAtLeast(const uint8_t* qual, int n, uint8_t thresh)
+  {
+    const __m256i t = _mm256_set1_epi8((char)thresh);
+    int i = n;
+    for (; i >= 32; i -= 32) {
+      __m256i x = _mm256_loadu_si256((const __m256i*)(qual + i - 32));
+      unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(x, t), x));
+      if (m)
+	return i - 32 + (32 - __builtin_clz(m));
+    }
+    return sse42::lastQualAtLeast(qual, i, thresh);
+  }
+
+  __attribute__((target("avx2,popcnt")))
+  int countN(const uint8_t* seq, int n)
+  {
+    const __m256i hi = _mm256_set1_epi8((char)0xf0);
+    const __m256i lo = _mm256_set1_epi8(0x0f);
+    int c = 0, b = 0;
+    for (; b + 32 <= n / 2; b += 32) {
+      __m256i x = _mm256_loadu_si256((const __m256i*)(seq + b));
+      c += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(x, hi), hi)));
+      c += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(x, lo), lo)));
+    }
+    return c + sse42::countN(seq + b, n - 2 * b);
+  }
+
+}
+
+#endif
+
+struct Table {
+  Level level;
+  int (*countQualAtLeast)(const uint8_t*, int, uint8_t);
+  int (*lastQualAtLeast)(const uint8_t*, int, uint8_t);
+  int (*countN)(const uint8_t*, int);
+};
+
+static Table pick(Level max)
+{
+#ifdef VARIANT_X86_KERNELS
+  __builtin_cpu_init();
+  if (max >= AVX2 && __builtin_cpu_supports("avx2"))
+    return {AVX2, avx2::countQualAtLeast, avx2::lastQualAtLeast, avx2::countN};
+  if (max >= SSE42 && __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt"))
+    return {SSE42, sse42::countQualAtLeast, sse42::lastQualAtLeast, sse42::countN};
+#else
+  (void)max;
+#endif
+  return {SCALAR, scalar::countQualAtLeast, scalar::lastQualAtLeast, scalar::countN};
+}
+
+static Table& table()
+{
+  static Table t = pick(AVX2);
+  return t;
+}
+
+int countQualAtLeast(const uint8_t* qual, int n, uint8_t thresh)
+{
+  return table().countQualAtLeast(qual, n, thresh);
+}
+
+int lastQualAtLeast(const uint8_t* qual, int n, uint8_t thresh)
+{
+  return table().lastQualAtLeast(qual, n, thresh);
+}
+
+int countN(const uint8_t* seq, int n)
+{
+  return table().countN(seq, n);
+}
+
+Level level()
+{
+  return table().level;
+}
+
+Level setLevel(Level max)
+{
+  table() = pick(max);
+  return table().level;
+}
+
+const char* levelName(Level l)
+{
+  switch (l) {
+  case AVX2: return "avx2";
+  case SSE42: return "sse4.2";
+  default: return "scalar";
+  }
+}
+
+}
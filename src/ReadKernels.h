@@ -0,0 +1,43 @@
+#ifndef VARIANT_READ_KERNELS_H__
+#define VARIANT_READ_KERNELS_H__
+
+#include <cstdint>
+
+/** Scans over a read's qualities and packed sequence.
+ *
+ * Each kernel has a scalar version and, on x86, SSE4.2 and AVX2
+ * versions. The first call picks the best one the CPU supports.
+ * All versions give exactly the same answers.
+ */
+namespace ReadKernels {
+
+  /** Number of qualities >= thresh */
+  int countQualAtLeast(const uint8_t* qual, int n, uint8_t thresh);
+
+  /** One past the last quality >= thresh, or 0 if there is none */
+  int lastQualAtLeast(const uint8_t* qual, int n, uint8_t thresh);
+
+  /** Number of N (code 15) bases in a 4-bit packed sequence of n bases */
+  int countN(const uint8_t* seq, int n);
+
+  enum Level {
+    SCALAR,
+    SSE42,
+    AVX2
+  };
+
+  /** The kernels in use */
+  Level level();
+
+  /** Use at most this level (for tests and benchmarks). Returns the level now in use */
+  Level setLevel(Level max);
+
+  const char* levelName(Level l);
+
+  namespace scalar {
+    int countQualAtLeast(const uint8_t* qual, int n, uint8_t thresh);
+    int lastQualAtLeast(const uint8_t* qual, int n, uint8_t thresh);
+    int countN(const uint8_t* seq, int n);
+  }
+}
+#endif
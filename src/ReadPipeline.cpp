@@ -0,0 +1,168 @@
+#include "ReadPipeline.h"
+
+#include <thread>
+
+const size_t ReadPipeline::BATCH_SIZE;
+const size_t ReadPipeline::QUEUE_SIZE;
+
+ReadPipeline::ReadPipeline(const std::string& rules, int evaluators)
+  : m_rules(rules), m_evaluators(evaluators > 0 ? evaluators : 1)
+{
+  for (size_t e = 0; e < m_evaluators; ++e) {
+    m_in.push_back(std::unique_ptr<SpscQueue<ReadBatch*> >(new SpscQueue<ReadBatch*>(QUEUE_SIZE)));
+    m_out.push_back(std::unique_ptr<SpscQueue<ReadBatch*> >(new SpscQueue<ReadBatch*>(QUEUE_SIZE)));
+  }
+  // room for every batch that can be in flight, so the writer never waits on it
+  m_free.reset(new SpscQueue<ReadBatch*>(2 * QUEUE_SIZE * m_evaluators + 4));
+}
+
+void ReadPipeline::reader(VariantBamWalker* walk)
+{
+  size_t e = 0;
+  bool more = true;
+  uint64_t skipped = walk->m_reader.coreSkipped();
+  while (more) {
+
+    ReadBatch* batch;
+    if (!m_free->tryPop(batch)) {
+      batch = new ReadBatch;
+      batch->reads.reserve(BATCH_SIZE);
+      ++m_made;
+    }
+
+    // read into the records of the batch where nothing else holds them
+    size_t n = 0;
+    for (; n < BATCH_SIZE; ++n) {
+      if (n == batch->reads.size())
+	batch->reads.push_back(SnowTools::BamRead());
+      SnowTools::BamRead& r = batch->reads[n];
+      bam1_t* b = r.b && r.b.use_count() == 1 ? r.raw() : nullptr;
+      if (!b) {
+	b = bam_init1();
+	++walk->m_read_allocs;
+      }
+      if (!walk->m_reader.next(b)) {
+	if (b != r.raw())
+	  bam_destroy1(b);
+	more = false;
+	break;
+      }
+      if (walk->qcOn())
+	walk->m_qc.add(b);
+      if (b != r.raw())
+	r.assign(b);
+    }
+    batch->reads.resize(n);
+
+    if (batch->reads.size()) {
+      batch->skipped = walk->m_reader.coreSkipped() - skipped;
+      skipped += batch->skipped;
+      m_in[e]->push(batch);
+      e = (e + 1) % m_evaluators;
+    } else {
+      delete batch;
+    }
+  }
+
+  // end of input. the writer stops at the first of these it meets,
+  // which has the reads skipped after the last batch
+  for (size_t i = 0; i < m_evaluators; ++i) {
+    ReadBatch* batch = new ReadBatch;
+    batch->last = true;
+    if (i == 0)
+      batch->skipped = walk->m_reader.coreSkipped() - skipped;
+    m_in[(e + i) % m_evaluators]->push(batch);
+  }
+}
+
+void ReadPipeline::evaluator(size_t e, bam_hdr_t* h)
+{
+  SnowTools::MiniRulesCollection mr(m_rules, h);
+  RuleProgram program;
+  program.compile(&mr);
+
+  for (;;) {
+    ReadBatch* batch;
+    m_in[e]->pop(batch);
+
+    batch->keep.resize(batch->reads.size());
+    for (size_t i = 0; i < batch->reads.size(); ++i)
+      batch->keep[i] = program.isValid(batch->reads[i]);
+
+    bool last = batch->last;
+    m_out[e]->push(batch);
+    if (last)
+      return;
+  }
+}
+
+void ReadPipeline::run(VariantBamWalker& walk, bool verbose)
+{
+  std::vector<std::thread> threads;
+  for (size_t e = 0; e < m_evaluators; ++e)
+    threads.push_back(std::thread(&ReadPipeline::evaluator, this, e, walk.m_reader.header()));
+  threads.push_back(std::thread(&ReadPipeline::reader, this, &walk));
+
+  // this thread is the writer. collect in the order the reader dealt
+  SnowTools::BamRead last_read;
+  bool any = false;
+  uint64_t last = walk.rc_main.total;
+  for (size_t e = 0; ; e = (e + 1) % m_evaluators) {
+
+    ReadBatch* batch;
+    m_out[e]->pop(batch);
+    walk.rc_main.total += batch->skipped;
+    if (batch->last) {
+      delete batch;
+      break;
+    }
+
+    // with the skipped reads the count can pass a million instead of landing on it
+    for (size_t i = 0; i < batch->reads.size(); ++i) {
+      if (batch->keep[i] && walk.hasOutput()) {
+	walk.writeRead(batch->reads[i]);
+	++walk.rc_main.keep;
+      }
+      if (++walk.rc_main.total / 1000000 != last / 1000000 && verbose)
+	walk.printMessage(batch->reads[i]);
+      last = walk.rc_main.total;
+    }
+    last_read = batch->reads.back();
+    any = true;
+    if (!m_free->tryPush(batch))
+      delete batch;
+  }
+
+  for (auto& t : threads)
+    t.join();
+
+  // the other end-of-input markers, and the batches the reader didn't take back
+  for (size_t e = 0; e < m_evaluators; ++e) {
+    ReadBatch* batch;
+    while (m_out[e]->tryPop(batch))
+      delete batch;
+  }
+  ReadBatch* batch;
+  while (m_free->tryPop(batch))
+    delete batch;
+
+  if (verbose && any)
+    walk.printMessage(last_read);
+}
+
+void ReadPipeline::printStalls(std::ostream& out) const
+{
+  uint64_t reader = 0, eval_in = 0, eval_out = 0, writer = 0;
+  for (size_t e = 0; e < m_evaluators; ++e) {
+    reader   += m_in[e]->pushStalls();
+    eval_in  += m_in[e]->popStalls();
+    eval_out += m_out[e]->pushStalls();
+    writer   += m_out[e]->popStalls();
+  }
+
+  out << "...pipeline stalls (" << m_evaluators << " evaluator" << (m_evaluators > 1 ? "s" : "") << ")" << std::endl
+      << "      reader    waited on full queues:   " << reader << std::endl
+      << "      evaluator waited for reads:        " << eval_in << std::endl
+      << "      evaluator waited on writer:        " << eval_out << std::endl
+      << "      writer    waited for reads:        " << writer << std::endl;
+}
@@ -0,0 +1,80 @@
+#ifndef VARIANT_READ_PIPELINE_H__
+#define VARIANT_READ_PIPELINE_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "SpscQueue.h"
+#include "VariantBamWalker.h"
+
+/** A batch of reads passed down the pipeline, with the rule decision for each */
+struct ReadBatch {
+
+  SnowTools::BamReadVector reads;
+
+  std::vector<char> keep;
+
+  // reads the core filter stepped over since the batch before
+  uint64_t skipped = 0;
+
+  // marks the end of the input
+  bool last = false;
+
+};
+
+/** Run a streaming filter as three stages: a reader thread that
+ * decodes batches of reads, evaluator threads that check them against
+ * the rules, and the calling thread, which writes the kept reads.
+ *
+ * Batches are dealt to the evaluators round-robin through one
+ * single-producer/single-consumer queue each, and collected from them
+ * in the same order, so the output order is the input order.
+ *
+ * Written batches go back to the reader through one more queue, and
+ * the reader reads into their records again. Once the pipeline is
+ * full, reading allocates nothing, as for the single-threaded walk.
+ */
+class ReadPipeline
+{
+ public:
+
+  ReadPipeline(const std::string& rules, int evaluators);
+
+  /** Filter everything left in walk.m_reader, writing through walk */
+  void run(VariantBamWalker& walk, bool verbose);
+
+  /** Print how often each stage had to wait on its neighbors */
+  void printStalls(std::ostream& out) const;
+
+  static const size_t BATCH_SIZE = 1000;
+
+  // batches in flight between two stages
+  static const size_t QUEUE_SIZE = 8;
+
+  /** Batches the reader made new, rather than taking back from the writer */
+  uint64_t batchesMade() const { return m_made; }
+
+ private:
+
+  void reader(VariantBamWalker* walk);
+
+  void evaluator(size_t e, bam_hdr_t* h);
+
+  std::string m_rules;
+
+  size_t m_evaluators;
+
+  // reader -> evaluator e
+  std::vector<std::unique_ptr<SpscQueue<ReadBatch*> > > m_in;
+
+  // evaluator e -> writer
+  std::vector<std::unique_ptr<SpscQueue<ReadBatch*> > > m_out;
+
+  // writer -> reader, batches done with
+  std::unique_ptr<SpscQueue<ReadBatch*> > m_free;
+
+  uint64_t m_made = 0;
+
+};
+#endif
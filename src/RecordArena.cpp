@@ -0,0 +1,92 @@
+#include "RecordArena.h"
+
+#include <algorithm>
+#include <cstring>
+
+const size_t RecordArena::CHUNK_SIZE;
+
+// keep the bam1_t of each record aligned
+static inline size_t roundUp(size_t n)
+{
+  return (n + 7) & ~(size_t)7;
+}
+
+RecordArena::~RecordArena()
+{
+  for (auto c : m_used) {
+    delete[] c->mem;
+    delete c;
+  }
+  for (auto c : m_spare) {
+    delete[] c->mem;
+    delete c;
+  }
+}
+
+RecordArena::Chunk* RecordArena::take(size_t need)
+{
+  if (need <= CHUNK_SIZE && m_spare.size()) {
+    Chunk* c = m_spare.back();
+    m_spare.pop_back();
+    return c;
+  }
+
+  Chunk* c = new Chunk;
+  c->capacity = std::max(need, CHUNK_SIZE);
+  c->mem = new uint8_t[c->capacity];
+  ++m_allocations;
+  m_bytes += c->capacity;
+  m_peak_bytes = std::max(m_peak_bytes, m_bytes);
+  return c;
+}
+
+void RecordArena::release(Chunk* c)
+{
+  if (c->capacity == CHUNK_SIZE) {
+    c->used = c->pushed = c->popped = 0;
+    m_spare.push_back(c);
+    return;
+  }
+  m_bytes -= c->capacity;
+  delete[] c->mem;
+  delete c;
+}
+
+bam1_t* RecordArena::push(const bam1_t* b)
+{
+  size_t need = roundUp(sizeof(bam1_t)) + roundUp(b->l_data);
+
+  Chunk* c = m_used.size() ? m_used.back() : nullptr;
+  if (!c || c->used + need > c->capacity) {
+    c = take(need);
+    m_used.push_back(c);
+  }
+
+  bam1_t* r = (bam1_t*)(c->mem + c->used);
+  *r = *b;
+  r->data = c->mem + c->used + roundUp(sizeof(bam1_t));
+  r->m_data = b->l_data;
+  memcpy(r->data, b->data, b->l_data);
+
+  c->used += need;
+  ++c->pushed;
+  ++m_size;
+  return r;
+}
+
+void RecordArena::pop()
+{
+  Chunk* c = m_used.front();
+  ++c->popped;
+  --m_size;
+  if (c->popped < c->pushed)
+    return;
+
+  // the chunk being filled is just started over
+  if (m_used.size() == 1) {
+    c->used = c->pushed = c->popped = 0;
+    return;
+  }
+  m_used.pop_front();
+  release(c);
+}
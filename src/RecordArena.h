@@ -0,0 +1,74 @@
+#ifndef VARIANT_RECORD_ARENA_H__
+#define VARIANT_RECORD_ARENA_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "htslib/sam.h"
+
+/** Copies of BAM records that are let go in the order they were made,
+ * such as the reads held back in the -m coverage buffer.
+ *
+ * Each record and its data are copied end to end into chunks of
+ * CHUNK_SIZE bytes. A chunk is put aside for reuse once every record in
+ * it has been popped, so the chunks grow to what the deepest window
+ * needs and a walk allocates nothing after that. A record bigger than a
+ * chunk gets a chunk of its own, which is freed when it is popped.
+ */
+class RecordArena
+{
+ public:
+
+  static const size_t CHUNK_SIZE = 1 << 20;
+
+  RecordArena() {}
+
+  ~RecordArena();
+
+  RecordArena(const RecordArena&) = delete;
+  RecordArena& operator=(const RecordArena&) = delete;
+
+  /** Copy b in. The copy is valid until it is popped. Its data can be
+   * changed in place and shrunk, but must not be reallocated */
+  bam1_t* push(const bam1_t* b);
+
+  /** Let go of the oldest record */
+  void pop();
+
+  /** Records held */
+  size_t size() const { return m_size; }
+
+  /** Chunks allocated over the life of the arena */
+  uint64_t allocations() const { return m_allocations; }
+
+  /** Most bytes of chunks held at once, in use or put aside */
+  uint64_t peakBytes() const { return m_peak_bytes; }
+
+ private:
+
+  struct Chunk {
+    uint8_t* mem;
+    size_t capacity;
+    size_t used = 0;
+    size_t pushed = 0;
+    size_t popped = 0;
+  };
+
+  // a chunk with room for need bytes, from the spare ones if it can be
+  Chunk* take(size_t need);
+
+  void release(Chunk* c);
+
+  // oldest first. the last is being filled
+  std::deque<Chunk*> m_used;
+  std::vector<Chunk*> m_spare;
+
+  size_t m_size = 0;
+  uint64_t m_allocations = 0;
+  uint64_t m_bytes = 0;
+  uint64_t m_peak_bytes = 0;
+
+};
+#endif
@@ -0,0 +1,184 @@
+#include "RegionCache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "SnowTools/GenomicRegionCollection.h"
+
+static const char MAGIC[8] = {'V', 'B', 'R', 'G', 'N', 'C', 1, 0};
+
+// fixed-width fields in host order, like a checkpoint. the cache is only
+// read on the machine type that wrote it (a node, or a shared filesystem
+// of one architecture)
+struct CacheHeader {
+  char magic[8];
+  uint64_t pad;
+  uint64_t contigs;
+  uint64_t size;      // of the region file
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t hash;      // of its contents
+  uint64_t reserved;
+};
+
+static_assert(sizeof(CacheHeader) % 8 == 0, "the index block must stay 8-byte aligned");
+
+static void mtimeOf(const struct stat& st, int64_t& sec, int64_t& nsec)
+{
+#ifdef __APPLE__
+  sec = st.st_mtimespec.tv_sec;
+  nsec = st.st_mtimespec.tv_nsec;
+#else
+  sec = st.st_mtim.tv_sec;
+  nsec = st.st_mtim.tv_nsec;
+#endif
+}
+
+uint64_t RegionCache::hashBytes(const void* data, size_t n, uint64_t seed)
+{
+  // FNV-1a over 8-byte words, then the tail
+  const uint64_t prime = 0x100000001b3ULL;
+  const uint8_t* p = (const uint8_t*)data;
+  uint64_t h = seed ^ 0xcbf29ce484222325ULL;
+  for (; n >= 8; n -= 8, p += 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    h = (h ^ w) * prime;
+  }
+  for (; n; --n, ++p)
+    h = (h ^ *p) * prime;
+  return h;
+}
+
+bool RegionCache::hashFile(const std::string& file, uint64_t& hash)
+{
+  FILE* fp = fopen(file.c_str(), "rb");
+  if (!fp)
+    return false;
+  std::vector<char> buf(1 << 20);
+  hash = 0;
+  size_t n;
+  while ((n = fread(buf.data(), 1, buf.size(), fp)) > 0)
+    hash = hashBytes(buf.data(), n, hash);
+  bool ok = !ferror(fp);
+  fclose(fp);
+  return ok;
+}
+
+RegionCache::RegionCache(const std::string& dir, bam_hdr_t* h)
+  : m_dir(dir), m_hdr(h)
+{
+  m_contigs = 0;
+  for (int32_t i = 0; h && i < h->n_targets; ++i) {
+    m_contigs = hashBytes(h->target_name[i], strlen(h->target_name[i]) + 1, m_contigs);
+    m_contigs = hashBytes(&h->target_len[i], sizeof(h->target_len[i]), m_contigs);
+  }
+}
+
+std::string RegionCache::path(const std::string& file, int pad) const
+{
+  char* real = realpath(file.c_str(), nullptr);
+  std::string full = real ? real : file;
+  free(real);
+
+  uint64_t key = hashBytes(full.data(), full.size(), m_contigs);
+  key = hashBytes(&pad, sizeof(pad), key);
+
+  size_t slash = file.rfind('/');
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)key);
+  return m_dir + "/" + file.substr(slash == std::string::npos ? 0 : slash + 1) + "." + hex + ".vbregions";
+}
+
+bool RegionCache::load(const std::string& p, const std::string& file, int pad, IntervalIndex& idx)
+{
+  int fd = open(p.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+    close(fd);
+    return false;
+  }
+  size_t len = st.st_size;
+  void* mem = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED)
+    return false;
+  std::shared_ptr<const void> owner(mem, [len](const void* m) { munmap(const_cast<void*>(m), len); });
+
+  const CacheHeader* h = (const CacheHeader*)mem;
+  if (memcmp(h->magic, MAGIC, sizeof(MAGIC)) || h->pad != (uint64_t)pad || h->contigs != m_contigs)
+    return false;
+
+  // an unchanged file is taken on trust. one that was touched has to hash the same
+  struct stat src;
+  if (stat(file.c_str(), &src) != 0)
+    return false;
+  int64_t sec, nsec;
+  mtimeOf(src, sec, nsec);
+  if (h->size != (uint64_t)src.st_size || h->mtime_sec != sec || h->mtime_nsec != nsec) {
+    uint64_t hash;
+    if (!hashFile(file, hash) || hash != h->hash)
+      return false;
+  }
+
+  return idx.view((const uint8_t*)mem + sizeof(CacheHeader), len - sizeof(CacheHeader), owner);
+}
+
+std::shared_ptr<const IntervalIndex> RegionCache::get(const std::string& file, int pad)
+{
+  struct stat src;
+  if (stat(file.c_str(), &src) != 0)
+    return nullptr;
+
+  std::string p = path(file, pad);
+  std::shared_ptr<IntervalIndex> idx(new IntervalIndex);
+  if (load(p, file, pad, *idx)) {
+    ++m_hits;
+    return idx;
+  }
+  ++m_misses;
+
+  CacheHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, MAGIC, sizeof(MAGIC));
+  h.pad = pad;
+  h.contigs = m_contigs;
+  h.size = src.st_size;
+  mtimeOf(src, h.mtime_sec, h.mtime_nsec);
+  if (!hashFile(file, h.hash))
+    return nullptr;
+
+  // the one parse of the file
+  SnowTools::GRC grc;
+  grc.regionFileToGRV(file, 0, m_hdr);
+  for (auto& gr : grc)
+    idx->add(gr.chr, std::max(0, gr.pos1 - pad), gr.pos2 + pad);
+  idx->build();
+
+  std::string out((const char*)&h, sizeof(h));
+  idx->serialize(out);
+
+  std::string tmp = p + ".tmp." + std::to_string(getpid());
+  FILE* fp = fopen(tmp.c_str(), "wb");
+  bool ok = fp && fwrite(out.data(), 1, out.size(), fp) == out.size();
+  if (fp)
+    ok = fclose(fp) == 0 && ok;
+  if (!ok || rename(tmp.c_str(), p.c_str()) != 0) {
+    std::cerr << "WARNING: Could not write region cache " << p << std::endl;
+    unlink(tmp.c_str());
+    return idx;
+  }
+
+  // map what was written, so this run shares its pages with the ones after it
+  std::shared_ptr<IntervalIndex> mapped(new IntervalIndex);
+  return load(p, file, pad, *mapped) ? mapped : idx;
+}
@@ -0,0 +1,65 @@
+#ifndef VARIANT_REGION_CACHE_H__
+#define VARIANT_REGION_CACHE_H__
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "htslib/sam.h"
+
+#include "IntervalIndex.h"
+
+/** -k region files kept pre-parsed in a directory (--region-cache).
+ *
+ * The first run to use a file parses it and writes its cache: a short
+ * header, then the file's intervals, padded, sorted and merged per
+ * chromosome, as an IntervalIndex block. Later runs map the cache
+ * read-only and query it where it lies, so loading a panel costs the
+ * same whatever its size, and the jobs on a node share its pages.
+ *
+ * A cache is named after the path of the region file, the pad and the
+ * contigs of the BAM header. It is used while the region file keeps the
+ * size and modification time it had when the cache was made, or failing
+ * that the same contents (by hash); otherwise it is made again. It is
+ * written to a temporary file and renamed into place, so runs sharing a
+ * directory never see half of one.
+ */
+class RegionCache
+{
+ public:
+
+  /** Keep caches in dir, for BAMs with the contigs of h */
+  RegionCache(const std::string& dir, bam_hdr_t* h);
+
+  /** The intervals of file, each widened by pad on both sides. Null
+   * if file can't be read */
+  std::shared_ptr<const IntervalIndex> get(const std::string& file, int pad);
+
+  /** Caches used as they were, and region files parsed */
+  uint64_t hits() const { return m_hits; }
+  uint64_t misses() const { return m_misses; }
+
+  /** 64-bit hash of a file's contents. false if it can't be read */
+  static bool hashFile(const std::string& file, uint64_t& hash);
+
+  /** 64-bit hash of n bytes, carrying on from seed */
+  static uint64_t hashBytes(const void* data, size_t n, uint64_t seed);
+
+ private:
+
+  // where the cache of file and pad goes
+  std::string path(const std::string& file, int pad) const;
+
+  // map the cache at p into idx, if it is good for file
+  bool load(const std::string& p, const std::string& file, int pad, IntervalIndex& idx);
+
+  std::string m_dir;
+  bam_hdr_t* m_hdr;
+  uint64_t m_contigs;  // hash of the contig names and lengths
+
+  uint64_t m_hits = 0;
+  uint64_t m_misses = 0;
+
+};
+#endif
@@ -0,0 +1,108 @@
+#include "RouteScript.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+
+// take the trailing >file off a line
+static std::string takeTarget(std::string& line)
+{
+  size_t gt = line.rfind('>');
+  if (gt == std::string::npos)
+    return "";
+
+  std::string file = line.substr(gt + 1);
+  line.erase(gt);
+  file.erase(0, file.find_first_not_of(" \t"));
+  file.erase(file.find_last_not_of(" \t") + 1);
+  line.erase(line.find_last_not_of(" \t") + 1);
+  return file;
+}
+
+RouteScript::RouteScript(const std::string& rules)
+{
+  std::vector<bool> used(1, false);
+
+  // the region block being read, and the outputs that have its region line
+  std::string region;
+  size_t region_out = 0;
+  std::vector<bool> has_region;
+  bool region_rules = false;
+
+  auto endRegion = [&]() {
+    if (region.length() && !region_rules) {
+      addLine(region_out, region);
+      used[region_out] = true;
+    }
+  };
+
+  std::istringstream iss(rules);
+  std::string line;
+  while (std::getline(iss, line, '%')) {
+    std::string file = takeTarget(line);
+    if (line.empty())
+      continue;
+    if (m_merged.length())
+      m_merged += "%";
+    m_merged += line;
+
+    size_t out = output(file);
+    used.resize(m_outputs.size(), false);
+
+    if (line.find("global@") != std::string::npos) {
+      if (file.length()) {
+	std::cerr << "ERROR: global@ applies to every output and can't be sent to " << file << std::endl;
+	exit(EXIT_FAILURE);
+      }
+      m_globals.push_back(line);
+      for (size_t i = 0; i < m_scripts.size(); ++i)
+	addLine(i, line);
+    } else if (line.find("region@") != std::string::npos) {
+      endRegion();
+      region = line;
+      region_out = out;
+      has_region.assign(m_outputs.size(), false);
+      region_rules = false;
+    } else {
+      // a rule goes where its region goes, unless it says otherwise
+      if (file.empty())
+	out = region_out;
+      has_region.resize(m_outputs.size(), false);
+      if (region.length() && !has_region[out]) {
+	addLine(out, region);
+	has_region[out] = true;
+      }
+      addLine(out, line);
+      used[out] = true;
+      region_rules = true;
+    }
+  }
+  endRegion();
+
+  // an output with only global@ lines keeps nothing
+  for (size_t i = 0; i < m_scripts.size(); ++i)
+    if (!used[i])
+      m_scripts[i].clear();
+}
+
+size_t RouteScript::output(const std::string& file)
+{
+  for (size_t i = 0; i < m_outputs.size(); ++i)
+    if (m_outputs[i] == file)
+      return i;
+
+  // a new output starts with the global@ lines so far, which apply to everything below them
+  m_outputs.push_back(file);
+  m_scripts.push_back("");
+  for (auto& g : m_globals)
+    addLine(m_scripts.size() - 1, g);
+  return m_outputs.size() - 1;
+}
+
+void RouteScript::addLine(size_t out, const std::string& line)
+{
+  std::string& s = m_scripts[out];
+  if (s.length())
+    s += "%";
+  s += line;
+}
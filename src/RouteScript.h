@@ -0,0 +1,52 @@
+#ifndef VARIANT_ROUTE_SCRIPT_H__
+#define VARIANT_ROUTE_SCRIPT_H__
+
+#include <string>
+#include <vector>
+
+/** Split a rules script (lines separated by %) by output, so one walk
+ * can fill several BAMs.
+ *
+ * A region line or a rule line ending in >file sends its reads to that
+ * file: a region line for every rule of its block, a rule line for that
+ * rule alone. Untagged lines go to the main output. Each output gets a
+ * script of its own, with the region line of every rule it takes and
+ * every global@ line, in the order they came. A region block with no
+ * rules (which keeps everything) stays whole in its region's output.
+ */
+class RouteScript
+{
+ public:
+
+  RouteScript() {}
+
+  /** Split the script. Exits if a global@ line is routed, as it applies to every output */
+  explicit RouteScript(const std::string& rules);
+
+  /** True if any line was sent to another output */
+  bool routed() const { return m_outputs.size() > 1; }
+
+  /** Output files, "" first for the main output */
+  const std::vector<std::string>& outputs() const { return m_outputs; }
+
+  /** The script of each output, in the order of outputs(). Empty if
+   * no rule goes there */
+  const std::vector<std::string>& scripts() const { return m_scripts; }
+
+  /** The whole script without the >file tags: what any output keeps */
+  const std::string& merged() const { return m_merged; }
+
+ private:
+
+  // index of the output, added if new
+  size_t output(const std::string& file);
+
+  void addLine(size_t out, const std::string& line);
+
+  std::vector<std::string> m_outputs = {""};
+  std::vector<std::string> m_scripts = {""};
+  std::vector<std::string> m_globals;
+  std::string m_merged;
+
+};
+#endif
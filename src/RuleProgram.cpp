@@ -0,0 +1,333 @@
+#include "RuleProgram.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+
+// add the bits a flag condition pins down. on_set is the value the bit
+// has when the condition is "on"
+static void addFlag(const SnowTools::Flag& f, uint16_t bit, bool on_set, uint16_t& mask, uint16_t& want)
+{
+  if (f.isNA())
+    return;
+  bool set = f.isOn() ? on_set : !on_set;
+  mask |= bit;
+  if (set)
+    want |= bit;
+}
+
+void RuleProgram::shareGates(const RuleProgram& p)
+{
+  m_shared.clear();
+  for (auto& g : p.m_gates) {
+    if (m_shared.size() <= g.block)
+      m_shared.resize(g.block + 1);
+    m_shared[g.block] = g;
+  }
+}
+
+void RuleProgram::compile(SnowTools::MiniRulesCollection* mr)
+{
+  m_mr = mr;
+  m_steps.clear();
+  m_gates.clear();
+  m_shared_gates = 0;
+  m_filter = mr && mr->m_regions.size();
+
+  if (!mr)
+    return;
+
+  int region = 0;
+  for (auto& reg : mr->m_regions) {
+    ++region;
+
+    // an exclude region keeps reads that fail it. can't be ruled out here
+    if (reg.excluder)
+      m_filter = false;
+
+    int gate = -1;
+    if (!reg.m_whole_genome) {
+      gate = m_gates.size();
+      m_gates.push_back(Gate());
+      Gate& g = m_gates.back();
+      g.block = region - 1;
+      g.mate = reg.m_applies_to_mate;
+      g.pad = reg.pad;
+      if (g.block < m_shared.size() && m_shared[g.block].index) {
+	g.index = m_shared[g.block].index;
+	++m_shared_gates;
+      } else {
+	std::shared_ptr<IntervalIndex> idx(new IntervalIndex);
+	for (auto& gr : reg.m_grv)
+	  idx->add(gr.chr, gr.pos1, gr.pos2);
+	idx->build();
+	g.index = idx;
+      }
+    }
+
+    // a region with no rules keeps everything in it, so only the region is tested
+    if (reg.m_abstract_rules.empty()) {
+      Step s;
+      s.gate = gate;
+      s.region = region;
+      if (gate < 0)
+	m_filter = false;
+      m_steps.push_back(s);
+    }
+
+    int rule = 0;
+    for (auto& ar : reg.m_abstract_rules) {
+      Step s;
+      s.gate = gate;
+      s.region = region;
+      s.rule = ++rule;
+      const SnowTools::FlagRule& fr = ar.fr;
+      addFlag(fr.dup,             BAM_FDUP,           true,  s.mask, s.want);
+      addFlag(fr.supp,            BAM_FSUPPLEMENTARY, true,  s.mask, s.want);
+      addFlag(fr.qcfail,          BAM_FQCFAIL,        true,  s.mask, s.want);
+      addFlag(fr.mapped,          BAM_FUNMAP,         false, s.mask, s.want);
+      addFlag(fr.mate_mapped,     BAM_FMUNMAP,        false, s.mask, s.want);
+      addFlag(fr.fwd_strand,      BAM_FREVERSE,       false, s.mask, s.want);
+      addFlag(fr.rev_strand,      BAM_FREVERSE,       true,  s.mask, s.want);
+      addFlag(fr.mate_fwd_strand, BAM_FMREVERSE,      false, s.mask, s.want);
+      addFlag(fr.mate_rev_strand, BAM_FMREVERSE,      true,  s.mask, s.want);
+
+      if (!ar.mapq.isEvery()) {
+	s.has_mapq = true;
+	s.mapq = ar.mapq;
+      }
+
+      // with an inverted phred range there's no trimming bound, only the read
+      if (!ar.phred.isEvery() && !ar.phred.inverted)
+	s.phred = ar.phred.min;
+
+      // all but isize only give a bound, which is only of use one way
+      if (!ar.isize.isEvery())
+	s.checks.push_back({CHECK_ISIZE, ar.isize});
+      if (!ar.len.isEvery() && (ar.len.inverted ? ar.len.min <= 0 : ar.len.min > 0))
+	s.checks.push_back({CHECK_LEN, ar.len});
+      if (!ar.ins.isEvery() && !ar.ins.inverted)
+	s.checks.push_back({CHECK_INS, ar.ins});
+      if (!ar.del.isEvery() && !ar.del.inverted)
+	s.checks.push_back({CHECK_DEL, ar.del});
+      if (!ar.clip.isEvery() && !ar.clip.inverted && ar.clip.min > 0)
+	s.checks.push_back({CHECK_CLIP, ar.clip});
+      if (!ar.nbases.isEvery() && !ar.nbases.inverted && ar.nbases.min > 0)
+	s.checks.push_back({CHECK_NBASES, ar.nbases});
+      if (!ar.xp.isEvery() && !ar.xp.inverted && ar.xp.min > 0)
+	s.checks.push_back({CHECK_XP, ar.xp});
+
+      // a hit anywhere in the read is needed for a hit in the trimmed read.
+      // an inverted motif could pass on the trimmed read alone, so it isn't checked.
+      // the rule only looks at the forward strand, so the automaton leaves out the rest
+      if (ar.atm_file.length() && !ar.atm_inv) {
+	s.motif = MotifMatcher::shared(ar.atm_file, MotifMatcher::FORWARD);
+	if (s.motif && s.motif->exact())
+	  s.checks.push_back({CHECK_MOTIF, SnowTools::Range()});
+	else
+	  s.motif.reset();
+      }
+
+      std::stable_sort(s.checks.begin(), s.checks.end(),
+		       [](const Check& a, const Check& b) { return a.type < b.type; });
+
+      // a step with nothing to test passes every read
+      if (!s.mask && !s.has_mapq && s.gate < 0 && s.checks.empty())
+	m_filter = false;
+
+      m_steps.push_back(s);
+    }
+  }
+
+  m_gate_state.assign(m_gates.size(), GATE_UNKNOWN);
+  if (m_prof)
+    m_step_prof.assign(m_steps.size(), StepProfile());
+}
+
+void RuleProgram::setProfile(StageProfiler* p)
+{
+  m_prof = p;
+  m_step_prof.clear();
+  if (m_prof)
+    m_step_prof.resize(m_steps.size());
+}
+
+bool RuleProgram::mightPassProfiled(const bam1_t* b)
+{
+  const bool timed = m_prof->timed();
+  const uint64_t start = timed ? StageProfiler::now() : 0;
+
+  const uint16_t flag = b->core.flag;
+  const int mapq = b->core.qual;
+  m_features.reset(b);
+  std::fill(m_gate_state.begin(), m_gate_state.end(), (uint8_t)GATE_UNKNOWN);
+
+  bool pass = false;
+  uint64_t t = start;
+  for (size_t i = 0; i < m_steps.size() && !pass; ++i) {
+    Step& s = m_steps[i];
+    StepProfile& p = m_step_prof[i];
+    ++p.evaluated;
+
+    pass = (flag & s.mask) == s.want && (!s.has_mapq || s.mapq.isValid(mapq));
+    if (pass && s.gate >= 0) {
+      // the first step of a region block does its lookup, the rest reuse it
+      if (timed && m_gate_state[s.gate] == GATE_UNKNOWN) {
+	uint64_t g = StageProfiler::now();
+	pass = inGate(s.gate, b);
+	m_prof->add(StageProfiler::STAGE_REGION_LOOKUP, StageProfiler::now() - g);
+      } else {
+	pass = inGate(s.gate, b);
+      }
+    }
+    pass = pass && checksPass(s, b);
+    if (pass)
+      ++p.passed;
+    if (timed) {
+      uint64_t n = StageProfiler::now();
+      p.ns += n - t;
+      ++p.timed;
+      t = n;
+    }
+  }
+
+  if (timed)
+    m_prof->add(StageProfiler::STAGE_PREFILTER, t - start);
+  return pass;
+}
+
+CoreFilter RuleProgram::coreFilter() const
+{
+  CoreFilter f;
+  if (!m_filter || m_steps.empty())
+    return f;
+
+  // flag bits that every step tests, and wants the same value of
+  f.mask = 0xffff;
+  for (auto& s : m_steps)
+    f.mask &= s.mask & ~(s.want ^ m_steps[0].want);
+  f.want = m_steps[0].want & f.mask;
+
+  // a range only bounds the value if every step has one that isn't inverted.
+  // the filter then takes the hull, which holds whatever any of them holds
+  f.has_mapq = f.has_isize = f.placed = true;
+  f.mapq_min = f.isize_min = INT_MAX;
+  f.mapq_max = f.isize_max = INT_MIN;
+  for (auto& s : m_steps) {
+    if (s.has_mapq && !s.mapq.inverted) {
+      f.mapq_min = std::min(f.mapq_min, s.mapq.min);
+      f.mapq_max = std::max(f.mapq_max, s.mapq.max);
+    } else {
+      f.has_mapq = false;
+    }
+
+    auto c = std::find_if(s.checks.begin(), s.checks.end(), [](const Check& c) { return c.type == CHECK_ISIZE; });
+    if (c != s.checks.end() && !c->range.inverted) {
+      f.isize_min = std::min(f.isize_min, c->range.min);
+      f.isize_max = std::max(f.isize_max, c->range.max);
+    } else {
+      f.has_isize = false;
+    }
+
+    if (s.gate < 0)
+      f.placed = false;
+  }
+
+  f.active = f.mask || f.has_mapq || f.has_isize || f.placed;
+  return f;
+}
+
+bool RuleProgram::overlapsGate(Gate& g, const bam1_t* b)
+{
+  // widen by the pad and a base each side, so that whatever span the
+  // full rules use for the read (or its mate) is inside the one tested
+  const bam1_core_t& c = b->core;
+  int32_t end = std::max((int32_t)bam_endpos(b), c.pos + 1);
+  if (g.index->overlaps(g.read_cursor, c.tid, c.pos - g.pad - 1, end + g.pad))
+    return true;
+  if (!g.mate)
+    return false;
+  int32_t span = std::max(end - c.pos, c.l_qseq);
+  return g.index->overlaps(g.mate_cursor, c.mtid, c.mpos - g.pad - 1, c.mpos + span + g.pad);
+}
+
+bool RuleProgram::checksPass(Step& s, const bam1_t* b)
+{
+  for (auto& c : s.checks) {
+    switch (c.type) {
+    case CHECK_ISIZE:
+      if (!c.range.isValid(std::abs(b->core.isize)))
+	return false;
+      break;
+    case CHECK_LEN:
+      {
+	// the length after trimming is at most this
+	int len = s.phred >= 0 ? m_features.trimmedEnd(s.phred) : b->core.l_qseq;
+	if (c.range.inverted ? len <= c.range.max : len < c.range.min)
+	  return false;
+      }
+      break;
+    case CHECK_INS:
+      // the rule keeps a read if any one I operation is in the range, so
+      // only a read whose longest one is too short (or with none) fails
+      if (m_features.maxInsOp() == 0 || m_features.maxInsOp() < c.range.min)
+	return false;
+      break;
+    case CHECK_DEL:
+      if (m_features.maxDelOp() == 0 || m_features.maxDelOp() < c.range.min)
+	return false;
+      break;
+    case CHECK_CLIP:
+      {
+	// trimming only takes bases away from the clips. nothing past
+	// the trimmed end is left, so at most this much soft clip is
+	int clip = m_features.clipBases();
+	if (s.phred >= 0) {
+	  int end = m_features.trimmedEnd(s.phred);
+	  clip = m_features.hardClipBases() + std::min(m_features.softClipLeft(), end)
+	    + std::max(0, end - (b->core.l_qseq - m_features.softClipRight()));
+	}
+	if (clip < c.range.min)
+	  return false;
+      }
+      break;
+    case CHECK_NBASES:
+      // the rules count the Ns of the trimmed read, which has at most these
+      if (m_features.nBases() < c.range.min)
+	return false;
+      break;
+    case CHECK_XP:
+      if (!m_features.hasAltTags())
+	return false;
+      break;
+    case CHECK_MOTIF:
+      if (!m_features.hasMotif(*s.motif))
+	return false;
+      break;
+    }
+  }
+  return true;
+}
+
+std::ostream& operator<<(std::ostream& out, const RuleProgram& p)
+{
+  out << "Rule program: " << p.m_steps.size() << " steps, prefilter " << (p.m_filter ? "ON" : "OFF");
+  for (size_t i = 0; i < p.m_steps.size(); ++i) {
+    const RuleProgram::Step& s = p.m_steps[i];
+    out << std::endl << "  " << i << ": flag & 0x" << std::hex << s.mask << " == 0x" << s.want << std::dec;
+    if (s.gate >= 0) {
+      const RuleProgram::Gate& g = p.m_gates[s.gate];
+      out << " && in " << g.index->size() << " intervals" << (g.mate ? " (or mate)" : "");
+    }
+    if (s.has_mapq)
+      out << " && mapq " << (s.mapq.inverted ? "!" : "") << "[" << s.mapq.min << "," << s.mapq.max << "]";
+    static const char* names[] = {"isize", "len", "ins", "del", "clip", "nbases", "xp", "motif"};
+    for (auto& c : s.checks) {
+      if (c.type == RuleProgram::CHECK_MOTIF)
+	out << " && motif[" << s.motif->size() << " motifs, " << s.motif->states() << " states]";
+      else
+	out << " && " << names[c.type] << (c.range.inverted ? "!" : "") << "[" << c.range.min << "," << c.range.max << "]";
+    }
+  }
+  return out;
+}
@@ -0,0 +1,225 @@
+#ifndef VARIANT_RULE_PROGRAM_H__
+#define VARIANT_RULE_PROGRAM_H__
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+#include "SnowTools/MiniRules.h"
+#include "SnowTools/BamRead.h"
+
+#include "ReadFeatures.h"
+#include "IntervalIndex.h"
+#include "CoreFilter.h"
+#include "StageProfiler.h"
+
+/** A MiniRulesCollection lowered into a flat list of cheap tests that
+ * can prove a read fails every rule without walking the collection.
+ *
+ * Each AbstractRule becomes one step: a single mask test of the BAM
+ * flag word for all of its flag conditions, its mapq range, and then
+ * the rest of its conditions ordered from cheapest to dearest (core
+ * fields, CIGAR, sequence, qualities, tags, motifs). Those that depend
+ * on phred trimming are checked against a bound that the trimmed value
+ * can't exceed. A motif rule scans the packed sequence with a
+ * MotifMatcher shared by every program that uses the same dictionary.
+ * A read passes a step if it might satisfy that rule.
+ * If it passes none of them, no rule can keep it and it is rejected
+ * here, skipping the region lookups and the full rule checks (motif
+ * matching among them). Otherwise the full collection decides, so
+ * results and per-rule counts are exactly those of MiniRulesCollection.
+ *
+ * The values the checks need are shared across all steps through a
+ * ReadFeatures cache, so each is computed at most once per read.
+ *
+ * Steps of a rule that is tied to regions (not WG) are also gated on
+ * the read, or for mlregion its mate, overlapping one of them. Each
+ * region block gets its own IntervalIndex with forward-only cursors,
+ * so on sorted input an off-target read is rejected in amortized O(1)
+ * without the interval tree lookups of the full collection. The
+ * programs of shard walkers share the indexes of the main walker's.
+ *
+ * Collections whose outcome doesn't follow from "some rule passed"
+ * (exclude regions, whole-genome regions with no rules) are not filtered.
+ *
+ * The flag, mapq and isize conditions that all steps share also make
+ * a CoreFilter, which HtsReader can apply to a record before decoding it.
+ *
+ * With setProfile, each step counts how often it is tried and how often
+ * it lets the read through (ending the search), and the reads the
+ * profiler samples are timed step by step. The collection's own rules
+ * are opaque from here, so this is the per-rule cost that can be seen.
+ */
+class RuleProgram
+{
+ public:
+
+  RuleProgram() {}
+
+  /** Build the program for this collection, which must outlive it */
+  void compile(SnowTools::MiniRulesCollection* mr);
+
+  /** Gate the region blocks on the indexes p built, instead of indexing
+   * them again. p must be compiled from the same script. Call before compile */
+  void shareGates(const RuleProgram& p);
+
+  /** Region blocks gated on an index from shareGates */
+  size_t sharedGates() const { return m_shared_gates; }
+
+  /** Same answer as MiniRulesCollection::isValid */
+  bool isValid(SnowTools::BamRead &r) {
+    if (!mightKeep(r))
+      return false;
+    ++m_full;
+    return m_mr->isValid(r);
+  }
+
+  /** False if the program alone shows no rule can keep r. Always true
+   * for a program that doesn't filter */
+  bool mightKeep(SnowTools::BamRead &r) {
+    if (m_filter && !(m_prof ? mightPassProfiled(r.raw()) : mightPass(r.raw()))) {
+      ++m_rejected;
+      return false;
+    }
+    return true;
+  }
+
+  /** Reads rejected by the program alone */
+  uint64_t rejected() const { return m_rejected; }
+
+  /** Reads that went to the full collection */
+  uint64_t evaluated() const { return m_full; }
+
+  /** True if the program can reject reads on its own */
+  bool filters() const { return m_filter; }
+
+  /** What every step asks of the BAM core fields. Inactive unless the
+   * program filters and the steps share at least one condition */
+  CoreFilter coreFilter() const;
+
+  /** The per-read cache, for its hit/miss counts */
+  const ReadFeatures& features() const { return m_features; }
+
+  size_t size() const { return m_steps.size(); }
+
+  /** Count and time the steps, with p sampling the reads to time and
+   * taking the PREFILTER and REGION_LOOKUP stages. p must outlive the
+   * program. Null turns it off */
+  void setProfile(StageProfiler* p);
+
+  struct StepProfile {
+    uint64_t evaluated = 0;  // reads the step was tried on
+    uint64_t passed = 0;     // reads it let through, so no later step was tried
+    uint64_t timed = 0;      // evaluations that were timed
+    uint64_t ns = 0;         // and their time, with any region lookup they did
+
+    /** Time of all evaluations */
+    uint64_t estimatedNs() const { return timed ? (uint64_t)((double)ns / timed * evaluated) : 0; }
+  };
+
+  /** Profile of each step, empty unless profiled */
+  const std::vector<StepProfile>& profile() const { return m_step_prof; }
+
+  /** Region block (from 1, in script order) of step i */
+  int stepRegion(size_t i) const { return m_steps[i].region; }
+
+  /** Rule (from 1, within its region block) of step i. 0 for a region with no rules */
+  int stepRule(size_t i) const { return m_steps[i].rule; }
+
+  friend std::ostream& operator<<(std::ostream& out, const RuleProgram& p);
+
+ private:
+
+  // in order of cost
+  enum CheckType {
+    CHECK_ISIZE,    // range of |isize|
+    CHECK_LEN,      // length, bounded by the read or trimmed length
+    CHECK_INS,      // range of inserted bases
+    CHECK_DEL,      // range of deleted bases
+    CHECK_CLIP,     // clipped bases, bounded by the CIGAR clips
+    CHECK_NBASES,   // range of N bases
+    CHECK_XP,       // needs an XA or XP tag
+    CHECK_MOTIF     // needs a motif of the rule's dictionary
+  };
+
+  struct Check {
+    CheckType type;
+    SnowTools::Range range;
+  };
+
+  struct Step {
+    uint16_t mask = 0;  // flag bits that are tested
+    uint16_t want = 0;  // and the values they must have
+    bool has_mapq = false;
+    SnowTools::Range mapq;
+    int gate = -1;      // index into m_gates, or -1 for whole genome
+    int phred = -1;     // trimming threshold, or -1 if the rule doesn't trim
+    std::vector<Check> checks;
+    std::shared_ptr<const MotifMatcher> motif;
+    int region = 0;
+    int rule = 0;
+  };
+
+  // the intervals of one region block. the index is never changed once
+  // built, so programs on other threads can share it
+  struct Gate {
+    std::shared_ptr<const IntervalIndex> index;
+    size_t block = 0;   // region block, from 0 in script order
+    bool mate = false;  // mlregion: the mate may overlap instead
+    int pad = 0;
+    IntervalIndex::Cursor read_cursor;
+    IntervalIndex::Cursor mate_cursor;
+  };
+
+  enum { GATE_UNKNOWN, GATE_IN, GATE_OUT };
+
+  bool mightPass(const bam1_t* b) {
+    const uint16_t flag = b->core.flag;
+    const int mapq = b->core.qual;
+    m_features.reset(b);
+    std::fill(m_gate_state.begin(), m_gate_state.end(), (uint8_t)GATE_UNKNOWN);
+    for (auto& s : m_steps)
+      if ((flag & s.mask) == s.want && (!s.has_mapq || s.mapq.isValid(mapq))
+	  && (s.gate < 0 || inGate(s.gate, b)) && checksPass(s, b))
+	return true;
+    return false;
+  }
+
+  // mightPass, counting and timing each step
+  bool mightPassProfiled(const bam1_t* b);
+
+  bool inGate(int g, const bam1_t* b) {
+    if (m_gate_state[g] == GATE_UNKNOWN)
+      m_gate_state[g] = overlapsGate(m_gates[g], b) ? GATE_IN : GATE_OUT;
+    return m_gate_state[g] == GATE_IN;
+  }
+
+  bool overlapsGate(Gate& g, const bam1_t* b);
+
+  bool checksPass(Step& s, const bam1_t* b);
+
+  std::vector<Gate> m_gates;
+  std::vector<uint8_t> m_gate_state;
+
+  // from shareGates, by region block
+  std::vector<Gate> m_shared;
+  size_t m_shared_gates = 0;
+
+  ReadFeatures m_features;
+
+  SnowTools::MiniRulesCollection* m_mr = nullptr;
+
+  std::vector<Step> m_steps;
+
+  bool m_filter = false;
+
+  uint64_t m_rejected = 0;
+  uint64_t m_full = 0;
+
+  StageProfiler* m_prof = nullptr;
+  std::vector<StepProfile> m_step_prof;
+
+};
+#endif
@@ -0,0 +1,343 @@
+#include "ShardMerge.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <zlib.h>
+
+static const size_t BGZF_HEADER_SIZE = 18;
+static const size_t BGZF_FOOTER_SIZE = 8;
+
+static inline uint32_t get_le32(const uint8_t* p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24; }
+
+// one BGZF block as it is on disk, and inflated
+struct RawBlock {
+  std::vector<uint8_t> raw;
+  std::vector<uint8_t> data;
+};
+
+// read the next block. false at the end of the file
+static bool readBlock(FILE* fp, const std::string& file, RawBlock& b)
+{
+  uint8_t h[BGZF_HEADER_SIZE];
+  size_t n = fread(h, 1, sizeof(h), fp);
+  if (n == 0)
+    return false;
+
+  // the same header htslib insists on: gzip with one extra field, BC
+  if (n != sizeof(h) || h[0] != 0x1f || h[1] != 0x8b || h[2] != 8 || !(h[3] & 4)
+      || h[10] != 6 || h[11] != 0 || h[12] != 'B' || h[13] != 'C') {
+    std::cerr << "ERROR: " << file << " is not a BGZF-compressed BAM" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  size_t bsize = (h[16] | h[17] << 8) + 1;
+  b.raw.resize(std::max(bsize, BGZF_HEADER_SIZE));
+  memcpy(b.raw.data(), h, sizeof(h));
+  if (bsize < BGZF_HEADER_SIZE + BGZF_FOOTER_SIZE || fread(b.raw.data() + sizeof(h), 1, bsize - sizeof(h), fp) != bsize - sizeof(h)) {
+    std::cerr << "ERROR: " << file << " is truncated" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t crc = get_le32(b.raw.data() + bsize - 8);
+  uint32_t isize = get_le32(b.raw.data() + bsize - 4);
+  b.data.resize(isize);
+  if (!isize)
+    return true;
+
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  bool ok = inflateInit2(&zs, -15) == Z_OK;
+  if (ok) {
+    zs.next_in = b.raw.data() + BGZF_HEADER_SIZE;
+    zs.avail_in = bsize - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+    zs.next_out = b.data.data();
+    zs.avail_out = isize;
+    ok = inflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out == isize;
+    inflateEnd(&zs);
+  }
+  if (!ok || crc != crc32(crc32(0L, NULL, 0L), b.data.data(), isize)) {
+    std::cerr << "ERROR: " << file << " has a damaged BGZF block" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return true;
+}
+
+// length of the BAM header at the start of s, or 0 if s doesn't hold all of it yet.
+// refs is set to the part after the text: the names and lengths of the references
+static size_t headerLength(const std::string& s, const std::string& file, std::string& refs, int32_t& n_ref, uint64_t& max_len)
+{
+  const uint8_t* p = (const uint8_t*)s.data();
+  if (s.size() >= 4 && memcmp(p, "BAM\1", 4) != 0) {
+    std::cerr << "ERROR: " << file << " is not a BAM file" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  size_t pos = 4;
+  if (s.size() < pos + 4)
+    return 0;
+  pos += 4 + get_le32(p + pos);
+  if (s.size() < pos + 4)
+    return 0;
+
+  size_t refs_beg = pos;
+  n_ref = get_le32(p + pos);
+  pos += 4;
+  max_len = 0;
+  for (int32_t i = 0; i < n_ref; ++i) {
+    if (s.size() < pos + 4)
+      return 0;
+    pos += 4 + get_le32(p + pos) + 4;
+    if (s.size() >= pos)
+      max_len = std::max<uint64_t>(max_len, get_le32(p + pos - 4));
+  }
+  if (s.size() < pos)
+    return 0;
+
+  refs = s.substr(refs_beg, pos - refs_beg);
+  return pos;
+}
+
+void ShardMerger::scan(const uint8_t* data, size_t len, uint64_t addr, uint64_t next)
+{
+  size_t p = 0;
+  while (p < len) {
+    if (m_rec.empty())
+      m_rec_beg = addr << 16 | p;
+
+    size_t take = std::min(m_need - m_rec.size(), len - p);
+    m_rec.append((const char*)data + p, take);
+    p += take;
+    if (m_rec.size() < m_need)
+      break;
+
+    const uint8_t* r = (const uint8_t*)m_rec.data();
+    if (m_need == 4) {
+      uint32_t block_size = get_le32(r);
+      if (block_size < 32) {
+	std::cerr << "ERROR: " << m_file << " has a damaged BAM record" << std::endl;
+	exit(EXIT_FAILURE);
+      }
+      m_need += block_size;
+      continue;
+    }
+
+    // a record that ends with its block ends at the start of the next, as bgzf_tell has it
+    uint64_t end = p == len ? next << 16 : addr << 16 | p;
+    int32_t tid = get_le32(r + 4);
+    int32_t pos = get_le32(r + 8);
+    bool mapped = !((get_le32(r + 16) >> 16) & 4);
+    if (!m_index.push(tid, pos, BaiBuilder::recordEnd(r + 4, m_rec.size() - 4), mapped, m_rec_beg, end)) {
+      std::cerr << "ERROR: " << m_file << " has a read before the end of the BAM before it. " << std::endl
+		<< "       Inputs must be sorted, given in coordinate order and must not overlap" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    m_rec.clear();
+    m_need = 4;
+  }
+}
+
+void ShardMerger::mergeBams(const std::vector<std::string>& inputs, const std::string& out, bool index)
+{
+  if (std::find(inputs.begin(), inputs.end(), out) != inputs.end()) {
+    std::cerr << "ERROR: Output " << out << " is also an input" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // level and threads only matter for the blocks where headers end
+  if (!m_out.open(out)) {
+    std::cerr << "ERROR: Could not open " << out << " for writing" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  std::string first_refs;
+  RawBlock b;
+  for (auto& in : inputs) {
+    m_file = in;
+    FILE* fp = fopen(in.c_str(), "rb");
+    if (!fp) {
+      std::cerr << "ERROR: Could not open " << in << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    std::string head;
+    bool in_header = true;
+    while (readBlock(fp, in, b)) {
+
+      // empty blocks, like the EOF marker, are dropped
+      if (b.data.empty())
+	continue;
+
+      if (!in_header) {
+	uint64_t addr = m_out.compressedBytes();
+	m_out.writeRawBlock(b.raw.data(), b.raw.size(), b.data.size());
+	++m_copied;
+	scan(b.data.data(), b.data.size(), addr, m_out.compressedBytes());
+	continue;
+      }
+
+      head.append((const char*)b.data.data(), b.data.size());
+      std::string refs;
+      int32_t n_ref;
+      uint64_t max_len;
+      size_t len = headerLength(head, in, refs, n_ref, max_len);
+      if (!len)
+	continue;
+      in_header = false;
+
+      // the header of the first shard, which the others must agree with on the references
+      if (first_refs.empty()) {
+	first_refs = refs;
+	m_index = BaiBuilder(n_ref, BaiBuilder::depthFor(max_len));
+	m_out.write(head.data(), len);
+	m_out.flush();
+      } else if (refs != first_refs) {
+	std::cerr << "ERROR: " << in << " has different references than " << inputs[0] << std::endl;
+	exit(EXIT_FAILURE);
+      }
+
+      // records after the header in the same block are written to fresh blocks
+      for (size_t p = len; p < head.size(); p += BgzfWriter::BLOCK_SIZE) {
+	size_t n = std::min(head.size() - p, BgzfWriter::BLOCK_SIZE);
+	uint64_t addr = m_out.compressedBytes();
+	m_out.write(head.data() + p, n);
+	m_out.flush();
+	++m_recompressed;
+	scan((const uint8_t*)head.data() + p, n, addr, m_out.compressedBytes());
+      }
+    }
+    fclose(fp);
+
+    if (in_header || m_rec.size()) {
+      std::cerr << "ERROR: " << in << " is truncated" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (m_verbose)
+      std::cerr << "...merged " << in << ", " << m_index.records() << " reads so far" << std::endl;
+  }
+
+  m_out.close();
+
+  if (index && !m_index.write(out + m_index.extension())) {
+    std::cerr << "ERROR: Could not write index " << out << m_index.extension() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+// an integer, which is summed
+static bool isCount(const std::string& s)
+{
+  size_t i = s.size() && s[0] == '-';
+  if (i == s.size())
+    return false;
+  for (; i < s.size(); ++i)
+    if (s[i] < '0' || s[i] > '9')
+      return false;
+  return true;
+}
+
+typedef std::map<std::pair<int64_t, int64_t>, int64_t> Histogram;
+
+// a histogram of min_max_count bins, separated by commas
+static bool parseHistogram(const std::string& s, Histogram& h)
+{
+  std::istringstream iss(s);
+  std::string bin;
+  while (std::getline(iss, bin, ',')) {
+    size_t a = bin.find('_');
+    size_t b = a == std::string::npos ? a : bin.find('_', a + 1);
+    if (b == std::string::npos || !isCount(bin.substr(0, a)) || !isCount(bin.substr(a + 1, b - a - 1)) || !isCount(bin.substr(b + 1)))
+      return false;
+    h[std::make_pair(std::stoll(bin.substr(0, a)), std::stoll(bin.substr(a + 1, b - a - 1)))] += std::stoll(bin.substr(b + 1));
+  }
+  return h.size();
+}
+
+static std::string sumCells(const std::string& a, const std::string& b)
+{
+  if (isCount(a))
+    return std::to_string(std::stoll(a) + std::stoll(b));
+
+  Histogram h;
+  parseHistogram(a, h);
+  parseHistogram(b, h);
+  std::string out;
+  for (auto& i : h)
+    out += (out.empty() ? "" : ",") + std::to_string(i.first.first) + "_" + std::to_string(i.first.second) + "_" + std::to_string(i.second);
+  return out;
+}
+
+void ShardMerger::mergeTables(const std::vector<std::string>& inputs, const std::string& out)
+{
+  std::string header;
+  std::vector<std::vector<std::string> > rows;
+  std::map<std::string, size_t> row_of;
+
+  for (auto& in : inputs) {
+    std::ifstream ifs(in);
+    if (!ifs) {
+      std::cerr << "ERROR: Could not open " << in << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    std::string line;
+    std::getline(ifs, line);
+    if (&in == &inputs[0]) {
+      header = line;
+    } else if (line != header) {
+      std::cerr << "ERROR: " << in << " doesn't have the same header line as " << inputs[0] << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    std::map<std::string, int> seen;
+    while (std::getline(ifs, line)) {
+      if (line.empty())
+	continue;
+
+      std::vector<std::string> cells;
+      std::istringstream iss(line);
+      std::string cell;
+      while (std::getline(iss, cell, '\t'))
+	cells.push_back(cell);
+
+      // a row is named by the cells that aren't summed, and how often that name came up before
+      std::string key;
+      std::vector<bool> summed(cells.size());
+      for (size_t i = 0; i < cells.size(); ++i) {
+	Histogram h;
+	summed[i] = isCount(cells[i]) || parseHistogram(cells[i], h);
+	key += (summed[i] ? std::string(isCount(cells[i]) ? "#" : "%") : "=" + cells[i]) + "\t";
+      }
+      key += std::to_string(seen[key]++);
+
+      auto r = row_of.find(key);
+      if (r == row_of.end()) {
+	row_of[key] = rows.size();
+	rows.push_back(cells);
+	continue;
+      }
+      std::vector<std::string>& row = rows[r->second];
+      for (size_t i = 0; i < cells.size(); ++i)
+	if (summed[i])
+	  row[i] = sumCells(row[i], cells[i]);
+    }
+  }
+
+  std::ofstream ofs(out);
+  if (!ofs) {
+    std::cerr << "ERROR: Could not open " << out << " for writing" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  ofs << header << std::endl;
+  for (auto& row : rows) {
+    for (size_t i = 0; i < row.size(); ++i)
+      ofs << (i ? "\t" : "") << row[i];
+    ofs << std::endl;
+  }
+}
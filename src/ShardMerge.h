@@ -0,0 +1,67 @@
+#ifndef VARIANT_SHARD_MERGE_H__
+#define VARIANT_SHARD_MERGE_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "BaiBuilder.h"
+#include "BgzfWriter.h"
+
+/** Join the outputs of runs on separate regions (variant merge).
+ *
+ * The BAMs must be sorted and given in coordinate order, each one
+ * starting at or after the last read of the one before. Their BGZF
+ * blocks are copied to the output as they are, without recompression.
+ * Only the block where each header ends is recompressed, to drop the
+ * header. Every block is still inflated once to check it and to index
+ * the records, so the index is written in the same pass.
+ */
+class ShardMerger
+{
+ public:
+
+  explicit ShardMerger(bool verbose = false) : m_verbose(verbose) {}
+
+  /** Write the records of inputs, in order, to out under the header of
+   * the first. Writes out.bai (or .csi) too if index. Exits if the inputs don't
+   * have the same references or are out of order */
+  void mergeBams(const std::vector<std::string>& inputs, const std::string& out, bool index);
+
+  /** Add up -c counts or -q qc files from the same rules. Integer cells
+   * and histograms (min_max_count,...) are summed. Rows are matched by
+   * their other cells (the read group, the rule) and the order they come
+   * in. Exits if the header lines differ */
+  static void mergeTables(const std::vector<std::string>& inputs, const std::string& out);
+
+  /** Records written */
+  uint64_t records() const { return m_index.records(); }
+
+  /** Blocks copied as they were */
+  uint64_t blocksCopied() const { return m_copied; }
+
+  /** Blocks recompressed, where headers ended */
+  uint64_t blocksRecompressed() const { return m_recompressed; }
+
+ private:
+
+  // follow records through the data of a block that starts at addr in
+  // the output, with next the address of the block after it
+  void scan(const uint8_t* data, size_t len, uint64_t addr, uint64_t next);
+
+  bool m_verbose;
+
+  BgzfWriter m_out;
+  BaiBuilder m_index;
+  std::string m_file;  // input being merged
+
+  // the record being put together, which can span blocks
+  std::string m_rec;
+  size_t m_need = 4;
+  uint64_t m_rec_beg = 0;
+
+  uint64_t m_copied = 0;
+  uint64_t m_recompressed = 0;
+
+};
+#endif
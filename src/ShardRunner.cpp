@@ -0,0 +1,250 @@
+#include "ShardRunner.h"
+
+#include <algorithm>
+#include <thread>
+
+const int32_t ShardRunner::SHARD_WIDTH;
+const int32_t ShardRunner::COVERAGE_MARGIN;
+const size_t ShardRunner::MAX_QUEUED;
+const size_t ShardRunner::BATCH_SIZE;
+
+std::ostream& operator<<(std::ostream& out, const ReadShard& s)
+{
+  if (s.unplaced)
+    out << "unplaced reads";
+  else if (s.regions.size())
+    out << s.regions[0] << " ... " << s.regions.back() << " (" << s.regions.size() << " regions)";
+  return out;
+}
+
+bool ReadShard::owns(const bam1_t* b, size_t& cursor) const
+{
+  if (unplaced)
+    return true;
+
+  const bam1_core_t& c = b->core;
+  if (has_prev && prev.chr == c.tid && c.pos < prev.pos2)
+    return false;
+
+  // reads come in order of position, so the region to test against only moves on
+  while (cursor < regions.size() &&
+	 (regions[cursor].chr < c.tid || (regions[cursor].chr == c.tid && regions[cursor].pos2 <= c.pos)))
+    ++cursor;
+  return cursor < regions.size() && regions[cursor].chr == c.tid && bam_endpos(b) > regions[cursor].pos1;
+}
+
+// the parts of grv (sorted) within COVERAGE_MARGIN before and after the regions of s
+static void lookAround(const SnowTools::GenomicRegionVector& grv, ReadShard& s)
+{
+  auto before = [](const SnowTools::GenomicRegion& a, const SnowTools::GenomicRegion& b) {
+    return a.chr < b.chr || (a.chr == b.chr && a.pos1 < b.pos1);
+  };
+
+  const SnowTools::GenomicRegion& first = s.regions.front();
+  const int32_t from = first.pos1 - ShardRunner::COVERAGE_MARGIN;
+  size_t i = std::lower_bound(grv.begin(), grv.end(), first, before) - grv.begin();
+  for (; i > 0 && grv[i-1].chr == first.chr && grv[i-1].pos2 > from; --i)
+    s.around.push_back(SnowTools::GenomicRegion(first.chr, std::max(grv[i-1].pos1, from), std::min(grv[i-1].pos2, first.pos1)));
+
+  // the last region of the shard may be the front piece of a longer one
+  const SnowTools::GenomicRegion& last = s.regions.back();
+  const int32_t to = last.pos2 + ShardRunner::COVERAGE_MARGIN;
+  size_t k = std::upper_bound(grv.begin(), grv.end(), SnowTools::GenomicRegion(last.chr, last.pos2 - 1, last.pos2), before) - grv.begin();
+  if (k > 0 && grv[k-1].chr == last.chr && grv[k-1].pos2 > last.pos2)
+    s.around.push_back(SnowTools::GenomicRegion(last.chr, last.pos2, std::min(grv[k-1].pos2, to)));
+  for (; k < grv.size() && grv[k].chr == last.chr && grv[k].pos1 < to; ++k)
+    s.around.push_back(SnowTools::GenomicRegion(last.chr, grv[k].pos1, std::min(grv[k].pos2, to)));
+}
+
+bool ShardRunner::setup(VariantBamWalker& walk)
+{
+  if (!walk.isSorted()) {
+    std::cerr << "WARNING: BAM does not appear to be sorted (no SO:coordinate). Not sharding" << std::endl;
+    return false;
+  }
+
+  if (!walk.m_reader.loadIndex()) {
+    std::cerr << "WARNING: No index found for " << m_bam << ". Not sharding" << std::endl;
+    return false;
+  }
+
+  // regions the single-threaded walk would take. none means whole genome
+  SnowTools::GenomicRegionVector grv = walk.m_reader.regions();
+  bool whole_genome = grv.empty();
+  if (whole_genome) {
+    bam_hdr_t* h = walk.m_reader.header();
+    for (int32_t i = 0; i < h->n_targets; ++i)
+      grv.push_back(SnowTools::GenomicRegion(i, 0, h->target_len[i]));
+  }
+
+  // cut into pieces of at most m_width, and group
+  // neighboring small regions into one shard
+  ReadShard shard;
+  int32_t width = 0;
+  for (auto& gr : grv) {
+    for (int32_t p = gr.pos1; ; p += m_width) {
+      SnowTools::GenomicRegion piece(gr.chr, p, std::min(gr.pos2, p + m_width));
+      shard.regions.push_back(piece);
+      width += piece.pos2 - piece.pos1;
+      if (width >= m_width) {
+	m_shards.push_back(shard);
+	shard = ReadShard();
+	shard.prev = piece;
+	shard.has_prev = true;
+	width = 0;
+      }
+      if (piece.pos2 >= gr.pos2)
+	break;
+    }
+  }
+  if (shard.regions.size())
+    m_shards.push_back(shard);
+
+  if (walk.max_cov != 0)
+    for (auto& sh : m_shards)
+      lookAround(grv, sh);
+
+  if (whole_genome) {
+    ReadShard tail;
+    tail.unplaced = true;
+    m_shards.push_back(tail);
+  }
+
+  return m_shards.size() > 0;
+}
+
+void ShardRunner::push(size_t i, SnowTools::BamReadVector& batch)
+{
+  if (batch.empty())
+    return;
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  // hold back if this shard is too far ahead of the writer
+  m_cv.wait(lock, [&]{ return i == m_head || m_out[i].queued < MAX_QUEUED; });
+  m_out[i].queued += batch.size();
+  m_out[i].batches.push_back(std::move(batch));
+  batch.clear();
+  lock.unlock();
+
+  m_cv.notify_all();
+}
+
+void ShardRunner::worker(VariantBamWalker* main_walk)
+{
+  // only the reader opens the BAM, and the rules were parsed by the main walker
+  VariantBamWalker w;
+  if (!w.m_reader.open(m_bam)) {
+    std::cerr << "ERROR: Could not open " << m_bam << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  w.m_reader.setReference(main_walk->m_reader.reference());
+  w.m_reader.setSeekGap(main_walk->m_reader.seekGap());
+  w.m_reader.setPrefetch(main_walk->m_reader.prefetch());
+  w.m_reader.setPrefetchWindow(main_walk->m_reader.prefetchWindow());
+  w.m_reader.setTimed(main_walk->m_reader.timed());
+  w.copyMiniRulesCollection(*main_walk);
+  w.max_cov = main_walk->max_cov;
+  w.m_seed = main_walk->m_seed;
+  w.m_cov.configure(main_walk->m_cov);
+  if (main_walk->qcOn())
+    w.setQc();
+
+  bool output = main_walk->hasOutput();
+
+  size_t i;
+  while ((i = m_next_shard++) < m_shards.size()) {
+
+    const ReadShard& s = m_shards[i];
+    size_t cursor = 0;
+    w.m_owns = nullptr;
+    if (s.unplaced) {
+      w.m_reader.setUnplaced();
+    } else if (s.around.size()) {
+      // the reads around the shard are read too, and told apart by owns
+      SnowTools::GenomicRegionVector grv = s.regions;
+      grv.insert(grv.end(), s.around.begin(), s.around.end());
+      w.m_reader.setRegions(grv);
+      w.m_owns = [&](const bam1_t* b) { return s.owns(b, cursor); };
+    } else {
+      w.m_reader.setRegions(s.regions);
+      if (s.has_prev)
+	w.m_reader.setPreviousRegion(s.prev);
+    }
+
+    SnowTools::BamReadVector batch;
+    if (output)
+      w.m_sink = [&](SnowTools::BamRead& r) {
+	batch.push_back(r);
+	if (batch.size() >= BATCH_SIZE)
+	  push(i, batch);
+      };
+
+    w.rc_main = SnowTools::ReadCount();
+    w.m_read_allocs = 0;
+    w.writeVariantBam();
+    push(i, batch);
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_out[i].rc = w.rc_main;
+      m_out[i].read_allocs = w.m_read_allocs;
+      m_out[i].done = true;
+    }
+    m_cv.notify_all();
+  }
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  main_walk->m_reader.addInputStats(w.m_reader.inputStats());
+  if (w.qcOn())
+    main_walk->m_qc.merge(w.m_qc);
+}
+
+void ShardRunner::run(VariantBamWalker& walk, bool verbose)
+{
+  m_out = std::vector<ShardOutput>(m_shards.size());
+
+  size_t nthreads = std::min((size_t)m_threads, m_shards.size());
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < nthreads; ++i)
+    workers.push_back(std::thread(&ShardRunner::worker, this, &walk));
+
+  // write the shards back in order, as they come in
+  for (size_t i = 0; i < m_shards.size(); ++i) {
+
+    ShardOutput& out = m_out[i];
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_head = i;
+    }
+    m_cv.notify_all();
+
+    for (;;) {
+      SnowTools::BamReadVector batch;
+      {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_cv.wait(lock, [&]{ return out.batches.size() || out.done; });
+	if (out.batches.empty())
+	  break; // done, and nothing left
+	batch = std::move(out.batches.front());
+	out.batches.pop_front();
+	out.queued -= batch.size();
+      }
+      m_cv.notify_all();
+
+      for (auto& r : batch)
+	walk.writeRead(r);
+    }
+
+    walk.rc_main.total += out.rc.total;
+    walk.rc_main.keep += out.rc.keep;
+    walk.m_read_allocs += out.read_allocs;
+
+    if (verbose)
+      std::cerr << "...finished shard " << (i+1) << " of " << m_shards.size() << ": " << m_shards[i]
+		<< ". Read " << walk.rc_main.totalString() << ", kept " << walk.rc_main.keepString() << std::endl;
+  }
+
+  for (auto& t : workers)
+    t.join();
+}
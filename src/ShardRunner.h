@@ -0,0 +1,112 @@
+#ifndef VARIANT_SHARD_RUNNER_H__
+#define VARIANT_SHARD_RUNNER_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "VariantBamWalker.h"
+
+/** One independent piece of the walk. Reads are owned by the
+ * first region (in sorted order) that they overlap.
+ */
+struct ReadShard {
+
+  SnowTools::GenomicRegionVector regions;
+
+  // last region of the shard before this one
+  SnowTools::GenomicRegion prev;
+  bool has_prev = false;
+
+  // reads with no coordinate, at the end of a sorted file
+  bool unplaced = false;
+
+  // for -m: the regions of the walk just before and after the shard.
+  // their reads are read for the depth near the shard ends, not kept
+  SnowTools::GenomicRegionVector around;
+
+  /** True if b is a read of this shard and not one from around it.
+   * Reads must come in order. cursor starts at 0 */
+  bool owns(const bam1_t* b, size_t& cursor) const;
+
+  friend std::ostream& operator<<(std::ostream& out, const ReadShard& s);
+};
+
+/** Split the walk into shards, filter each shard on its own thread
+ * with its own VariantBamWalker, on a copy of the main walker's rules,
+ * and write the kept reads back in
+ * shard order through the main walker. The output is the same as
+ * a single-threaded walk over the same regions.
+ *
+ * With -m, each shard also reads COVERAGE_MARGIN into the shards on
+ * either side, so the depth its reads are sampled on is the depth a
+ * single walk would see.
+ */
+class ShardRunner
+{
+ public:
+
+  ShardRunner(const std::string& bam, int threads)
+    : m_bam(bam), m_threads(threads) {}
+
+  /** Check that the input can be sharded (sorted and indexed) and
+   * make the shards from the regions of the main walker */
+  bool setup(VariantBamWalker& walk);
+
+  /** Run the workers and write their output through walk */
+  void run(VariantBamWalker& walk, bool verbose);
+
+  /** Cut shards this wide instead of SHARD_WIDTH. Call before setup */
+  void setShardWidth(int32_t width) { m_width = width; }
+
+  size_t size() const { return m_shards.size(); }
+
+  const std::vector<ReadShard>& shards() const { return m_shards; }
+
+  // width of a shard, in bp
+  static const int32_t SHARD_WIDTH = 10000000;
+
+  // with -m, how far past its ends a shard reads for the depth. Enough for
+  // the mates of its reads (CoverageSampler::MAX_PAIR_GAP), and for reads
+  // up to this long
+  static const int32_t COVERAGE_MARGIN = 100000;
+
+  // reads a shard may hold in memory while it waits its turn to be written
+  static const size_t MAX_QUEUED = 200000;
+
+  static const size_t BATCH_SIZE = 1000;
+
+ private:
+
+  struct ShardOutput {
+    std::deque<SnowTools::BamReadVector> batches;
+    size_t queued = 0;
+    bool done = false;
+    SnowTools::ReadCount rc;
+    uint64_t read_allocs = 0;
+  };
+
+  void worker(VariantBamWalker* main_walk);
+
+  void push(size_t i, SnowTools::BamReadVector& batch);
+
+  std::string m_bam;
+  int m_threads;
+  int32_t m_width = SHARD_WIDTH;
+
+  std::vector<ReadShard> m_shards;
+  std::vector<ShardOutput> m_out;
+
+  std::atomic<size_t> m_next_shard{0};
+
+  // shard currently being written
+  size_t m_head = 0;
+
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+
+};
+#endif
@@ -0,0 +1,336 @@
+#include "SimBam.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <queue>
+
+#include "BamOutput.h"
+#include "BaiBuilder.h"
+
+static const char BASES[] = "ACGT";
+
+std::string SimBam::reference(int i) const
+{
+  // a stream of its own per chromosome, so each is the same whatever the others are
+  Rng rng(m_opt.seed * 1000003 + i);
+  std::string ref(m_opt.chr_length, 'A');
+  for (int32_t p = 0; p < m_opt.chr_length; p += 32) {
+    uint64_t r = rng.next();
+    for (int32_t k = p; k < std::min(p + 32, m_opt.chr_length); ++k, r >>= 2)
+      ref[k] = BASES[r & 3];
+  }
+  return ref;
+}
+
+int32_t SimBam::makeCigar(Rng& rng, std::vector<uint32_t>& cigar, int& nm)
+{
+  const int len = m_opt.read_length;
+  cigar.clear();
+  nm = 0;
+
+  if (len > 40 && rng.chance(m_opt.clipped)) {
+    int clip = 5 + rng.below(26);
+    if (rng.chance(0.5)) {
+      cigar.push_back(clip << BAM_CIGAR_SHIFT | BAM_CSOFT_CLIP);
+      cigar.push_back((len - clip) << BAM_CIGAR_SHIFT | BAM_CMATCH);
+    } else {
+      cigar.push_back((len - clip) << BAM_CIGAR_SHIFT | BAM_CMATCH);
+      cigar.push_back(clip << BAM_CIGAR_SHIFT | BAM_CSOFT_CLIP);
+    }
+    return len - clip;
+  }
+
+  if (len > 40 && rng.chance(m_opt.indel)) {
+    int at = 10 + rng.below(len - 30);
+    int n = 1 + rng.below(5);
+    nm = n;
+    cigar.push_back(at << BAM_CIGAR_SHIFT | BAM_CMATCH);
+    if (rng.chance(0.5)) {
+      cigar.push_back(n << BAM_CIGAR_SHIFT | BAM_CINS);
+      cigar.push_back((len - at - n) << BAM_CIGAR_SHIFT | BAM_CMATCH);
+      return len - n;
+    }
+    cigar.push_back(n << BAM_CIGAR_SHIFT | BAM_CDEL);
+    cigar.push_back((len - at) << BAM_CIGAR_SHIFT | BAM_CMATCH);
+    return len + n;
+  }
+
+  cigar.push_back(len << BAM_CIGAR_SHIFT | BAM_CMATCH);
+  return len;
+}
+
+static void auxInt(std::string& aux, const char* tag, int32_t v)
+{
+  aux.append(tag, 2);
+  aux += 'i';
+  aux.append((const char*)&v, 4);
+}
+
+static void auxString(std::string& aux, const char* tag, const std::string& v)
+{
+  aux.append(tag, 2);
+  aux += 'Z';
+  aux.append(v.c_str(), v.size() + 1);
+}
+
+void SimBam::pack(bam1_t* b, int32_t tid, const SimRead& r, const std::string& ref)
+{
+  Rng rng(r.seed);
+  const int len = m_opt.read_length;
+
+  // bases from the reference where the read aligns, random elsewhere
+  m_seq.clear();
+  if (r.flag & BAM_FUNMAP) {
+    for (int i = 0; i < len; ++i)
+      m_seq += BASES[rng.below(4)];
+  } else {
+    int32_t p = r.pos;
+    for (auto c : r.cigar) {
+      int op = bam_cigar_op(c), n = bam_cigar_oplen(c);
+      if (op == BAM_CMATCH)
+	m_seq.append(ref, p, n);
+      else if (op == BAM_CINS || op == BAM_CSOFT_CLIP)
+	for (int i = 0; i < n; ++i)
+	  m_seq += BASES[rng.below(4)];
+      if (op == BAM_CMATCH || op == BAM_CDEL)
+	p += n;
+    }
+  }
+
+  // qualities that fall off along the read, with a low tail now and then
+  m_qual.resize(len);
+  int tail = rng.chance(0.1) ? len - 1 - rng.below(len / 2) : len;
+  for (int i = 0; i < len; ++i)
+    m_qual[i] = i >= tail ? 2 : 41 - (int)(10.0 * i / len) - rng.below(8);
+
+  m_aux.clear();
+  auxString(m_aux, "RG", "sim");
+  auxInt(m_aux, "NM", r.nm);
+  if (m_opt.tags > 0) {
+    std::string oq(len, 0);
+    for (int i = 0; i < len; ++i)
+      oq[i] = 33 + std::max(2, m_qual[i] + (int)rng.below(7) - 3);
+    auxString(m_aux, "OQ", oq);
+  }
+  for (int t = 1; t < std::min(m_opt.tags, 3); ++t) {
+    std::string bq(len, 'N');
+    for (int i = 0; i < len; ++i)
+      bq[i] = 'A' + rng.below(26);
+    auxString(m_aux, t == 1 ? "BD" : "BI", bq);
+  }
+
+  char name[48];
+  int l_name = snprintf(name, sizeof(name), "sim:%d:%llu", tid + 1, (unsigned long long)r.name) + 1;
+
+  bam1_core_t& c = b->core;
+  c.tid = tid;
+  c.pos = r.pos;
+  c.qual = r.mapq;
+  c.l_qname = l_name;
+  c.flag = r.flag;
+  c.n_cigar = r.cigar.size();
+  c.l_qseq = len;
+  c.mtid = tid;
+  c.mpos = r.mpos;
+  c.isize = r.isize;
+  int32_t end = r.pos + 1;
+  if (!(r.flag & BAM_FUNMAP)) {
+    end = r.pos;
+    for (auto op : r.cigar)
+      if (bam_cigar_type(bam_cigar_op(op)) & 2)
+	end += bam_cigar_oplen(op);
+  }
+  c.bin = BaiBuilder::reg2bin(r.pos, std::max(end, r.pos + 1));
+
+  b->l_data = l_name + 4 * r.cigar.size() + (len + 1) / 2 + len + m_aux.size();
+  if (b->m_data < b->l_data) {
+    b->m_data = b->l_data;
+    b->data = (uint8_t*)realloc(b->data, b->m_data);
+  }
+  memcpy(b->data, name, l_name);
+  memcpy(bam_get_cigar(b), r.cigar.data(), 4 * r.cigar.size());
+  uint8_t* s = bam_get_seq(b);
+  memset(s, 0, (len + 1) / 2);
+  for (int i = 0; i < len; ++i) {
+    // 4-bit codes of A, C, G, T
+    static const uint8_t code[] = {1, 2, 4, 8};
+    s[i >> 1] |= code[strchr(BASES, m_seq[i]) - BASES] << ((~i & 1) << 2);
+  }
+  memcpy(bam_get_qual(b), m_qual.data(), len);
+  memcpy(bam_get_aux(b), m_aux.data(), m_aux.size());
+}
+
+bam_hdr_t* SimBam::makeHeader() const
+{
+  bam_hdr_t* h = bam_hdr_init();
+  std::string text = "@HD\tVN:1.4\tSO:coordinate\n";
+  h->n_targets = m_opt.chromosomes;
+  h->target_len = (uint32_t*)malloc(h->n_targets * sizeof(uint32_t));
+  h->target_name = (char**)malloc(h->n_targets * sizeof(char*));
+  for (int i = 0; i < h->n_targets; ++i) {
+    h->target_len[i] = m_opt.chr_length;
+    h->target_name[i] = strdup(chrName(i).c_str());
+    text += "@SQ\tSN:" + chrName(i) + "\tLN:" + std::to_string(m_opt.chr_length) + "\n";
+  }
+  text += "@RG\tID:sim\tSM:sim\n";
+  h->text = strdup(text.c_str());
+  h->l_text = text.size();
+  return h;
+}
+
+bool SimBam::writeBam(const std::string& file)
+{
+  m_reads = m_discordant = m_clipped = m_duplicates = m_unmapped = 0;
+
+  bam_hdr_t* h = makeHeader();
+  BamOutput out;
+  if (!out.open(file, h, m_opt.level, 0, true)) {
+    bam_hdr_destroy(h);
+    return false;
+  }
+
+  const int len = m_opt.read_length;
+  bam1_t* b = bam_init1();
+  Rng rng(m_opt.seed);
+  uint64_t order = 0, name = 0;
+
+  for (int tid = 0; tid < m_opt.chromosomes; ++tid) {
+    const std::string ref = reference(tid);
+
+    // reads of pairs whose first read is out, waiting for their place
+    std::priority_queue<SimRead, std::vector<SimRead>, std::greater<SimRead> > pending;
+    auto flushTo = [&](int32_t pos) {
+      while (pending.size() && pending.top().pos <= pos) {
+	const SimRead& r = pending.top();
+	pack(b, tid, r, ref);
+	out.write(b);
+	++m_reads;
+	m_duplicates += (r.flag & BAM_FDUP) != 0;
+	m_unmapped += (r.flag & BAM_FUNMAP) != 0;
+	m_discordant += (r.flag & (BAM_FREAD1 | BAM_FMUNMAP | BAM_FPROPER_PAIR)) == BAM_FREAD1;
+	m_clipped += r.cigar.size() == 2 && (bam_cigar_op(r.cigar[0]) == BAM_CSOFT_CLIP || bam_cigar_op(r.cigar[1]) == BAM_CSOFT_CLIP);
+	pending.pop();
+      }
+    };
+
+    // pairs start a mean gap apart, so the reads add up to the depth
+    double gap = 2.0 * len / m_opt.depth;
+    double at = 0;
+    for (;;) {
+      at += gap * 2 * rng.uniform();
+      int32_t pos = (int32_t)at;
+      if (pos + len >= m_opt.chr_length)
+	break;
+
+      SimRead r1, r2;
+      makeCigar(rng, r1.cigar, r1.nm);
+      int32_t span2 = makeCigar(rng, r2.cigar, r2.nm);
+      int32_t isize = m_opt.isize - 100 + rng.below(201);
+      bool same_strand = false;
+      if (rng.chance(m_opt.discordant)) {
+	if (rng.chance(0.5))
+	  isize = 5000 + rng.below(100000);
+	else
+	  same_strand = true;
+      }
+      int32_t mpos = pos + std::max(0, isize - span2);
+      if (mpos + span2 >= m_opt.chr_length)
+	continue;
+
+      bool unmapped = rng.chance(m_opt.unmapped);
+      int copies = rng.chance(m_opt.duplicate) ? 2 : 1;
+      for (int copy = 0; copy < copies; ++copy) {
+	uint16_t dup = copy ? BAM_FDUP : 0;
+	r1.pos = pos;
+	r1.name = r2.name = ++name;
+	r1.seed = rng.next();
+	r2.seed = rng.next();
+	r1.mapq = rng.chance(m_opt.mapq0) ? 0 : 60;
+	r2.mapq = rng.chance(m_opt.mapq0) ? 0 : 60;
+	if (unmapped) {
+	  // the unmapped mate takes the place of the mapped one
+	  r1.flag = BAM_FPAIRED | BAM_FMUNMAP | BAM_FREAD1 | dup;
+	  r1.mpos = pos;
+	  r1.isize = 0;
+	  r2.flag = BAM_FPAIRED | BAM_FUNMAP | BAM_FREAD2 | dup;
+	  r2.pos = r2.mpos = pos;
+	  r2.isize = 0;
+	  r2.mapq = 0;
+	  r2.nm = 0;
+	  r2.cigar.clear();
+	} else {
+	  uint16_t proper = same_strand || isize > 1000 ? 0 : BAM_FPROPER_PAIR;
+	  uint16_t rev2 = same_strand ? 0 : BAM_FREVERSE;
+	  r1.flag = BAM_FPAIRED | proper | BAM_FREAD1 | (rev2 ? BAM_FMREVERSE : 0) | dup;
+	  r2.flag = BAM_FPAIRED | proper | BAM_FREAD2 | rev2 | dup;
+	  r2.pos = r1.mpos = mpos;
+	  r2.mpos = pos;
+	  r1.isize = mpos + span2 - pos;
+	  r2.isize = -r1.isize;
+	}
+	r1.order = order++;
+	r2.order = order++;
+	flushTo(pos);
+	pending.push(r1);
+	pending.push(r2);
+      }
+    }
+    flushTo(INT32_MAX);
+  }
+
+  out.close();
+  bam_destroy1(b);
+  bam_hdr_destroy(h);
+  return out.indexFile().length();
+}
+
+bool SimBam::writeVcf(const std::string& file)
+{
+  std::ofstream ofs(file);
+  if (!ofs)
+    return false;
+
+  ofs << "##fileformat=VCFv4.1" << std::endl
+      << "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO" << std::endl;
+  Rng rng(m_opt.seed + 1);
+  int per_chr = std::max(1, m_opt.sites / m_opt.chromosomes);
+  for (int i = 0; i < m_opt.chromosomes; ++i) {
+    const std::string ref = reference(i);
+    std::vector<int32_t> pos(per_chr);
+    for (auto& p : pos)
+      p = rng.below(m_opt.chr_length);
+    std::sort(pos.begin(), pos.end());
+    pos.erase(std::unique(pos.begin(), pos.end()), pos.end());
+    for (auto p : pos) {
+      char alt = BASES[(strchr(BASES, ref[p]) - BASES + 1 + rng.below(3)) % 4];
+      ofs << chrName(i) << "\t" << p + 1 << "\t.\t" << ref[p] << "\t" << alt << "\t50\tPASS\t." << std::endl;
+    }
+  }
+  return (bool)ofs;
+}
+
+bool SimBam::writeMotifs(const std::string& file)
+{
+  std::ofstream ofs(file);
+  if (!ofs)
+    return false;
+
+  // half can be found in the reads, half most likely can't
+  const int k = 24;
+  Rng rng(m_opt.seed + 2);
+  const std::string ref = reference(0);
+  for (int i = 0; i < m_opt.motifs; ++i) {
+    std::string m;
+    if (i % 2 == 0) {
+      m = ref.substr(rng.below(m_opt.chr_length - k), k);
+    } else {
+      for (int j = 0; j < k; ++j)
+	m += BASES[rng.below(4)];
+    }
+    ofs << m << std::endl;
+  }
+  return (bool)ofs;
+}
@@ -0,0 +1,125 @@
+#ifndef VARIANT_SIM_BAM_H__
+#define VARIANT_SIM_BAM_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "htslib/sam.h"
+
+/** A synthetic sorted, indexed, paired-end BAM for benchmarks
+ * (variant_bench simulate).
+ *
+ * Pairs are laid down at random along random chromosomes to the asked
+ * depth, with set fractions of discordant pairs (far apart or on the
+ * same strand), soft clipped reads, indels, duplicates, unmapped mates
+ * and mapq 0 reads. Each read can carry OQ, BD and BI tags as long as the
+ * read, which is where most of the bytes of a recalibrated BAM go.
+ *
+ * The random numbers come from a generator of our own, not <random>'s
+ * distributions, so the same options and seed give the same bytes on any
+ * platform and compiler, and results of later runs can be compared.
+ */
+class SimBam
+{
+ public:
+
+  struct Options {
+    int chromosomes = 2;
+    int32_t chr_length = 10000000;
+    double depth = 5;
+    int read_length = 101;
+    int isize = 350;           // mean insert size. spread over +-100
+    double discordant = 0.01;  // of pairs
+    double unmapped = 0.01;    // of pairs, with the second read unmapped
+    double clipped = 0.05;     // of reads
+    double indel = 0.02;       // of reads
+    double duplicate = 0.02;   // of pairs, written a second time as duplicates
+    double mapq0 = 0.05;       // of reads
+    int tags = 3;              // per-base tags on each read: OQ, BD, BI, in that order
+    int sites = 1000;          // VCF sites, spread over the genome
+    int motifs = 1000;         // motifs, half of them from the reference
+    uint64_t seed = 1;
+    int level = 1;             // BAM compression level
+  };
+
+  explicit SimBam(const Options& o) : m_opt(o) {}
+
+  /** Write the BAM and its .bai. Returns false if it can't be written */
+  bool writeBam(const std::string& file);
+
+  /** Write a VCF of sites on the reference, for region rules */
+  bool writeVcf(const std::string& file);
+
+  /** Write a motif dictionary, one motif per line, for motif rules */
+  bool writeMotifs(const std::string& file);
+
+  /** Counts of what writeBam wrote */
+  uint64_t reads() const { return m_reads; }
+  uint64_t discordantPairs() const { return m_discordant; }
+  uint64_t clippedReads() const { return m_clipped; }
+  uint64_t duplicateReads() const { return m_duplicates; }
+  uint64_t unmappedReads() const { return m_unmapped; }
+
+  /** Name of reference i, from 0 */
+  static std::string chrName(int i) { return std::to_string(i + 1); }
+
+ private:
+
+  // splitmix64, which is small, fast and the same everywhere
+  struct Rng {
+    uint64_t s;
+    explicit Rng(uint64_t seed) : s(seed) {}
+    uint64_t next() {
+      uint64_t z = (s += 0x9e3779b97f4a7c15ull);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+      return z ^ (z >> 31);
+    }
+    double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+    uint32_t below(uint32_t n) { return n ? next() % n : 0; }
+    bool chance(double p) { return uniform() < p; }
+  };
+
+  // a read waiting its turn in coordinate order
+  struct SimRead {
+    int32_t pos = 0;
+    int32_t mpos = 0;
+    int32_t isize = 0;
+    uint16_t flag = 0;
+    uint8_t mapq = 60;
+    uint64_t order = 0;  // ties on pos go in the order the reads were made
+    uint64_t name = 0;
+    uint64_t seed = 0;   // for its bases and qualities
+    int nm = 0;
+    std::vector<uint32_t> cigar;
+
+    bool operator>(const SimRead& o) const { return pos != o.pos ? pos > o.pos : order > o.order; }
+  };
+
+  // reference bases of chromosome i
+  std::string reference(int i) const;
+
+  // a CIGAR for a mapped read, with its edit distance. Returns the reference bases it covers
+  int32_t makeCigar(Rng& rng, std::vector<uint32_t>& cigar, int& nm);
+
+  // fill b from r, with its bases from ref
+  void pack(bam1_t* b, int32_t tid, const SimRead& r, const std::string& ref);
+
+  bam_hdr_t* makeHeader() const;
+
+  Options m_opt;
+
+  uint64_t m_reads = 0;
+  uint64_t m_discordant = 0;
+  uint64_t m_clipped = 0;
+  uint64_t m_duplicates = 0;
+  uint64_t m_unmapped = 0;
+
+  // reused by pack
+  std::string m_seq;
+  std::string m_qual;
+  std::string m_aux;
+
+};
+#endif
@@ -0,0 +1,100 @@
+#ifndef VARIANT_SPSC_QUEUE_H__
+#define VARIANT_SPSC_QUEUE_H__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+/** Bounded lock-free ring buffer between exactly one producer
+ * thread and one consumer thread.
+ *
+ * push() blocks while the ring is full and pop() while it is empty.
+ * Each side counts how many times it had to wait, which is how
+ * the pipeline reports which stage is holding the others up.
+ */
+template <typename T>
+class SpscQueue
+{
+ public:
+
+  /** Capacity is rounded up to a power of two */
+  explicit SpscQueue(size_t capacity) {
+    size_t n = 2;
+    while (n < capacity)
+      n <<= 1;
+    m_buf.resize(n);
+    m_mask = n - 1;
+  }
+
+  SpscQueue(const SpscQueue&) = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+
+  bool tryPush(const T& v) {
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_head.load(std::memory_order_acquire) > m_mask)
+      return false;
+    m_buf[tail & m_mask] = v;
+    m_tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool tryPop(T& v) {
+    size_t head = m_head.load(std::memory_order_relaxed);
+    if (head == m_tail.load(std::memory_order_acquire))
+      return false;
+    v = m_buf[head & m_mask];
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  void push(const T& v) {
+    if (tryPush(v))
+      return;
+    ++m_push_stalls;
+    for (size_t spins = 0; !tryPush(v); ++spins)
+      backoff(spins);
+  }
+
+  void pop(T& v) {
+    if (tryPop(v))
+      return;
+    ++m_pop_stalls;
+    for (size_t spins = 0; !tryPop(v); ++spins)
+      backoff(spins);
+  }
+
+  size_t capacity() const { return m_mask + 1; }
+
+  /** Number of times the producer found the ring full */
+  uint64_t pushStalls() const { return m_push_stalls; }
+
+  /** Number of times the consumer found the ring empty */
+  uint64_t popStalls() const { return m_pop_stalls; }
+
+ private:
+
+  static void backoff(size_t spins) {
+    if (spins < 64)
+      std::this_thread::yield();
+    else
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+
+  std::vector<T> m_buf;
+  size_t m_mask;
+
+  // consumer side
+  std::atomic<size_t> m_head{0};
+  uint64_t m_pop_stalls = 0;
+
+  // keep the two sides on separate cache lines
+  char m_pad[64];
+
+  // producer side
+  std::atomic<size_t> m_tail{0};
+  uint64_t m_push_stalls = 0;
+
+};
+#endif
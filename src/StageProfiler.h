@@ -0,0 +1,91 @@
+#ifndef VARIANT_STAGE_PROFILER_H__
+#define VARIANT_STAGE_PROFILER_H__
+
+#include <chrono>
+#include <cstdint>
+
+/** Where the time of a walk goes, for --profile.
+ *
+ * One read in every SAMPLE_EVERY is timed stage by stage on the steady
+ * clock, and the totals are scaled back up to all reads. The other reads
+ * only pay for the counter that picks the sampled ones. Until enable()
+ * nothing is counted or timed.
+ *
+ * PREFILTER (the RuleProgram steps) and REGION_LOOKUP (their interval
+ * lookups) are parts of RULES, and REGION_LOOKUP is part of PREFILTER.
+ * The other stages don't overlap: COVERAGE leaves out the writes of the
+ * reads it releases, which count as WRITE.
+ */
+class StageProfiler
+{
+ public:
+
+  enum Stage {
+    STAGE_READ,           // reading and decoding the next record
+    STAGE_RULES,          // the rules of every output, program and full collection
+    STAGE_PREFILTER,      // the rule program, see RuleProgram
+    STAGE_REGION_LOOKUP,  // the program's region lookups
+    STAGE_COVERAGE,       // the -m buffer
+    STAGE_WRITE,          // stripping, compressing and writing kept reads
+    N_STAGES
+  };
+
+  // a power of 2
+  static const uint64_t SAMPLE_EVERY = 64;
+
+  void enable() { m_on = true; }
+
+  bool enabled() const { return m_on; }
+
+  /** Move on to the next read, and pick whether it is timed */
+  bool next() {
+    m_timed = m_on && (++m_reads & (SAMPLE_EVERY - 1)) == 0;
+    return m_timed;
+  }
+
+  /** True if the current read is timed */
+  bool timed() const { return m_timed; }
+
+  static uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void add(Stage s, uint64_t ns) {
+    m_ns[s] += ns;
+    ++m_samples[s];
+  }
+
+  /** Add the time since t to s, and return the time now */
+  uint64_t lap(Stage s, uint64_t t) {
+    uint64_t n = now();
+    add(s, n - t);
+    return n;
+  }
+
+  /** Time of the sampled reads in s */
+  uint64_t sampledNs(Stage s) const { return m_ns[s]; }
+
+  /** Times s was sampled */
+  uint64_t samples(Stage s) const { return m_samples[s]; }
+
+  /** Time of all reads in s */
+  uint64_t estimatedNs(Stage s) const { return m_ns[s] * SAMPLE_EVERY; }
+
+  /** Reads seen since enable() */
+  uint64_t reads() const { return m_reads; }
+
+  static const char* name(Stage s) {
+    static const char* names[] = {"read", "rules", "prefilter", "region_lookup", "coverage", "write"};
+    return names[s];
+  }
+
+ private:
+
+  bool m_on = false;
+  bool m_timed = false;
+  uint64_t m_reads = 0;
+  uint64_t m_ns[N_STAGES] = {};
+  uint64_t m_samples[N_STAGES] = {};
+
+};
+#endif
@@ -0,0 +1,98 @@
+#include "StreamingCoverage.h"
+
+#include <algorithm>
+
+static size_t roundUpPow2(size_t n)
+{
+  size_t p = 2;
+  while (p < n)
+    p <<= 1;
+  return p;
+}
+
+StreamingCoverage::StreamingCoverage(size_t window)
+{
+  m_depth.assign(roundUpPow2(window), 0);
+  m_mask = m_depth.size() - 1;
+}
+
+void StreamingCoverage::reset(int32_t chr)
+{
+  if (m_started)
+    advance(m_base + m_depth.size());
+  m_chr = chr;
+  m_base = 0;
+  m_started = false;
+}
+
+void StreamingCoverage::add(int32_t pos, int32_t end)
+{
+  if (!m_started) {
+    m_base = pos;
+    m_started = true;
+  }
+
+  // the window was moved past the start of this read. only count what's left
+  if (pos < m_base)
+    pos = m_base;
+  if (end <= pos)
+    return;
+
+  if ((size_t)(end - m_base) > m_depth.size())
+    grow(end - m_base);
+
+  for (int32_t p = pos; p < end; ++p)
+    ++m_depth[p & m_mask];
+}
+
+int StreamingCoverage::depth(int32_t pos) const
+{
+  if (!m_started || pos < m_base || (size_t)(pos - m_base) >= m_depth.size())
+    return 0;
+  return m_depth[pos & m_mask];
+}
+
+void StreamingCoverage::advance(int32_t pos)
+{
+  if (!m_started || pos <= m_base)
+    return;
+
+  // positions that leave the window are zeroed so they can be reused
+  size_t n = std::min<size_t>(pos - m_base, m_depth.size());
+  for (size_t i = 0; i < n; ++i)
+    m_depth[(m_base + i) & m_mask] = 0;
+  m_base = pos;
+}
+
+void StreamingCoverage::grow(size_t n)
+{
+  std::vector<uint32_t> d(roundUpPow2(n), 0);
+  size_t mask = d.size() - 1;
+  for (size_t i = 0; i < m_depth.size(); ++i)
+    d[(m_base + i) & mask] = m_depth[(m_base + i) & m_mask];
+  m_depth.swap(d);
+  m_mask = mask;
+}
+
+StreamingCoverage::State StreamingCoverage::state() const
+{
+  State s;
+  s.chr = m_chr;
+  s.base = m_base;
+  s.started = m_started;
+  s.depth.resize(m_depth.size());
+  for (size_t i = 0; i < m_depth.size(); ++i)
+    s.depth[i] = m_depth[(m_base + i) & m_mask];
+  return s;
+}
+
+void StreamingCoverage::restore(const State& s)
+{
+  m_chr = s.chr;
+  m_base = s.base;
+  m_started = s.started;
+  m_depth.assign(roundUpPow2(s.depth.size()), 0);
+  m_mask = m_depth.size() - 1;
+  for (size_t i = 0; i < s.depth.size(); ++i)
+    m_depth[(m_base + i) & m_mask] = s.depth[i];
+}
@@ -0,0 +1,68 @@
+#ifndef VARIANT_STREAMING_COVERAGE_H__
+#define VARIANT_STREAMING_COVERAGE_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/** Per-base read depth over a window that slides along one chromosome.
+ *
+ * Depths live in a circular array indexed by position modulo its size.
+ * Reads must be added in order of start position. Once the caller moves
+ * the window start past a position it is forgotten, so memory is bounded
+ * by the span between the oldest position still needed and the end of
+ * the newest read, not by the size of the region. The array doubles if
+ * a read ever reaches past the end of the window.
+ */
+class StreamingCoverage
+{
+ public:
+
+  /** window is rounded up to a power of two */
+  explicit StreamingCoverage(size_t window = 0x10000);
+
+  /** Forget everything and start on a new chromosome */
+  void reset(int32_t chr);
+
+  int32_t chr() const { return m_chr; }
+
+  /** Add one to the depth of [pos, end) */
+  void add(int32_t pos, int32_t end);
+
+  /** Depth at pos. 0 if pos has left the window */
+  int depth(int32_t pos) const;
+
+  /** Move the window start up to pos. Positions before it are dropped */
+  void advance(int32_t pos);
+
+  /** First position still tracked */
+  int32_t start() const { return m_base; }
+
+  size_t window() const { return m_depth.size(); }
+
+  /** Everything needed to carry on from here later (for checkpoints) */
+  struct State {
+    int32_t chr = -1;
+    int32_t base = 0;
+    bool started = false;
+    std::vector<uint32_t> depth;  // the window, from base on
+  };
+
+  State state() const;
+
+  void restore(const State& s);
+
+ private:
+
+  // make room for at least n positions from m_base
+  void grow(size_t n);
+
+  std::vector<uint32_t> m_depth;
+  size_t m_mask;
+
+  int32_t m_chr = -1;
+  int32_t m_base = 0;
+  bool m_started = false;
+
+};
+#endif
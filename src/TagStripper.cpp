@@ -0,0 +1,98 @@
+#include "TagStripper.h"
+
+#include <cstring>
+#include <sstream>
+
+void TagStripper::setTags(const std::string& tags)
+{
+  std::istringstream iss(tags);
+  std::string tag;
+  while (std::getline(iss, tag, ','))
+    if (tag.length() == 2) {
+      m_tags.set(code(tag[0], tag[1]));
+      m_any = true;
+    }
+}
+
+int TagStripper::fieldSize(const uint8_t* s, const uint8_t* end)
+{
+  if (end - s < 3)
+    return -1;
+
+  int64_t n;
+  switch (s[2]) {
+  case 'A': case 'c': case 'C': n = 4; break;
+  case 's': case 'S': n = 5; break;
+  case 'i': case 'I': case 'f': n = 7; break;
+  case 'd': n = 11; break;
+  case 'Z': case 'H':
+    {
+      const uint8_t* z = (const uint8_t*)memchr(s + 3, 0, end - s - 3);
+      if (!z)
+	return -1;
+      n = z + 1 - s;
+    }
+    break;
+  case 'B':
+    {
+      if (end - s < 8)
+	return -1;
+      int size;
+      switch (s[3]) {
+      case 'c': case 'C': size = 1; break;
+      case 's': case 'S': size = 2; break;
+      case 'i': case 'I': case 'f': size = 4; break;
+      default: return -1;
+      }
+      uint32_t count;
+      memcpy(&count, s + 4, 4);
+      n = 8 + (int64_t)count * size;
+    }
+    break;
+  default:
+    return -1;
+  }
+  return n <= end - s ? (int)n : -1;
+}
+
+void TagStripper::apply(bam1_t* b)
+{
+  int32_t l_data = b->l_data;
+
+  if (m_drop_qual && b->core.l_qseq > 0)
+    memset(bam_get_qual(b), 0xff, b->core.l_qseq);
+
+  if (m_all) {
+    b->l_data -= bam_get_l_aux(b);
+  } else if (m_any) {
+    uint8_t* s = bam_get_aux(b);
+    uint8_t* end = b->data + b->l_data;
+    uint8_t* out = s;
+    while (s < end) {
+      int n = fieldSize(s, end);
+      if (n < 0) {
+	// can't tell where the next field starts, so keep the rest
+	memmove(out, s, end - s);
+	out += end - s;
+	break;
+      }
+      if (!m_tags.test(code(s[0], s[1]))) {
+	if (out != s)
+	  memmove(out, s, n);
+	out += n;
+      }
+      s += n;
+    }
+    b->l_data = out - b->data;
+  }
+
+  if (m_drop_names && b->core.l_qname > 2) {
+    int shift = b->core.l_qname - 2;
+    memmove(b->data + 2, b->data + b->core.l_qname, b->l_data - b->core.l_qname);
+    memcpy(b->data, "*", 2);
+    b->core.l_qname = 2;
+    b->l_data -= shift;
+  }
+
+  m_removed += l_data - b->l_data;
+}
@@ -0,0 +1,63 @@
+#ifndef VARIANT_TAG_STRIPPER_H__
+#define VARIANT_TAG_STRIPPER_H__
+
+#include <bitset>
+#include <cstdint>
+#include <string>
+
+#include "htslib/sam.h"
+
+/** Removes tags (and optionally base qualities and read names) from
+ * records on their way to the output.
+ *
+ * The tags to drop are resolved once into a set of 2-byte codes. Each
+ * record then gets one forward scan of its aux block that moves the
+ * kept tags down over the dropped ones, instead of a search and a
+ * shift of the whole block per tag. An aux block that can't be parsed
+ * is kept as it is from the first bad field on.
+ */
+class TagStripper
+{
+ public:
+
+  TagStripper() {}
+
+  /** Drop these tags, separated by commas, e.g. "OQ,BD,BI". Adds to any set before */
+  void setTags(const std::string& tags);
+
+  /** Drop every tag */
+  void setAll() { m_all = true; }
+
+  /** Set every base quality to 0xff (missing), which compresses to almost nothing */
+  void setDropQualities(bool drop) { m_drop_qual = drop; }
+
+  /** Replace the read name with "*" */
+  void setDropNames(bool drop) { m_drop_names = drop; }
+
+  /** True if apply changes anything */
+  bool active() const { return m_all || m_any || m_drop_qual || m_drop_names; }
+
+  /** Strip a record in place */
+  void apply(bam1_t* b);
+
+  /** Bytes taken out of the records so far */
+  uint64_t bytesRemoved() const { return m_removed; }
+
+  /** Bytes taken by one aux field (tag, type and value) starting at s,
+   * or -1 if it is malformed or runs past end */
+  static int fieldSize(const uint8_t* s, const uint8_t* end);
+
+ private:
+
+  static unsigned code(uint8_t a, uint8_t b) { return (unsigned)a << 8 | b; }
+
+  std::bitset<65536> m_tags;
+  bool m_any = false;
+  bool m_all = false;
+  bool m_drop_qual = false;
+  bool m_drop_names = false;
+
+  uint64_t m_removed = 0;
+
+};
+#endif
@@ -1,5 +1,19 @@
 #include "VariantBamWalker.h"
-#include "htslib/khash.h"
+#include "SnowTools/SnowUtils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <fstream>
+
+VariantBamWalker::VariantBamWalker(const std::string in) : SnowTools::BamWalker(in)
+{
+  if (!m_reader.open(in)) {
+    std::cerr << "ERROR: Could not open " << in << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
 
 void VariantBamWalker::writeVariantBam() 
 {
@@ -12,127 +26,575 @@ void VariantBamWalker::writeVariantBam()
   SnowTools::BamRead r;
   bool rule;
 
-  bool COV_A = true;
-  int32_t buffer_size = 10000;
-  SnowTools::BamReadVector buffer;
-
-  // check if the BAM is sorted by looking at the header
-  std::string hh = std::string(header()->text);
-  bool sorted = hh.find("SO:coord") != std::string::npos;
-
-  if (!sorted && max_cov > 0) {
+  if (!isSorted() && max_cov != 0) {
     std::cerr << "ERROR: BAM file does not appear to be sorted (no SO:coordinate) found in header." << std::endl;
     std::cerr << "       Sorted BAMs are required for coverage-based rules (max/min coverage)." << std::endl;
     exit(EXIT_FAILURE);
   }
 
-  while (GetNextRead(r, rule)) {
+  // a shard worker walks more than once. start each walk with no depth
+  if (max_cov != 0) {
+    m_cov.setTarget(max_cov, m_seed);
+    m_cov.reset(-1);
+    m_cov_last = -1;
+  }
+
+  if (m_resume)
+    restoreCheckpoint();
+
+  // nextRead counts the reads the reader steps over as it goes, so the
+  // count can pass a million (or a checkpoint) between two reads instead
+  // of landing on it. a resumed walk carries on from the saved count, and
+  // crosses the same ones
+  uint64_t last = rc_main.total;
 
-      // prepare for case of long reads
-      buffer_size = std::max((int32_t)r.Length() * 5, buffer_size);
+  while (nextRead(r, rule)) {
 
       //std::cerr << "...r " << r << " rule " << rule << std::endl;
-      //TrackSeenRead(r);
 
-      // add coverage
-      if (max_cov != 0) {
-	cov_a.addRead(r);
-	cov_b.addRead(r);
+      if (max_cov != 0 && m_prof.timed()) {
+	// the writes of the reads it releases are timed as writes
+	uint64_t t = StageProfiler::now();
+	uint64_t w = m_prof.sampledNs(StageProfiler::STAGE_WRITE);
+	addCoverageRead(r, rule);
+	w = m_prof.sampledNs(StageProfiler::STAGE_WRITE) - w;
+	m_prof.add(StageProfiler::STAGE_COVERAGE, StageProfiler::now() - t - w);
+      } else if (max_cov != 0) {
+	addCoverageRead(r, rule);
+      } else if (rule && hasOutput()) { // if we specified an output file, write it
+	writeRead(r);
+	++rc_main.keep;
       }
 
-      // read is valid
-      if (rule) {
-
-	if (max_cov == 0 && fop) {// if we specified an output file, write it
-	  writeAlignment(r);
-	  ++rc_main.keep;
-	} else if (fop) {
-	  buffer.push_back(r);
-
-	  // clear buffer
-	  // pass back and forth between cov_a and cov_b.
-	  if (buffer.size()) {
-
-	    // error if BAM not sorted
-	    if (buffer[0].Position() - buffer.back().Position() > 0 && buffer[0].ChrID() == buffer.back().ChrID())
-	      {
-		std::cerr << "ERROR: BAM file is not sorted. " << std::endl;
-		std::cerr << " ------ Found read:  " << buffer[0] << std::endl;
-		std::cerr << " ------ before read: " << buffer.back() << std::endl;
-		std::cerr << " ------ BAM must be sorted if using the -m flag for max coverage. Exiting" << std::endl;
-		exit(EXIT_FAILURE);
-	      }
-
-	    if ( (buffer.back().Position() - buffer[0].Position() > buffer_size) || buffer.back().ChrID() != buffer[0].ChrID()) {
-	      COV_A ? subSampleWrite(buffer, cov_a) : subSampleWrite(buffer, cov_b);
-	      COV_A ? cov_a.clear() : cov_b.clear();
-	      COV_A = !COV_A;
-	      buffer.clear();
-	    }
-	  }
-	}
-      }
+      if (m_routes.size())
+	writeRoutes(r);
       
-      if (++rc_main.total % 1000000 == 0 && m_verbose)
+      if (++rc_main.total / 1000000 != last / 1000000 && m_verbose)
 	printMessage(r);
 
-    }
+      if (m_ckpt_every && rc_main.total / m_ckpt_every != last / m_ckpt_every)
+	saveCheckpoint();
 
-  // clear last buffer
-  if (buffer.size()) {
-    if ( (buffer.back().Position() - buffer[0].Position() > buffer_size) || buffer.back().ChrID() != buffer[0].ChrID()) {
-      COV_A ? subSampleWrite(buffer, cov_a) : subSampleWrite(buffer, cov_b);
-      COV_A ? cov_a.clear() : cov_b.clear();
-      COV_A = !COV_A;
-      buffer.clear();
+      last = rc_main.total;
     }
-  }
+
+  // everything left is final
+  releaseCoveredReads(INT32_MAX);
 
   if (m_verbose)
     printMessage(r);
 }
 
-void VariantBamWalker::subSampleWrite(SnowTools::BamReadVector& buff, const SnowTools::STCoverage& cov) {
+void VariantBamWalker::addCoverageRead(SnowTools::BamRead &r, bool rule)
+{
+  if (r.ChrID() != m_cov.chr()) {
+    releaseCoveredReads(INT32_MAX);
+    m_cov.reset(r.ChrID());
+  } else if (r.Position() < m_cov_last) {
+    std::cerr << "ERROR: BAM file is not sorted. " << std::endl;
+    std::cerr << " ------ Found read:  " << r << std::endl;
+    std::cerr << " ------ BAM must be sorted if using the -m flag for max coverage. Exiting" << std::endl;
+    exit(EXIT_FAILURE);
+  }
 
-  for (auto& r : buff)
-    {
-      double this_cov1 = cov.getCoverageAtPosition(r.ChrID(), r.Position());
-      double this_cov2 = cov.getCoverageAtPosition(r.ChrID(), r.PositionEnd());
-      //double this_cov3 = cov.getCoverageAtPosition(r.ChrID(), r.Position());
-      //double this_cov4 = cov.getCoverageAtPosition(r.ChrID(), r.PositionEnd());
-      double this_cov = std::max(this_cov1, this_cov2);
-      double sample_rate = 1; // dummy, always set if max_coverage > 0
-      if (this_cov > 0) 
-	sample_rate = 1 - (this_cov - max_cov) / this_cov; // if cov->inf, sample_rate -> 0. if cov -> max_cov, sample_rate -> 1
-      
-      // this read should be randomly sampled, cov is too high
-      if (this_cov > max_cov && max_cov > 0) 
-	{
-	  uint32_t k = __ac_Wang_hash(__ac_X31_hash_string(r.Qname().c_str()) ^ m_seed);
-	  if ((double)(k&0xffffff) / 0x1000000 <= sample_rate) { // passed the random filter
-	    writeAlignment(r);
-	    ++rc_main.keep;
-	  }
-	}
-      // only take if reaches minimum coverage
-      else if (this_cov < -max_cov) // max_cov = -10 
-	{
-	  //std::cerr << "not writing because this cov is " << this_cov << " and min cov is " << (-max_cov) << std::endl;
-	}
-      else // didn't have a coverage problems
-	{
-	  ++rc_main.keep;
-	  writeAlignment(r);
-	}
-      
+  m_cov_last = r.Position();
+
+  // no read from here on starts before this one, so the depth before it is settled
+  releaseCoveredReads(r.Position());
+
+  m_cov.add(r.raw());
+
+  // r's record goes back to nextRead, so a steady walk allocates nothing here
+  if (rule && hasOutput())
+    holdRead(r.raw());
+
+  // only the held reads and their mates still need the coverage behind this read
+  int32_t pos = m_cov_reads.size() ? m_cov_reads.front().Position() : r.Position();
+  m_cov.advance(pos - CoverageSampler::MAX_PAIR_GAP);
+}
+
+void VariantBamWalker::releaseCoveredReads(int32_t pos)
+{
+  // keep the input order, so a long read holds back the ones after it
+  while (m_cov_reads.size() && CoverageSampler::needUntil(m_cov_reads.front().raw()) < pos) {
+    subSampleWrite(m_cov_reads.front());
+    m_cov_reads.pop_front();
+    m_cov_arena.pop();
+  }
+}
+
+void VariantBamWalker::holdRead(const bam1_t* b)
+{
+  // an empty owner aliased to the arena's record: no control block, and nothing deleted
+  m_cov_reads.push_back(SnowTools::BamRead());
+  m_cov_reads.back().b = std::shared_ptr<bam1_t>(std::shared_ptr<bam1_t>(), m_cov_arena.push(b));
+}
+
+void VariantBamWalker::subSampleWrite(SnowTools::BamRead &r) {
+
+  if (m_cov.keep(r.raw())) {
+    ++rc_main.keep;
+    writeRead(r);
+  }
+
+}
+
+void VariantBamWalker::setReadRegions(const SnowTools::GenomicRegionVector& grv)
+{
+  m_reader.setRegions(grv);
+}
+
+bool VariantBamWalker::nextRead(SnowTools::BamRead &r, bool& rule)
+{
+  // read into the last record if nothing else holds it. htslib keeps its
+  // data buffer, so a steady stream of reads needs no new memory. reads
+  // held for -m or taken by m_sink keep their record and we start a new one
+  bam1_t* b = r.b && r.b.use_count() == 1 ? r.raw() : nullptr;
+  if (!b) {
+    b = bam_init1();
+    ++m_read_allocs;
+  }
+
+  const bool timed = m_prof.next();
+  uint64_t t = timed ? StageProfiler::now() : 0;
+
+  // reads the core filter steps over still count as read
+  const uint64_t skipped = m_reader.coreSkipped();
+
+  for (;;) {
+    if (!m_reader.next(b)) {
+      addSkipped(m_reader.coreSkipped() - skipped);
+      if (b != r.raw())
+	bam_destroy1(b);
+      return false;
+    }
+    if (!m_owns || m_owns(b))
+      break;
+
+    // someone else's read, only here for the depth around ours
+    if (b != r.raw())
+      r.assign(b);
+    addCoverageRead(r, false);
+  }
+  addSkipped(m_reader.coreSkipped() - skipped);
+  if (m_qc_on)
+    m_qc.add(b);
+
+  if (timed)
+    t = m_prof.lap(StageProfiler::STAGE_READ, t);
+
+  if (b != r.raw())
+    r.assign(b);
+  rule = m_routes.size() ? routeRead(r) : m_program.isValid(r);
+
+  if (timed)
+    m_prof.lap(StageProfiler::STAGE_RULES, t);
+  return true;
+}
+
+void VariantBamWalker::addSkipped(uint64_t n)
+{
+  // no output keeps them, but every output counts them as read
+  rc_main.total += n;
+  for (size_t i = 1; i < m_routes.size(); ++i)
+    m_routes[i]->rc.total += n;
+}
+
+void VariantBamWalker::setRoutes(const RouteScript& s)
+{
+  m_routes.clear();
+  if (!s.routed())
+    return;
+
+  for (size_t i = 0; i < s.outputs().size(); ++i) {
+    std::unique_ptr<Route> rt(new Route);
+    rt->file = s.outputs()[i];
+    if (s.scripts()[i].length()) {
+      rt->mr.reset(new SnowTools::MiniRulesCollection(s.scripts()[i], header()));
+      rt->mr->m_fall_through = m_mr->m_fall_through;
+      rt->program.compile(rt->mr.get());
+    }
+    m_routes.push_back(std::move(rt));
+  }
+}
+
+bool VariantBamWalker::routeRead(SnowTools::BamRead &r)
+{
+  // a read the merged rules can't keep is kept by no route, so it's checked once
+  bool any = m_program.mightKeep(r);
+  for (auto& rt : m_routes)
+    rt->pass = any && rt->mr && rt->program.isValid(r);
+  return m_routes[0]->pass;
+}
+
+void VariantBamWalker::writeRoutes(SnowTools::BamRead &r)
+{
+  const bool timed = m_prof.timed();
+  const uint64_t t = timed ? StageProfiler::now() : 0;
+
+  for (size_t i = 1; i < m_routes.size(); ++i) {
+    Route& rt = *m_routes[i];
+    ++rt.rc.total;
+    if (!rt.pass)
+      continue;
+    if (m_stripper.active())
+      m_stripper.apply(r.raw());
+    rt.out->write(r.raw());
+    ++rt.rc.keep;
+  }
+
+  if (timed)
+    m_prof.lap(StageProfiler::STAGE_WRITE, t);
+}
+
+void VariantBamWalker::openRoutes()
+{
+  for (size_t i = 1; i < m_routes.size(); ++i) {
+    Route& rt = *m_routes[i];
+    rt.out.reset(new BamOutput);
+    if (!rt.out->open(rt.file, header(), m_out_level, m_out_threads, m_out_index)) {
+      std::cerr << "ERROR: Could not open output BAM " << rt.file << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+void VariantBamWalker::closeRoutes()
+{
+  for (size_t i = 1; i < m_routes.size(); ++i) {
+    Route& rt = *m_routes[i];
+    if (!rt.out)
+      continue;
+    if (m_verbose)
+      std::cerr << "...wrote " << rt.rc.keepString() << " of " << rt.rc.totalString() << " reads to " << rt.file << std::endl;
+    closeBamOutput(*rt.out, rt.file);
+  }
+}
+
+void VariantBamWalker::routeCountsToFile(const std::string& file) const
+{
+  if (file.empty())
+    return;
+  for (size_t i = 0; i < m_routes.size(); ++i)
+    if (m_routes[i]->mr)
+      m_routes[i]->mr->countsToFile(i ? m_routes[i]->file + ".counts" : file);
+}
+
+void VariantBamWalker::SetMiniRulesCollection(const std::string& rules)
+{
+  SnowTools::BamWalker::SetMiniRulesCollection(rules);
+  m_program.compile(m_mr);
+}
+
+void VariantBamWalker::copyMiniRulesCollection(const VariantBamWalker& w)
+{
+  // held like the one BamWalker::SetMiniRulesCollection makes
+  m_mr = new SnowTools::MiniRulesCollection(w.GetMiniRulesCollection());
+  // each region block points back to the collection it is in
+  for (auto& reg : m_mr->m_regions)
+    reg.mrc = m_mr;
+  m_program.shareGates(w.m_program);
+  m_program.compile(m_mr);
+}
+
+void VariantBamWalker::writeRead(SnowTools::BamRead &r)
+{
+  if (m_sink) {
+    // the sink keeps what it is given, and a held read's record goes back to the arena
+    if (r.b && !r.b.use_count())
+      r.assign(bam_dup1(r.raw()));
+    m_sink(r);
+    return;
+  }
+
+  const bool timed = m_prof.timed();
+  const uint64_t t = timed ? StageProfiler::now() : 0;
+
+  if (m_stripper.active())
+    m_stripper.apply(r.raw());
+  if (m_bam_out)
+    m_bam_out->write(r.raw());
+  else
+    writeAlignment(r);
+
+  if (timed)
+    m_prof.lap(StageProfiler::STAGE_WRITE, t);
+}
+
+void VariantBamWalker::setProfile()
+{
+  m_prof.enable();
+  m_program.setProfile(&m_prof);
+}
+
+void VariantBamWalker::profileToJson(const std::string& file, double walk_secs) const
+{
+  std::ofstream ofs(file);
+  if (!ofs) {
+    std::cerr << "ERROR: Could not open " << file << " for writing" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  ofs << "{" << std::endl
+      << "  \"reads\": " << rc_main.total << "," << std::endl
+      << "  \"kept\": " << rc_main.keep << "," << std::endl
+      << "  \"seconds\": " << walk_secs << "," << std::endl
+      << "  \"sample_every\": " << StageProfiler::SAMPLE_EVERY << "," << std::endl
+      << "  \"sampled_reads\": " << m_prof.samples(StageProfiler::STAGE_RULES) << "," << std::endl
+      << "  \"prefilter\": " << (m_program.filters() ? "true" : "false") << "," << std::endl
+      << "  \"stages\": {";
+  for (int s = 0; s < StageProfiler::N_STAGES; ++s) {
+    StageProfiler::Stage st = (StageProfiler::Stage)s;
+    ofs << (s ? "," : "") << std::endl << "    \"" << StageProfiler::name(st) << "\": {\"ns\": " << m_prof.estimatedNs(st)
+	<< ", \"sampled_ns\": " << m_prof.sampledNs(st) << ", \"samples\": " << m_prof.samples(st) << "}";
+  }
+  ofs << std::endl << "  }," << std::endl
+      << "  \"rules\": [";
+  const std::vector<RuleProgram::StepProfile>& prof = m_program.profile();
+  for (size_t i = 0; i < prof.size(); ++i)
+    ofs << (i ? "," : "") << std::endl << "    {\"region\": " << m_program.stepRegion(i) << ", \"rule\": " << m_program.stepRule(i)
+	<< ", \"evaluated\": " << prof[i].evaluated << ", \"passed\": " << prof[i].passed
+	<< ", \"ns\": " << prof[i].estimatedNs() << ", \"sampled_ns\": " << prof[i].ns << ", \"samples\": " << prof[i].timed << "}";
+  ofs << std::endl << "  ]" << std::endl
+      << "}" << std::endl;
+}
+
+void VariantBamWalker::profileToCounts(const std::string& file) const
+{
+  if (file.empty() || !m_prof.enabled())
+    return;
+
+  std::ofstream ofs(file, std::ios::app);
+  if (!ofs) {
+    std::cerr << "ERROR: Could not open " << file << " for writing" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  for (int s = 0; s < StageProfiler::N_STAGES; ++s)
+    ofs << "#stage_ns\t" << StageProfiler::name((StageProfiler::Stage)s) << "\t"
+	<< m_prof.estimatedNs((StageProfiler::Stage)s) << std::endl;
+
+  // evaluated, passed (so the later rules were skipped), time
+  const std::vector<RuleProgram::StepProfile>& prof = m_program.profile();
+  for (size_t i = 0; i < prof.size(); ++i)
+    ofs << "#rule_cost\tregion" << m_program.stepRegion(i) << "\trule" << m_program.stepRule(i) << "\t"
+	<< prof[i].evaluated << "\t" << prof[i].passed << "\t" << prof[i].estimatedNs() << std::endl;
+}
+
+void VariantBamWalker::printProfile(std::ostream& out) const
+{
+  uint64_t total = 0;
+  for (auto s : {StageProfiler::STAGE_READ, StageProfiler::STAGE_RULES, StageProfiler::STAGE_COVERAGE, StageProfiler::STAGE_WRITE})
+    total += m_prof.estimatedNs(s);
+  if (!total)
+    return;
+
+  out << "...profile of " << SnowTools::AddCommas<uint64_t>(m_prof.samples(StageProfiler::STAGE_RULES))
+      << " sampled reads (1 in " << StageProfiler::SAMPLE_EVERY << "):" << std::endl;
+  for (int s = 0; s < StageProfiler::N_STAGES; ++s) {
+    StageProfiler::Stage st = (StageProfiler::Stage)s;
+    bool part = st == StageProfiler::STAGE_PREFILTER || st == StageProfiler::STAGE_REGION_LOOKUP;
+    char line[128];
+    snprintf(line, sizeof(line), "...  %s%-*s %10.3f s %6.1f%%", part ? "  " : "", part ? 14 : 16, StageProfiler::name(st),
+	     m_prof.estimatedNs(st) / 1e9, 100.0 * m_prof.estimatedNs(st) / total);
+    out << line << std::endl;
+  }
+
+  // the dearest steps first
+  const std::vector<RuleProgram::StepProfile>& prof = m_program.profile();
+  std::vector<size_t> order(prof.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return prof[a].estimatedNs() > prof[b].estimatedNs(); });
+  for (size_t k = 0; k < order.size() && k < 10; ++k) {
+    size_t i = order[k];
+    out << "...  region " << m_program.stepRegion(i) << " rule " << m_program.stepRule(i) << ": tried on "
+	<< SnowTools::AddCommas<uint64_t>(prof[i].evaluated) << " reads, let through "
+	<< SnowTools::AddCommas<uint64_t>(prof[i].passed) << ", " << prof[i].estimatedNs() / 1e9 << " s" << std::endl;
+  }
+}
+
+void VariantBamWalker::setOutputCompression(int level, int threads)
+{
+  m_out_level = level;
+  m_out_threads = threads;
+}
+
+void VariantBamWalker::openOutput(const std::string& out, bool bam)
+{
+  m_out_file = out;
+  if (!bam && m_out_cram) {
+    fop = sam_open(out.c_str(), "wc");
+    if (!fop) {
+      std::cerr << "ERROR: Could not open output CRAM " << out << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (m_out_ref.length())
+      hts_set_fai_filename(fop, m_out_ref.c_str());
+    if (m_out_threads > 0)
+      hts_set_threads(fop, m_out_threads);
+    if (m_out_level >= 0)
+      hts_set_opt(fop, HTS_OPT_COMPRESSION_LEVEL, m_out_level);
+    if (sam_hdr_write(fop, header()) < 0) {
+      std::cerr << "ERROR: Could not write the header to " << out << std::endl;
+      exit(EXIT_FAILURE);
     }
+    return;
+  }
+  if (!bam) {
+    // SAM, which has no compression to set up
+    OpenWriteBam(out);
+    return;
+  }
 
+  m_bam_out.reset(new BamOutput);
+  if (m_resume) {
+    if (m_out_index)
+      std::cerr << "WARNING: Output carried on from a checkpoint is not indexed as it is written. Index it with samtools index" << std::endl;
+    if (!m_bam_out->resume(out, m_resume->out_size, m_resume->out_bytes, m_out_level, m_out_threads)) {
+      std::cerr << "ERROR: Could not carry on " << out << " from checkpoint " << m_ckpt_file
+		<< ". It is missing or shorter than when the checkpoint was saved" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+  if (!m_bam_out->open(out, header(), m_out_level, m_out_threads, m_out_index)) {
+    std::cerr << "ERROR: Could not open output BAM " << out << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+void VariantBamWalker::closeOutput()
+{
+  closeRoutes();
+
+  // htslib of this vintage can only index a CRAM once it is closed
+  if (fop && fop->is_cram && m_out_index) {
+    sam_close(fop);
+    fop = nullptr;
+    if (sam_index_build(m_out_file.c_str(), 0) < 0)
+      std::cerr << "WARNING: Could not index " << m_out_file << std::endl;
+    else if (m_verbose)
+      std::cerr << "...indexed " << m_out_file << std::endl;
+  }
 
+  if (m_bam_out)
+    closeBamOutput(*m_bam_out, m_out_file);
+}
+
+void VariantBamWalker::closeBamOutput(BamOutput& out, const std::string& file)
+{
+  out.close();
+  if (out.indexFailed())
+    std::cerr << "WARNING: " << file << " is not in coordinate order, so it was not indexed" << std::endl;
+  if (m_verbose) {
+    const BgzfWriter& z = out.bgzf();
+    std::cerr << "...wrote " << SnowTools::AddCommas<uint64_t>(z.compressedBytes()) << " bytes ("
+	      << SnowTools::AddCommas<uint64_t>(z.uncompressedBytes()) << " uncompressed) to " << file;
+    if (out.indexFile().length())
+      std::cerr << ", indexed in " << out.indexFile();
+    std::cerr << std::endl;
+  }
+}
+
+void VariantBamWalker::setCheckpoint(const std::string& file, uint64_t every, const std::string& args)
+{
+  m_ckpt_file = file;
+  m_ckpt_every = every;
+  m_ckpt_args = args;
+}
+
+bool VariantBamWalker::loadCheckpoint()
+{
+  std::unique_ptr<Checkpoint> c(new Checkpoint);
+  if (!c->load(m_ckpt_file))
+    return false;
+
+  if (c->args != m_ckpt_args) {
+    std::cerr << "ERROR: Checkpoint " << m_ckpt_file << " is from a run with other arguments:" << std::endl
+	      << "  " << c->args << std::endl
+	      << "Run that again, or remove the checkpoint to start over" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  m_resume = std::move(c);
+  return true;
+}
+
+void VariantBamWalker::saveCheckpoint()
+{
+  auto t0 = std::chrono::steady_clock::now();
+
+  Checkpoint c;
+  c.args = m_ckpt_args;
+  c.in_offset = m_reader.tell();
+  if (m_bam_out) {
+    c.out_size = m_bam_out->bgzf().sync();
+    c.out_bytes = m_bam_out->bgzf().uncompressedBytes();
+  }
+  c.total = rc_main.total;
+  c.keep = rc_main.keep;
+  c.core_skipped = m_reader.coreSkipped();
+
+  for (auto& reg : m_mr->m_regions) {
+    c.rule_counts.push_back(reg.m_count);
+    for (auto& ar : reg.m_abstract_rules)
+      c.rule_counts.push_back(ar.m_count);
+  }
+
+  c.cov = m_cov.state();
+  c.cov_last = m_cov_last;
+  for (auto& h : m_cov_reads)
+    c.held.push_back(Checkpoint::pack(h.raw()));
+
+  c.save(m_ckpt_file);
+
+  ++m_ckpt_count;
+  m_ckpt_secs += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+void VariantBamWalker::restoreCheckpoint()
+{
+  const Checkpoint& c = *m_resume;
+
+  size_t n = m_mr->m_regions.size();
+  for (auto& reg : m_mr->m_regions)
+    n += reg.m_abstract_rules.size();
+  if (c.rule_counts.size() != n || !m_reader.seek(c.in_offset)) {
+    std::cerr << "ERROR: Could not resume from checkpoint " << m_ckpt_file << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  size_t i = 0;
+  for (auto& reg : m_mr->m_regions) {
+    reg.m_count = c.rule_counts[i++];
+    for (auto& ar : reg.m_abstract_rules)
+      ar.m_count = c.rule_counts[i++];
+  }
+
+  rc_main.total = c.total;
+  rc_main.keep = c.keep;
+  m_reader.setCoreSkipped(c.core_skipped);
+
+  m_cov.restore(c.cov);
+  m_cov_last = c.cov_last;
+  bam1_t* b = bam_init1();
+  for (auto& h : c.held) {
+    Checkpoint::unpack(h, b);
+    holdRead(b);
+  }
+  bam_destroy1(b);
+
+  if (m_verbose)
+    std::cerr << "...resuming from checkpoint " << m_ckpt_file << " after " << SnowTools::AddCommas<uint64_t>(c.total)
+	      << " reads" << std::endl;
+  m_resume.reset();
 }
 
-void VariantBamWalker::TrackSeenRead(SnowTools::BamRead &r)
+bool VariantBamWalker::isSorted() const
 {
-  m_stats.addRead(r);
+  // check if the BAM is sorted by looking at the header. a shard's walker only has its reader's
+  std::string hh = std::string(m_reader.header()->text);
+  return hh.find("SO:coord") != std::string::npos;
 }
 
 void VariantBamWalker::printMessage(const SnowTools::BamRead &r) const 
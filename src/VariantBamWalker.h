@@ -1,10 +1,23 @@
 #ifndef VARIANT_VARIANT_BAM_WALKER_H__
 #define VARIANT_VARIANT_BAM_WALKER_H__
 
+#include <deque>
+#include <functional>
+#include <memory>
+
 #include "SnowTools/BamWalker.h"
-#include "SnowTools/BamStats.h"
 #include "SnowTools/BamRead.h"
-#include "SnowTools/STCoverage.h"
+
+#include "HtsReader.h"
+#include "BamOutput.h"
+#include "CoverageSampler.h"
+#include "RuleProgram.h"
+#include "TagStripper.h"
+#include "Checkpoint.h"
+#include "RouteScript.h"
+#include "StageProfiler.h"
+#include "QcStats.h"
+#include "RecordArena.h"
 
 class VariantBamWalker: public SnowTools::BamWalker
 {
@@ -12,26 +25,214 @@ class VariantBamWalker: public SnowTools::BamWalker
 
   VariantBamWalker() {}
 
-  VariantBamWalker(const std::string in) : SnowTools::BamWalker(in) {}
+  VariantBamWalker(const std::string in);
 
   void writeVariantBam();
-  
-  void TrackSeenRead(SnowTools::BamRead &r);
+
+  /** Restrict the walk to these regions (sorted and merged) */
+  void setReadRegions(const SnowTools::GenomicRegionVector& grv);
+
+  /** Parse the rules and compile them into m_program */
+  void SetMiniRulesCollection(const std::string& rules);
+
+  /** Filter on a copy of the rules of w, without parsing the script
+   * (or its region files) again, and on the region indexes of w's
+   * m_program. For the walkers of shards, which read through m_reader alone */
+  void copyMiniRulesCollection(const VariantBamWalker& w);
+
+  /** Read the next record into r and check it against the rules.
+   * r's record is reused when r is its only owner */
+  bool nextRead(SnowTools::BamRead &r, bool& rule);
+
+  /** Send a kept read to the output, or to m_sink if one is set */
+  void writeRead(SnowTools::BamRead &r);
+
+  /** True if kept reads go anywhere */
+  bool hasOutput() const { return fop || m_sink || m_bam_out; }
+
+  /** Compression level (-1 for default, 0 for uncompressed) and number
+   * of compression threads for the output. Call before openOutput */
+  void setOutputCompression(int level, int threads);
+
+  /** Index the output files. BAM outputs are indexed as they are
+   * written, CRAM by htslib once it is closed. Call before openOutput */
+  void setOutputIndex(bool index) { m_out_index = index; }
+
+  /** Write the output as CRAM, encoded against ref. Call before openOutput */
+  void setOutputCram(const std::string& ref) { m_out_cram = true; m_out_ref = ref; }
+
+  /** Open the output. BAM files go through BamOutput, which compresses
+   * on m_out_threads threads. CRAM is opened here, with its level and
+   * threads set before the header is written. SAM is left to BamWalker */
+  void openOutput(const std::string& out, bool bam);
+
+  /** Finish writing the output (needed for BAM, so the EOF block is
+   * added) and write the index if one was asked for */
+  void closeOutput();
+
+  /** What to take out of kept reads before they are written (tags,
+   * qualities, names). Applied to every output, in place of the
+   * tag stripping of BamWalker::writeAlignment */
+  TagStripper m_stripper;
+
+  /** Save a Checkpoint to file every `every` reads of a whole-file walk.
+   * args is the command line, which a resumed run has to repeat */
+  void setCheckpoint(const std::string& file, uint64_t every, const std::string& args);
+
+  /** Load the checkpoint file, if there is one. openOutput then carries
+   * on the output from it, and the walk picks up where it stopped */
+  bool loadCheckpoint();
+
+  /** Checkpoints saved, and the time spent saving them */
+  uint64_t checkpoints() const { return m_ckpt_count; }
+  double checkpointSeconds() const { return m_ckpt_secs; }
+
+  /** Send the reads of each output of s to a BAM of its own, in the
+   * same walk. The main output then keeps the reads of s.scripts()[0],
+   * and the collection from SetMiniRulesCollection, which must be
+   * s.merged(), only screens out reads no output keeps. Call after
+   * SetMiniRulesCollection and setCountAllRules */
+  void setRoutes(const RouteScript& s);
+
+  /** True if rules were sent to other outputs */
+  bool routed() const { return m_routes.size(); }
+
+  /** Open the BAM of each route. Each compresses on threads of its own */
+  void openRoutes();
+
+  void closeRoutes();
+
+  /** Write the rule counts of the main output to file, and those of
+   * each route to <its BAM>.counts. Nothing if file is empty */
+  void routeCountsToFile(const std::string& file) const;
+
+  /** Time the stages of the walk on a sample of reads, and count and
+   * time the steps of m_program. Call after SetMiniRulesCollection */
+  void setProfile();
+
+  /** Write the profile as JSON, with walk_secs the time of the whole walk */
+  void profileToJson(const std::string& file, double walk_secs) const;
+
+  /** Add the profile to a -c counts file, as #stage_ns and #rule_cost
+   * rows that variant merge can add up */
+  void profileToCounts(const std::string& file) const;
+
+  /** Print where the time went */
+  void printProfile(std::ostream& out) const;
+
+  StageProfiler m_prof;
+
+  /** Check the header for SO:coordinate */
+  bool isSorted() const;
+
+  HtsReader m_reader;
+
+  RuleProgram m_program;
+
+  // if set, kept reads are handed here instead of being written
+  std::function<void(SnowTools::BamRead&)> m_sink;
+
+  std::unique_ptr<BamOutput> m_bam_out;
   
   void printMessage(const SnowTools::BamRead &r) const;
   
-  SnowTools::BamStats m_stats;
+  /** Count every read the reader returns in m_qc, for -q. Reads the
+   * core filter steps over are never seen, so don't set one with this */
+  void setQc() { m_qc_on = true; }
+
+  bool qcOn() const { return m_qc_on; }
 
-  SnowTools::STCoverage cov_a;
-  SnowTools::STCoverage cov_b;
+  QcStats m_qc;
 
   int m_seed = 0;
   
   int max_cov = 0;
 
-  void subSampleWrite(SnowTools::BamReadVector& buff, const SnowTools::STCoverage& cov);
+  /** Add a read to the coverage for -m. If it passed the rules it is held
+   * until no later read can change the depth its sampling is decided on */
+  void addCoverageRead(SnowTools::BamRead &r, bool rule);
+
+  /** Sample and write the held reads whose depth is final before pos */
+  void releaseCoveredReads(int32_t pos);
+
+  /** Write a read, or not, according to the depth around it */
+  void subSampleWrite(SnowTools::BamRead &r);
+
+  /** The -m sampling. Its target and seed are taken from max_cov and
+   * m_seed when the walk starts */
+  CoverageSampler m_cov;
+
+  // kept reads waiting for their coverage to be final, in input order.
+  // their records live in m_cov_arena, and the BamReads don't own them
+  std::deque<SnowTools::BamRead> m_cov_reads;
+
+  /** If set, the reads it turns down only count in the -m coverage. A
+   * shard uses it to see the depth a little past its own ends */
+  std::function<bool(const bam1_t*)> m_owns;
+
+  /** Where the records of m_cov_reads are kept */
+  const RecordArena& coverageArena() const { return m_cov_arena; }
+
+  // start of the last read added to m_cov, to catch unsorted input
+  int32_t m_cov_last = -1;
 
   SnowTools::ReadCount rc_main;
 
+  // records nextRead had to allocate (the rest reused the last one)
+  uint64_t m_read_allocs = 0;
+
+ private:
+
+  // the rules and output of one route
+  struct Route {
+    std::string file;
+    std::unique_ptr<SnowTools::MiniRulesCollection> mr;  // null if no rule goes there
+    RuleProgram program;
+    std::unique_ptr<BamOutput> out;
+    SnowTools::ReadCount rc;
+    bool pass = false;  // for the current read
+  };
+
+  // check a read against every route. returns whether the main output keeps it
+  bool routeRead(SnowTools::BamRead &r);
+
+  // write a read to the routes (not the main output) that keep it
+  void writeRoutes(SnowTools::BamRead &r);
+
+  // count n reads the core filter stepped over, in the main output and each route
+  void addSkipped(uint64_t n);
+
+  void saveCheckpoint();
+
+  // put back the state a loaded checkpoint had
+  void restoreCheckpoint();
+
+  // close a BamOutput and tell how it went
+  void closeBamOutput(BamOutput& out, const std::string& file);
+
+  // copy b into the arena and add it to the end of m_cov_reads
+  void holdRead(const bam1_t* b);
+
+  RecordArena m_cov_arena;
+
+  int m_out_level = -1;
+  int m_out_threads = 0;
+  bool m_out_index = false;
+  bool m_out_cram = false;
+  std::string m_out_ref;
+  std::string m_out_file;
+
+  bool m_qc_on = false;
+
+  std::string m_ckpt_file;
+  std::string m_ckpt_args;
+  uint64_t m_ckpt_every = 0;
+  uint64_t m_ckpt_count = 0;
+  double m_ckpt_secs = 0;
+  std::unique_ptr<Checkpoint> m_resume;
+
+  // the main output first, then one per output file of the script
+  std::vector<std::unique_ptr<Route> > m_routes;
+
 };
 #endif
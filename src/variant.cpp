@@ -1,6 +1,9 @@
+#include <algorithm>
+#include <chrono>
 #include <string>
 #include <getopt.h>
 #include <iostream>
+#include <unistd.h>
 
 #include "SnowTools/gzstream.h"
 #include "SnowTools/SnowUtils.h"
@@ -9,6 +12,15 @@
 #include "SnowTools/SnowToolsCommon.h"
 
 #include "VariantBamWalker.h"
+#include "ShardRunner.h"
+#include "QcRunner.h"
+#include "ReadPipeline.h"
+#include "ReadKernels.h"
+#include "AllocCounter.h"
+#include "MateLinkPlanner.h"
+#include "ShardMerge.h"
+#include "RouteScript.h"
+#include "RegionCache.h"
 
 using SnowTools::GenomicRegion;
 using SnowTools::GenomicRegionCollection;
@@ -23,6 +35,11 @@ static const char *VARIANT_BAM_USAGE_MESSAGE =
 "  -v, --verbose                        Verbose output\n"
 "  -c, --counts-file                    File to place read counts per rule / region\n"
 "  -x, --no-output                      Don't output reads (used for profiling with -q and/or counting with -c)\n"
+"  -t, --threads                        Number of threads. Splits the genome (or -k regions) into shards that are filtered in parallel.\n"
+"                                       Unsorted or unindexed input falls back to --pipeline with this many rule evaluators\n"
+"  -p, --pipeline                       Stream through separate read / rule evaluation / write threads instead of sharding\n"
+"      --profile                        Write where the time goes (per stage, per rule) to this JSON file. Reads are timed 1 in 64.\n"
+"                                       With -c the same figures are added to the counts file. Runs single-threaded\n"
 " Output options\n"
 "  -o, --output-bam                     Output BAM file to write instead of SAM-format stdout\n"
 "  -C, --cram                           Output file should be in CRAM format\n"
@@ -30,16 +47,55 @@ static const char *VARIANT_BAM_USAGE_MESSAGE =
 "  -h, --include-header                 When outputting to stdout, include the header.\n"
 "  -s, --strip-tags                     Remove the specified tags, separated by commas. eg. -s RG,MD\n"
 "  -S, --strip-all-tags                 Remove all alignment tags\n"
+"      --drop-qualities                 Set every base quality to missing (0xff) in the output, for a smaller file\n"
+"      --drop-names                     Replace every read name with * in the output\n"
+"      --out-threads                    Number of threads used to compress the output BAM/CRAM. Default 0 (compress on the writing thread)\n"
+"      --compression-level              Compression level of the output BAM/CRAM, 0-9. Use 0 or 1 for fast intermediate files. Default 6\n"
+"      --no-index                       Don't index the output. BAM is indexed as it is written (.bai, or .csi for very long references)\n"
 " Filtering options\n"
-"  -q, --qc-file                        Output a qc file that contains information about BAM\n"
-"  -m, --max-coverage                   Maximum coverage of output file. BAM must be sorted. Negative values enforce a minimum coverage\n"
+"  -q, --qc-file                        Output a qc file that contains information about BAM (plot it with R/BamQCPlot.R)\n"
+"  -Q, --qc-only                        Only write this qc file: no rules and no output. Reads the -k regions (or the whole BAM)\n"
+"                                       on -t threads without decoding the reads any further than the qc needs\n"
+"  -m, --max-coverage                   Maximum coverage of output file. BAM must be sorted. Negative values enforce a minimum coverage.\n"
+"                                       Reads are sampled on their name and the depth at both mates, so pairs stay whole and\n"
+"                                       the output is the same with or without -t\n"
+"      --per-read-group                 With -m, count the depth of each read group (RG tag) on its own and bring each down to -m\n"
+"      --rg-max-coverage                With -m, a target depth for some read groups, eg. --rg-max-coverage RG1=30,RG2=-5. Implies --per-read-group\n"
+"      --seed                           Seed of the -m sampling. Default 0\n"
 "  -g, --region                         Regions (e.g. myvcf.vcf or WG for whole genome) or newline seperated subsequence file.  Applied in same order as -r for multiple\n"
 "  -G, --exclude-region                 Same as -g, but for region where satisfying a rule EXCLUDES this read. Applied in same order as -r for multiple\n"
 "  -l, --linked-region                  Same as -g, but turns on mate-linking\n"
 "  -L, --linked-exclue-region           Same as -l, but for mate-linked region where satisfying this rule EXCLUDES this read.\n"
-"  -r, --rules                          Script for the rules. If specified multiple times, will be applied in same order as -g\n"
+"  -r, --rules                          Script for the rules. If specified multiple times, will be applied in same order as -g.\n"
+"                                       A region or rule line ending in >file sends its reads to a BAM of its own\n"
 "  -k, --proc-regions-file              Samtools-style region string (e.g. 1:1,000,000-2,000,000) or BED file of regions to proess reads from\n"
 "  -P, --region-pad                     Apply a padding to each region supplied to variantBam with the -l, -L, -g or -G flags. ** Must place before -l, etc flag! ** \n"
+"      --mate-seek                      With mate-linked regions, seek to the regions and then to their mates instead of walking the whole BAM.\n"
+"                                       Secondary alignments of mates outside the walked regions are missed\n"
+"      --seek-gap                       Regions whose index chunks are at most this many compressed bytes apart are read with one seek. -1 for a seek per region. Default 65536\n"
+"      --prefetch                       Read a BAM input ahead on a background thread (for network filesystems): the blocks\n"
+"                                       of the regions, or the rest of the file when streaming. Not for CRAM input\n"
+"      --prefetch-window                Megabytes of compressed input --prefetch keeps read ahead of the walk. Default 64\n"
+"      --region-cache                   Directory of pre-parsed -k region files. A -k file is parsed once, and later runs map the cache instead.\n"
+"                                       The region files of the rules are still parsed on every run\n"
+"      --checkpoint                     Save progress to this file as the BAM is walked. If the run is stopped, the same command\n"
+"                                       carries on from the last checkpoint. Needs -o with BAM output, one thread and a whole-file walk\n"
+"      --checkpoint-every               Millions of reads between checkpoints, counting those skipped before decoding. Default 10\n"
+"\n"
+"  variant merge -o <out.bam> <shard1.bam> <shard2.bam> ...  Join the outputs of runs on separate regions (see variant merge --help)\n"
+"\n";
+
+static const char *VARIANT_MERGE_USAGE_MESSAGE =
+"Usage: variant merge -o <out.bam> [OPTIONS] <shard1.bam> <shard2.bam> ...\n\n"
+"  Description: Join the outputs of runs on separate regions (-k) without recompressing the reads.\n"
+"               The BAMs must be sorted, given in coordinate order and must not overlap\n"
+"\n"
+"      --help                           Display this help and exit\n"
+"  -v, --verbose                        Verbose output\n"
+"  -o, --output-bam                     Merged BAM. Its index is written alongside (out.bam.bai)\n"
+"      --no-index                       Don't write the index\n"
+"  -c, --counts-file                    Add up the -c counts files of the shards into this file instead\n"
+"  -q, --qc-file                        Add up the -q qc files of the shards into this file instead\n"
 "\n";
 
 namespace opt {
@@ -48,6 +104,9 @@ namespace opt {
   static std::string bam;
   static std::string out;
   static int max_cov = 0;
+  static bool per_rg = false;
+  static std::string rg_max_cov = "";
+  static int seed = 0;
   static bool verbose = false;
   static std::string rules = "";
   static std::string proc_regions = "";
@@ -57,17 +116,49 @@ namespace opt {
   static std::string reference = SnowTools::REFHG19;
   static bool strip_all_tags = false;
   static std::string tag_list = "";
+  static bool drop_quals = false;
+  static bool drop_names = false;
+  static std::string checkpoint = "";
+  static int checkpoint_every = 10;
   static std::string counts_file = "";
   static bool counts_only = false;
   static std::string bam_qcfile = "";
+  static bool qc_only = false;
   static int pad = 0;
+  static int threads = 1;
+  static bool pipeline = false;
+  static int out_threads = 0;
+  static int compression_level = -1;
+  static bool mate_seek = false;
+  static int64_t seek_gap = 0x10000;
+  static bool prefetch = false;
+  static int prefetch_window = 64;
+  static bool index = true;
+  static std::string profile = "";
+  static std::string region_cache = "";
 }
 
 enum {
-  OPT_HELP
+  OPT_HELP,
+  OPT_OUT_THREADS,
+  OPT_COMPRESSION_LEVEL,
+  OPT_MATE_SEEK,
+  OPT_SEEK_GAP,
+  OPT_PREFETCH,
+  OPT_PREFETCH_WINDOW,
+  OPT_DROP_QUALITIES,
+  OPT_DROP_NAMES,
+  OPT_CHECKPOINT,
+  OPT_CHECKPOINT_EVERY,
+  OPT_NO_INDEX,
+  OPT_PROFILE,
+  OPT_PER_READ_GROUP,
+  OPT_RG_MAX_COVERAGE,
+  OPT_SEED,
+  OPT_REGION_CACHE
 };
 
-static const char* shortopts = "hvji:o:r:k:g:Cf:s:ST:l:c:x:q:m:L:G:P:";
+static const char* shortopts = "hvjpi:o:r:k:g:Cf:s:ST:l:c:x:q:Q:m:L:G:P:t:";
 static const struct option longopts[] = {
   { "help",                       no_argument, NULL, OPT_HELP },
   { "linked-region",              required_argument, NULL, 'l' },
@@ -84,13 +175,43 @@ static const struct option longopts[] = {
   { "include-header",             no_argument, NULL, 'h' },
   { "input",                      required_argument, NULL, 'i' },
   { "output-bam",                 required_argument, NULL, 'o' },
-  { "qc-file",                    no_argument, NULL, 'q' },
+  { "qc-file",                    required_argument, NULL, 'q' },
+  { "qc-only",                    required_argument, NULL, 'Q' },
   { "rules",                      required_argument, NULL, 'r' },
   { "region",                     required_argument, NULL, 'g' },
   { "region-pad",                 required_argument, NULL, 'P' },
   { "region-with-mates",          required_argument, NULL, 'c' },
   { "proc-regions-file",          required_argument, NULL, 'k' },
   { "no-pileup-check",            no_argument, NULL, 'j' },
+  { "threads",                    required_argument, NULL, 't' },
+  { "pipeline",                   no_argument, NULL, 'p' },
+  { "out-threads",                required_argument, NULL, OPT_OUT_THREADS },
+  { "compression-level",          required_argument, NULL, OPT_COMPRESSION_LEVEL },
+  { "mate-seek",                  no_argument, NULL, OPT_MATE_SEEK },
+  { "seek-gap",                   required_argument, NULL, OPT_SEEK_GAP },
+  { "prefetch",                   no_argument, NULL, OPT_PREFETCH },
+  { "prefetch-window",            required_argument, NULL, OPT_PREFETCH_WINDOW },
+  { "drop-qualities",             no_argument, NULL, OPT_DROP_QUALITIES },
+  { "drop-names",                 no_argument, NULL, OPT_DROP_NAMES },
+  { "checkpoint",                 required_argument, NULL, OPT_CHECKPOINT },
+  { "checkpoint-every",           required_argument, NULL, OPT_CHECKPOINT_EVERY },
+  { "no-index",                   no_argument, NULL, OPT_NO_INDEX },
+  { "profile",                    required_argument, NULL, OPT_PROFILE },
+  { "per-read-group",             no_argument, NULL, OPT_PER_READ_GROUP },
+  { "rg-max-coverage",            required_argument, NULL, OPT_RG_MAX_COVERAGE },
+  { "seed",                       required_argument, NULL, OPT_SEED },
+  { "region-cache",               required_argument, NULL, OPT_REGION_CACHE },
+  { NULL, 0, NULL, 0 }
+};
+
+static const char* merge_shortopts = "vo:c:q:";
+static const struct option merge_longopts[] = {
+  { "help",                       no_argument, NULL, OPT_HELP },
+  { "verbose",                    no_argument, NULL, 'v' },
+  { "output-bam",                 required_argument, NULL, 'o' },
+  { "no-index",                   no_argument, NULL, OPT_NO_INDEX },
+  { "counts-file",                required_argument, NULL, 'c' },
+  { "qc-file",                    required_argument, NULL, 'q' },
   { NULL, 0, NULL, 0 }
 };
 
@@ -107,9 +228,15 @@ std::string myreplace(std::string &s,
 
 // forward declare
 void parseVarOptions(int argc, char** argv);
+int runMerge(int argc, char** argv);
+int runQc(VariantBamWalker& walk, const SnowTools::GenomicRegionVector& regions);
+void printInputStats(const HtsReader::InputStats& in, double secs, bool threads);
 
 int main(int argc, char** argv) {
 
+  if (argc > 1 && std::string(argv[1]) == "merge")
+    return runMerge(argc - 1, argv + 1);
+
 #ifndef __APPLE__
   // start the timer
   clock_gettime(CLOCK_MONOTONIC, &start);
@@ -126,6 +253,13 @@ int main(int argc, char** argv) {
     }*/
 
   bool has_ml_region = opt::rules.find("mlregion") != std::string::npos;
+
+  // rules tagged >file fill outputs of their own in the same walk. with
+  // nothing left for the main output, it is only written if asked for
+  RouteScript routes(opt::rules);
+  if (routes.routed() && routes.scripts()[0].empty() && opt::out.empty())
+    opt::to_stdout = false;
+  bool main_output = !opt::counts_only && (opt::to_stdout || opt::out.length());
   
   if (opt::verbose) {
     //std::cerr << "Input BAM:  " << opt::bam << std::endl;
@@ -139,27 +273,57 @@ int main(int argc, char** argv) {
     std::cerr << "Rules script: " << opt::rules << std::endl;
 
   if (has_ml_region && opt::verbose) {
-    std::cerr << "...mate-linked region supplied. Defaulting to whole BAM run unless trimmed explicitly with -k flag" << std::endl;
+    std::cerr << "...mate-linked region supplied. Defaulting to whole BAM run unless trimmed explicitly with -k flag"
+	      << (opt::mate_seek ? ", or seeking to the regions and their mates (--mate-seek)" : "") << std::endl;
   }
 
   // setup the walker
   if (opt::verbose)
     std::cerr << "...setting up the bam walker" << std::endl;
   VariantBamWalker walk(opt::bam);
+  walk.m_reader.setReference(opt::reference);
+  walk.m_reader.setSeekGap(opt::seek_gap);
+  // the prefetcher follows BGZF offsets, which a CRAM doesn't have
+  if (opt::prefetch && walk.m_reader.isCram()) {
+    std::cerr << "WARNING: --prefetch only reads BAM input ahead. Ignoring it for CRAM " << opt::bam << std::endl;
+    opt::prefetch = false;
+  }
+  walk.m_reader.setPrefetch(opt::prefetch);
+  walk.m_reader.setPrefetchWindow((uint64_t)opt::prefetch_window << 20);
+  walk.m_reader.setTimed(opt::verbose);
 
   // set which regions to run
   if (opt::verbose)
     std::cerr << "...setting which regions to run" << std::endl;
+  std::unique_ptr<RegionCache> region_cache;
+  if (opt::region_cache.length())
+    region_cache.reset(new RegionCache(opt::region_cache, walk.header()));
+
+  // a cached -k file is used as it is mapped, with no tree
   GRC grv_proc_regions;
+  std::shared_ptr<const IntervalIndex> proc_idx;
+  SnowTools::GenomicRegionVector proc_grv;
   if (opt::proc_regions.length()) {
     if (SnowTools::read_access_test(opt::proc_regions)) {
-      grv_proc_regions.regionFileToGRV(opt::proc_regions, 0, walk.header()); // 0 is pad
+      if (region_cache)
+	proc_idx = region_cache->get(opt::proc_regions, 0);
+      if (!proc_idx)
+	grv_proc_regions.regionFileToGRV(opt::proc_regions, 0, walk.header()); // 0 is pad
     } else if (opt::proc_regions.find(":") != std::string::npos) {
       grv_proc_regions.add(SnowTools::GenomicRegion(opt::proc_regions, walk.header()));
     }
-    grv_proc_regions.createTreeMap();
+    if (proc_idx)
+      proc_idx->forEach([&](int32_t chr, int32_t start, int32_t end) { proc_grv.push_back(SnowTools::GenomicRegion(chr, start, end)); });
+    else {
+      grv_proc_regions.createTreeMap();
+      proc_grv = grv_proc_regions.asGenomicRegionVector();
+    }
   }
 
+  // the qc file alone needs no rules, and no more of a read than its record
+  if (opt::qc_only)
+    return runQc(walk, proc_grv);
+
   // should it print to stdout?
   if (opt::to_stdout) {
     walk.setStdout();
@@ -168,31 +332,47 @@ int main(int argc, char** argv) {
   }
   // should we print to cram
   else if (opt::cram) {
-    walk.setCram(opt::out, opt::reference);
+    walk.setOutputCram(opt::reference);
   }
 
   // should we clear tags?
   if (opt::strip_all_tags)
-    walk.setStripAllTags();
+    walk.m_stripper.setAll();
   else if (opt::tag_list.length())
-    walk.setStripTags(opt::tag_list);
+    walk.m_stripper.setTags(opt::tag_list);
+  walk.m_stripper.setDropQualities(opt::drop_quals);
+  walk.m_stripper.setDropNames(opt::drop_names);
 
   // make the mini rules collection from the rules file
   // this also calls function to parse the BED files
   if (opt::verbose)
     std::cerr << "...rules: " << opt::rules << std::endl;
-  walk.SetMiniRulesCollection(opt::rules);
+  walk.SetMiniRulesCollection(routes.routed() ? routes.merged() : opt::rules);
+  if (region_cache && opt::verbose)
+    std::cerr << "...region cache " << opt::region_cache << ": " << region_cache->hits() << " file(s) mapped, "
+	      << region_cache->misses() << " parsed and cached" << std::endl;
 
   // set max coverage
   walk.max_cov = opt::max_cov;
+  walk.m_seed = opt::seed;
   if (opt::max_cov > 0 && opt::verbose)
     std::cerr << "--- Setting MAX coverage to: " << opt::max_cov << std::endl;
+  if (opt::per_rg) {
+    if (opt::max_cov == 0) {
+      std::cerr << "ERROR: --per-read-group and --rg-max-coverage need -m (the depth of the read groups not named)" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (!walk.m_cov.setPerReadGroup(opt::rg_max_cov)) {
+      std::cerr << "ERROR: Could not parse --rg-max-coverage " << opt::rg_max_cov << ". Expected RG1=30,RG2=10" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
 
   // set the regions to run
-  if (grv_proc_regions.size()) {
+  if (proc_grv.size()) {
     //if (opt::verbose)
     //  std::cerr << "...from -g flag will run on " << grv_proc_regions.size() << " regions" << std::endl;
-    walk.setBamWalkerRegions(grv_proc_regions.asGenomicRegionVector());
+    walk.setReadRegions(proc_grv);
   }
 
   SnowTools::GRC rules_rg = walk.GetMiniRulesCollection().getAllRegions();
@@ -202,41 +382,109 @@ int main(int argc, char** argv) {
 
   rules_rg.createTreeMap();
 
-  if (grv_proc_regions.size() && rules_rg.size()) { // intersect rules regions with mask regions. 
+  // rules is whole genome, so the -k regions are just a mask
+  bool rules_wg = rules_rg.size() == 0;
+
+  if (proc_grv.size() && rules_rg.size()) { // intersect rules regions with mask regions. 
 
     // dont incorporate rules regions if there are any mate-linked regions
-    rules_rg = rules_rg.intersection(grv_proc_regions, true); // true -> ignore_strand
+    if (proc_idx) {
+      // only whether any are left matters, which the cached intervals answer without a tree
+      GRC in_proc;
+      for (auto& gr : rules_rg)
+	if (proc_idx->overlaps(gr.chr, gr.pos1, gr.pos2))
+	  in_proc.add(gr);
+      rules_rg = in_proc;
+    } else {
+      rules_rg = rules_rg.intersection(grv_proc_regions, true); // true -> ignore_strand
+    }
     if (opt::verbose)
       std::cerr << "rules region " << rules_rg.size() << std::endl;
-  } else if (grv_proc_regions.size()) {
-    rules_rg = grv_proc_regions; // rules is whole genome, so just make mask instead
   }
 
-  if (grv_proc_regions.size() > 0 && (rules_rg.size() || has_ml_region )) // explicitly gave regions
-    walk.setBamWalkerRegions(grv_proc_regions.asGenomicRegionVector());
-  else if (rules_rg.size() && !has_ml_region && grv_proc_regions.size() == 0) {
-    walk.setBamWalkerRegions(rules_rg.asGenomicRegionVector());
+  if (proc_grv.size() > 0 && (rules_rg.size() || rules_wg || has_ml_region )) // explicitly gave regions
+    walk.setReadRegions(proc_grv);
+  else if (rules_rg.size() && !has_ml_region && proc_grv.size() == 0) {
+    walk.setReadRegions(rules_rg.asGenomicRegionVector());
     if (opt::verbose)
       std::cerr << "...from rules, will run on " << rules_rg.size() << " regions" << std::endl;
-  } else if (!rules_rg.size() && grv_proc_regions.size() > 0) {
+  } else if (!rules_rg.size() && proc_grv.size() > 0) {
     std::cerr << "No regions with possibility of reads. This error occurs if no regions in -g are in -k." << std::endl;
     return 1;
+  } else if (has_ml_region && opt::mate_seek && opt::max_cov == 0) {
+    // -m needs the coverage of every read, so it stays on the whole BAM
+    MateLinkPlanner planner(opt::bam, opt::reference);
+    if (planner.plan(walk.GetMiniRulesCollection())) {
+      walk.setReadRegions(planner.regions());
+      if (opt::verbose)
+	std::cerr << "...found " << SnowTools::AddCommas<uint64_t>(planner.mates()) << " mates and "
+		  << SnowTools::AddCommas<uint64_t>(planner.supplementary()) << " supplementary alignments in "
+		  << SnowTools::AddCommas<uint64_t>(planner.scanned()) << " reads. Will run on "
+		  << planner.regions().size() << " regions" << std::endl;
+    } else if (opt::verbose) {
+      std::cerr << "...can't seek to mates" << (planner.longReads() ? " (reads longer than the mate margin)" : "")
+		<< ". Running on whole BAM" << std::endl;
+    }
   }
 
   // should we count all rules (slower)
   if (opt::counts_only || opt::counts_file.length())
     walk.setCountAllRules();
+  walk.setRoutes(routes);
+  if (routes.routed() && (opt::max_cov != 0 || opt::checkpoint.length())) {
+    std::cerr << "ERROR: Rules sent to other outputs (>file) can't be used with -m or --checkpoint" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  if (opt::profile.length())
+    walk.setProfile();
+  if (opt::bam_qcfile.length())
+    walk.setQc();
+
+  // a checkpoint holds one place in the input and one in the output
+  if (opt::checkpoint.length()) {
+    if (opt::threads > 1 || opt::pipeline || opt::to_stdout || opt::cram || walk.m_reader.tell() < 0 || opt::checkpoint_every <= 0) {
+      std::cerr << "ERROR: --checkpoint needs a BAM input that is walked whole (no -k or region rules, and no --mate-seek)," << std::endl
+		<< "       BAM output with -o and a single thread" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    std::string args;
+    for (int i = 0; i < argc; ++i)
+      args += (i ? " " : "") + std::string(argv[i]);
+    if (opt::bam_qcfile.length()) {
+      std::cerr << "ERROR: --checkpoint can't be used with -q, as the qc counts aren't saved in the checkpoint" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (opt::per_rg) {
+      std::cerr << "ERROR: --checkpoint can't be used with --per-read-group, as only one depth is saved in the checkpoint" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    walk.setCheckpoint(opt::checkpoint, (uint64_t)opt::checkpoint_every * 1000000, args);
+    if (walk.loadCheckpoint() && opt::verbose)
+      std::cerr << "...found checkpoint " << opt::checkpoint << ". Carrying on from it" << std::endl;
+  }
 
   // open the output BAM/CRAM. If we already set SAM, this does nothing
-  if (!opt::counts_only)
-    walk.OpenWriteBam(opt::out);
+  walk.setOutputCompression(opt::compression_level, opt::out_threads);
+  walk.setOutputIndex(opt::index && !opt::to_stdout);
+  if (main_output)
+    walk.openOutput(opt::out, !opt::to_stdout && !opt::cram);
+  walk.openRoutes();
 
   // if counts or qc only, dont write output
   //walk.fop = nullptr;
 
+  // skip records that no rule can keep before decoding them. -m needs
+  // the coverage of every read and -q counts every read, so there they are all decoded
+  if (opt::max_cov == 0 && !walk.qcOn())
+    walk.m_reader.setCoreFilter(walk.m_program.coreFilter());
+
   // print out some info
-  if (opt::verbose) 
+  if (opt::verbose) {
     std::cerr << walk << std::endl;
+    std::cerr << walk.m_program << std::endl;
+    std::cerr << "...read kernels: " << ReadKernels::levelName(ReadKernels::level()) << std::endl;
+  }
 
   // set verbosity of walker
   if (opt::verbose)
@@ -246,32 +494,131 @@ int main(int argc, char** argv) {
   if (opt::verbose)
     std::cerr << "...starting filtering" << std::endl;
 
+  // shards and pipeline stages are written back in order, but the per-rule counts
+  // live in each worker, so those runs stay on one thread. -m needs the depth
+  // on either side of a read, which shards read for themselves but pipeline stages can't
+  bool parallel = false;
+  if (opt::threads > 1 || opt::pipeline) {
+    if (opt::max_cov != 0 && opt::pipeline)
+      std::cerr << "WARNING: -m is not supported with --pipeline. Running single-threaded" << std::endl;
+    else if (opt::counts_file.length())
+      std::cerr << "WARNING: -c/-x are not supported with --threads / --pipeline yet. Running single-threaded" << std::endl;
+    else if (opt::profile.length())
+      std::cerr << "WARNING: --profile is not supported with --threads / --pipeline yet. Running single-threaded" << std::endl;
+    else if (routes.routed())
+      std::cerr << "WARNING: Rules sent to other outputs (>file) are not supported with --threads / --pipeline yet. Running single-threaded" << std::endl;
+    else
+      parallel = true;
+  }
+
   ////////////
   /// RUN THE WALKER
   ////////////
-  walk.writeVariantBam();
+  ShardRunner shards(opt::bam, opt::threads);
+  uint64_t allocs = AllocCounter::count();
+  auto walk_start = std::chrono::steady_clock::now();
+  bool sharded = parallel && !opt::pipeline && shards.setup(walk);
+  if (sharded) {
+    if (opt::verbose)
+      std::cerr << "...running " << shards.size() << " shards on " << opt::threads << " threads" << std::endl;
+    shards.run(walk, opt::verbose);
+  } else if (parallel && opt::max_cov == 0) {
+    ReadPipeline pipe(opt::rules, opt::threads);
+    if (opt::verbose)
+      std::cerr << "...running read / evaluate / write pipeline with " << opt::threads << " evaluator thread(s)" << std::endl;
+    pipe.run(walk, opt::verbose);
+    if (opt::verbose)
+      pipe.printStalls(std::cerr);
+  } else {
+    walk.writeVariantBam();
+  }
+
+  allocs = AllocCounter::count() - allocs;
+  double walk_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - walk_start).count();
+
+  // shards have their own readers
+  if (opt::verbose && walk.m_reader.seeks() && !sharded) {
+    const HtsReader& rd = walk.m_reader;
+    std::cerr << "...walked " << SnowTools::AddCommas<uint64_t>(rd.regions().size()) << " regions with "
+	      << SnowTools::AddCommas<uint64_t>(rd.seeks()) << " seeks ("
+	      << SnowTools::AddCommas<uint64_t>(rd.regions().size() - rd.seeks()) << " saved)";
+    if (rd.regionBytes())
+      std::cerr << ", " << SnowTools::AddCommas<uint64_t>(rd.seekBytes()) << " compressed bytes instead of "
+		<< SnowTools::AddCommas<uint64_t>(rd.regionBytes());
+    std::cerr << std::endl;
+  }
+
+  // the shards add theirs to the main reader
+  if (opt::verbose)
+    printInputStats(walk.m_reader.inputStats(), walk_secs, sharded);
+
+  walk.closeOutput();
+
+  if (opt::profile.length()) {
+    walk.profileToJson(opt::profile, walk_secs);
+    if (opt::verbose)
+      walk.printProfile(std::cerr);
+  }
+
+  // finished, so there is nothing to carry on from
+  if (opt::checkpoint.length())
+    unlink(opt::checkpoint.c_str());
+
+  if (opt::verbose && walk.checkpoints())
+    std::cerr << "...saved " << walk.checkpoints() << " checkpoints in " << walk.checkpointSeconds() << " seconds ("
+	      << (100.0 * walk.checkpointSeconds() / walk_secs) << "% of the walk)" << std::endl;
+
+  if (opt::verbose && walk.rc_main.total && AllocCounter::enabled()) {
+    std::cerr << "...heap allocations during the walk: " << SnowTools::AddCommas<uint64_t>(allocs) << " ("
+	      << (double)allocs / walk.rc_main.total << " per read)";
+    if (walk.m_read_allocs)
+      std::cerr << ", plus " << SnowTools::AddCommas<uint64_t>(walk.m_read_allocs) << " BAM records";
+    std::cerr << std::endl;
+  }
+
+  if (opt::verbose && walk.coverageArena().allocations())
+    std::cerr << "...reads held for -m were kept in " << walk.coverageArena().allocations() << " arena chunks ("
+	      << SnowTools::AddCommas<uint64_t>(walk.coverageArena().peakBytes()) << " bytes at most)" << std::endl;
+  if (opt::verbose && walk.m_stripper.bytesRemoved())
+    std::cerr << "...stripped " << SnowTools::AddCommas<uint64_t>(walk.m_stripper.bytesRemoved())
+	      << " bytes from the kept reads" << std::endl;
+  if (opt::verbose && walk.m_reader.coreSkipped())
+    std::cerr << "...skipped " << SnowTools::AddCommas<uint64_t>(walk.m_reader.coreSkipped()) << " of "
+	      << SnowTools::AddCommas<uint64_t>(walk.rc_main.total)
+	      << " reads on their flag / mapq / isize before decoding them" << std::endl;
+  if (opt::verbose && walk.m_program.rejected())
+    std::cerr << "...rule program rejected " << SnowTools::AddCommas<uint64_t>(walk.m_program.rejected()) << " of "
+	      << SnowTools::AddCommas<uint64_t>(walk.m_program.rejected() + walk.m_program.evaluated())
+	      << " reads without the full rules" << std::endl;
+  if (opt::verbose && walk.m_program.features().misses()) {
+    const ReadFeatures& f = walk.m_program.features();
+    std::cerr << "...read feature cache: " << SnowTools::AddCommas<uint64_t>(f.hits()) << " hits, "
+	      << SnowTools::AddCommas<uint64_t>(f.misses()) << " misses ("
+	      << (int)(100.0 * f.hits() / (f.hits() + f.misses())) << "% hit)" << std::endl;
+  }
 
   // dump the stats file
   if (opt::bam_qcfile.length()) {
-    std::ofstream ofs;
-    ofs.open(opt::bam_qcfile);
-    ofs << walk.m_stats;
-    ofs.close();
+    std::ofstream ofs(opt::bam_qcfile);
+    if (!ofs) {
+      std::cerr << "ERROR: Could not open " << opt::bam_qcfile << " for writing" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    ofs << walk.m_qc;
   }
 
   // display the rule counts
-  walk.MiniRulesToFile(opt::counts_file);
+  if (walk.routed())
+    walk.routeCountsToFile(opt::counts_file);
+  else
+    walk.MiniRulesToFile(opt::counts_file);
+  walk.profileToCounts(opt::counts_file);
 
   // make a bed file
   //if (opt::verbose > 0)
   //  std::cerr << "...sending merged regions to BED file" << std::endl;
   //mr->sendToBed("merged_rules.bed");
 
-  // index it
-#ifdef HAVE_BAMTOOLS
-  walk.MakeIndex();
-#endif
-
   if (opt::verbose) {
     SnowTools::displayRuntime(start);
     std::cerr << std::endl;
@@ -280,6 +627,35 @@ int main(int argc, char** argv) {
   return 0;
 }
 
+int runQc(VariantBamWalker& walk, const SnowTools::GenomicRegionVector& regions) {
+
+  if (regions.size())
+    walk.setReadRegions(regions);
+
+  if (opt::verbose)
+    std::cerr << "...writing the qc file only, on " << opt::threads << " thread(s)" << std::endl;
+
+  auto t0 = std::chrono::steady_clock::now();
+  QcRunner qc(opt::bam, opt::threads);
+  qc.run(walk, opt::verbose);
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+  std::ofstream ofs(opt::bam_qcfile);
+  if (!ofs) {
+    std::cerr << "ERROR: Could not open " << opt::bam_qcfile << " for writing" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  ofs << qc.stats();
+
+  if (opt::verbose)
+    printInputStats(walk.m_reader.inputStats(), secs, opt::threads > 1);
+  if (opt::verbose)
+    std::cerr << "...counted " << SnowTools::AddCommas<uint64_t>(qc.stats().reads()) << " reads in "
+	      << qc.stats().groups().size() << " read group(s) in " << secs << " seconds ("
+	      << (uint64_t)(qc.stats().reads() / std::max(secs, 1e-9)) << " reads/s)" << std::endl;
+  return 0;
+}
+
 void parseVarOptions(int argc, char** argv) {
 
   bool die = false;
@@ -363,8 +739,26 @@ void parseVarOptions(int argc, char** argv) {
     case 'c': arg >> opt::counts_file; break;
     case 'x': arg >> opt::counts_file; opt::counts_only = true; break;
     case 'q': arg >> opt::bam_qcfile; break;
-    case 'Q': arg >> opt::bam_qcfile; opt::counts_only = true; break;
+    case 'Q': arg >> opt::bam_qcfile; opt::counts_only = true; opt::qc_only = true; break;
     case 'P': arg >> opt::pad; break;
+    case 't': arg >> opt::threads; break;
+    case 'p': opt::pipeline = true; break;
+    case OPT_OUT_THREADS: arg >> opt::out_threads; break;
+    case OPT_COMPRESSION_LEVEL: arg >> opt::compression_level; break;
+    case OPT_MATE_SEEK: opt::mate_seek = true; break;
+    case OPT_SEEK_GAP: arg >> opt::seek_gap; break;
+    case OPT_PREFETCH: opt::prefetch = true; break;
+    case OPT_PREFETCH_WINDOW: arg >> opt::prefetch_window; opt::prefetch = true; break;
+    case OPT_DROP_QUALITIES: opt::drop_quals = true; break;
+    case OPT_DROP_NAMES: opt::drop_names = true; break;
+    case OPT_CHECKPOINT: arg >> opt::checkpoint; break;
+    case OPT_CHECKPOINT_EVERY: arg >> opt::checkpoint_every; break;
+    case OPT_NO_INDEX: opt::index = false; break;
+    case OPT_PROFILE: arg >> opt::profile; break;
+    case OPT_PER_READ_GROUP: opt::per_rg = true; break;
+    case OPT_RG_MAX_COVERAGE: arg >> opt::rg_max_cov; opt::per_rg = true; break;
+    case OPT_SEED: arg >> opt::seed; break;
+    case OPT_REGION_CACHE: arg >> opt::region_cache; break;
     case 'r': 
       {
 	std::string tmp;
@@ -420,9 +814,25 @@ void parseVarOptions(int argc, char** argv) {
 
   if (opt::bam == "")
     die = true;
+  // -1 is the default, left to the writer
+  if (opt::compression_level > 9 || opt::compression_level < -1) {
+    std::cerr << "ERROR: --compression-level must be between 0 and 9" << std::endl;
+    die = true;
+  }
+  if (opt::prefetch_window < 4) {
+    std::cerr << "ERROR: --prefetch-window must be at least 4 (MB)" << std::endl;
+    die = true;
+  }
   if (opt::out == "" && !opt::counts_only)
     opt::to_stdout = true;
 
+  // SAM on stdout isn't compressed
+  if (opt::to_stdout && (opt::compression_level >= 0 || opt::out_threads > 0)) {
+    std::cerr << "WARNING: --compression-level and --out-threads have no effect on SAM output to stdout" << std::endl;
+    opt::compression_level = -1;
+    opt::out_threads = 0;
+  }
+
   // dont stop the run for bad bams for quality checking only
   //opt::perc_limit = opt::qc_only ? 101 : opt::perc_limit;
 
@@ -434,3 +844,57 @@ void parseVarOptions(int argc, char** argv) {
 
 }
 
+
+int runMerge(int argc, char** argv) {
+
+  bool die = argc < 2;
+  bool verbose = false;
+  bool index = true;
+  std::string out, counts, qc;
+
+  for (char c; (c = getopt_long(argc, argv, merge_shortopts, merge_longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case OPT_HELP: die = true; break;
+    case 'v': verbose = true; break;
+    case 'o': arg >> out; break;
+    case OPT_NO_INDEX: index = false; break;
+    case 'c': arg >> counts; break;
+    case 'q': arg >> qc; break;
+    default: die = true;
+    }
+  }
+
+  std::vector<std::string> inputs(argv + optind, argv + argc);
+  if (inputs.empty() || (out.length() > 0) + (counts.length() > 0) + (qc.length() > 0) != 1)
+    die = true;
+  if (die) {
+    std::cerr << "\n" << VARIANT_MERGE_USAGE_MESSAGE;
+    exit(EXIT_FAILURE);
+  }
+
+  // counts and qc files are small tables
+  if (counts.length() || qc.length()) {
+    ShardMerger::mergeTables(inputs, counts.length() ? counts : qc);
+    return 0;
+  }
+
+  ShardMerger merger(verbose);
+  merger.mergeBams(inputs, out, index);
+  if (verbose)
+    std::cerr << "...merged " << SnowTools::AddCommas<uint64_t>(merger.records()) << " reads from " << inputs.size() << " BAMs. Copied "
+	      << SnowTools::AddCommas<uint64_t>(merger.blocksCopied()) << " BGZF blocks, recompressed "
+	      << SnowTools::AddCommas<uint64_t>(merger.blocksRecompressed()) << std::endl;
+  return 0;
+}
+
+void printInputStats(const HtsReader::InputStats& in, double secs, bool threads) {
+
+  if (!in.ns)
+    return;
+  std::cerr << "...input: " << in.ns / 1e9 << " s of the " << secs << " s walk reading records" << (threads ? " (over all threads)" : "")
+	    << ": " << in.cpu_ns / 1e9 << " s inflating and decoding, " << in.waitNs() / 1e9 << " s waiting on the file";
+  if (in.ahead_bytes)
+    std::cerr << ". " << SnowTools::AddCommas<uint64_t>(in.ahead_bytes) << " bytes read ahead in " << in.ahead_ns / 1e9 << " s";
+  std::cerr << std::endl;
+}
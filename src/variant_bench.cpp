@@ -0,0 +1,712 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <getopt.h>
+#include <random>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "htslib/sam.h"
+#include "SnowTools/BamRead.h"
+#include "SnowTools/MiniRules.h"
+
+#include "HtsReader.h"
+#include "BamOutput.h"
+#include "RuleProgram.h"
+#include "ReadKernels.h"
+#include "MotifMatcher.h"
+#include "TagStripper.h"
+#include "StageProfiler.h"
+#include "SimBam.h"
+#include "BenchSuite.h"
+#include "RecordArena.h"
+
+static const char *BENCH_USAGE_MESSAGE =
+"Usage: variant_bench <input.bam> [-r rules] [-m motifs] [-s tags] [case ...]\n\n"
+"  Description: Time the parts of variant on the reads of a BAM. Runs every case if none are given\n"
+"\n"
+"  -r          Rules script or file, as for variant -r. Default: keep everything\n"
+"  -m          Motif dictionary, one per line. Topped up with random motifs of the same lengths to 1M\n"
+"  -s          Tags to strip in the tags case, as for variant -s. Default: OQ,BD,BI\n"
+"\n"
+"  Cases\n"
+"    bgzf          Write the reads as BAM at each compression level with 0..N compression threads\n"
+"    rules         Reads/sec through MiniRulesCollection::isValid and through the compiled RuleProgram\n"
+"    kernels       Quality and N-count scans at each instruction set level\n"
+"    motif         Build the motif automaton and scan every read for hits, forward only and on both strands\n"
+"    core          Stream the whole BAM through the rules with and without skipping on the core fields\n"
+"    tags          Strip tags a tag at a time and with one pass over the aux block. Reads are given\n"
+"                  OQ, BD and BI tags first if they lack them, so any BAM is tag-heavy\n"
+"    profile       Reads/sec through the compiled rules with and without --profile, for its overhead\n"
+"    hold          Hold each read in a window and let it go, as the -m buffer does, with a record\n"
+"                  allocated per read and with the reads copied into a RecordArena\n"
+"\n"
+"  variant_bench simulate <out.bam> ...           Write a synthetic BAM to run on (see variant_bench simulate --help)\n"
+"  variant_bench suite <variant> <sim.bam> ...    Time whole runs of variant (see variant_bench suite --help)\n"
+"\n";
+
+static const char *SIMULATE_USAGE_MESSAGE =
+"Usage: variant_bench simulate <out.bam> [OPTIONS]\n\n"
+"  Description: Write a sorted, indexed, paired-end BAM of random reads on a random reference, with\n"
+"               out.vcf (sites on the reference) and out.motifs.txt (motifs, half in the reference) next to it.\n"
+"               The same options always give the same files\n"
+"\n"
+"      --help                           Display this help and exit\n"
+"  -d, --depth                          Depth of coverage. Default 5\n"
+"  -l, --read-length                    Read length. Default 101\n"
+"  -n, --chromosomes                    Number of chromosomes. Default 2\n"
+"  -L, --chr-length                     Length of each chromosome. Default 10000000\n"
+"  -D, --discordant                     Fraction of pairs that are far apart or on the same strand. Default 0.01\n"
+"  -c, --clipped                        Fraction of reads with 5-30 soft clipped bases. Default 0.05\n"
+"  -u, --duplicate                      Fraction of pairs written again as duplicates. Default 0.02\n"
+"  -t, --tags                           Per-base tags on each read, 0-3 (OQ, then BD, then BI). Default 3\n"
+"  -s, --seed                           Random seed. Default 1\n"
+"\n";
+
+static const char *SUITE_USAGE_MESSAGE =
+"Usage: variant_bench suite <variant> <sim.bam> [OPTIONS]\n\n"
+"  Description: Run the variant binary on a BAM from variant_bench simulate for each case, and report\n"
+"               reads/sec, MB/s of input, peak RSS and heap allocations (the fastest of --repeat runs)\n"
+"\n"
+"      --help                           Display this help and exit\n"
+"  -r, --rules                          Rules file for the whole-genome cases (eg. examples/rules.vb)\n"
+"  -w, --work-dir                       Directory for the outputs and logs of the runs. Default: that of the BAM\n"
+"  -n, --repeat                         Runs of each case. Default 3\n"
+"  -o, --results                        Append the results to this table. Default bench_results.tsv\n"
+"  -b, --baseline                       Compare with this table, and exit with an error if a case got worse.\n"
+"                                       Written from this run if it doesn't exist yet\n"
+"  -T, --tolerance                      Change that counts as worse, as a fraction. Default 0.1\n"
+"      --label                          Label for the rows of this run, eg. a commit\n"
+"\n"
+"  Cases\n"
+"    wg_rules      -r rules, writing a BAM\n"
+"    vcf_region    -l out.vcf with 100 bp of padding, writing a BAM\n"
+"    max_cov       -m 3 on every read\n"
+"    motif         a motif[out.motifs.txt] rule\n"
+"    strip_tags    every read, with -s OQ,BD,BI\n"
+"    counts_only   -x with -r rules\n"
+"    qc_only       -Q, the qc file alone\n"
+"\n";
+
+// number of reads to preload, so the input side isn't timed
+static const size_t BENCH_READS = 1000000;
+
+// size of the motif dictionary for the motif case
+static const size_t BENCH_MOTIFS = 1000000;
+
+// reads for the tags case, which holds three copies of each
+static const size_t BENCH_TAG_READS = 200000;
+
+static double secondsSince(const std::chrono::steady_clock::time_point& t)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
+// same as variant -r: a file of rules, one per line, or a rule string
+static std::string readRules(const std::string& arg)
+{
+  std::ifstream iss(arg);
+  if (!iss)
+    return "region@WG%" + arg;
+
+  std::string rules, val;
+  while (std::getline(iss, val))
+    if (val.find("#") == std::string::npos && val.length())
+      rules += (rules.length() ? "%" : "") + val;
+  return rules;
+}
+
+static void benchBgzf(const HtsReader& reader, const SnowTools::BamReadVector& reads)
+{
+  std::string tmp = "variant_bench.tmp.bam";
+
+  std::vector<int> threads = {0, 1, 2, 4};
+  int hw = std::thread::hardware_concurrency();
+  if (hw > 4)
+    threads.push_back(hw);
+
+  std::printf("%-8s %-6s %-8s %10s %10s %8s\n", "case", "level", "threads", "seconds", "MB/s", "ratio");
+  for (int level : {0, 1, 6, 9}) {
+    for (int t : threads) {
+      BamOutput out;
+      auto start = std::chrono::steady_clock::now();
+      if (!out.open(tmp, reader.header(), level, t)) {
+	std::cerr << "ERROR: Could not open " << tmp << std::endl;
+	exit(EXIT_FAILURE);
+      }
+      for (auto& r : reads)
+	out.write(r.raw());
+      out.close();
+      double secs = secondsSince(start);
+
+      const BgzfWriter& z = out.bgzf();
+      double mb = z.uncompressedBytes() / 1e6;
+      std::printf("%-8s %-6d %-8d %10.2f %10.1f %8.2f\n", "bgzf", level, t, secs, mb / secs,
+		  (double)z.uncompressedBytes() / z.compressedBytes());
+    }
+  }
+  unlink(tmp.c_str());
+}
+
+static void benchRules(const HtsReader& reader, SnowTools::BamReadVector& reads, const std::string& rules)
+{
+  std::printf("%-8s %-12s %10s %12s %10s\n", "case", "evaluator", "seconds", "reads/s", "kept");
+
+  // separate collections, so each starts with fresh counts
+  SnowTools::MiniRulesCollection mr_plain(rules, reader.header());
+  auto start = std::chrono::steady_clock::now();
+  size_t kept = 0;
+  for (auto& r : reads)
+    kept += mr_plain.isValid(r);
+  double secs = secondsSince(start);
+  std::printf("%-8s %-12s %10.2f %12.0f %10zu\n", "rules", "minirules", secs, reads.size() / secs, kept);
+
+  SnowTools::MiniRulesCollection mr_prog(rules, reader.header());
+  RuleProgram program;
+  program.compile(&mr_prog);
+  start = std::chrono::steady_clock::now();
+  size_t kept_prog = 0;
+  for (auto& r : reads)
+    kept_prog += program.isValid(r);
+  secs = secondsSince(start);
+  std::printf("%-8s %-12s %10.2f %12.0f %10zu\n", "rules", "program", secs, reads.size() / secs, kept_prog);
+
+  std::cerr << program << std::endl;
+  std::cerr << "...program rejected " << program.rejected() << " of " << reads.size() << " reads on its own" << std::endl;
+  std::cerr << "...read feature cache: " << program.features().hits() << " hits, " << program.features().misses() << " misses" << std::endl;
+  if (kept != kept_prog) {
+    std::cerr << "ERROR: program kept " << kept_prog << " reads, rules kept " << kept << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void benchKernels(const SnowTools::BamReadVector& reads)
+{
+  std::printf("%-8s %-8s %10s %12s %14s\n", "case", "level", "seconds", "MB/s", "checksum");
+
+  uint64_t bytes = 0;
+  for (auto& r : reads)
+    bytes += r.raw()->core.l_qseq;
+
+  for (auto l : {ReadKernels::SCALAR, ReadKernels::SSE42, ReadKernels::AVX2}) {
+    if (ReadKernels::setLevel(l) != l)
+      continue;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t sum = 0;
+    for (auto& r : reads) {
+      const bam1_t* b = r.raw();
+      sum += ReadKernels::countQualAtLeast(bam_get_qual(b), b->core.l_qseq, 20);
+      sum += ReadKernels::lastQualAtLeast(bam_get_qual(b), b->core.l_qseq, 20);
+      sum += ReadKernels::countN(bam_get_seq(b), b->core.l_qseq);
+    }
+    double secs = secondsSince(start);
+    // the checksum must be the same on every line
+    std::printf("%-8s %-8s %10.3f %12.1f %14llu\n", "kernels", ReadKernels::levelName(l), secs,
+		bytes * 1.5 / 1e6 / secs, (unsigned long long)sum);
+  }
+  ReadKernels::setLevel(ReadKernels::AVX2);
+}
+
+static void benchMotif(const SnowTools::BamReadVector& reads, const std::string& file)
+{
+  std::vector<std::string> motifs;
+  std::ifstream in(file);
+  std::string line;
+  while (std::getline(in, line))
+    if (line.length())
+      motifs.push_back(line);
+  if (motifs.empty()) {
+    std::cerr << "ERROR: No motifs in " << file << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // random motifs with the lengths of the real ones, so the trie has the same shape
+  std::mt19937 rng(42);
+  size_t real = motifs.size();
+  while (motifs.size() < BENCH_MOTIFS) {
+    std::string m(motifs[rng() % real].length(), 'A');
+    for (auto& c : m)
+      c = "ACGT"[rng() & 3];
+    motifs.push_back(m);
+  }
+
+  std::printf("%-8s %-12s %10s %12s %10s\n", "case", "step", "seconds", "per sec", "count");
+
+  // forward only, as the rule builds it, then both strands
+  for (int want : {(int)MotifMatcher::FORWARD, (int)MotifMatcher::BOTH}) {
+    MotifMatcher mm;
+    auto start = std::chrono::steady_clock::now();
+    mm.build(motifs, want);
+    double secs = secondsSince(start);
+    std::printf("%-8s %-12s %10.2f %12.0f %10zu\n", "motif", want == MotifMatcher::BOTH ? "build-both" : "build-fwd",
+		secs, mm.size() / secs, mm.size());
+    std::cerr << "...automaton: " << mm.states() << " states, " << mm.bytes() / (1 << 20) << " MB" << std::endl;
+
+    start = std::chrono::steady_clock::now();
+    size_t hits = 0;
+    for (auto& r : reads) {
+      const bam1_t* b = r.raw();
+      hits += mm.scan(bam_get_seq(b), b->core.l_qseq, want) != 0;
+    }
+    secs = secondsSince(start);
+    std::printf("%-8s %-12s %10.2f %12.0f %10zu\n", "motif", want == MotifMatcher::BOTH ? "scan-both" : "scan-fwd",
+		secs, reads.size() / secs, hits);
+  }
+}
+
+// the only case that times the input side, so it reads the whole file itself
+static void benchCore(const std::string& bam, const std::string& rules)
+{
+  std::printf("%-8s %-12s %10s %12s %12s %10s\n", "case", "reader", "seconds", "reads/s", "skipped", "kept");
+
+  size_t kept_plain = 0;
+  for (bool core : {false, true}) {
+    HtsReader reader;
+    if (!reader.open(bam)) {
+      std::cerr << "ERROR: Could not open " << bam << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    SnowTools::MiniRulesCollection mr(rules, reader.header());
+    RuleProgram program;
+    program.compile(&mr);
+    CoreFilter f = program.coreFilter();
+    if (core) {
+      if (!f.active)
+	std::cerr << "...the rules share no core-field condition, so nothing is skipped" << std::endl;
+      reader.setCoreFilter(f);
+    }
+
+    SnowTools::BamRead r;
+    r.assign(bam_init1());
+    size_t n = 0, kept = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (reader.next(r.raw())) {
+      ++n;
+      kept += program.isValid(r);
+    }
+    double secs = secondsSince(start);
+    n += reader.coreSkipped();
+    std::printf("%-8s %-12s %10.2f %12.0f %12llu %10zu\n", "core", core ? "core-filter" : "decode-all", secs, n / secs,
+		(unsigned long long)reader.coreSkipped(), kept);
+
+    if (!core) {
+      kept_plain = kept;
+    } else if (kept != kept_plain) {
+      std::cerr << "ERROR: kept " << kept << " reads with the core filter, " << kept_plain << " without" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+static void benchTags(const SnowTools::BamReadVector& reads, const std::string& tags)
+{
+  // tag-heavy copies: quality-length OQ, BD and BI strings, as from GATK base recalibration
+  std::vector<bam1_t*> heavy;
+  uint64_t bytes = 0;
+  for (size_t i = 0; i < reads.size() && i < BENCH_TAG_READS; ++i) {
+    bam1_t* b = bam_dup1(reads[i].raw());
+    std::string v(b->core.l_qseq, 'I');
+    for (int k = 0; k < b->core.l_qseq; ++k)
+      v[k] = 33 + std::min(bam_get_qual(b)[k], (uint8_t)93);
+    for (const char* tag : {"OQ", "BD", "BI"})
+      if (!bam_aux_get(b, tag))
+	bam_aux_append(b, tag, 'Z', v.length() + 1, (uint8_t*)&v[0]);
+    bytes += b->l_data;
+    heavy.push_back(b);
+  }
+
+  std::vector<std::string> tag_list;
+  std::istringstream iss(tags);
+  std::string tag;
+  while (std::getline(iss, tag, ','))
+    if (tag.length() == 2)
+      tag_list.push_back(tag);
+
+  TagStripper stripper;
+  stripper.setTags(tags);
+
+  std::printf("%-8s %-12s %10s %12s %12s\n", "case", "method", "seconds", "reads/s", "MB/s");
+
+  std::vector<bam1_t*> per_tag, compact;
+  for (auto b : heavy) {
+    per_tag.push_back(bam_dup1(b));
+    compact.push_back(bam_dup1(b));
+  }
+
+  // what -s did before: a search and a shift of the aux block per tag
+  auto start = std::chrono::steady_clock::now();
+  for (auto b : per_tag)
+    for (auto& t : tag_list) {
+      uint8_t* s = bam_aux_get(b, t.c_str());
+      if (s)
+	bam_aux_del(b, s);
+    }
+  double secs = secondsSince(start);
+  std::printf("%-8s %-12s %10.3f %12.0f %12.1f\n", "tags", "per-tag", secs, heavy.size() / secs, bytes / 1e6 / secs);
+
+  start = std::chrono::steady_clock::now();
+  for (auto b : compact)
+    stripper.apply(b);
+  secs = secondsSince(start);
+  std::printf("%-8s %-12s %10.3f %12.0f %12.1f\n", "tags", "compact", secs, heavy.size() / secs, bytes / 1e6 / secs);
+
+  std::cerr << "...stripped " << stripper.bytesRemoved() << " of " << bytes << " record bytes" << std::endl;
+  for (size_t i = 0; i < heavy.size(); ++i) {
+    if (per_tag[i]->l_data != compact[i]->l_data || memcmp(per_tag[i]->data, compact[i]->data, compact[i]->l_data)) {
+      std::cerr << "ERROR: the two methods differ on read " << i << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    bam_destroy1(heavy[i]);
+    bam_destroy1(per_tag[i]);
+    bam_destroy1(compact[i]);
+  }
+}
+
+static void benchHold(const SnowTools::BamReadVector& reads)
+{
+  std::printf("%-8s %-12s %10s %10s %12s %12s\n", "case", "records", "window", "seconds", "reads/s", "chunks");
+
+  for (size_t window : {1000, 100000}) {
+    uint64_t sum_alloc = 0, sum_arena = 0;
+
+    // what the -m buffer did before: a record of its own for each held read
+    std::deque<SnowTools::BamRead> held;
+    auto start = std::chrono::steady_clock::now();
+    for (auto& r : reads) {
+      held.push_back(SnowTools::BamRead());
+      held.back().assign(bam_dup1(r.raw()));
+      if (held.size() > window) {
+	sum_alloc += held.front().raw()->l_data;
+	held.pop_front();
+      }
+    }
+    held.clear();
+    double secs = secondsSince(start);
+    std::printf("%-8s %-12s %10zu %10.3f %12.0f %12s\n", "hold", "allocated", window, secs, reads.size() / secs, "-");
+
+    RecordArena arena;
+    std::deque<bam1_t*> in_arena;
+    start = std::chrono::steady_clock::now();
+    for (auto& r : reads) {
+      in_arena.push_back(arena.push(r.raw()));
+      if (in_arena.size() > window) {
+	sum_arena += in_arena.front()->l_data;
+	in_arena.pop_front();
+	arena.pop();
+      }
+    }
+    secs = secondsSince(start);
+    std::printf("%-8s %-12s %10zu %10.3f %12.0f %12llu\n", "hold", "arena", window, secs, reads.size() / secs,
+		(unsigned long long)arena.allocations());
+
+    if (sum_alloc != sum_arena) {
+      std::cerr << "ERROR: the held records differ" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+static void benchProfile(const HtsReader& reader, SnowTools::BamReadVector& reads, const std::string& rules)
+{
+  std::printf("%-8s %-12s %10s %12s %10s\n", "case", "profile", "seconds", "reads/s", "kept");
+
+  // as VariantBamWalker::nextRead times the rules
+  double secs_off = 0;
+  size_t kept_off = 0;
+  for (bool on : {false, true}) {
+    SnowTools::MiniRulesCollection mr(rules, reader.header());
+    RuleProgram program;
+    StageProfiler prof;
+    if (on) {
+      prof.enable();
+      program.setProfile(&prof);
+    }
+    program.compile(&mr);
+
+    size_t kept = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (auto& r : reads) {
+      const bool timed = prof.next();
+      uint64_t t = timed ? StageProfiler::now() : 0;
+      kept += program.isValid(r);
+      if (timed)
+	prof.lap(StageProfiler::STAGE_RULES, t);
+    }
+    double secs = secondsSince(start);
+    std::printf("%-8s %-12s %10.2f %12.0f %10zu\n", "profile", on ? "on" : "off", secs, reads.size() / secs, kept);
+
+    if (!on) {
+      secs_off = secs;
+      kept_off = kept;
+      continue;
+    }
+    std::cerr << "...overhead " << 100.0 * (secs - secs_off) / secs_off << "%, rules estimated at "
+	      << prof.estimatedNs(StageProfiler::STAGE_RULES) / 1e9 << " s" << std::endl;
+    if (kept != kept_off) {
+      std::cerr << "ERROR: kept " << kept << " reads with the profile on, " << kept_off << " with it off" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+// the files simulate writes next to out.bam
+static std::string simPrefix(const std::string& bam)
+{
+  if (bam.size() > 4 && bam.compare(bam.size() - 4, 4, ".bam") == 0)
+    return bam.substr(0, bam.size() - 4);
+  return bam;
+}
+
+static int runSimulate(int argc, char** argv)
+{
+  static const struct option longopts[] = {
+    { "help",          no_argument, NULL, 'h' },
+    { "depth",         required_argument, NULL, 'd' },
+    { "read-length",   required_argument, NULL, 'l' },
+    { "chromosomes",   required_argument, NULL, 'n' },
+    { "chr-length",    required_argument, NULL, 'L' },
+    { "discordant",    required_argument, NULL, 'D' },
+    { "clipped",       required_argument, NULL, 'c' },
+    { "duplicate",     required_argument, NULL, 'u' },
+    { "tags",          required_argument, NULL, 't' },
+    { "seed",          required_argument, NULL, 's' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  SimBam::Options o;
+  bool die = false;
+  for (int c; (c = getopt_long(argc, argv, "d:l:n:L:D:c:u:t:s:", longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'd': arg >> o.depth; break;
+    case 'l': arg >> o.read_length; break;
+    case 'n': arg >> o.chromosomes; break;
+    case 'L': arg >> o.chr_length; break;
+    case 'D': arg >> o.discordant; break;
+    case 'c': arg >> o.clipped; break;
+    case 'u': arg >> o.duplicate; break;
+    case 't': arg >> o.tags; break;
+    case 's': arg >> o.seed; break;
+    default: die = true;
+    }
+  }
+  if (die || optind + 1 != argc || o.depth <= 0 || o.read_length < 1 || o.chromosomes < 1
+      || o.chr_length < 10 * o.read_length || o.tags < 0 || o.tags > 3) {
+    std::cerr << "\n" << SIMULATE_USAGE_MESSAGE;
+    exit(EXIT_FAILURE);
+  }
+
+  std::string out = argv[optind];
+  std::string prefix = simPrefix(out);
+  SimBam sim(o);
+  auto start = std::chrono::steady_clock::now();
+  if (!sim.writeBam(out) || !sim.writeVcf(prefix + ".vcf") || !sim.writeMotifs(prefix + ".motifs.txt")) {
+    std::cerr << "ERROR: Could not write " << out << " and its VCF and motif files" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  std::cerr << "...wrote " << sim.reads() << " reads (" << sim.discordantPairs() << " discordant pairs, "
+	    << sim.clippedReads() << " clipped, " << sim.duplicateReads() << " duplicates, "
+	    << sim.unmappedReads() << " unmapped) to " << out << " in " << secondsSince(start) << " seconds" << std::endl;
+  return 0;
+}
+
+static int runSuite(int argc, char** argv)
+{
+  enum { OPT_HELP = 1, OPT_LABEL };
+  static const struct option longopts[] = {
+    { "help",          no_argument, NULL, OPT_HELP },
+    { "rules",         required_argument, NULL, 'r' },
+    { "work-dir",      required_argument, NULL, 'w' },
+    { "repeat",        required_argument, NULL, 'n' },
+    { "results",       required_argument, NULL, 'o' },
+    { "baseline",      required_argument, NULL, 'b' },
+    { "tolerance",     required_argument, NULL, 'T' },
+    { "label",         required_argument, NULL, OPT_LABEL },
+    { NULL, 0, NULL, 0 }
+  };
+
+  std::string rules, dir, results = "bench_results.tsv", baseline, label;
+  int repeat = 3;
+  double tolerance = 0.1;
+  bool die = false;
+  for (int c; (c = getopt_long(argc, argv, "r:w:n:o:b:T:", longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'r': arg >> rules; break;
+    case 'w': arg >> dir; break;
+    case 'n': arg >> repeat; break;
+    case 'o': arg >> results; break;
+    case 'b': arg >> baseline; break;
+    case 'T': arg >> tolerance; break;
+    case OPT_LABEL: arg >> label; break;
+    default: die = true;
+    }
+  }
+  if (die || optind + 2 != argc || repeat < 1) {
+    std::cerr << "\n" << SUITE_USAGE_MESSAGE;
+    exit(EXIT_FAILURE);
+  }
+
+  std::string variant = argv[optind];
+  std::string bam = argv[optind + 1];
+  std::string prefix = simPrefix(bam);
+  if (dir.empty()) {
+    size_t slash = bam.rfind('/');
+    dir = slash == std::string::npos ? "." : bam.substr(0, slash);
+  }
+
+  // read once for the count, which also leaves the file in the page cache for every case alike
+  HtsReader reader;
+  if (!reader.open(bam)) {
+    std::cerr << "ERROR: Could not open " << bam << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  uint64_t reads = 0;
+  bam1_t* b = bam_init1();
+  while (reader.next(b))
+    ++reads;
+  bam_destroy1(b);
+
+  BenchSuite suite(variant, bam, reads, dir);
+  if (rules.length())
+    suite.add("wg_rules", {"{bam}", "-r", rules, "-o", "{dir}/wg_rules.bam", "--no-index"});
+  else
+    std::cerr << "...no -r, so skipping wg_rules and counts_only" << std::endl;
+  if (access((prefix + ".vcf").c_str(), R_OK) == 0)
+    suite.add("vcf_region", {"{bam}", "-P", "100", "-l", prefix + ".vcf", "-o", "{dir}/vcf_region.bam", "--no-index"});
+  else
+    std::cerr << "...no " << prefix << ".vcf, so skipping vcf_region" << std::endl;
+  suite.add("max_cov", {"{bam}", "-r", "all", "-m", "3", "-o", "{dir}/max_cov.bam", "--no-index"});
+  if (access((prefix + ".motifs.txt").c_str(), R_OK) == 0)
+    suite.add("motif", {"{bam}", "-r", "motif[" + prefix + ".motifs.txt]", "-o", "{dir}/motif.bam", "--no-index"});
+  else
+    std::cerr << "...no " << prefix << ".motifs.txt, so skipping motif" << std::endl;
+  suite.add("strip_tags", {"{bam}", "-r", "all", "-s", "OQ,BD,BI", "-o", "{dir}/strip_tags.bam", "--no-index"});
+  if (rules.length())
+    suite.add("counts_only", {"{bam}", "-r", rules, "-x", "{dir}/counts_only.counts"});
+  suite.add("qc_only", {"{bam}", "-Q", "{dir}/qc_only.txt"});
+
+  std::cerr << "...running on " << reads << " reads of " << bam << std::endl;
+  bool ok = suite.run(repeat);
+  for (auto f : {"wg_rules.bam", "vcf_region.bam", "max_cov.bam", "motif.bam", "strip_tags.bam", "counts_only.counts", "qc_only.txt"})
+    unlink((dir + "/" + f).c_str());
+  if (!ok)
+    exit(EXIT_FAILURE);
+
+  if (!suite.appendTable(results, label)) {
+    std::cerr << "ERROR: Could not write " << results << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  std::cerr << "...results added to " << results << std::endl;
+
+  if (baseline.empty())
+    return 0;
+  std::vector<BenchSuite::Result> base;
+  if (!BenchSuite::readTable(baseline, base)) {
+    if (access(baseline.c_str(), F_OK) == 0) {
+      std::cerr << "ERROR: " << baseline << " is not a table from variant_bench suite" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    suite.appendTable(baseline, label);
+    std::cerr << "...no baseline yet, so this run is now " << baseline << std::endl;
+    return 0;
+  }
+
+  std::vector<std::string> worse = BenchSuite::compare(base, suite.results(), tolerance);
+  for (auto& w : worse)
+    std::cerr << "REGRESSION " << w << std::endl;
+  if (worse.size()) {
+    std::cerr << "ERROR: " << worse.size() << " case(s) more than " << 100 * tolerance << "% worse than " << baseline << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  std::cerr << "...no case more than " << 100 * tolerance << "% worse than " << baseline << std::endl;
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc > 1 && std::string(argv[1]) == "simulate")
+    return runSimulate(argc - 1, argv + 1);
+  if (argc > 1 && std::string(argv[1]) == "suite")
+    return runSuite(argc - 1, argv + 1);
+
+  if (argc < 2) {
+    std::cerr << "\n" << BENCH_USAGE_MESSAGE;
+    exit(EXIT_FAILURE);
+  }
+
+  std::string rules = "region@WG";
+  std::string motifs;
+  std::string tags = "OQ,BD,BI";
+  std::vector<std::string> cases;
+  for (int i = 2; i < argc; ++i) {
+    std::string a = argv[i];
+    if (a == "-r" && i + 1 < argc)
+      rules = readRules(argv[++i]);
+    else if (a == "-m" && i + 1 < argc)
+      motifs = argv[++i];
+    else if (a == "-s" && i + 1 < argc)
+      tags = argv[++i];
+    else
+      cases.push_back(a);
+  }
+  if (cases.empty()) {
+    cases = {"bgzf", "rules", "kernels", "core", "tags", "profile", "hold"};
+    if (motifs.length())
+      cases.push_back("motif");
+  }
+
+  HtsReader reader;
+  if (!reader.open(argv[1])) {
+    std::cerr << "ERROR: Could not open " << argv[1] << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  SnowTools::BamReadVector reads;
+  while (reads.size() < BENCH_READS) {
+    bam1_t* b = bam_init1();
+    if (!reader.next(b)) {
+      bam_destroy1(b);
+      break;
+    }
+    reads.push_back(SnowTools::BamRead());
+    reads.back().assign(b);
+  }
+  std::cerr << "...loaded " << reads.size() << " reads from " << argv[1] << std::endl;
+
+  for (auto& c : cases) {
+    if (c == "bgzf") {
+      benchBgzf(reader, reads);
+    } else if (c == "rules") {
+      benchRules(reader, reads, rules);
+    } else if (c == "kernels") {
+      benchKernels(reads);
+    } else if (c == "motif") {
+      if (motifs.empty()) {
+	std::cerr << "ERROR: The motif case needs -m\n\n" << BENCH_USAGE_MESSAGE;
+	exit(EXIT_FAILURE);
+      }
+      benchMotif(reads, motifs);
+    } else if (c == "core") {
+      benchCore(argv[1], rules);
+    } else if (c == "tags") {
+      benchTags(reads, tags);
+    } else if (c == "profile") {
+      benchProfile(reader, reads, rules);
+    } else if (c == "hold") {
+      benchHold(reads);
+    } else {
+      std::cerr << "ERROR: Unknown case " << c << "\n\n" << BENCH_USAGE_MESSAGE;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return 0;
+}
@@ -1,8 +1,72 @@
+#include <algorithm>
+#include <chrono>
 #include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <sys/stat.h>
+#include <thread>
+#include <zlib.h>
 #include <boost/test/unit_test.hpp>
 
 #include "SnowTools/MiniRules.h"
 #include "VariantBamWalker.h"
+#include "ShardRunner.h"
+#include "QcRunner.h"
+#include "ReadPipeline.h"
+#include "SpscQueue.h"
+#include "BgzfWriter.h"
+#include "StreamingCoverage.h"
+#include "RuleProgram.h"
+#include "HtsReader.h"
+#include "ReadFeatures.h"
+#include "ReadKernels.h"
+#include "IntervalIndex.h"
+#include "MateLinkPlanner.h"
+#include "BlockPrefetcher.h"
+#include "MotifMatcher.h"
+#include "CoreFilter.h"
+#include "TagStripper.h"
+#include "Checkpoint.h"
+#include "BaiBuilder.h"
+#include "ShardMerge.h"
+#include "RouteScript.h"
+#include "BamOutput.h"
+#include "StageProfiler.h"
+#include "SimBam.h"
+#include "BenchSuite.h"
+#include "QcStats.h"
+#include "RecordArena.h"
+#include "CoverageSampler.h"
+#include "RegionCache.h"
+
+// build a record by hand. cigar is a list of (op, length), seq is ACGTN
+static bam1_t* makeRead(const std::vector<std::pair<int, int> >& cigar, const std::string& seq, const std::vector<uint8_t>& qual)
+{
+  bam1_t* b = bam_init1();
+  b->core.l_qname = 2;
+  b->core.n_cigar = cigar.size();
+  b->core.l_qseq = seq.size();
+  b->l_data = 2 + 4 * cigar.size() + (seq.size() + 1) / 2 + seq.size();
+  b->m_data = b->l_data;
+  b->data = (uint8_t*)realloc(b->data, b->m_data);
+  memcpy(b->data, "r", 2);
+  for (size_t i = 0; i < cigar.size(); ++i)
+    bam_get_cigar(b)[i] = cigar[i].second << BAM_CIGAR_SHIFT | cigar[i].first;
+  uint8_t* s = bam_get_seq(b);
+  memset(s, 0, (seq.size() + 1) / 2);
+  for (size_t i = 0; i < seq.size(); ++i) {
+    static const std::string codes = "=ACMGRSVTWYHKDBN";
+    s[i >> 1] |= codes.find(seq[i]) << ((~i & 1) << 2);
+  }
+  memcpy(bam_get_qual(b), qual.data(), seq.size());
+  return b;
+}
 
 BOOST_AUTO_TEST_CASE( example_case_1 ) {
 
@@ -105,3 +169,1655 @@ BOOST_AUTO_TEST_CASE( example_case_3 ) {
   BOOST_TEST( !fr->qcfail.isNA());  
 
 }
+
+// the reads a walk of small.bam keeps, in the order they are written. With
+// threads > 1 the walk is cut into shards of this width, as variant -t does,
+// or with pipeline run by that many evaluators, as variant --pipeline does
+static std::vector<std::string> walkKept(const std::string& rules, const SnowTools::GenomicRegionVector& grv,
+					 int max_cov, int threads, int32_t width, bool pipeline = false)
+{
+  VariantBamWalker walk("small.bam");
+  walk.SetMiniRulesCollection(rules);
+  walk.max_cov = max_cov;
+  if (grv.size())
+    walk.setReadRegions(grv);
+
+  std::vector<std::string> kept;
+  walk.m_sink = [&](SnowTools::BamRead& r) {
+    kept.push_back(r.Qname() + ":" + std::to_string(r.AlignmentFlag()) + ":" + std::to_string(r.ChrID()) + ":"
+		   + std::to_string(r.Position()));
+  };
+
+  if (pipeline) {
+    ReadPipeline pipe(rules, threads);
+    pipe.run(walk, false);
+  } else if (threads > 1) {
+    ShardRunner shards("small.bam", threads);
+    shards.setShardWidth(width);
+    BOOST_REQUIRE( shards.setup(walk) );
+    BOOST_TEST( shards.size() > 2 );
+    shards.run(walk, false);
+  } else {
+    walk.writeVariantBam();
+  }
+  return kept;
+}
+
+BOOST_AUTO_TEST_CASE( shard_runner ) {
+
+  HtsReader h;
+  BOOST_REQUIRE( h.open("small.bam") );
+  BOOST_REQUIRE_MESSAGE( h.loadIndex(), "small.bam needs an index for this test (samtools index small.bam)" );
+
+  // the span of the reads on the first chromosome with any, cut into about 20 shards
+  bam1_t* b = bam_init1();
+  int32_t tid = -1, first = INT32_MAX, last = 0;
+  while (h.next(b)) {
+    if (b->core.tid < 0 || (tid >= 0 && b->core.tid != tid))
+      continue;
+    tid = b->core.tid;
+    first = std::min(first, b->core.pos);
+    last = std::max(last, b->core.pos);
+  }
+  bam_destroy1(b);
+  BOOST_REQUIRE( tid >= 0 && last > first );
+  const int32_t width = std::max(1000, (last - first) / 20);
+
+  SnowTools::GenomicRegionVector span = {SnowTools::GenomicRegion(tid, first, last + 1)};
+  // two pieces with a gap, so that a shard can start on a region that isn't cut from the one before
+  SnowTools::GenomicRegionVector pieces = {SnowTools::GenomicRegion(tid, first, first + (last - first) / 3),
+					   SnowTools::GenomicRegion(tid, first + (last - first) / 2, last + 1)};
+
+  const std::string rules = "global@!duplicate;!qcfail%region@WG%discordant[0,1000];mapq[1,1000]%mapq[1,1000];clip[5,1000]%supplementary";
+
+  for (auto& grv : {span, pieces}) {
+    // the reads that cross a shard cut are kept once, and in the same order
+    std::vector<std::string> one = walkKept(rules, grv, 0, 1, width);
+    BOOST_TEST( one.size() > 0 );
+    BOOST_TEST( walkKept(rules, grv, 0, 4, width) == one );
+
+    // -m: each shard reads the depth around it, and keeps its own reads only
+    std::vector<std::string> one_cov = walkKept("region@WG%all", grv, 5, 1, width);
+    BOOST_TEST( one_cov.size() > 0 );
+    BOOST_TEST( walkKept("region@WG%all", grv, 5, 4, width) == one_cov );
+  }
+
+  // the whole file, with the reads that have no position at the end
+  BOOST_TEST( walkKept(rules, SnowTools::GenomicRegionVector(), 0, 4, ShardRunner::SHARD_WIDTH) ==
+	      walkKept(rules, SnowTools::GenomicRegionVector(), 0, 1, ShardRunner::SHARD_WIDTH) );
+
+  // shard walkers copy the rules and share the region indexes of the main walker
+  const std::string region_rules = "region@test.vcf%mapq[1,1000]%mlregion@test.vcf%all";
+  VariantBamWalker main_walk("small.bam");
+  main_walk.SetMiniRulesCollection(region_rules);
+  VariantBamWalker shard_walk;
+  BOOST_REQUIRE( shard_walk.m_reader.open("small.bam") );
+  shard_walk.copyMiniRulesCollection(main_walk);
+  BOOST_CHECK_EQUAL( shard_walk.m_program.sharedGates(), 2 );
+  BOOST_CHECK_EQUAL( shard_walk.m_program.size(), main_walk.m_program.size() );
+  BOOST_CHECK_EQUAL( shard_walk.GetMiniRulesCollection().m_regions[0].mrc, &shard_walk.GetMiniRulesCollection() );
+  BOOST_TEST( walkKept(region_rules, SnowTools::GenomicRegionVector(), 0, 4, ShardRunner::SHARD_WIDTH) ==
+	      walkKept(region_rules, SnowTools::GenomicRegionVector(), 0, 1, ShardRunner::SHARD_WIDTH) );
+
+  // -Q: the reads at a shard cut are counted once
+  auto qcOf = [](const SnowTools::GenomicRegionVector& grv, int threads, int32_t w) {
+    VariantBamWalker walk("small.bam");
+    if (grv.size())
+      walk.setReadRegions(grv);
+    QcRunner qc("small.bam", threads);
+    qc.setShardWidth(w);
+    qc.run(walk, false);
+    BOOST_TEST( (threads > 1) == (qc.shards() > 2) );
+    BOOST_TEST( qc.stats().reads() > 0 );
+    std::ostringstream out;
+    out << qc.stats();
+    return out.str();
+  };
+  for (auto& grv : {span, pieces})
+    BOOST_TEST( qcOf(grv, 4, width) == qcOf(grv, 1, width) );
+  BOOST_TEST( qcOf(SnowTools::GenomicRegionVector(), 4, ShardRunner::SHARD_WIDTH) ==
+	      qcOf(SnowTools::GenomicRegionVector(), 1, ShardRunner::SHARD_WIDTH) );
+
+}
+
+BOOST_AUTO_TEST_CASE( spsc_queue ) {
+
+  SpscQueue<int> q(5);
+  BOOST_CHECK_EQUAL( q.capacity(), 8 );
+
+  // fill it up
+  for (int i = 0; i < 8; ++i)
+    BOOST_TEST( q.tryPush(i) );
+  BOOST_TEST( !q.tryPush(8) );
+
+  int v;
+  for (int i = 0; i < 8; ++i) {
+    BOOST_TEST( q.tryPop(v) );
+    BOOST_CHECK_EQUAL( v, i );
+  }
+  BOOST_TEST( !q.tryPop(v) );
+
+  // order is kept across threads, with a full ring holding the producer back
+  const int n = 100000;
+  std::thread producer([&q]() { for (int i = 0; i < n; ++i) q.push(i); });
+  bool in_order = true;
+  for (int i = 0; i < n; ++i) {
+    q.pop(v);
+    in_order = in_order && v == i;
+  }
+  producer.join();
+  BOOST_TEST( in_order );
+  BOOST_TEST( !q.tryPop(v) );
+
+}
+
+BOOST_AUTO_TEST_CASE( read_pipeline ) {
+
+  const std::string rules = "global@!duplicate;!qcfail%region@WG%discordant[0,1000];mapq[1,1000]%mapq[1,1000];clip[5,1000]%supplementary";
+  const SnowTools::GenomicRegionVector all;
+
+  // batches dealt round-robin and collected in the same order give the reads of the plain walk
+  std::vector<std::string> plain = walkKept(rules, all, 0, 1, 0);
+  BOOST_TEST( plain.size() > 0 );
+  for (int evaluators : {1, 2, 3})
+    BOOST_TEST( walkKept(rules, all, 0, evaluators, 0, true) == plain );
+
+  // everything, so the batches are full and the end of the input falls in the last one
+  std::vector<std::string> every = walkKept("region@WG%all", all, 0, 1, 0);
+  BOOST_TEST( every.size() > ReadPipeline::BATCH_SIZE );
+  BOOST_TEST( walkKept("region@WG%all", all, 0, 3, 0, true) == every );
+
+  // with no output holding on to reads, the reader reads into the records of written batches
+  VariantBamWalker walk("small.bam");
+  walk.SetMiniRulesCollection(rules);
+  ReadPipeline pipe(rules, 2);
+  pipe.run(walk, false);
+  const uint64_t in_flight = 2 * (2 * ReadPipeline::QUEUE_SIZE + 1) + 2;
+  BOOST_TEST( pipe.batchesMade() <= in_flight );
+  // the writer keeps the last read of a batch for its message, which costs the reader a record
+  const uint64_t batches = walk.rc_main.total / ReadPipeline::BATCH_SIZE + 1;
+  BOOST_TEST( walk.m_read_allocs <= pipe.batchesMade() * ReadPipeline::BATCH_SIZE + batches );
+
+}
+
+BOOST_AUTO_TEST_CASE( bgzf_writer ) {
+
+  // a few blocks worth of data, written in odd-sized records
+  std::string data;
+  for (int i = 0; data.size() < 3 * BgzfWriter::BLOCK_SIZE; ++i)
+    data += "read" + std::to_string(i) + std::string(i % 300, 'A' + i % 4);
+
+  std::vector<std::string> files;
+  for (int threads : {0, 3}) {
+    std::string file = "bgzf_writer_test" + std::to_string(threads) + ".bam";
+    BgzfWriter w;
+    BOOST_TEST( w.open(file, 1, threads) );
+    for (size_t i = 0; i < data.size(); i += 1000) {
+      size_t n = std::min<size_t>(1000, data.size() - i);
+      size_t h = std::min<size_t>(10, n);
+      w.writeRecord(data.data() + i, h, data.data() + i + h, n - h);
+    }
+    w.close();
+    BOOST_CHECK_EQUAL( w.uncompressedBytes(), data.size() );
+    files.push_back(file);
+  }
+
+  // same file for any number of threads
+  std::ifstream a(files[0], std::ios::binary), b(files[1], std::ios::binary);
+  std::string sa((std::istreambuf_iterator<char>(a)), std::istreambuf_iterator<char>());
+  std::string sb((std::istreambuf_iterator<char>(b)), std::istreambuf_iterator<char>());
+  BOOST_TEST( sa == sb );
+
+  // and it is a valid gzip stream holding the data
+  gzFile gz = gzopen(files[1].c_str(), "rb");
+  std::string back(data.size() + 1, 0);
+  int n = gzread(gz, &back[0], back.size());
+  gzclose(gz);
+  BOOST_CHECK_EQUAL( n, (int)data.size() );
+  back.resize(n);
+  BOOST_TEST( back == data );
+
+  for (auto& f : files)
+    std::remove(f.c_str());
+
+}
+
+BOOST_AUTO_TEST_CASE( streaming_coverage ) {
+
+  // sorted reads, some longer than the starting window so it has to grow
+  std::vector<std::pair<int, int> > reads;
+  srand(42);
+  for (int pos = 100; pos < 20000; pos += rand() % 20)
+    reads.push_back({pos, pos + 50 + (rand() % 100 == 0 ? 3000 : rand() % 100)});
+
+  std::vector<int> truth(30000, 0);
+  for (auto& r : reads)
+    for (int p = r.first; p < r.second; ++p)
+      ++truth[p];
+
+  // check each read's ends once no later read can reach them, as the walker does
+  StreamingCoverage cov(1024);
+  cov.reset(0);
+  std::deque<std::pair<int, int> > held;
+  bool ok = true;
+  for (auto& r : reads) {
+    while (held.size() && held.front().second <= r.first) {
+      ok = ok && cov.depth(held.front().first) == truth[held.front().first];
+      ok = ok && cov.depth(held.front().second - 1) == truth[held.front().second - 1];
+      held.pop_front();
+    }
+    cov.add(r.first, r.second);
+    held.push_back(r);
+    cov.advance(held.front().first);
+  }
+  for (auto& r : held)
+    ok = ok && cov.depth(r.first) == truth[r.first] && cov.depth(r.second - 1) == truth[r.second - 1];
+  BOOST_TEST( ok );
+  BOOST_TEST( cov.window() >= 4096 );
+
+  // dropped positions read as 0, and a new chromosome starts empty
+  BOOST_CHECK_EQUAL( cov.depth(100), 0 );
+  cov.reset(1);
+  BOOST_CHECK_EQUAL( cov.depth(reads.back().first), 0 );
+
+}
+
+BOOST_AUTO_TEST_CASE( rule_program ) {
+
+  SnowTools::BamWalker bw("small.bam");
+  std::string rules = "global@!duplicate;!qcfail%region@WG%discordant[0,1000];mapq[1,1000]%mapq[1,1000];clip[5,1000]%supplementary";
+  SnowTools::MiniRulesCollection mr(rules, bw.header());
+  SnowTools::MiniRulesCollection mr_prog(rules, bw.header());
+
+  RuleProgram program;
+  program.compile(&mr_prog);
+  BOOST_CHECK_EQUAL( program.size(), mr.numRules() );
+  BOOST_TEST( program.filters() );
+
+  // same decision as the rules for every read of small.bam. returns the reads
+  auto sameOnFile = [](SnowTools::MiniRulesCollection& full, RuleProgram& prog) {
+    HtsReader reader;
+    BOOST_TEST( reader.open("small.bam") );
+    size_t n = 0, same = 0;
+    for (;;) {
+      bam1_t* b = bam_init1();
+      if (!reader.next(b)) {
+	bam_destroy1(b);
+	break;
+      }
+      SnowTools::BamRead r;
+      r.assign(b);
+      same += full.isValid(r) == prog.isValid(r);
+      ++n;
+    }
+    BOOST_CHECK_EQUAL( same, n );
+    return n;
+  };
+
+  size_t n = sameOnFile(mr, program);
+  BOOST_CHECK_EQUAL( program.rejected() + program.evaluated(), n );
+
+  // a rule that keeps everything leaves nothing to rule out
+  SnowTools::MiniRulesCollection mr_all("region@WG%mapq[10,100]%all", bw.header());
+  RuleProgram all;
+  all.compile(&mr_all);
+  BOOST_TEST( !all.filters() );
+
+  // ins, del and nbases: a read passes if any one operation is in the range
+  std::string indel_rules = "region@WG%ins[1,5]%del[3,4]%nbases[2,3]";
+  SnowTools::MiniRulesCollection mr_indel(indel_rules, bw.header());
+  SnowTools::MiniRulesCollection mr_indel_prog(indel_rules, bw.header());
+  RuleProgram indel;
+  indel.compile(&mr_indel_prog);
+
+  sameOnFile(mr_indel, indel);
+
+  // reads with several indels, whose totals are out of the ranges
+  std::string seq(60, 'A');
+  seq[3] = seq[20] = seq[40] = seq[50] = 'N';
+  std::vector<uint8_t> qual(seq.size(), 30);
+  const std::vector<std::vector<std::pair<int, int> > > cigars = {
+    {{BAM_CMATCH, 20}, {BAM_CINS, 5}, {BAM_CMATCH, 10}, {BAM_CINS, 5}, {BAM_CMATCH, 20}},
+    {{BAM_CMATCH, 20}, {BAM_CINS, 8}, {BAM_CMATCH, 10}, {BAM_CINS, 2}, {BAM_CMATCH, 20}},
+    {{BAM_CMATCH, 30}, {BAM_CDEL, 3}, {BAM_CMATCH, 10}, {BAM_CDEL, 4}, {BAM_CMATCH, 20}},
+    {{BAM_CMATCH, 30}, {BAM_CDEL, 9}, {BAM_CMATCH, 30}},
+    {{BAM_CMATCH, 60}}};
+  for (auto& cig : cigars) {
+    bam1_t* b = makeRead(cig, seq, qual);
+    b->core.pos = 10000;
+    SnowTools::BamRead r;
+    r.assign(b);
+    BOOST_CHECK_EQUAL( mr_indel.isValid(r), indel.isValid(r) );
+  }
+
+  // phred trimming: the length, clip and N checks are bounds on the trimmed read
+  const std::vector<std::string> trim_rules = {
+    "global@nbases[0,0];!hardclip;!supplementary;!duplicate;!qcfail;phred[4,100];%region@WG%discordant[0,1000];mapq[1,1000]%mapq[1,1000];clip[5,1000]%ins[1,1000];mapq[1,100]%del[1,1000];mapq[1,1000]",
+    "global@phred[4,100]%region@WG%clip[5,1000]%nbases[1,5]%length[60,1000]%!length[0,40];clip[1,1000]"};
+  for (auto& rs : trim_rules) {
+    SnowTools::MiniRulesCollection mr_trim(rs, bw.header());
+    SnowTools::MiniRulesCollection mr_trim_prog(rs, bw.header());
+    RuleProgram trim;
+    trim.compile(&mr_trim_prog);
+    BOOST_TEST( trim.filters() );
+    sameOnFile(mr_trim, trim);
+
+    // soft clips with low quality tails, Ns in and out of them, and reads
+    // that trim down to nothing
+    std::string tseq(70, 'C');
+    tseq[2] = tseq[35] = tseq[68] = 'N';
+    const std::vector<std::pair<int, int> > clipped = {{BAM_CSOFT_CLIP, 10}, {BAM_CMATCH, 50}, {BAM_CSOFT_CLIP, 10}};
+    const std::vector<std::pair<int, int> > left = {{BAM_CSOFT_CLIP, 8}, {BAM_CMATCH, 62}};
+    const std::vector<std::pair<int, int> > hard = {{BAM_CHARD_CLIP, 6}, {BAM_CMATCH, 64}, {BAM_CSOFT_CLIP, 6}};
+    for (auto& cig : {clipped, left, hard})
+      for (int tail : {0, 2, 3, 10, 30})
+	for (int body : {2, 30}) {
+	  std::vector<uint8_t> tqual(tseq.size(), body);
+	  for (int i = 0; i < tail; ++i)
+	    tqual[i] = tqual[tseq.size() - 1 - i] = 2;
+	  bam1_t* b = makeRead(cig, tseq, tqual);
+	  b->core.pos = 10000;
+	  b->core.qual = 60;
+	  SnowTools::BamRead r;
+	  r.assign(b);
+	  BOOST_CHECK_EQUAL( mr_trim.isValid(r), trim.isValid(r) );
+	}
+  }
+
+}
+
+BOOST_AUTO_TEST_CASE( read_features ) {
+
+  // 3S 10M 2I 5M 4D 5M 5S 7H
+  std::string seq = "ACGNNACGTACGTACGTNACGTACGTACGT";
+  std::vector<uint8_t> qual(seq.size(), 30);
+  qual[seq.size() - 1] = qual[seq.size() - 2] = 2;
+  bam1_t* b = makeRead({{BAM_CSOFT_CLIP, 3}, {BAM_CMATCH, 10}, {BAM_CINS, 2}, {BAM_CMATCH, 5}, {BAM_CDEL, 4},
+			{BAM_CMATCH, 5}, {BAM_CSOFT_CLIP, 5}, {BAM_CHARD_CLIP, 7}}, seq, qual);
+
+  ReadFeatures f;
+  f.reset(b);
+  BOOST_CHECK_EQUAL( f.insBases(), 2 );
+  BOOST_CHECK_EQUAL( f.delBases(), 4 );
+  BOOST_CHECK_EQUAL( f.maxInsOp(), 2 );
+  BOOST_CHECK_EQUAL( f.maxDelOp(), 4 );
+  BOOST_CHECK_EQUAL( f.softClipLeft(), 3 );
+  BOOST_CHECK_EQUAL( f.softClipRight(), 5 );
+  BOOST_CHECK_EQUAL( f.hardClipBases(), 7 );
+  BOOST_CHECK_EQUAL( f.clipBases(), 15 );
+  BOOST_CHECK_EQUAL( f.nBases(), 3 );
+  BOOST_CHECK_EQUAL( f.trimmedEnd(4), 28 );
+  BOOST_CHECK_EQUAL( f.trimmedEnd(31), 0 );
+
+  // one CIGAR walk served all seven CIGAR features
+  BOOST_CHECK_EQUAL( f.misses(), 4 );
+  BOOST_CHECK_EQUAL( f.hits(), 7 );
+
+  // a new read starts empty
+  f.reset(b);
+  f.nBases();
+  BOOST_CHECK_EQUAL( f.misses(), 5 );
+
+  bam_destroy1(b);
+
+}
+
+BOOST_AUTO_TEST_CASE( read_kernels ) {
+
+  std::srand(7);
+  const ReadKernels::Level levels[] = {ReadKernels::SCALAR, ReadKernels::SSE42, ReadKernels::AVX2};
+
+  for (int n = 0; n <= 300; n += (n < 70 ? 1 : 37)) {
+    std::vector<uint8_t> qual(n), seq((n + 1) / 2);
+    for (auto& q : qual)
+      q = std::rand() % 64;
+    for (auto& s : seq)
+      s = std::rand() % 8 ? std::rand() % 256 : 0xff;
+    // a run of low qualities at the end, to exercise the backwards scan
+    for (int i = n - std::min(n, n / 3); i < n; ++i)
+      qual[i] %= 10;
+
+    int cn = ReadKernels::scalar::countN(seq.data(), n);
+    for (auto l : levels) {
+      ReadKernels::setLevel(l);
+      BOOST_CHECK_EQUAL( ReadKernels::countN(seq.data(), n), cn );
+      for (int t : {0, 1, 5, 10, 30, 63, 64, 200, 255}) {
+	BOOST_CHECK_EQUAL( ReadKernels::countQualAtLeast(qual.data(), n, t),
+			   ReadKernels::scalar::countQualAtLeast(qual.data(), n, t) );
+	BOOST_CHECK_EQUAL( ReadKernels::lastQualAtLeast(qual.data(), n, t),
+			   ReadKernels::scalar::lastQualAtLeast(qual.data(), n, t) );
+      }
+    }
+  }
+  ReadKernels::setLevel(ReadKernels::AVX2);
+
+  // qualities above 127 compare unsigned
+  std::vector<uint8_t> high(40, 200);
+  BOOST_CHECK_EQUAL( ReadKernels::countQualAtLeast(high.data(), 40, 100), 40 );
+  BOOST_CHECK_EQUAL( ReadKernels::lastQualAtLeast(high.data(), 40, 201), 0 );
+
+}
+
+BOOST_AUTO_TEST_CASE( interval_index ) {
+
+  std::srand(11);
+  std::vector<std::vector<std::pair<int, int> > > ivs(3);
+  IntervalIndex idx;
+  for (int i = 0; i < 2000; ++i) {
+    int c = std::rand() % 3;
+    int s = std::rand() % 100000;
+    int e = s + std::rand() % 200;
+    ivs[c].push_back({s, e});
+    idx.add(c, s, e);
+  }
+  idx.build();
+  BOOST_CHECK( idx.size() < 2000 ); // some merged
+
+  auto naive = [&](int c, int s, int e) {
+    if (c < 0 || c >= 3)
+      return false;
+    for (auto& iv : ivs[c])
+      if (iv.first <= e && s <= iv.second)
+	return true;
+    return false;
+  };
+
+  // sorted queries, as from a coordinate-sorted BAM
+  IntervalIndex::Cursor cur;
+  for (int c = -1; c < 5; ++c)
+    for (int s = 0; s < 101000; s += 1 + std::rand() % 50) {
+      int e = s + std::rand() % 150;
+      BOOST_REQUIRE_EQUAL( idx.overlaps(cur, c, s, e), naive(c, s, e) );
+    }
+  BOOST_CHECK_EQUAL( cur.seeks, 5 ); // once per chromosome, never within one
+
+  // unsorted queries fall back to a search, and still agree
+  IntervalIndex::Cursor rcur;
+  for (int i = 0; i < 5000; ++i) {
+    int c = std::rand() % 4;
+    int s = std::rand() % 101000;
+    int e = s + std::rand() % 150;
+    BOOST_REQUIRE_EQUAL( idx.overlaps(rcur, c, s, e), naive(c, s, e) );
+    BOOST_REQUIRE_EQUAL( idx.overlaps(c, s, e), naive(c, s, e) );
+  }
+
+  // touching intervals merge
+  IntervalIndex t;
+  t.add(0, 10, 20);
+  t.add(0, 21, 30);
+  t.add(0, 40, 50);
+  t.build();
+  BOOST_CHECK_EQUAL( t.size(), 2 );
+  BOOST_CHECK( !t.overlaps(0, 31, 39) );
+  BOOST_CHECK( t.overlaps(0, 30, 39) );
+
+  // a serialized index is queried in place, without a copy
+  std::string block;
+  idx.serialize(block);
+  BOOST_CHECK_EQUAL( block.size() % 8, 0 );
+  std::shared_ptr<std::vector<uint64_t> > mem(new std::vector<uint64_t>(block.size() / 8));
+  memcpy(mem->data(), block.data(), block.size());
+  IntervalIndex v;
+  BOOST_REQUIRE( v.view((const uint8_t*)mem->data(), block.size(), mem) );
+  BOOST_TEST( v.viewed() );
+  BOOST_CHECK_EQUAL( v.size(), idx.size() );
+  BOOST_CHECK_EQUAL( v.bytes(), 0 );
+  IntervalIndex::Cursor vcur;
+  for (int c = -1; c < 5; ++c)
+    for (int s = 0; s < 101000; s += 1 + std::rand() % 50) {
+      int e = s + std::rand() % 150;
+      BOOST_REQUIRE_EQUAL( v.overlaps(vcur, c, s, e), naive(c, s, e) );
+    }
+  IntervalIndex vc = v;
+  BOOST_TEST( vc.viewed() );
+  BOOST_CHECK_EQUAL( vc.bytes(), 0 );
+
+  // a cut or unaligned block is turned down
+  IntervalIndex bad;
+  BOOST_TEST( !bad.view((const uint8_t*)mem->data(), block.size() - 8, mem) );
+  BOOST_TEST( !bad.view((const uint8_t*)mem->data() + 4, block.size() - 8, mem) );
+  BOOST_TEST( !bad.viewed() );
+
+  // more intervals on top of a view are merged into a copy of its own
+  v.add(0, 200000, 200010);
+  v.build();
+  BOOST_TEST( !v.viewed() );
+  BOOST_CHECK_EQUAL( v.size(), idx.size() + 1 );
+  BOOST_TEST( v.overlaps(0, 200005, 200005) );
+  BOOST_CHECK_EQUAL( vc.size(), idx.size() );
+
+}
+
+BOOST_AUTO_TEST_CASE( region_cache ) {
+
+  SnowTools::BamWalker bw("small.bam");
+  char dir[] = "/tmp/vb_region_cache_XXXXXX";
+  BOOST_REQUIRE( mkdtemp(dir) );
+
+  std::string bed = std::string(dir) + "/panel.bed";
+  std::ofstream(bed) << "1\t1000\t2000\n1\t1500\t2500\n2\t100\t200\n";
+
+  // made on first use, then mapped
+  RegionCache first(dir, bw.header());
+  auto a = first.get(bed, 10);
+  BOOST_REQUIRE( a );
+  BOOST_CHECK_EQUAL( first.misses(), 1 );
+  BOOST_CHECK_EQUAL( a->size(), 2 );
+
+  RegionCache second(dir, bw.header());
+  auto b = second.get(bed, 10);
+  BOOST_REQUIRE( b );
+  BOOST_CHECK_EQUAL( second.hits(), 1 );
+  BOOST_TEST( b->viewed() );
+  BOOST_CHECK_EQUAL( b->size(), a->size() );
+  a->forEach([&](int32_t chr, int32_t start, int32_t end) {
+      BOOST_TEST( b->overlaps(chr, start, start) );
+      BOOST_TEST( b->overlaps(chr, end, end) );
+      BOOST_TEST( !b->overlaps(chr, end + 1, end + 1) );
+    });
+
+  // another pad is another cache. a missing file has none
+  BOOST_TEST( second.get(bed, 0) );
+  BOOST_CHECK_EQUAL( second.misses(), 1 );
+  BOOST_TEST( !second.get(std::string(dir) + "/none.bed", 0) );
+
+  // touched but the same is still good. changed is made again
+  struct timespec times[2] = {{0, UTIME_NOW}, {0, UTIME_NOW}};
+  utimensat(AT_FDCWD, bed.c_str(), times, 0);
+  BOOST_TEST( second.get(bed, 10) );
+  BOOST_CHECK_EQUAL( second.hits(), 2 );
+  std::ofstream(bed, std::ios::app) << "3\t100\t200\n";
+  auto c = second.get(bed, 10);
+  BOOST_CHECK_EQUAL( second.misses(), 2 );
+  BOOST_CHECK_EQUAL( c->size(), 3 );
+
+  BOOST_CHECK( RegionCache::hashBytes("abc", 3, 0) != RegionCache::hashBytes("abd", 3, 0) );
+
+}
+
+BOOST_AUTO_TEST_CASE( mate_link_planner ) {
+
+  std::string rules = "mlregion@test.vcf%all";
+
+  // kept reads of a walk over the given regions (none = whole file)
+  auto keep = [&](const SnowTools::GenomicRegionVector& grv) {
+    HtsReader reader;
+    BOOST_REQUIRE( reader.open("small.bam") );
+    reader.setRegions(grv);
+    SnowTools::MiniRulesCollection mr(rules, reader.header());
+    std::vector<std::string> kept;
+    for (;;) {
+      bam1_t* b = bam_init1();
+      if (!reader.next(b)) {
+	bam_destroy1(b);
+	break;
+      }
+      SnowTools::BamRead r;
+      r.assign(b);
+      if (mr.isValid(r))
+	kept.push_back(r.Qname() + ":" + std::to_string(r.Position()));
+    }
+    return kept;
+  };
+
+  HtsReader h;
+  BOOST_REQUIRE( h.open("small.bam") );
+  SnowTools::MiniRulesCollection mr(rules, h.header());
+  BOOST_REQUIRE_MESSAGE( h.loadIndex(), "small.bam needs an index for this test (samtools index small.bam)" );
+  MateLinkPlanner planner("small.bam", "");
+  BOOST_REQUIRE( planner.plan(mr) );
+  BOOST_TEST( planner.mates() > 0 );
+
+  std::vector<std::string> full = keep(SnowTools::GenomicRegionVector());
+  BOOST_TEST( full.size() > 0 );
+  BOOST_TEST( keep(planner.regions()) == full );
+
+}
+
+BOOST_AUTO_TEST_CASE( block_prefetcher ) {
+
+  std::string tmp = "block_prefetcher.tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary);
+    std::string data(1 << 20, 'x');
+    out << data;
+  }
+
+  BlockPrefetcher p;
+  BOOST_REQUIRE( p.start(tmp, {{0, 1000}, {500, 300000}, {900000, 2000000}}) );
+  p.advance(1);
+  p.advance(3);
+  p.stop();
+  // the last range runs past the end of the file
+  BOOST_CHECK( p.bytes() <= 1000 + 299500 + 148576 );
+
+  // nothing held back: everything in the file is read
+  BOOST_REQUIRE( p.start(tmp, {{0, 1000}, {1000, 1 << 20}}) );
+  for (int i = 0; i < 1000 && p.bytes() < (1 << 20); ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  BOOST_CHECK_EQUAL( p.bytes(), 1 << 20 );
+  p.stop();
+
+  BOOST_CHECK( !p.start("does_not_exist.tmp", {{0, 10}}) );
+
+  // a whole file streamed with the smallest window: a chunk ahead of the reader
+  {
+    std::ofstream out(tmp, std::ios::binary);
+    std::string data(3 * BlockPrefetcher::CHUNK, 'x');
+    out << data;
+  }
+  p.setWindow(1);
+  BOOST_CHECK_EQUAL( p.window(), BlockPrefetcher::CHUNK );
+  BOOST_REQUIRE( p.start(tmp, {{0, UINT64_MAX}}) );
+  for (int i = 0; i < 1000 && p.bytes() < BlockPrefetcher::CHUNK; ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  BOOST_CHECK_EQUAL( p.bytes(), BlockPrefetcher::CHUNK );
+
+  // the reader half way through the first chunk lets one more be read
+  p.advanceTo(BlockPrefetcher::CHUNK / 2);
+  for (int i = 0; i < 1000 && p.bytes() < 2 * BlockPrefetcher::CHUNK; ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  BOOST_CHECK_EQUAL( p.bytes(), 2 * BlockPrefetcher::CHUNK );
+
+  // and the end of the file stops it
+  p.advanceTo(UINT64_MAX);
+  for (int i = 0; i < 1000 && p.bytes() < 3 * BlockPrefetcher::CHUNK; ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  BOOST_CHECK_EQUAL( p.bytes(), 3 * BlockPrefetcher::CHUNK );
+  p.stop();
+
+  std::remove(tmp.c_str());
+
+}
+
+BOOST_AUTO_TEST_CASE( merged_seeks ) {
+
+  HtsReader h;
+  BOOST_REQUIRE( h.open("small.bam") );
+  if (!h.loadIndex()) {
+    BOOST_TEST_MESSAGE("small.bam has no index. Skipping");
+    return;
+  }
+
+  // small regions around every 20th read, so neighbors share blocks
+  SnowTools::GenomicRegionVector grv;
+  bam1_t* b = bam_init1();
+  for (int i = 0; i < 5000 && h.next(b); ++i)
+    if (i % 20 == 0 && b->core.tid >= 0)
+      grv.push_back(SnowTools::GenomicRegion(b->core.tid, b->core.pos, b->core.pos + 50));
+  bam_destroy1(b);
+  BOOST_REQUIRE( grv.size() > 10 );
+
+  auto walk = [&](int64_t gap, size_t& seeks) {
+    HtsReader r;
+    r.open("small.bam");
+    r.setSeekGap(gap);
+    r.setRegions(grv);
+    std::vector<std::string> reads;
+    bam1_t* b = bam_init1();
+    while (r.next(b))
+      reads.push_back(std::string(bam_get_qname(b)) + ":" + std::to_string(b->core.flag) + ":" + std::to_string(b->core.pos));
+    bam_destroy1(b);
+    seeks = r.seeks();
+    return reads;
+  };
+
+  size_t each, merged;
+  std::vector<std::string> a = walk(-1, each);
+  std::vector<std::string> m = walk(1 << 30, merged);
+  BOOST_CHECK( merged < each );
+  BOOST_TEST( a == m );
+
+}
+
+BOOST_AUTO_TEST_CASE( motif_matcher ) {
+
+  std::srand(5);
+  auto randSeq = [](int n, bool with_n) {
+    std::string s(n, 'A');
+    for (auto& c : s)
+      c = with_n && std::rand() % 20 == 0 ? 'N' : "ACGT"[std::rand() % 4];
+    return s;
+  };
+  auto revComp = [](std::string s) {
+    std::reverse(s.begin(), s.end());
+    for (auto& c : s)
+      c = c == 'A' ? 'T' : c == 'C' ? 'G' : c == 'G' ? 'C' : 'A';
+    return s;
+  };
+
+  std::vector<std::string> motifs;
+  for (int i = 0; i < 300; ++i)
+    motifs.push_back(randSeq(4 + std::rand() % 5, false));
+  MotifMatcher mm;
+  mm.build(motifs);
+  BOOST_CHECK( mm.exact() );
+  BOOST_CHECK_EQUAL( mm.size(), 300 );
+
+  // one strand only leaves the reverse complements out of the automaton
+  MotifMatcher fwd;
+  fwd.build(motifs, MotifMatcher::FORWARD);
+  BOOST_CHECK_EQUAL( fwd.size(), 300 );
+  BOOST_CHECK_LT( fwd.states(), mm.states() );
+
+  for (int i = 0; i < 500; ++i) {
+    std::string seq = randSeq(1 + std::rand() % 120, true);
+    int want = 0;
+    for (auto& m : motifs) {
+      if (seq.find(m) != std::string::npos)
+	want |= MotifMatcher::FORWARD;
+      if (seq.find(revComp(m)) != std::string::npos)
+	want |= MotifMatcher::REVERSE;
+    }
+    bam1_t* b = makeRead({{BAM_CMATCH, (int)seq.size()}}, seq, std::vector<uint8_t>(seq.size(), 30));
+    BOOST_REQUIRE_EQUAL( mm.scan(bam_get_seq(b), b->core.l_qseq), want );
+    BOOST_REQUIRE_EQUAL( mm.scan(bam_get_seq(b), b->core.l_qseq, MotifMatcher::FORWARD), want & MotifMatcher::FORWARD );
+    BOOST_REQUIRE_EQUAL( mm.scan(seq), want );
+    BOOST_REQUIRE_EQUAL( fwd.scan(seq), want & MotifMatcher::FORWARD );
+    bam_destroy1(b);
+  }
+
+  // lower case is upper-cased, anything else is left out
+  MotifMatcher odd;
+  odd.build({"acgt", "ACNGT"});
+  BOOST_CHECK( !odd.exact() );
+  BOOST_CHECK_EQUAL( odd.size(), 1 );
+  BOOST_CHECK_EQUAL( odd.scan("TTACGTT", MotifMatcher::FORWARD), MotifMatcher::FORWARD );
+  BOOST_CHECK_EQUAL( odd.scan("TTACNGTT"), 0 );
+
+}
+
+BOOST_AUTO_TEST_CASE( core_filter ) {
+
+  SnowTools::BamWalker bw("small.bam");
+  std::string rules = "global@!duplicate;!qcfail%region@WG%mapq[20,60]%mapq[30,1000];clip[5,1000]";
+  SnowTools::MiniRulesCollection mr(rules, bw.header());
+  RuleProgram program;
+  program.compile(&mr);
+
+  // what both rules share: the global flags and the hull of the mapq ranges
+  CoreFilter f = program.coreFilter();
+  BOOST_REQUIRE( f.active );
+  BOOST_CHECK_EQUAL( f.mask, BAM_FDUP | BAM_FQCFAIL );
+  BOOST_CHECK_EQUAL( f.want, 0 );
+  BOOST_TEST( f.has_mapq );
+  BOOST_CHECK_EQUAL( f.mapq_min, 20 );
+  BOOST_CHECK_EQUAL( f.mapq_max, 1000 );
+  BOOST_TEST( !f.placed );
+  BOOST_TEST( f.pass(0, 0, 25, 0, 0) );
+  BOOST_TEST( !f.pass(0, BAM_FDUP, 25, 0, 0) );
+  BOOST_TEST( !f.pass(0, 0, 10, 0, 0) );
+
+  // the same reads are kept whether or not the reader skips on the core
+  auto walk = [&](bool core, uint64_t& skipped) {
+    SnowTools::MiniRulesCollection mr(rules, bw.header());
+    RuleProgram p;
+    p.compile(&mr);
+    HtsReader reader;
+    reader.open("small.bam");
+    if (core)
+      reader.setCoreFilter(p.coreFilter());
+    std::vector<std::string> kept;
+    SnowTools::BamRead r;
+    r.assign(bam_init1());
+    size_t n = 0;
+    while (reader.next(r.raw())) {
+      ++n;
+      if (core)
+	BOOST_CHECK( f.pass(r.raw()->core.tid, r.raw()->core.flag, r.raw()->core.qual, r.raw()->core.mtid, r.raw()->core.isize) );
+      if (p.isValid(r))
+	kept.push_back(std::string(bam_get_qname(r.raw())) + ":" + std::to_string(r.raw()->core.flag));
+    }
+    skipped = reader.coreSkipped();
+    BOOST_TEST_MESSAGE("core filter " << core << ": " << n << " decoded, " << skipped << " skipped");
+    return kept;
+  };
+
+  uint64_t none, skipped;
+  std::vector<std::string> a = walk(false, none);
+  std::vector<std::string> b = walk(true, skipped);
+  BOOST_CHECK_EQUAL( none, 0 );
+  BOOST_CHECK( skipped > 0 );
+  BOOST_TEST( a == b );
+
+  // the walker and the pipeline count the skipped reads as read as they go by
+  HtsReader all;
+  BOOST_REQUIRE( all.open("small.bam") );
+  uint64_t records = 0;
+  bam1_t* rec = bam_init1();
+  while (all.next(rec))
+    ++records;
+  bam_destroy1(rec);
+  for (bool pipeline : {false, true}) {
+    VariantBamWalker vw("small.bam");
+    vw.SetMiniRulesCollection(rules);
+    vw.m_reader.setCoreFilter(vw.m_program.coreFilter());
+    if (pipeline) {
+      ReadPipeline pipe(rules, 2);
+      pipe.run(vw, false);
+    } else {
+      // as each kept read is written, all the reads before it, decoded or not
+      bool counted = true;
+      vw.m_sink = [&](SnowTools::BamRead&) {
+	const RuleProgram& vp = vw.m_program;
+	counted = counted && vw.rc_main.total + 1 == vp.rejected() + vp.evaluated() + vw.m_reader.coreSkipped();
+      };
+      vw.writeVariantBam();
+      BOOST_TEST( counted );
+    }
+    BOOST_CHECK_EQUAL( vw.m_reader.coreSkipped(), skipped );
+    BOOST_CHECK_EQUAL( vw.rc_main.total, records );
+  }
+
+  // checkpoints are as far apart in the input with the core filter as without
+  uint64_t ckpts[2];
+  for (bool core : {false, true}) {
+    VariantBamWalker vw("small.bam");
+    vw.SetMiniRulesCollection(rules);
+    if (core)
+      vw.m_reader.setCoreFilter(vw.m_program.coreFilter());
+    vw.setCheckpoint("core_filter_test.ckpt", 1000, "core_filter");
+    vw.writeVariantBam();
+    ckpts[core] = vw.checkpoints();
+  }
+  unlink("core_filter_test.ckpt");
+  BOOST_CHECK_EQUAL( ckpts[0], records / 1000 );
+  BOOST_TEST( ckpts[1] + 1 >= ckpts[0] );
+
+  // a whole-genome rule with no core conditions leaves nothing to skip on
+  SnowTools::MiniRulesCollection mr_clip("region@WG%clip[5,1000]", bw.header());
+  RuleProgram clip;
+  clip.compile(&mr_clip);
+  BOOST_TEST( !clip.coreFilter().active );
+
+}
+
+BOOST_AUTO_TEST_CASE( tag_stripper ) {
+
+  // RG:Z, NM:i, OQ:Z, XB:B:c (3 values), MD:Z
+  std::string rg("RGZgrp1\0", 8), nm("NMi\x05\0\0\0", 7), oq("OQZIIII\0", 8), xb("XBBc\x03\0\0\0\x01\x02\x03", 11), md("MDZ4\0", 5);
+  std::string aux = rg + nm + oq + xb + md;
+  auto read = [&](const std::string& name) {
+    bam1_t* b = makeRead({{BAM_CMATCH, 4}}, "ACGT", {30, 30, 30, 30});
+    std::string data = name + '\0' + std::string((char*)b->data + 2, b->l_data - 2) + aux;
+    b->data = (uint8_t*)realloc(b->data, data.size());
+    memcpy(b->data, data.data(), data.size());
+    b->l_data = b->m_data = data.size();
+    b->core.l_qname = name.length() + 1;
+    return b;
+  };
+  auto auxOf = [](const bam1_t* b) { return std::string((const char*)bam_get_aux(b), bam_get_l_aux(b)); };
+
+  bam1_t* b = read("r");
+  BOOST_CHECK_EQUAL( TagStripper::fieldSize(bam_get_aux(b), b->data + b->l_data), 8 );
+  BOOST_CHECK_EQUAL( TagStripper::fieldSize((const uint8_t*)xb.data(), (const uint8_t*)xb.data() + xb.size()), 11 );
+  BOOST_CHECK_EQUAL( TagStripper::fieldSize((const uint8_t*)xb.data(), (const uint8_t*)xb.data() + 10), -1 );
+
+  // one pass takes out the listed tags wherever they are
+  TagStripper ts;
+  BOOST_TEST( !ts.active() );
+  ts.setTags("OQ,XB,RG,bad");
+  ts.apply(b);
+  BOOST_TEST( auxOf(b) == nm + md );
+  BOOST_CHECK_EQUAL( ts.bytesRemoved(), rg.size() + oq.size() + xb.size() );
+  BOOST_CHECK_EQUAL( bam_cigar_oplen(bam_get_cigar(b)[0]), 4 );
+  bam_destroy1(b);
+
+  // a field that can't be parsed is kept, with everything after it
+  b = read("r");
+  b->l_data -= md.size() + 2;
+  ts.apply(b);
+  BOOST_TEST( auxOf(b) == nm + xb.substr(0, xb.size() - 2) );
+  bam_destroy1(b);
+
+  // all tags, qualities and names
+  TagStripper all;
+  all.setAll();
+  all.setDropQualities(true);
+  all.setDropNames(true);
+  b = read("read_1/1");
+  all.apply(b);
+  BOOST_CHECK_EQUAL( bam_get_l_aux(b), 0 );
+  BOOST_CHECK_EQUAL( std::string(bam_get_qname(b)), "*" );
+  BOOST_CHECK_EQUAL( bam_cigar_oplen(bam_get_cigar(b)[0]), 4 );
+  BOOST_CHECK_EQUAL( bam_seqi(bam_get_seq(b), 3), 8 );
+  for (int i = 0; i < 4; ++i)
+    BOOST_CHECK_EQUAL( bam_get_qual(b)[i], 0xff );
+  bam_destroy1(b);
+
+}
+
+BOOST_AUTO_TEST_CASE( checkpoint ) {
+
+  std::string data;
+  for (int i = 0; data.size() < 3 * BgzfWriter::BLOCK_SIZE; ++i)
+    data += "read" + std::to_string(i) + std::string(i % 300, 'A' + i % 4);
+  size_t half = data.size() / 2;
+  auto slurp = [](const std::string& f) {
+    std::ifstream in(f, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  };
+
+  // a run that syncs half way, and one that is cut off after that point and resumed
+  BgzfWriter a;
+  BOOST_TEST( a.open("checkpoint_test_a.bam", 1, 2) );
+  a.write(data.data(), half);
+  uint64_t size = a.sync();
+  a.write(data.data() + half, data.size() - half);
+  a.close();
+
+  {
+    BgzfWriter b;
+    BOOST_TEST( b.open("checkpoint_test_b.bam", 1, 2) );
+    b.write(data.data(), half);
+    BOOST_CHECK_EQUAL( b.sync(), size );
+    b.write("written after the checkpoint", 29);
+    b.close();
+  }
+  BgzfWriter b;
+  BOOST_TEST( !b.resume("checkpoint_test_b.bam", 1 << 30, half) );
+  BOOST_TEST( b.resume("checkpoint_test_b.bam", size, half, 1, 2) );
+  b.write(data.data() + half, data.size() - half);
+  b.close();
+  BOOST_CHECK_EQUAL( b.uncompressedBytes(), data.size() );
+  BOOST_TEST( slurp("checkpoint_test_a.bam") == slurp("checkpoint_test_b.bam") );
+
+  // coverage carries on as if it had never stopped
+  StreamingCoverage cov(16), back;
+  cov.reset(1);
+  cov.add(100, 150);
+  cov.add(120, 130);
+  cov.advance(110);
+  back.restore(cov.state());
+  cov.add(125, 200);
+  back.add(125, 200);
+  for (int32_t p = 100; p < 210; ++p)
+    BOOST_CHECK_EQUAL( cov.depth(p), back.depth(p) );
+  BOOST_CHECK_EQUAL( back.chr(), 1 );
+
+  // and the rest round trips through the file
+  Checkpoint c;
+  c.args = "variant in.bam -o out.bam --checkpoint ck";
+  c.in_offset = 12345 << 16 | 17;
+  c.out_size = size;
+  c.total = 10000000;
+  c.rule_counts = {5, 3, 2};
+  c.cov = cov.state();
+  c.cov_last = 125;
+  bam1_t* r = makeRead({{BAM_CMATCH, 4}}, "ACGT", {30, 31, 32, 33});
+  r->core.pos = 125;
+  r->core.flag = BAM_FREVERSE;
+  c.held.push_back(Checkpoint::pack(r));
+  c.save("checkpoint_test.ckpt");
+
+  Checkpoint l;
+  BOOST_TEST( !l.load("checkpoint_test.none") );
+  BOOST_TEST( l.load("checkpoint_test.ckpt") );
+  BOOST_TEST( l.args == c.args );
+  BOOST_CHECK_EQUAL( l.in_offset, c.in_offset );
+  BOOST_CHECK_EQUAL( l.out_size, size );
+  BOOST_CHECK_EQUAL( l.total, c.total );
+  BOOST_TEST( l.rule_counts == c.rule_counts );
+  BOOST_TEST( l.cov.depth == c.cov.depth );
+  BOOST_CHECK_EQUAL( l.cov_last, 125 );
+  BOOST_REQUIRE_EQUAL( l.held.size(), 1 );
+
+  bam1_t* u = bam_init1();
+  Checkpoint::unpack(l.held[0], u);
+  BOOST_CHECK_EQUAL( u->core.pos, 125 );
+  BOOST_CHECK_EQUAL( u->core.flag, BAM_FREVERSE );
+  BOOST_CHECK_EQUAL( u->l_data, r->l_data );
+  BOOST_TEST( memcmp(u->data, r->data, r->l_data) == 0 );
+  bam_destroy1(u);
+  bam_destroy1(r);
+
+  for (auto f : {"checkpoint_test_a.bam", "checkpoint_test_b.bam", "checkpoint_test.ckpt"})
+    std::remove(f);
+
+}
+
+BOOST_AUTO_TEST_CASE( shard_merge ) {
+
+  // bins and spans as in the SAM spec
+  BOOST_CHECK_EQUAL( BaiBuilder::reg2bin(0, 1), 4681 );
+  BOOST_CHECK_EQUAL( BaiBuilder::reg2bin(16383, 16385), 585 );
+  BOOST_CHECK_EQUAL( BaiBuilder::reg2bin(0, 1 << 29), 0 );
+
+  bam1_t* r = makeRead({{BAM_CSOFT_CLIP, 2}, {BAM_CMATCH, 3}, {BAM_CDEL, 5}, {BAM_CMATCH, 2}}, "ACGTACG", std::vector<uint8_t>(7, 30));
+  r->core.pos = 1000;
+  std::string rec = Checkpoint::pack(r);
+  BOOST_CHECK_EQUAL( BaiBuilder::recordEnd((const uint8_t*)rec.data(), rec.size()), 1010 );
+  r->core.flag = BAM_FUNMAP;
+  rec = Checkpoint::pack(r);
+  BOOST_CHECK_EQUAL( BaiBuilder::recordEnd((const uint8_t*)rec.data(), rec.size()), 1001 );
+  r->core.flag = 0;
+
+  BaiBuilder bai(2);
+  BOOST_TEST( bai.push(0, 10, 20, true, 100 << 16, 100 << 16 | 50) );
+  BOOST_TEST( !bai.push(0, 5, 20, true, 100 << 16 | 50, 100 << 16 | 90) );
+  BOOST_TEST( bai.push(-1, -1, 0, false, 100 << 16 | 90, 200 << 16) );
+  BOOST_TEST( !bai.push(1, 5, 20, true, 200 << 16, 200 << 16 | 40) );
+
+  // two shards, the second with a header that spans blocks, as BAMs
+  auto header = [](const std::string& text) {
+    std::string h("BAM\1", 4);
+    uint32_t x = text.size();
+    h.append((const char*)&x, 4);
+    h += text;
+    x = 2;
+    h.append((const char*)&x, 4);
+    for (auto name : {"1", "2"}) {
+      x = 2;
+      h.append((const char*)&x, 4);
+      h.append(name, 2);
+      x = 1 << 20;
+      h.append((const char*)&x, 4);
+    }
+    return h;
+  };
+  std::string reads[2];
+  for (int i = 0; i < 3000; ++i) {
+    r->core.tid = i < 2000 ? 0 : 1;
+    r->core.pos = 100 * (i % 2000);
+    std::string p = Checkpoint::pack(r);
+    uint32_t block_size = p.size();
+    reads[i >= 1000] += std::string((const char*)&block_size, 4) + p;
+  }
+  std::string heads[2] = {header("@HD\tVN:1.4\tSO:coordinate\n"), header("@CO\t" + std::string(100000, 'x') + "\n")};
+  for (int i = 0; i < 2; ++i) {
+    BgzfWriter w;
+    BOOST_TEST( w.open("shard_merge_test_" + std::to_string(i) + ".bam", 1) );
+    w.write(heads[i].data(), heads[i].size());
+    w.write(reads[i].data(), reads[i].size());
+    w.close();
+  }
+
+  ShardMerger m;
+  m.mergeBams({"shard_merge_test_0.bam", "shard_merge_test_1.bam"}, "shard_merge_test.bam", true);
+  BOOST_CHECK_EQUAL( m.records(), 3000 );
+  BOOST_TEST( m.blocksCopied() > 0 );
+  BOOST_TEST( m.blocksRecompressed() >= 2 );
+
+  // gzip reads the concatenated blocks back as one stream
+  gzFile gz = gzopen("shard_merge_test.bam", "rb");
+  std::string merged;
+  char buf[65536];
+  for (int n; (n = gzread(gz, buf, sizeof(buf))) > 0;)
+    merged.append(buf, n);
+  gzclose(gz);
+  BOOST_TEST( merged == heads[0] + reads[0] + reads[1] );
+
+  std::ifstream bai_in("shard_merge_test.bam.bai", std::ios::binary);
+  std::string bai_text((std::istreambuf_iterator<char>(bai_in)), std::istreambuf_iterator<char>());
+  BOOST_TEST( bai_text.compare(0, 4, "BAI\1", 4) == 0 );
+
+  // counts and qc tables are summed on their numbers, matched on the rest
+  {
+    std::ofstream a("shard_merge_test_0.qc"), b("shard_merge_test_1.qc");
+    a << "ReadGroup\tReadCount\tMapq\n" << "rg1\t10\t0_10_5,10_20_1\n" << "rg2\t3\t0_10_2\n";
+    b << "ReadGroup\tReadCount\tMapq\n" << "rg2\t4\t0_10_1,20_30_7\n" << "rg3\t1\t5_6_1\n";
+  }
+  ShardMerger::mergeTables({"shard_merge_test_0.qc", "shard_merge_test_1.qc"}, "shard_merge_test.qc");
+  std::ifstream qc("shard_merge_test.qc");
+  std::string qc_text((std::istreambuf_iterator<char>(qc)), std::istreambuf_iterator<char>());
+  BOOST_CHECK_EQUAL( qc_text, "ReadGroup\tReadCount\tMapq\nrg1\t10\t0_10_5,10_20_1\nrg2\t7\t0_10_3,20_30_7\nrg3\t1\t5_6_1\n" );
+
+  bam_destroy1(r);
+  for (auto f : {"shard_merge_test_0.bam", "shard_merge_test_1.bam", "shard_merge_test.bam", "shard_merge_test.bam.bai",
+	"shard_merge_test_0.qc", "shard_merge_test_1.qc", "shard_merge_test.qc"})
+    std::remove(f);
+
+}
+
+BOOST_AUTO_TEST_CASE( route_script ) {
+
+  // nothing tagged: one output with the whole script
+  RouteScript plain("region@WG%mapq[10,60]");
+  BOOST_TEST( !plain.routed() );
+  BOOST_TEST( plain.merged() == "region@WG%mapq[10,60]" );
+
+  // a tagged region takes its block, a tagged rule takes itself along with its region line
+  RouteScript r("global@!duplicate%region@WG%!isize[0,600] > sv.bam%clip[10,101]%"
+		"mlregion@hla.bed>hla.bam%all%region@panel.bed%all%region@other.bed");
+  BOOST_TEST( r.routed() );
+  BOOST_REQUIRE_EQUAL( r.outputs().size(), 3 );
+  BOOST_TEST( r.outputs()[1] == "sv.bam" );
+  BOOST_TEST( r.outputs()[2] == "hla.bam" );
+  BOOST_TEST( r.scripts()[0] == "global@!duplicate%region@WG%clip[10,101]%region@panel.bed%all%region@other.bed" );
+  BOOST_TEST( r.scripts()[1] == "global@!duplicate%region@WG%!isize[0,600]" );
+  BOOST_TEST( r.scripts()[2] == "global@!duplicate%mlregion@hla.bed%all" );
+  BOOST_TEST( r.merged() == "global@!duplicate%region@WG%!isize[0,600]%clip[10,101]%"
+	      "mlregion@hla.bed%all%region@panel.bed%all%region@other.bed" );
+
+  // with every rule routed, the main output keeps nothing
+  RouteScript all("region@WG%mapq[0,0]>a.bam%region@x.bed>b.bam");
+  BOOST_TEST( all.scripts()[0].empty() );
+  BOOST_TEST( all.scripts()[1] == "region@WG%mapq[0,0]" );
+  BOOST_TEST( all.scripts()[2] == "region@x.bed" );
+
+}
+
+BOOST_AUTO_TEST_CASE( bam_output_index ) {
+
+  BOOST_CHECK_EQUAL( BaiBuilder::depthFor(1 << 29), 5 );
+  BOOST_CHECK_EQUAL( BaiBuilder::depthFor((1 << 29) + 1), 6 );
+  BOOST_CHECK_EQUAL( BaiBuilder::reg2bin(0, 1, 6), 37449 );
+
+  bam_hdr_t* h = bam_hdr_init();
+  h->n_targets = 2;
+  h->target_len = (uint32_t*)malloc(2 * sizeof(uint32_t));
+  h->target_len[0] = h->target_len[1] = 1 << 20;
+  h->target_name = (char**)malloc(2 * sizeof(char*));
+  h->target_name[0] = strdup("1");
+  h->target_name[1] = strdup("2");
+  h->text = strdup("@HD\tVN:1.4\tSO:coordinate\n");
+  h->l_text = strlen(h->text);
+
+  // indexed as it is written, on compression threads
+  bam1_t* r = makeRead({{BAM_CMATCH, 100}}, std::string(100, 'A'), std::vector<uint8_t>(100, 30));
+  BamOutput out;
+  BOOST_TEST( out.open("bam_output_index_test.bam", h, -1, 2, true) );
+  for (int i = 0; i < 20000; ++i) {
+    r->core.tid = i < 15000 ? 0 : 1;
+    r->core.pos = 50 * (i % 15000);
+    r->core.flag = i % 7 ? 0 : BAM_FUNMAP;
+    out.write(r);
+  }
+  r->core.tid = -1;
+  r->core.pos = -1;
+  out.write(r);
+  out.close();
+  BOOST_TEST( out.indexFile() == "bam_output_index_test.bam.bai" );
+
+  // the same file and index as a pass over the finished BAM finds
+  ShardMerger m;
+  m.mergeBams({"bam_output_index_test.bam"}, "bam_output_index_test_copy.bam", true);
+  auto slurp = [](const std::string& f) {
+    std::ifstream in(f, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  };
+  BOOST_TEST( slurp("bam_output_index_test.bam") == slurp("bam_output_index_test_copy.bam") );
+  BOOST_TEST( slurp("bam_output_index_test.bam.bai") == slurp("bam_output_index_test_copy.bam.bai") );
+
+  // out of order, so no index
+  BamOutput unsorted;
+  BOOST_TEST( unsorted.open("bam_output_index_test_unsorted.bam", h, -1, 0, true) );
+  for (int pos : {500, 100}) {
+    r->core.tid = 0;
+    r->core.pos = pos;
+    unsorted.write(r);
+  }
+  unsorted.close();
+  BOOST_TEST( unsorted.indexFailed() );
+  BOOST_TEST( unsorted.indexFile().empty() );
+
+  bam_destroy1(r);
+  bam_hdr_destroy(h);
+  for (auto f : {"bam_output_index_test.bam", "bam_output_index_test.bam.bai", "bam_output_index_test_copy.bam",
+	"bam_output_index_test_copy.bam.bai", "bam_output_index_test_unsorted.bam"})
+    std::remove(f);
+
+}
+
+BOOST_AUTO_TEST_CASE( stage_profiler ) {
+
+  // nothing is sampled until it is on
+  StageProfiler off;
+  for (int i = 0; i < 1000; ++i)
+    BOOST_TEST( !off.next() );
+  BOOST_CHECK_EQUAL( off.reads(), 0 );
+
+  StageProfiler p;
+  p.enable();
+  size_t timed = 0;
+  for (uint64_t i = 0; i < 100 * StageProfiler::SAMPLE_EVERY; ++i) {
+    if (!p.next())
+      continue;
+    BOOST_TEST( p.timed() );
+    ++timed;
+    p.lap(StageProfiler::STAGE_READ, StageProfiler::now() - 10);
+    p.add(StageProfiler::STAGE_WRITE, 5);
+  }
+  BOOST_CHECK_EQUAL( timed, 100 );
+  BOOST_CHECK_EQUAL( p.samples(StageProfiler::STAGE_READ), 100 );
+  BOOST_TEST( p.sampledNs(StageProfiler::STAGE_READ) >= 1000 );
+  BOOST_CHECK_EQUAL( p.estimatedNs(StageProfiler::STAGE_WRITE), 500 * StageProfiler::SAMPLE_EVERY );
+  BOOST_CHECK_EQUAL( p.samples(StageProfiler::STAGE_COVERAGE), 0 );
+  BOOST_CHECK_EQUAL( std::string(StageProfiler::name(StageProfiler::STAGE_REGION_LOOKUP)), "region_lookup" );
+
+}
+
+BOOST_AUTO_TEST_CASE( rule_program_profile ) {
+
+  SnowTools::BamWalker bw("small.bam");
+  std::string rules = "global@!duplicate;!qcfail%region@WG%discordant[0,1000];mapq[1,1000]%mapq[1,1000];clip[5,1000]%supplementary";
+  SnowTools::MiniRulesCollection mr(rules, bw.header());
+  SnowTools::MiniRulesCollection mr_prof(rules, bw.header());
+
+  RuleProgram plain, profiled;
+  plain.compile(&mr);
+  StageProfiler prof;
+  prof.enable();
+  profiled.setProfile(&prof);
+  profiled.compile(&mr_prof);
+  BOOST_CHECK_EQUAL( profiled.profile().size(), profiled.size() );
+  BOOST_CHECK_EQUAL( profiled.stepRegion(0), 1 );
+  BOOST_CHECK_EQUAL( profiled.stepRule(0), 1 );
+  BOOST_CHECK_EQUAL( profiled.stepRule(2), 3 );
+
+  // profiling doesn't change the answer
+  HtsReader reader;
+  BOOST_TEST( reader.open("small.bam") );
+  size_t n = 0, same = 0;
+  for (;;) {
+    bam1_t* b = bam_init1();
+    if (!reader.next(b)) {
+      bam_destroy1(b);
+      break;
+    }
+    SnowTools::BamRead r;
+    r.assign(b);
+    prof.next();
+    same += plain.isValid(r) == profiled.isValid(r);
+    ++n;
+  }
+  BOOST_CHECK_EQUAL( same, n );
+
+  // every read tries the first step, and each later step gets the reads the one before didn't let through
+  const std::vector<RuleProgram::StepProfile>& p = profiled.profile();
+  BOOST_CHECK_EQUAL( p[0].evaluated, n );
+  uint64_t passed = 0;
+  for (size_t i = 0; i < p.size(); ++i) {
+    if (i)
+      BOOST_CHECK_EQUAL( p[i].evaluated, p[i - 1].evaluated - p[i - 1].passed );
+    passed += p[i].passed;
+    BOOST_TEST( p[i].timed <= p[i].evaluated );
+  }
+  BOOST_CHECK_EQUAL( passed, profiled.evaluated() );
+  BOOST_CHECK_EQUAL( n - passed, profiled.rejected() );
+  BOOST_TEST( prof.samples(StageProfiler::STAGE_PREFILTER) <= n / StageProfiler::SAMPLE_EVERY );
+
+}
+
+BOOST_AUTO_TEST_CASE( sim_bam ) {
+
+  SimBam::Options o;
+  o.chr_length = 200000;
+  o.discordant = 0.05;
+  o.sites = 20;
+  o.motifs = 10;
+  SimBam sim(o);
+  BOOST_TEST( sim.writeBam("sim_bam_test.bam") );
+  BOOST_TEST( sim.writeVcf("sim_bam_test.vcf") );
+  BOOST_TEST( sim.writeMotifs("sim_bam_test.motifs.txt") );
+
+  // about depth * genome / read length reads, with the asked-for fractions
+  double expect = o.depth * o.chromosomes * o.chr_length / o.read_length;
+  BOOST_TEST( sim.reads() > 0.9 * expect );
+  BOOST_TEST( sim.reads() < 1.1 * expect );
+  BOOST_TEST( sim.discordantPairs() > 0.02 * sim.reads() / 2 );
+  BOOST_TEST( sim.discordantPairs() < 0.08 * sim.reads() / 2 );
+  BOOST_TEST( sim.clippedReads() > 0.03 * sim.reads() );
+  BOOST_TEST( sim.clippedReads() < 0.07 * sim.reads() );
+  BOOST_TEST( sim.duplicateReads() > 0 );
+  BOOST_TEST( sim.unmappedReads() > 0 );
+
+  // sorted, with the same index a pass over the finished file finds
+  ShardMerger m;
+  m.mergeBams({"sim_bam_test.bam"}, "sim_bam_test_copy.bam", true);
+  BOOST_CHECK_EQUAL( m.records(), sim.reads() );
+  auto slurp = [](const std::string& f) {
+    std::ifstream in(f, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  };
+  BOOST_TEST( slurp("sim_bam_test.bam.bai") == slurp("sim_bam_test_copy.bam.bai") );
+
+  // the same options give the same bytes
+  SimBam again(o);
+  BOOST_TEST( again.writeBam("sim_bam_test_copy.bam") );
+  BOOST_TEST( slurp("sim_bam_test.bam") == slurp("sim_bam_test_copy.bam") );
+
+  // and another seed doesn't
+  o.seed = 2;
+  SimBam other(o);
+  BOOST_TEST( other.writeBam("sim_bam_test_copy.bam") );
+  BOOST_TEST( slurp("sim_bam_test.bam") != slurp("sim_bam_test_copy.bam") );
+
+  std::ifstream vcf("sim_bam_test.vcf");
+  std::string line;
+  size_t sites = 0;
+  while (std::getline(vcf, line))
+    sites += line[0] != '#';
+  BOOST_CHECK_EQUAL( sites, 20 );
+
+  for (auto f : {"sim_bam_test.bam", "sim_bam_test.bam.bai", "sim_bam_test_copy.bam", "sim_bam_test_copy.bam.bai",
+	"sim_bam_test.vcf", "sim_bam_test.motifs.txt"})
+    std::remove(f);
+
+}
+
+BOOST_AUTO_TEST_CASE( bench_suite ) {
+
+  BOOST_CHECK_EQUAL( BenchSuite::parseAllocs("...x\n...heap allocations during the walk: 1,234,567 (0.1 per read)\n"), 1234567 );
+  BOOST_CHECK_EQUAL( BenchSuite::parseAllocs("...no such line\n"), 0 );
+
+  // a program that does nothing stands in for variant
+  BenchSuite suite("/bin/true", "no.bam", 1000, ".");
+  suite.add("a", {"{bam}", "-o", "{dir}/a.bam"});
+  suite.add("b", {"{bam}"});
+  BOOST_TEST( suite.run(2) );
+  BOOST_CHECK_EQUAL( suite.results().size(), 2 );
+  BOOST_TEST( suite.results()[0].seconds > 0 );
+
+  // the last row of each case is read back
+  std::remove("bench_suite_test.tsv");
+  BOOST_TEST( suite.appendTable("bench_suite_test.tsv", "first") );
+  BOOST_TEST( suite.appendTable("bench_suite_test.tsv", "second") );
+  std::vector<BenchSuite::Result> back;
+  BOOST_TEST( BenchSuite::readTable("bench_suite_test.tsv", back) );
+  BOOST_CHECK_EQUAL( back.size(), 2 );
+  BOOST_CHECK_EQUAL( back[1].name, "b" );
+  std::remove("bench_suite_test.tsv");
+  std::remove("a.log");
+  std::remove("b.log");
+
+  BenchSuite::Result base;
+  base.name = "a";
+  base.reads_per_sec = 1000;
+  base.peak_rss_kb = 100000;
+  base.allocs = 50000;
+  BenchSuite::Result same = base, slow = base, fat = base;
+  same.reads_per_sec = 950;
+  slow.reads_per_sec = 800;
+  fat.peak_rss_kb = 150000;
+  fat.allocs = 80000;
+  BOOST_TEST( BenchSuite::compare({base}, {same}, 0.1).empty() );
+  BOOST_CHECK_EQUAL( BenchSuite::compare({base}, {slow}, 0.1).size(), 1 );
+  BOOST_TEST( BenchSuite::compare({base}, {fat}, 0.1)[0].find("allocations") != std::string::npos );
+
+}
+
+BOOST_AUTO_TEST_CASE( qc_stats ) {
+
+  auto read = [](const std::string& rg, int nm, uint16_t flag, int32_t isize, int clip) {
+    bam1_t* b = makeRead({{BAM_CSOFT_CLIP, clip}, {BAM_CMATCH, 10 - clip}}, "ACGTACGTAC", std::vector<uint8_t>(10, 25));
+    std::string aux;
+    if (rg.length())
+      aux += "RGZ" + rg + '\0';
+    if (nm >= 0)
+      aux += std::string("NMC") + (char)nm;
+    b->data = (uint8_t*)realloc(b->data, b->l_data + aux.size());
+    memcpy(b->data + b->l_data, aux.data(), aux.size());
+    b->l_data = b->m_data = b->l_data + aux.size();
+    b->core.flag = flag;
+    b->core.qual = 60;
+    b->core.isize = isize;
+    return b;
+  };
+
+  const uint16_t pair = BAM_FPAIRED | BAM_FPROPER_PAIR;
+  std::vector<bam1_t*> reads = {
+    read("g1", 0, pair, 350, 0),
+    read("g1", 2, pair | BAM_FDUP, -350, 3),
+    read("g2", -1, pair | BAM_FMUNMAP, 0, 0),
+    read("g1", 1, pair | BAM_FSUPPLEMENTARY | BAM_FQCFAIL, 5000, 0),
+    read("", 0, BAM_FUNMAP, 0, 0),
+  };
+  reads[2]->core.mtid = 1;
+
+  QcStats all, first, second;
+  for (size_t i = 0; i < reads.size(); ++i) {
+    all.add(reads[i]);
+    (i < 2 ? first : second).add(reads[i]);
+  }
+  BOOST_CHECK_EQUAL( all.reads(), 5 );
+  BOOST_CHECK_EQUAL( all.groups().size(), 3 );
+
+  const QcStats::ReadGroup& g1 = *all.groups()[0];
+  BOOST_CHECK_EQUAL( g1.name, "g1" );
+  BOOST_CHECK_EQUAL( g1.reads, 3 );
+  BOOST_CHECK_EQUAL( g1.duplicate, 1 );
+  BOOST_CHECK_EQUAL( g1.supplementary, 1 );
+  BOOST_CHECK_EQUAL( g1.qcfail, 1 );
+  BOOST_CHECK_EQUAL( g1.mapq.counts[60], 3 );
+  BOOST_CHECK_EQUAL( g1.nm.counts[2], 1 );
+  BOOST_CHECK_EQUAL( g1.isize.counts[350 + 2], 2 );
+  BOOST_CHECK_EQUAL( g1.isize.counts[2002], 1 ); // 2000 and over
+  BOOST_CHECK_EQUAL( g1.clip.counts[3], 1 );
+  BOOST_CHECK_EQUAL( g1.phred.counts[25], 3 );
+  BOOST_CHECK_EQUAL( g1.length.counts[10], 3 );
+
+  // a mate that is unmapped, and a read with no RG
+  BOOST_CHECK_EQUAL( all.groups()[1]->mate_unmapped, 1 );
+  BOOST_CHECK_EQUAL( all.groups()[1]->isize.counts[0], 1 );
+  BOOST_CHECK_EQUAL( all.groups()[2]->name, "NA" );
+  BOOST_CHECK_EQUAL( all.groups()[2]->unmapped, 1 );
+
+  // the columns R/BamQCPlot.R reads, with min_max_count bins
+  std::ostringstream out;
+  out << all;
+  std::istringstream lines(out.str());
+  std::string line;
+  std::getline(lines, line);
+  BOOST_CHECK_EQUAL( line, QcStats::HEADER );
+  std::getline(lines, line); // NA sorts first
+  std::getline(lines, line);
+  std::vector<std::string> cells;
+  std::istringstream cs(line);
+  for (std::string c; std::getline(cs, c, '\t'); )
+    cells.push_back(c);
+  BOOST_CHECK_EQUAL( cells.size(), 13 );
+  BOOST_CHECK_EQUAL( cells[0], "g1" );
+  BOOST_CHECK_EQUAL( cells[1], "3" );
+  BOOST_TEST( cells[7].find(",60_60_3,") != std::string::npos );
+  BOOST_CHECK_EQUAL( cells[9].substr(0, 14), "-2_-2_0,-1_-1_" );
+  BOOST_TEST( cells[9].find(",2000_2147483647_1") != std::string::npos );
+
+  // per-thread stats merge to the same file, and so do qc files of shards
+  first.merge(second);
+  std::ostringstream merged;
+  merged << first;
+  BOOST_CHECK_EQUAL( merged.str(), out.str() );
+
+  QcStats a, b;
+  a.add(reads[0]);
+  b.add(reads[1]);
+  b.add(reads[2]);
+  std::ofstream("qc_stats_a.txt") << a;
+  std::ofstream("qc_stats_b.txt") << b;
+  ShardMerger::mergeTables({"qc_stats_a.txt", "qc_stats_b.txt"}, "qc_stats_ab.txt");
+  a.merge(b);
+  std::ostringstream ab;
+  ab << a;
+  std::ifstream ifs("qc_stats_ab.txt");
+  std::stringstream file;
+  file << ifs.rdbuf();
+  BOOST_CHECK_EQUAL( file.str(), ab.str() );
+
+  for (auto f : {"qc_stats_a.txt", "qc_stats_b.txt", "qc_stats_ab.txt"})
+    std::remove(f);
+  for (auto r : reads)
+    bam_destroy1(r);
+
+}
+
+BOOST_AUTO_TEST_CASE( record_arena ) {
+
+  std::vector<bam1_t*> src;
+  for (int i = 0; i < 50; ++i) {
+    int len = 50 + 37 * i % 200;
+    bam1_t* b = makeRead({{BAM_CMATCH, len}}, std::string(len, "ACGT"[i % 4]), std::vector<uint8_t>(len, i));
+    b->core.pos = i;
+    src.push_back(b);
+  }
+
+  // a window of reads held and let go in order, over and over
+  RecordArena arena;
+  std::deque<bam1_t*> held;
+  const size_t window = 2000;
+  uint64_t allocations = 0;
+  for (int round = 0; round < 200; ++round) {
+    for (size_t i = 0; i < src.size(); ++i) {
+      held.push_back(arena.push(src[i]));
+      if (held.size() > window) {
+	const bam1_t* h = held.front();
+	const bam1_t* o = src[h->core.pos];
+	BOOST_REQUIRE_EQUAL( h->l_data, o->l_data );
+	BOOST_REQUIRE( !memcmp(h->data, o->data, o->l_data) );
+	BOOST_REQUIRE( std::string(bam_get_qname(h)) == "r" );
+	held.pop_front();
+	arena.pop();
+      }
+    }
+    // the chunks stop growing once the window is full
+    if (round == 100)
+      allocations = arena.allocations();
+  }
+  BOOST_CHECK_EQUAL( arena.size(), window );
+  BOOST_CHECK_EQUAL( arena.allocations(), allocations );
+  BOOST_TEST( arena.peakBytes() < 2 * window * (sizeof(bam1_t) + 1000) + 2 * RecordArena::CHUNK_SIZE );
+
+  // held records can be changed in place
+  bam_get_qual(held.back())[0] = 0xff;
+  BOOST_CHECK_EQUAL( bam_get_qual(src.back())[0], 49 );
+
+  // a record bigger than a chunk has one of its own
+  int big = RecordArena::CHUNK_SIZE;
+  bam1_t* b = makeRead({{BAM_CMATCH, big}}, std::string(big, 'A'), std::vector<uint8_t>(big, 30));
+  uint64_t before = arena.allocations();
+  held.push_back(arena.push(b));
+  BOOST_CHECK_EQUAL( arena.allocations(), before + 1 );
+  held.push_back(arena.push(src[0]));
+  while (held.size()) {
+    held.pop_front();
+    arena.pop();
+  }
+  BOOST_CHECK_EQUAL( arena.size(), 0 );
+  BOOST_CHECK_EQUAL( held.size(), 0 );
+
+  bam_destroy1(b);
+  for (auto r : src)
+    bam_destroy1(r);
+
+}
+
+BOOST_AUTO_TEST_CASE( coverage_sampler ) {
+
+  // a pileup of 50 bp pairs, mates 200 bp apart, in two read groups
+  auto read = [](const std::string& name, const std::string& rg, int32_t pos, int32_t mpos, uint16_t flag) {
+    bam1_t* b = makeRead({{BAM_CMATCH, 50}}, std::string(50, 'A'), std::vector<uint8_t>(50, 30));
+    std::string aux = "RGZ" + rg + '\0';
+    std::string data = name + '\0' + std::string((char*)b->data + 2, b->l_data - 2) + aux;
+    b->data = (uint8_t*)realloc(b->data, data.size());
+    memcpy(b->data, data.data(), data.size());
+    b->l_data = b->m_data = data.size();
+    b->core.l_qname = name.length() + 1;
+    b->core.tid = b->core.mtid = 0;
+    b->core.pos = pos;
+    b->core.mpos = mpos;
+    b->core.flag = flag;
+    return b;
+  };
+
+  std::vector<bam1_t*> reads;
+  for (int i = 0; i < 400; ++i) {
+    std::string name = "p" + std::to_string(i), rg = i % 4 ? "g1" : "g2";
+    int32_t pos = 1000 + i % 100;
+    reads.push_back(read(name, rg, pos, pos + 200, BAM_FPAIRED | BAM_FMREVERSE | BAM_FREAD1));
+    reads.push_back(read(name, rg, pos + 200, pos, BAM_FPAIRED | BAM_FREVERSE | BAM_FREAD2));
+  }
+  std::stable_sort(reads.begin(), reads.end(), [](const bam1_t* a, const bam1_t* b) { return a->core.pos < b->core.pos; });
+
+  // stream the reads the way the walker does, deciding the ones from `from` on
+  auto stream = [&](CoverageSampler& cs, int32_t from) {
+    std::map<std::string, bool> kept;
+    std::deque<const bam1_t*> held;
+    auto release = [&](int32_t pos) {
+      while (held.size() && CoverageSampler::needUntil(held.front()) < pos) {
+	kept[std::string(bam_get_qname(held.front())) + (held.front()->core.flag & BAM_FREAD1 ? "/1" : "/2")] = cs.keep(held.front());
+	held.pop_front();
+      }
+    };
+    cs.reset(0);
+    for (auto b : reads) {
+      release(b->core.pos);
+      cs.add(b);
+      if (b->core.pos >= from)
+	held.push_back(b);
+      cs.advance((held.size() ? held.front() : b)->core.pos - CoverageSampler::MAX_PAIR_GAP);
+    }
+    release(INT32_MAX);
+    return kept;
+  };
+
+  CoverageSampler cs;
+  cs.setTarget(40, 7);
+  BOOST_TEST( CoverageSampler::pairPlaced(reads[0]) );
+  BOOST_CHECK_EQUAL( CoverageSampler::needUntil(reads[0]), reads[0]->core.mpos );
+  BOOST_CHECK_EQUAL( CoverageSampler::needFrom(reads.back()), reads.back()->core.mpos );
+
+  std::map<std::string, bool> all = stream(cs, 0);
+  BOOST_CHECK_EQUAL( all.size(), reads.size() );
+
+  // both mates get the same answer. the pileup is up to 200 deep, and
+  // only its first 10 bp are under 40
+  size_t pairs = 0;
+  for (int i = 0; i < 400; ++i) {
+    std::string name = "p" + std::to_string(i);
+    BOOST_CHECK_EQUAL( all[name + "/1"], all[name + "/2"] );
+    pairs += all[name + "/1"];
+  }
+  BOOST_TEST( pairs > 60 );
+  BOOST_TEST( pairs < 200 );
+
+  // a walk that starts part way (a shard, with the reads before it for the
+  // depth) decides its reads as the whole walk did
+  CoverageSampler shard;
+  shard.configure(cs);
+  std::map<std::string, bool> part = stream(shard, 1150);
+  BOOST_TEST( part.size() > 0 );
+  for (auto& k : part)
+    BOOST_CHECK_EQUAL( k.second, all[k.first] );
+
+  // another seed picks other reads
+  CoverageSampler other;
+  other.setTarget(40, 8);
+  BOOST_TEST( stream(other, 0) != all );
+
+  // per read group: g2 has a quarter of the depth, and a target of its own
+  CoverageSampler rg;
+  rg.setTarget(1000, 7);
+  BOOST_TEST( rg.setPerReadGroup("g2=10") );
+  BOOST_TEST( rg.perReadGroup() );
+  rg.reset(0);
+  for (auto b : reads)
+    rg.add(b);
+  auto group = [](const bam1_t* b) { return std::string((const char*)bam_aux_get(b, "RG") + 1); };
+  const bam1_t* g1 = *std::find_if(reads.begin(), reads.end(), [&](const bam1_t* b) { return group(b) == "g1"; });
+  const bam1_t* g2 = *std::find_if(reads.begin(), reads.end(), [&](const bam1_t* b) { return group(b) == "g2"; });
+  BOOST_CHECK_EQUAL( cs.depth(g1, 1099), 200 );
+  BOOST_CHECK_EQUAL( rg.depth(g1, 1099) + rg.depth(g2, 1099), 200 );
+  BOOST_CHECK_EQUAL( rg.depth(g2, 1099), 48 );
+  size_t kept1 = 0, kept2 = 0;
+  for (auto b : reads)
+    if (b->core.flag & BAM_FREAD1)
+      (group(b) == "g2" ? kept2 : kept1) += rg.keep(b);
+  BOOST_CHECK_EQUAL( kept1, 300 );
+  BOOST_TEST( kept2 > 0 );
+  BOOST_TEST( kept2 < 50 );
+
+  BOOST_TEST( !rg.setPerReadGroup("g2") );
+  BOOST_TEST( !rg.setPerReadGroup("g2=x") );
+  BOOST_TEST( rg.setPerReadGroup("") );
+
+  // a minimum depth keeps nothing where it isn't reached
+  CoverageSampler min;
+  min.setTarget(-1000, 7);
+  BOOST_TEST( stream(min, 0).begin()->second == false );
+
+  for (auto b : reads)
+    bam_destroy1(b);
+
+}